@@ -70,6 +70,7 @@ WS_DLL_PUBLIC_DEF const int plugin_want_minor = WIRESHARK_VERSION_MINOR;
 #define HOMA_FREEZE_PACKET 0x16
 #define HOMA_NEED_ACK_PACKET 0x17
 #define HOMA_ACK_PACKET 0x18
+#define HOMA_MULTI_GRANT_PACKET 0x19
 
 #define COMMON_HEADER_LENGTH 28
 #define HOMA_ACK_LENGTH 12
@@ -77,8 +78,12 @@ WS_DLL_PUBLIC_DEF const int plugin_want_minor = WIRESHARK_VERSION_MINOR;
 #define DATA_HEADER_LENGTH (12 + DATA_SEGMENT_LENGTH)
 #define RESEND_HEADER_LENGTH 9
 #define GRANT_HEADER_LENGTH 5
-#define CUTOFFS_HEADER_LENGTH 34
+#define CUTOFFS_HEADER_LENGTH 38
 #define ACK_HEADER_LENGTH 62
+#define MULTI_GRANT_ENTRY_LENGTH 14
+#define MULTI_GRANT_MAX_ENTRIES 4
+#define MULTI_GRANT_HEADER_LENGTH (2 + MULTI_GRANT_MAX_ENTRIES \
+		* MULTI_GRANT_ENTRY_LENGTH)
 
 static int proto_homa = -1;
 
@@ -104,6 +109,9 @@ static int hf_homa_resend_priority = -1;
 static int hf_homa_ack_num_acks = -1;
 static int hf_homa_cutoff_unsched_cutoffs = -1;
 static int hf_homa_cutoff_version = -1;
+static int hf_homa_cutoff_unsched_bytes = -1;
+static int hf_homa_multi_grant_num_grants = -1;
+static int hf_homa_multi_grant_id = -1;
 
 static int ett_homa_common = -1;
 
@@ -131,6 +139,9 @@ static int dissect_homa(tvbuff_t *tvb, packet_info *pinfo, proto_tree *tree _U_,
 	case HOMA_CUTOFFS_PACKET:
 		header_length += CUTOFFS_HEADER_LENGTH;
 		break;
+	case HOMA_MULTI_GRANT_PACKET:
+		header_length += MULTI_GRANT_HEADER_LENGTH;
+		break;
 	}
 	proto_item *ti = proto_tree_add_item(tree, proto_homa, tvb, 0,
 					     header_length, ENC_NA);
@@ -142,6 +153,7 @@ static int dissect_homa(tvbuff_t *tvb, packet_info *pinfo, proto_tree *tree _U_,
 	case HOMA_CUTOFFS_PACKET:
 	case HOMA_ACK_PACKET:
 	case HOMA_RESEND_PACKET:
+	case HOMA_MULTI_GRANT_PACKET:
 		homa_tree_common = proto_tree_add_subtree(homa_tree, tvb, 0,
 							  COMMON_HEADER_LENGTH,
 							  0, &ti,
@@ -272,6 +284,37 @@ static int dissect_homa(tvbuff_t *tvb, packet_info *pinfo, proto_tree *tree _U_,
 		proto_tree_add_item(homa_tree_cutoff, hf_homa_cutoff_version,
 				    tvb, COMMON_HEADER_LENGTH + 32, 2,
 				    ENC_BIG_ENDIAN);
+		proto_tree_add_item(homa_tree_cutoff,
+				    hf_homa_cutoff_unsched_bytes, tvb,
+				    COMMON_HEADER_LENGTH + 34, 4,
+				    ENC_BIG_ENDIAN);
+		break;
+
+	case HOMA_MULTI_GRANT_PACKET:
+		col_set_str(pinfo->cinfo, COL_INFO, "Multi-Grant Packet");
+		proto_tree *homa_tree_multi = proto_tree_add_subtree(
+			homa_tree, tvb, COMMON_HEADER_LENGTH,
+			header_length - COMMON_HEADER_LENGTH, 0, &ti,
+			"Multi-Grant Header");
+		proto_tree_add_item(homa_tree_multi,
+				    hf_homa_multi_grant_num_grants, tvb,
+				    COMMON_HEADER_LENGTH, 2, ENC_BIG_ENDIAN);
+		guint num_grants = tvb_get_ntohs(tvb, COMMON_HEADER_LENGTH);
+		if (num_grants > MULTI_GRANT_MAX_ENTRIES)
+			num_grants = MULTI_GRANT_MAX_ENTRIES;
+		for (guint i = 0; i < num_grants; i++) {
+			gint entry = COMMON_HEADER_LENGTH + 2
+					+ i * MULTI_GRANT_ENTRY_LENGTH;
+			proto_tree_add_item(homa_tree_multi,
+					    hf_homa_multi_grant_id, tvb,
+					    entry, 8, ENC_BIG_ENDIAN);
+			proto_tree_add_item(homa_tree_multi,
+					    hf_homa_grant_offset, tvb,
+					    entry + 8, 4, ENC_BIG_ENDIAN);
+			proto_tree_add_item(homa_tree_multi,
+					    hf_homa_grant_priority, tvb,
+					    entry + 12, 1, ENC_BIG_ENDIAN);
+		}
 		break;
 	}
 	call_data_dissector(tvb_new_subset_remaining(tvb, header_length), pinfo,
@@ -364,6 +407,19 @@ static void proto_register_homa(void)
 		{ &hf_homa_cutoff_version,
 		  { "Homa cutoff version", "homa.cutoff.cutoff_version",
 		    FT_UINT16, BASE_DEC, NULL, 0x0, NULL, HFILL } },
+		{ &hf_homa_cutoff_unsched_bytes,
+		  { "Homa incast unscheduled bytes",
+		    "homa.cutoff.unsched_bytes",
+		    FT_UINT32, BASE_DEC, NULL, 0x0, NULL, HFILL } },
+	};
+
+	static hf_register_info hf_multi_grant[] = {
+		{ &hf_homa_multi_grant_num_grants,
+		  { "Homa number of grants", "homa.num_grants", FT_UINT16,
+		    BASE_DEC, NULL, 0x0, NULL, HFILL } },
+		{ &hf_homa_multi_grant_id,
+		  { "Homa granted RPC id", "homa.grant_id", FT_UINT64,
+		    BASE_DEC, NULL, 0x0, NULL, HFILL } },
 	};
 
 	/* Setup protocol subtree array */
@@ -387,6 +443,8 @@ static void proto_register_homa(void)
 				   array_length(hf_header_ack));
 	proto_register_field_array(proto_homa, hf_cutoffs,
 				   array_length(hf_cutoffs));
+	proto_register_field_array(proto_homa, hf_multi_grant,
+				   array_length(hf_multi_grant));
 	proto_register_subtree_array(ett, array_length(ett));
 }
 
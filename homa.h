@@ -32,12 +32,20 @@ extern "C"
 #define HOMA_MAX_MESSAGE_LENGTH 1000000
 
 /**
- * define HOMA_BPAGE_SIZE - Number of bytes in pages used for receive
- * buffers. Must be power of two.
+ * define HOMA_BPAGE_SIZE - Default number of bytes in pages used for
+ * receive buffers (a socket can select larger bpages when it invokes
+ * SO_HOMA_SET_BUF). Must be power of two.
  */
 #define HOMA_BPAGE_SHIFT 16
 #define HOMA_BPAGE_SIZE (1 << HOMA_BPAGE_SHIFT)
 
+/**
+ * define HOMA_MAX_BPAGE_SHIFT - Log base 2 of the largest bpage size
+ * that a socket can select with SO_HOMA_SET_BUF (2 MB, which allows
+ * each bpage to be backed by a single huge page).
+ */
+#define HOMA_MAX_BPAGE_SHIFT 21
+
 /**
  * define HOMA_MAX_BPAGES: The largest number of bpages that will be required
  * to store an incoming message.
@@ -137,8 +145,9 @@ struct homa_recvmsg_args {
 	 * @bpage_offsets: (in/out) Each entry is an offset into the buffer
 	 * region for the socket pool. When returned from recvmsg, the
 	 * offsets indicate where fragments of the new message are stored. All
-	 * entries but the last refer to full buffer pages (HOMA_BPAGE_SIZE bytes)
-	 * and are bpage-aligned. The last entry may refer to a bpage fragment and
+	 * entries but the last refer to full buffer pages (HOMA_BPAGE_SIZE bytes
+	 * unless a different size was selected with SO_HOMA_SET_BUF) and are
+	 * bpage-aligned. The last entry may refer to a bpage fragment and
 	 * is not necessarily aligned. The application now owns these bpages and
 	 * must eventually return them to Homa, using bpage_offsets in a future
 	 * recvmsg invocation.
@@ -191,8 +200,300 @@ struct homa_set_buf_args {
 
 	/** @length: Total number of bytes available at @start. */
 	size_t length;
+
+	/**
+	 * @bpage_shift: Log base 2 of the size of the bpages into which
+	 * the region is divided; must be between HOMA_BPAGE_SHIFT and
+	 * HOMA_MAX_BPAGE_SHIFT, or 0 to use HOMA_BPAGE_SHIFT. Applications
+	 * compiled before this field existed may omit it (i.e. pass an
+	 * optlen that ends just before it).
+	 */
+	uint32_t bpage_shift;
+
+	/**
+	 * @ring_entries: If nonzero, the end of the region holds a
+	 * struct homa_return_ring with this many entries (see
+	 * homa_return_ring_addr), which the application can use to return
+	 * bpages without invoking recvmsg. Must be a power of 2 no greater
+	 * than HOMA_MAX_RING_ENTRIES. Zero means no ring.
+	 */
+	uint32_t ring_entries;
+
+	/**
+	 * @flags: OR-ed combination of HOMA_BUF_* bits. Applications
+	 * compiled before this field existed may omit it (i.e. pass an
+	 * optlen that ends just before it); this is equivalent to 0.
+	 */
+	uint32_t flags;
+
+	uint32_t _pad;
+};
+
+/**
+ * define HOMA_BUF_PIN - Bit in the flags field of homa_set_buf_args:
+ * pin the entire region in memory when it is registered, so that
+ * incoming data can be copied directly into the region's pages without
+ * going through user-address translation (and without page faults).
+ * Works best if the region is backed by hugepages. The pages are
+ * charged to the application's locked memory, so setsockopt fails with
+ * ENOMEM if the region would exceed RLIMIT_MEMLOCK (unless the
+ * application has CAP_IPC_LOCK); they remain pinned until the socket
+ * is closed.
+ */
+#define HOMA_BUF_PIN 1
+
+/**
+ * define HOMA_MAX_RING_ENTRIES - Largest value allowed for the
+ * ring_entries field of struct homa_set_buf_args.
+ */
+#define HOMA_MAX_RING_ENTRIES (1 << 16)
+
+/**
+ * struct homa_return_ring - Shared between an application and Homa; the
+ * application adds the offsets of bpages it no longer needs, and Homa
+ * removes them (lazily, when it needs buffer space or during its timer).
+ * This allows bpages to be returned by threads that aren't receiving
+ * messages. Entries are used circularly; @head and @tail increase
+ * monotonically and must be reduced mod @size to index @offsets.
+ */
+struct homa_return_ring {
+	/**
+	 * @head: Written by the application: the number of entries that
+	 * have been added to the ring. Entries must be filled in before
+	 * @head is incremented to include them.
+	 */
+	uint32_t head;
+
+	/**
+	 * @lock: Not used by Homa; available to the application for
+	 * serializing threads that add entries to the ring.
+	 */
+	uint32_t lock;
+
+	/**
+	 * @size: Written by Homa during SO_HOMA_SET_BUF: number of entries
+	 * in @offsets.
+	 */
+	uint32_t size;
+
+	uint32_t _pad1[13];
+
+	/**
+	 * @tail: Written by Homa: the number of entries that have been
+	 * removed from the ring. The application may add entries as long
+	 * as @head - @tail doesn't exceed @size. Kept in a different
+	 * cache line from @head.
+	 */
+	uint32_t tail;
+
+	uint32_t _pad2[15];
+
+	/** @offsets: Offsets of bpages being returned. */
+	uint32_t offsets[];
+};
+
+/**
+ * homa_return_ring_addr() - Returns the location of the return ring
+ * within a buffer region.
+ * @start:    First byte of the buffer region.
+ * @length:   Total number of bytes in the buffer region.
+ * @entries:  Number of entries in the ring.
+ * Return:    Address of the ring (it is placed at the end of the region,
+ *            aligned to a 64-byte boundary). Bpages are carved only from
+ *            the space below this address.
+ */
+static inline struct homa_return_ring *homa_return_ring_addr(void *start,
+		size_t length, uint32_t entries)
+{
+	uintptr_t end = (uintptr_t) start + length;
+
+	return (struct homa_return_ring *) ((end
+			- sizeof(struct homa_return_ring)
+			- entries*sizeof(uint32_t)) & ~((uintptr_t) 63));
+}
+
+/**
+ * define SO_HOMA_BUF_STATS: getsockopt option for retrieving information
+ * about a socket's buffer pool (returns a struct homa_buf_stats).
+ */
+#define SO_HOMA_BUF_STATS 11
+
+/**
+ * define HOMA_SCAN_BUCKETS: number of entries in the scan_lengths
+ * histogram of struct homa_buf_stats.
+ */
+#define HOMA_SCAN_BUCKETS 8
+
+/**
+ * struct homa_buf_stats - getsockopt result for SO_HOMA_BUF_STATS. All
+ * fields are zero if no buffer region has been set for the socket.
+ */
+struct homa_buf_stats {
+	/** @num_bpages: Total number of bpages in the buffer region. */
+	uint32_t num_bpages;
+
+	/**
+	 * @free_bpages: Number of bpages not currently in use (not
+	 * including bpages that are in the return ring).
+	 */
+	uint32_t free_bpages;
+
+	/**
+	 * @owned_bpages: Number of bpages currently being used by Homa
+	 * to pack messages smaller than a bpage.
+	 */
+	uint32_t owned_bpages;
+
+	/**
+	 * @waiting_rpcs: Number of incoming messages currently waiting for
+	 * buffer space.
+	 */
+	uint32_t waiting_rpcs;
+
+	/**
+	 * @partial_bpages: Number of bpages used for packing small
+	 * messages that have filled up (so Homa moved on to another bpage).
+	 */
+	uint64_t partial_bpages;
+
+	/**
+	 * @partial_waste: Total bytes in @partial_bpages that were never
+	 * used for message data (alignment padding plus unused space at the
+	 * end of the bpage). @partial_waste / @partial_bpages gives the
+	 * average space wasted per bpage.
+	 */
+	uint64_t partial_waste;
+
+	/**
+	 * @waits: Number of times an incoming message had to wait for
+	 * buffer space.
+	 */
+	uint64_t waits;
+
+	/**
+	 * @wait_usecs: Total time (in microseconds) that incoming messages
+	 * spent waiting for buffer space.
+	 */
+	uint64_t wait_usecs;
+
+	/**
+	 * @scan_lengths: Histogram of the number of free-map words examined
+	 * when allocating bpages: entry 0 counts allocations that
+	 * examined no words; entry i counts allocations that examined
+	 * 2^(i-1) to 2^i - 1 words (the last entry also counts all larger
+	 * scans).
+	 */
+	uint64_t scan_lengths[HOMA_SCAN_BUCKETS];
+};
+
+/**
+ * define SO_HOMA_GRANT_WEIGHT: setsockopt/getsockopt option for the grant
+ * weight of a socket (an int). When choosing which incoming messages to
+ * grant, Homa divides each message's remaining bytes by the weight of its
+ * socket, so messages on a socket with weight 2 compete as if they were
+ * half their actual size. The default weight is 1.
+ */
+#define SO_HOMA_GRANT_WEIGHT 12
+
+/**
+ * define HOMA_MAX_GRANT_WEIGHT: largest value that may be set with
+ * SO_HOMA_GRANT_WEIGHT.
+ */
+#define HOMA_MAX_GRANT_WEIGHT 64
+
+/**
+ * define SO_HOMA_SET_SEND_BUF: setsockopt option for registering a region
+ * from which outgoing messages can be transmitted without copying or
+ * pinning (messages in the region are sent this way when sendmsg is
+ * invoked with MSG_ZEROCOPY).
+ */
+#define SO_HOMA_SET_SEND_BUF 13
+
+/**
+ * struct homa_set_send_buf_args - setsockopt argument for
+ * SO_HOMA_SET_SEND_BUF.
+ */
+struct homa_set_send_buf_args {
+	/** @start: First byte of the send region; must be page-aligned. */
+	void *start;
+
+	/** @length: Total number of bytes available at @start. */
+	size_t length;
+
+	/**
+	 * @ring_entries: If nonzero, the end of the region holds a
+	 * struct homa_send_ring with this many entries (see
+	 * homa_send_ring_addr), in which Homa reports messages whose
+	 * buffers can be reused. Must be a power of 2 no greater than
+	 * HOMA_MAX_RING_ENTRIES. Zero means no ring.
+	 */
+	uint32_t ring_entries;
+
+	/** @_pad: Must be zero. */
+	uint32_t _pad;
+};
+
+/**
+ * struct homa_send_ring - Shared between an application and Homa; Homa
+ * adds the offsets (within the send region) of messages sent from the
+ * region once it no longer references their pages, and the
+ * application removes them to recycle the space. Entries are used
+ * circularly; @head and @tail increase monotonically and must be reduced
+ * mod @size to index @offsets.
+ */
+struct homa_send_ring {
+	/**
+	 * @head: Written by Homa: the number of entries that have been
+	 * added to the ring. Entries are filled in before @head is
+	 * incremented to include them.
+	 */
+	uint32_t head;
+
+	/**
+	 * @size: Written by Homa during SO_HOMA_SET_SEND_BUF: number of
+	 * entries in @offsets.
+	 */
+	uint32_t size;
+
+	uint32_t _pad1[14];
+
+	/**
+	 * @tail: Written by the application: the number of entries that
+	 * have been removed from the ring. Homa adds entries only while
+	 * @head - @tail is less than @size. Kept in a different cache line
+	 * from @head.
+	 */
+	uint32_t tail;
+
+	uint32_t _pad2[15];
+
+	/**
+	 * @offsets: Offsets within the send region of the first bytes of
+	 * completed messages.
+	 */
+	uint32_t offsets[];
 };
 
+/**
+ * homa_send_ring_addr() - Returns the location of the completion ring
+ * within a send region.
+ * @start:    First byte of the send region.
+ * @length:   Total number of bytes in the send region.
+ * @entries:  Number of entries in the ring.
+ * Return:    Address of the ring (it is placed at the end of the region,
+ *            aligned to a 64-byte boundary). Messages must lie entirely
+ *            below this address.
+ */
+static inline struct homa_send_ring *homa_send_ring_addr(void *start,
+		size_t length, uint32_t entries)
+{
+	uintptr_t end = (uintptr_t) start + length;
+
+	return (struct homa_send_ring *) ((end
+			- sizeof(struct homa_send_ring)
+			- entries*sizeof(uint32_t)) & ~((uintptr_t) 63));
+}
+
 /**
  * Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
@@ -8,6 +8,33 @@
 
 #include "homa_impl.h"
 
+/* If the utilization of the incoming link (in thousandths) drops below
+ * this value while there are messages waiting for grants,
+ * homa_grant_tune_overcommit will consider increasing overcommit_current.
+ */
+#define HOMA_OVERCOMMIT_LOW_UTIL 900
+
+/* If the utilization of the incoming link (in thousandths) is above this
+ * value, homa_grant_tune_overcommit will decrease overcommit_current.
+ */
+#define HOMA_OVERCOMMIT_HIGH_UTIL 970
+
+/**
+ * homa_grant_key() - Returns the value that determines an RPC's position
+ * in the grantable lists (smaller means higher priority).
+ * @rpc:    RPC of interest.
+ * Return:  homa_grant_remaining(@rpc), except for a staged RPC: its lock
+ *          isn't held while it is moved into the grantable lists (see
+ *          homa_grant_add_staged), so use the value recorded when it was
+ *          staged; it can't change underneath us.
+ */
+static inline __s64 homa_grant_key(struct homa_rpc *rpc)
+{
+	if (rpc->msgin.staged)
+		return rpc->msgin.staged_remaining;
+	return homa_grant_remaining(rpc);
+}
+
 /**
  * homa_grant_outranks() - Returns nonzero if rpc1 should be considered
  * higher priority for grants than rpc2, and zero if the two RPCS are
@@ -17,12 +44,16 @@
  */
 int inline homa_grant_outranks(struct homa_rpc *rpc1, struct homa_rpc *rpc2)
 {
-	/* Fewest bytes remaining is the primary criterion; if those are
-	 * equal, then favor the older RPC.
+	/* Fewest bytes remaining (scaled down by the weight of the RPC's
+	 * socket) is the primary criterion; if those are equal, then
+	 * favor the older RPC. homa_grant_remaining is exact, and it is
+	 * also what homa->active_remaining holds, so this ordering always
+	 * agrees with comparisons against active_remaining.
 	 */
-	return (rpc1->msgin.bytes_remaining < rpc2->msgin.bytes_remaining)
-			|| ((rpc1->msgin.bytes_remaining
-			== rpc2->msgin.bytes_remaining)
+	__s64 remaining1 = homa_grant_key(rpc1);
+	__s64 remaining2 = homa_grant_key(rpc2);
+
+	return (remaining1 < remaining2) || ((remaining1 == remaining2)
 			&& (rpc1->msgin.birth < rpc2->msgin.birth));
 }
 
@@ -54,18 +85,73 @@ int inline homa_grant_update_incoming(struct homa_rpc *rpc, struct homa *homa) {
 	return 0;
 }
 
+/**
+ * homa_grant_insert_peer() - Add a peer to homa->grantable_peers, in the
+ * appropriate bucket and position for its highest priority RPC. The caller
+ * must hold the grantable lock.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer to insert; must not currently be in homa->grantable_peers,
+ *           and must have at least one entry in its grantable_rpcs list.
+ */
+void homa_grant_insert_peer(struct homa *homa, struct homa_peer *peer)
+{
+	struct homa_rpc *head = list_first_entry(&peer->grantable_rpcs,
+			struct homa_rpc, grantable_links);
+	struct homa_peer *peer_cand;
+	struct list_head *bucket_list;
+	int bucket, checks = 0;
+
+	bucket = homa_grant_bucket(homa_grant_key(head)
+			/ HOMA_GRANT_WEIGHT_SCALE);
+	bucket_list = &homa->grantable_peers[bucket];
+	peer->grant_bucket = bucket;
+
+	/* Scan backwards from the end of the bucket: insert the peer after
+	 * the last peer that it doesn't outrank.
+	 */
+	list_for_each_entry_reverse(peer_cand, bucket_list, grantable_links) {
+		checks++;
+		if (!homa_grant_outranks(head, list_first_entry(
+				&peer_cand->grantable_rpcs, struct homa_rpc,
+				grantable_links))) {
+			list_add(&peer->grantable_links,
+					&peer_cand->grantable_links);
+			goto done;
+		}
+	}
+	list_add(&peer->grantable_links, bucket_list);
+
+    done:
+	__set_bit(bucket, &homa->grantable_nonempty);
+	INC_METRIC(grantable_peer_inserts, 1);
+	INC_METRIC(grantable_peer_checks, checks);
+}
+
+/**
+ * homa_grant_unlink_peer() - Remove a peer from homa->grantable_peers.
+ * The caller must hold the grantable lock.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    Peer to remove; must currently be in homa->grantable_peers.
+ */
+void homa_grant_unlink_peer(struct homa *homa, struct homa_peer *peer)
+{
+	list_del_init(&peer->grantable_links);
+	if (list_empty(&homa->grantable_peers[peer->grant_bucket]))
+		__clear_bit(peer->grant_bucket, &homa->grantable_nonempty);
+}
+
 /**
  * homa_grant_add_rpc() - Make sure that an RPC is present in the grantable
  * list for its peer and in the appropriate position, and that the peer is
  * present in the overall grantable list for Homa and in the correct
- * position. The caller must hold the grantable lock and the RPC's lock.
+ * position. The caller must hold the grantable lock and the RPC's lock
+ * (unless the RPC is staged; see homa_grant_add_staged).
  * @rpc:    The RPC to add/reposition.
  */
 void homa_grant_add_rpc(struct homa_rpc *rpc)
 {
 	struct homa_rpc *candidate;
 	struct homa_peer *peer = rpc->peer;
-	struct homa_peer *peer_cand;
 	struct homa *homa = rpc->hsk->homa;
 
 	/* Make sure this message is in the right place in the grantable_rpcs
@@ -73,7 +159,8 @@ void homa_grant_add_rpc(struct homa_rpc *rpc)
 	 */
 	if (list_empty(&rpc->grantable_links)) {
 		/* Message not yet tracked; add it in priority order to
-		 * the peer's list.
+		 * the peer's list. New messages are usually larger than
+		 * those already in progress, so scan from the end.
 		 */
 		__u64 time = get_cycles();
 		INC_METRIC(grantable_rpcs_integral, homa->num_grantable_rpcs
@@ -84,16 +171,17 @@ void homa_grant_add_rpc(struct homa_rpc *rpc)
 				homa->num_grantable_rpcs, rpc->id);
 		if (homa->num_grantable_rpcs > homa->max_grantable_rpcs)
 			homa->max_grantable_rpcs = homa->num_grantable_rpcs;
-		rpc->msgin.birth = time;
-		list_for_each_entry(candidate, &peer->grantable_rpcs,
+		if (!rpc->msgin.staged)
+			rpc->msgin.birth = time;
+		list_for_each_entry_reverse(candidate, &peer->grantable_rpcs,
 				grantable_links) {
-			if (homa_grant_outranks(rpc, candidate)) {
-				list_add_tail(&rpc->grantable_links,
+			if (!homa_grant_outranks(rpc, candidate)) {
+				list_add(&rpc->grantable_links,
 						&candidate->grantable_links);
 				goto position_peer;
 			}
 		}
-		list_add_tail(&rpc->grantable_links, &peer->grantable_rpcs);
+		list_add(&rpc->grantable_links, &peer->grantable_rpcs);
 	} else while (rpc != list_first_entry(&peer->grantable_rpcs,
 			struct homa_rpc, grantable_links)) {
 		/* Message is on the list, but its priority may have
@@ -109,37 +197,49 @@ void homa_grant_add_rpc(struct homa_rpc *rpc)
 
     position_peer:
 	/* At this point rpc is positioned correctly on the list for its peer.
-	 * However, the peer may need to be added to, or moved upward on,
-	 * homa->grantable_peers.
+	 * However, the peer may need to be added to homa->grantable_peers,
+	 * or repositioned there if rpc is now its highest priority RPC
+	 * (it may now belong in a different bucket).
 	 */
 	if (list_empty(&peer->grantable_links)) {
-		/* Must add peer to the overall Homa list. */
-		list_for_each_entry(peer_cand, &homa->grantable_peers,
-				grantable_links) {
-			candidate = list_first_entry(&peer_cand->grantable_rpcs,
-					struct homa_rpc, grantable_links);
-			if (homa_grant_outranks(rpc, candidate)) {
-				list_add_tail(&peer->grantable_links,
-						&peer_cand->grantable_links);
-				goto done;
-			}
-		}
-		list_add_tail(&peer->grantable_links, &homa->grantable_peers);
-		goto done;
+		homa_grant_insert_peer(homa, peer);
+		return;
 	}
-        /* The peer is on Homa's list, but it may need to move upward. */
-        while (peer != list_first_entry(&homa->grantable_peers,
-			struct homa_peer, grantable_links)) {
-		struct homa_peer *prev_peer = list_prev_entry(
-			peer, grantable_links);
-		candidate = list_first_entry(&prev_peer->grantable_rpcs,
-				struct homa_rpc, grantable_links);
-		if (!homa_grant_outranks(rpc, candidate))
-			goto done;
-		__list_del_entry(&prev_peer->grantable_links);
-		list_add(&prev_peer->grantable_links, &peer->grantable_links);
+	if (rpc != list_first_entry(&peer->grantable_rpcs, struct homa_rpc,
+			grantable_links))
+		return;
+	homa_grant_unlink_peer(homa, peer);
+	homa_grant_insert_peer(homa, peer);
+}
+
+/**
+ * homa_grant_add_staged() - Move all of the RPCs in the grantable_staged
+ * lists of all cores into the grantable lists, so that they will be
+ * considered for grants.
+ * @homa:    Overall data about the Homa protocol implementation. The
+ *           grantable_lock must be held by the caller.
+ */
+void homa_grant_add_staged(struct homa *homa)
+{
+	struct homa_rpc *rpc, *next;
+	struct llist_node *staged;
+	int core;
+
+	if (atomic_read(&homa->num_staged_rpcs) == 0)
+		return;
+	for (core = 0; core < nr_cpu_ids; core++) {
+		staged = llist_del_all(&homa_cores[core]->grantable_staged);
+		llist_for_each_entry_safe(rpc, next, staged,
+				msgin.staged_links) {
+			homa_grant_add_rpc(rpc);
+			atomic_dec(&homa->num_staged_rpcs);
+
+			/* This must not happen until the RPC is in the
+			 * grantable lists (see homa_grant_check_rpc).
+			 */
+			smp_store_release(&rpc->msgin.staged, 0);
+		}
 	}
-	done:
 }
 
 /**
@@ -152,7 +252,6 @@ void homa_grant_remove_rpc(struct homa_rpc *rpc)
 {
 	struct homa_rpc *head;
 	struct homa_peer *peer = rpc->peer;
-	struct homa_rpc *candidate;
 	struct homa *homa = rpc->hsk->homa;
 	__u64 time = get_cycles();
 
@@ -175,30 +274,12 @@ void homa_grant_remove_rpc(struct homa_rpc *rpc)
 		return;
 
 	/* The removed RPC was at the front of the peer's list. This means
-	 * we may have to adjust the position of the peer in Homa's list,
-	 * or perhaps remove it.
+	 * we have to reposition the peer in Homa's list (its priority can
+	 * only have dropped), or perhaps remove it.
 	 */
-	if (list_empty(&peer->grantable_rpcs)) {
-		list_del_init(&peer->grantable_links);
-		return;
-	}
-
-	/* The peer may have to move down in Homa's list (removal of
-	 * an RPC can't cause the peer to move up).
-	 */
-	head =  list_first_entry(&peer->grantable_rpcs,
-			struct homa_rpc, grantable_links);
-        while (peer != list_last_entry(&homa->grantable_peers, struct homa_peer,
-			grantable_links)) {
-		struct homa_peer *next_peer = list_next_entry(
-				peer, grantable_links);
-		candidate = list_first_entry(&next_peer->grantable_rpcs,
-				struct homa_rpc, grantable_links);
-		if (!homa_grant_outranks(rpc, candidate))
-			break;
-		__list_del_entry(&peer->grantable_links);
-		list_add(&peer->grantable_links, &next_peer->grantable_links);
-	}
+	homa_grant_unlink_peer(homa, peer);
+	if (!list_empty(&peer->grantable_rpcs))
+		homa_grant_insert_peer(homa, peer);
 }
 
 /**
@@ -209,7 +290,7 @@ void homa_grant_remove_rpc(struct homa_rpc *rpc)
  */
 int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
 {
-	int incoming, increment, available;
+	int incoming, increment, available, limit;
 	struct grant_header grant;
 
 	/* Compute how many additional bytes to grant. */
@@ -230,6 +311,16 @@ int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
 	if (increment <= 0)
 		return 0;
 
+	/* Don't grant bytes for which there is no buffer space (this may
+	 * allocate more space for the message).
+	 */
+	limit = homa_pool_extend(rpc, rpc->msgin.granted + increment);
+	if (increment > (limit - rpc->msgin.granted)) {
+		increment = limit - rpc->msgin.granted;
+		if (increment <= 0)
+			return 0;
+	}
+
 	/* The following line is needed to prevent spurious resends. Without
 	 * it, if the timer fires right after we update rpc->msgin.granted,
 	 * it might think the RPC is slow and request a resend (timeouts
@@ -239,6 +330,8 @@ int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
 	rpc->silent_ticks = 0;
 
 	rpc->msgin.granted += increment;
+	if (homa->fifo_grant_increment != 0)
+		atomic_sub(increment, &homa->grant_nonfifo_left);
 
 	/* Send the grant. */
 	grant.offset = htonl(rpc->msgin.granted);
@@ -248,10 +341,124 @@ int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
 	tt_record4("sending grant for id %llu, offset %d, priority %d, "
 			"increment %d", rpc->id, rpc->msgin.granted,
 			rpc->msgin.priority, increment);
-	homa_xmit_control(GRANT, &grant, sizeof(grant),rpc);
+	homa_grant_xmit(rpc, &grant);
 	return 1;
 }
 
+/**
+ * homa_grant_xmit() - Transmit a grant for an RPC. If grants are being
+ * batched on this core (see homa_softirq), the grant is saved and sent
+ * later by homa_grant_flush; otherwise it is sent immediately.
+ * @rpc:    RPC for which the grant is intended. Must be locked by the caller.
+ * @grant:  Contents of the grant; the common header need not be valid.
+ */
+void homa_grant_xmit(struct homa_rpc *rpc, struct grant_header *grant)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	struct homa_deferred_grant *deferred;
+	__be64 sender_id = cpu_to_be64(rpc->id);
+	int i;
+
+	if (!core->defer_grants) {
+		homa_xmit_control(GRANT, grant, sizeof(*grant), rpc);
+		return;
+	}
+
+	/* If there is already a grant pending for this RPC, just update it
+	 * (the new grant supersedes the old one).
+	 */
+	for (i = 0; i < core->num_deferred_grants; i++) {
+		deferred = &core->deferred_grants[i];
+		if ((deferred->grant.sender_id == sender_id)
+				&& (deferred->hsk == rpc->hsk)
+				&& (deferred->peer == rpc->peer)
+				&& (deferred->dport == rpc->dport)) {
+			deferred->grant.offset = grant->offset;
+			deferred->grant.priority = grant->priority;
+			deferred->grant.resend_all |= grant->resend_all;
+			return;
+		}
+	}
+
+	if (core->num_deferred_grants >= HOMA_MAX_DEFERRED_GRANTS)
+		homa_grant_flush(core);
+	deferred = &core->deferred_grants[core->num_deferred_grants];
+	core->num_deferred_grants++;
+	deferred->hsk = rpc->hsk;
+	deferred->peer = rpc->peer;
+	deferred->dport = rpc->dport;
+	deferred->grant.sender_id = sender_id;
+	deferred->grant.offset = grant->offset;
+	deferred->grant.priority = grant->priority;
+	deferred->grant.resend_all = grant->resend_all;
+}
+
+/**
+ * homa_grant_flush() - Transmit all of the grants that have been deferred
+ * on a core by homa_grant_xmit. Grants for the same peer that involve the
+ * same pair of sockets are combined into MULTI_GRANT packets.
+ * @core:   Core whose deferred grants should be sent.
+ */
+void homa_grant_flush(struct homa_core *core)
+{
+	struct homa_deferred_grant *first, *other;
+	struct multi_grant_header multi;
+	struct grant_header grant;
+	struct homa_sock *hsk;
+	int i, j, count;
+
+	for (i = 0; i < core->num_deferred_grants; i++) {
+		first = &core->deferred_grants[i];
+		hsk = first->hsk;
+		if (hsk == NULL) {
+			/* Already sent as part of an earlier MULTI_GRANT. */
+			continue;
+		}
+		memset(&multi, 0, sizeof(multi));
+		multi.grants[0] = first->grant;
+		count = 1;
+		for (j = i+1; (j < core->num_deferred_grants)
+				&& (count < HOMA_MAX_MULTI_GRANTS); j++) {
+			other = &core->deferred_grants[j];
+			if ((other->hsk != hsk) || (other->peer != first->peer)
+					|| (other->dport != first->dport))
+				continue;
+			multi.grants[count] = other->grant;
+			count++;
+			other->hsk = NULL;
+		}
+
+		/* The socket's memory can't be freed before the end of
+		 * the SoftIRQ batch, but it may have been shut down.
+		 */
+		if (hsk->shutdown)
+			continue;
+
+		if (count == 1) {
+			grant.common.type = GRANT;
+			grant.common.sport = htons(hsk->port);
+			grant.common.dport = htons(first->dport);
+			grant.common.sender_id = first->grant.sender_id;
+			grant.offset = first->grant.offset;
+			grant.priority = first->grant.priority;
+			grant.resend_all = first->grant.resend_all;
+			__homa_xmit_control(&grant, sizeof(grant), first->peer,
+					hsk);
+			continue;
+		}
+		multi.common.type = MULTI_GRANT;
+		multi.common.sport = htons(hsk->port);
+		multi.common.dport = htons(first->dport);
+		multi.common.sender_id = first->grant.sender_id;
+		multi.num_grants = htons(count);
+		tt_record2("sending MULTI_GRANT with %d grants, first id %llu",
+				count, be64_to_cpu(first->grant.sender_id));
+		__homa_xmit_control(&multi, sizeof(multi), first->peer, hsk);
+		INC_METRIC(grants_coalesced, count);
+	}
+	core->num_deferred_grants = 0;
+}
+
 /**
  * homa_grant_check_rpc() - This function is invoked when the state of an
  * RPC has changed (such as packets arriving). It checks the state of the
@@ -274,9 +481,12 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	 * homa_grant_recalc or acquiring grantable_lock. Unfortunately
 	 * there are quite a few situations where homa_grant_recalc must
 	 * be called, which create a lot of special cases in this function.
+	 * New messages that can't immediately become active are staged on
+	 * per-core lists without acquiring grantable_lock; homa_grant_recalc
+	 * adds them to the grantable lists before picking active RPCs.
 	 */
 	struct homa *homa = rpc->hsk->homa;
-	int rank, recalc;
+	int rank, recalc, overcommit;
 
 	tt_record1("homa_grant_check_rpc starting for id %d", rpc->id);
 
@@ -293,20 +503,44 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	}
 
 	/* This message requires grants; if it is a new message, set up
-	 * granting.
+	 * granting. Staged must be checked before grantable_links: once
+	 * staged is cleared, the RPC is guaranteed to be in the grantable
+	 * lists.
 	 */
-	if (list_empty(&rpc->grantable_links)) {
+	overcommit = READ_ONCE(homa->overcommit_current);
+	if (!smp_load_acquire(&rpc->msgin.staged)
+			&& list_empty(&rpc->grantable_links)) {
 		homa_grant_update_incoming(rpc,homa);
+
+		/* overcommit_current can change (e.g. in
+		 * homa_grant_tune_overcommit) before the next recalculation
+		 * fills in the corresponding entries of active_remaining, so
+		 * only trust the threshold if the active set is actually full.
+		 */
+		if ((READ_ONCE(homa->num_active_rpcs) >= overcommit)
+				&& (homa_grant_remaining(rpc) >= atomic64_read(
+				&homa->active_remaining[overcommit-1]))) {
+			/* The message can't displace any of the active
+			 * messages, so there's no need to recalculate now.
+			 * Rather than acquiring grantable_lock to add the
+			 * message to the grantable lists, stage it on this
+			 * core; the next recalculation will add it.
+			 */
+			rpc->msgin.birth = get_cycles();
+			rpc->msgin.staged_remaining = homa_grant_remaining(rpc);
+			rpc->msgin.staged = 1;
+			atomic_inc(&homa->num_staged_rpcs);
+			llist_add(&rpc->msgin.staged_links,
+					&homa_cores[raw_smp_processor_id()]
+					->grantable_staged);
+			INC_METRIC(grantable_staged_rpcs, 1);
+			homa_rpc_unlock(rpc);
+			return;
+		}
 		homa_grantable_lock(homa, 0);
 		homa_grant_add_rpc(rpc);
-		recalc = ((homa->num_grantable_rpcs <= homa->max_overcommit)
-				|| (rpc->msgin.bytes_remaining < atomic_read(
-				&homa->active_remaining[homa->max_overcommit-1])));
 		homa_rpc_unlock(rpc);
-		if (recalc)
-			homa_grant_recalc(homa, 1);
-		else
-			homa_grantable_unlock(homa);
+		homa_grant_recalc(homa, 1);
 		return;
 	}
 
@@ -314,24 +548,36 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	rank = atomic_read(&rpc->msgin.rank);
 	if (rank < 0) {
 		homa_grant_update_incoming(rpc, homa);
-		if (rpc->msgin.bytes_remaining < atomic_read(
-				&homa->active_remaining[homa->max_overcommit-1])) {
+		if (homa_grant_remaining(rpc) < atomic64_read(
+				&homa->active_remaining[overcommit-1])) {
+			/* The message's position in the grantable lists
+			 * reflects its size when it was added or staged;
+			 * bring that up to date (we hold its lock now) so
+			 * the recalculation sees the correct order.
+			 */
+			homa_grantable_lock(homa, 0);
+			if (rpc->msgin.staged)
+				rpc->msgin.staged_remaining =
+						homa_grant_remaining(rpc);
+			else
+				homa_grant_add_rpc(rpc);
 			homa_rpc_unlock(rpc);
 			INC_METRIC(grant_priority_bumps, 1);
-			homa_grant_recalc(homa, 0);
+			homa_grant_recalc(homa, 1);
 		} else {
 			homa_rpc_unlock(rpc);
+			INC_METRIC(grant_recalcs_avoided, 1);
 		}
 		return;
 	}
-	atomic_set(&homa->active_remaining[rank], rpc->msgin.bytes_remaining);
-	if ((rank > 0) && (rpc->msgin.bytes_remaining < atomic_read(
+	atomic64_set(&homa->active_remaining[rank], homa_grant_remaining(rpc));
+	if ((rank > 0) && (homa_grant_remaining(rpc) < atomic64_read(
 			&homa->active_remaining[rank-1]))) {
-		homa_grant_update_incoming(rpc, homa);
-		homa_rpc_unlock(rpc);
+		/* The set of active RPCs hasn't changed, only their order,
+		 * so there's no need for a full recalculation.
+		 */
 		INC_METRIC(grant_priority_bumps, 1);
-		homa_grant_recalc(homa, 0);
-		return;
+		homa_grant_promote(rpc, homa);
 	}
 
 	/* Getting here should be the normal case: see if we can send a new
@@ -352,6 +598,79 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	homa_rpc_unlock(rpc);
 	if (recalc)
 		homa_grant_recalc(homa, 0);
+	else {
+		INC_METRIC(grant_recalcs_avoided, 1);
+		homa_grant_fifo(homa);
+	}
+}
+
+/**
+ * homa_grant_promote() - This function is invoked when the (weighted)
+ * bytes remaining for an active RPC has dropped below that of the active
+ * RPC ranked just above it. It moves the RPC upward in homa->active_rpcs and updates the
+ * ranks and priorities of the RPCs it passes. This is much cheaper than
+ * homa_grant_recalc, and it doesn't send any grants: the caller is
+ * expected to send a grant to @rpc, and the other RPCs will pick up
+ * their new priorities with their next grants.
+ * @rpc:    RPC whose priority has increased. Must be locked by the caller.
+ * @homa:   Overall data about the Homa protocol implementation.
+ */
+void homa_grant_promote(struct homa_rpc *rpc, struct homa *homa)
+{
+	struct homa_rpc *other;
+	int rank, old_rank;
+
+	homa_grantable_lock(homa, 0);
+
+	/* Must reread the rank now that we hold the lock: a recalculation
+	 * in another thread may have changed it.
+	 */
+	rank = atomic_read(&rpc->msgin.rank);
+	if (rank < 0)
+		goto done;
+	old_rank = rank;
+	while (rank > 0) {
+		other = homa->active_rpcs[rank-1];
+		if (!homa_grant_outranks(rpc, other))
+			break;
+		homa->active_rpcs[rank] = other;
+		atomic_set(&other->msgin.rank, rank);
+		atomic64_set(&homa->active_remaining[rank],
+				homa_grant_remaining(other));
+		homa_grant_set_priority(homa, other, rank);
+		rank--;
+	}
+	homa->active_rpcs[rank] = rpc;
+	atomic_set(&rpc->msgin.rank, rank);
+	atomic64_set(&homa->active_remaining[rank], homa_grant_remaining(rpc));
+	homa_grant_set_priority(homa, rpc, rank);
+	if (rank != old_rank)
+		INC_METRIC(grant_incremental_bumps, 1);
+
+    done:
+	homa_grantable_unlock(homa);
+}
+
+/**
+ * homa_grant_set_priority() - Compute the priority to use for grants to
+ * an active RPC. If there aren't enough RPCs to consume all of the priority
+ * levels, use only the lower levels; this allows faster preemption if a new
+ * high-priority message appears.
+ * @homa:   Overall data about the Homa protocol implementation. The
+ *          grantable lock must be held by the caller.
+ * @rpc:    RPC whose msgin.priority should be set.
+ * @rank:   Position of @rpc in homa->active_rpcs.
+ */
+void homa_grant_set_priority(struct homa *homa, struct homa_rpc *rpc, int rank)
+{
+	int extra_levels;
+
+	rpc->msgin.priority = homa->max_sched_prio - rank;
+	extra_levels = homa->max_sched_prio + 1 - homa->num_active_rpcs;
+	if (extra_levels >= 0)
+		rpc->msgin.priority -= extra_levels;
+	if (rpc->msgin.priority < 0)
+		rpc->msgin.priority = 0;
 }
 
 /**
@@ -396,6 +715,7 @@ void homa_grant_recalc(struct homa *homa, int locked)
 	while (1) {
 		try_again = 0;
 		atomic_inc(&homa->grant_recalc_count);
+		homa_grant_add_staged(homa);
 
 		/* Clear the existing grant calculation. */
 		for (i = 0; i < homa->num_active_rpcs; i++) {
@@ -406,31 +726,17 @@ void homa_grant_recalc(struct homa *homa, int locked)
 		 * about them.
 		 */
 		active = homa_grant_pick_rpcs(homa, homa->active_rpcs,
-				homa->max_overcommit);
+				READ_ONCE(homa->overcommit_current));
 		homa->num_active_rpcs = active;
 		for (i = 0; i < active; i++) {
-			int extra_levels;
 			struct homa_rpc *rpc = homa->active_rpcs[i];
 
 			active_rpcs[i] = rpc;
 			atomic_inc(&rpc->grants_in_progress);
 			atomic_set(&rpc->msgin.rank, i);
-			atomic_set(&homa->active_remaining[i],
-					rpc->msgin.bytes_remaining);
-
-			/* Compute the priority to use for this RPC's grants:
-			 * if there aren't enough RPCs to consume all of the
-			 * priority levels, use only the lower levels; this
-			 * allows faster preemption if a new high-priority
-			 * message appears.
-			 */
-			rpc->msgin.priority = homa->max_sched_prio - i;
-			extra_levels = homa->max_sched_prio + 1
-					- homa->num_active_rpcs;
-			if (extra_levels >= 0)
-				rpc->msgin.priority -= extra_levels;
-			if (rpc->msgin.priority < 0)
-				rpc->msgin.priority = 0;
+			atomic64_set(&homa->active_remaining[i],
+					homa_grant_remaining(rpc));
+			homa_grant_set_priority(homa, rpc, i);
 		}
 
 		/* Compute the maximum window size for any RPC. Dynamic window
@@ -474,6 +780,7 @@ void homa_grant_recalc(struct homa *homa, int locked)
 			break;
 		}
 	}
+	homa_grant_fifo(homa);
 }
 
 /**
@@ -495,7 +802,8 @@ int homa_grant_pick_rpcs(struct homa *homa, struct homa_rpc **rpcs,
 	/* Iterate over peers, in decreasing order of "highest priority
 	 * RPC from this peer".
 	 */
-	list_for_each_entry(peer, &homa->grantable_peers, grantable_links) {
+	for (peer = homa_grant_next_peer(homa, NULL); peer != NULL;
+			peer = homa_grant_next_peer(homa, peer)) {
 		int rpcs_from_peer = 0;
 
 		/* Consider up to homa->max_rpcs_per_peer from this peer,
@@ -559,7 +867,8 @@ void homa_grant_find_oldest(struct homa *homa)
 	/* Find the oldest message that doesn't currently have an
 	 * outstanding "pity grant".
 	 */
-	list_for_each_entry(peer, &homa->grantable_peers, grantable_links) {
+	for (peer = homa_grant_next_peer(homa, NULL); peer != NULL;
+			peer = homa_grant_next_peer(homa, peer)) {
 		list_for_each_entry(rpc, &peer->grantable_rpcs,
 				grantable_links) {
 			int received, incoming;
@@ -585,6 +894,182 @@ void homa_grant_find_oldest(struct homa *homa)
 	}
 	homa->oldest_rpc = oldest;
 }
+
+/**
+ * homa_grant_fifo() - Issue a "pity grant" to the oldest grantable message
+ * if homa->fifo_grant_interval bytes have been granted using SRPT since the
+ * last one. This ensures that the oldest message receives about
+ * homa->grant_fifo_fraction of all granted bytes, which bounds the
+ * starvation SRPT can cause for long messages.
+ * @homa:    Overall data about the Homa protocol implementation. No locks
+ *           may be held by the caller.
+ */
+void homa_grant_fifo(struct homa *homa)
+{
+	struct grant_header grant;
+	struct homa_rpc *rpc;
+	int increment, limit;
+
+	if ((homa->fifo_grant_increment == 0)
+			|| (atomic_read(&homa->grant_nonfifo_left) > 0))
+		return;
+
+	homa_grantable_lock(homa, 0);
+	if (atomic_read(&homa->grant_nonfifo_left) > 0) {
+		/* Another thread got here first and issued the grant. */
+		homa_grantable_unlock(homa);
+		return;
+	}
+	atomic_set(&homa->grant_nonfifo_left, homa->fifo_grant_interval);
+	homa_grant_add_staged(homa);
+	homa_grant_find_oldest(homa);
+	rpc = homa->oldest_rpc;
+	if (rpc == NULL) {
+		homa_grantable_unlock(homa);
+		return;
+	}
+
+	/* Must release grantable_lock before locking the RPC; as in
+	 * homa_grant_recalc, grants_in_progress keeps the RPC from being
+	 * reaped in the meantime.
+	 */
+	atomic_inc(&rpc->grants_in_progress);
+	homa_grantable_unlock(homa);
+	homa_rpc_lock(rpc, "homa_grant_fifo");
+	if (rpc->state == RPC_DEAD)
+		goto done;
+
+	/* FIFO grants aren't limited by homa->max_incoming: if they were,
+	 * SRPT grants could consume all of the available incoming and the
+	 * oldest message would still starve.
+	 */
+	increment = homa->fifo_grant_increment;
+	if (increment > (rpc->msgin.length - rpc->msgin.granted))
+		increment = rpc->msgin.length - rpc->msgin.granted;
+	limit = homa_pool_extend(rpc, rpc->msgin.granted + increment);
+	if (increment > (limit - rpc->msgin.granted))
+		increment = limit - rpc->msgin.granted;
+	if (increment <= 0)
+		goto done;
+
+	INC_METRIC(fifo_grants, 1);
+	if ((rpc->msgin.length - rpc->msgin.bytes_remaining)
+			>= rpc->msgin.granted)
+		INC_METRIC(fifo_grants_no_incoming, 1);
+	rpc->silent_ticks = 0;
+	rpc->msgin.granted += increment;
+	grant.offset = htonl(rpc->msgin.granted);
+	grant.priority = homa->max_sched_prio;
+	grant.resend_all = rpc->msgin.resend_all;
+	rpc->msgin.resend_all = 0;
+	tt_record4("sending fifo grant for id %llu, offset %d, priority %d, "
+			"increment %d", rpc->id, rpc->msgin.granted,
+			homa->max_sched_prio, increment);
+	homa_grant_xmit(rpc, &grant);
+	homa_grant_update_incoming(rpc, homa);
+
+	if (rpc->msgin.granted >= rpc->msgin.length) {
+		homa_grantable_lock(homa, 0);
+		homa_grant_remove_rpc(rpc);
+		homa_rpc_unlock(rpc);
+		atomic_dec(&rpc->grants_in_progress);
+		homa_grant_recalc(homa, 1);
+		return;
+	}
+
+    done:
+	homa_rpc_unlock(rpc);
+	atomic_dec(&rpc->grants_in_progress);
+}
+
+/**
+ * homa_grant_tune_overcommit() - This function is invoked by homa_timer on
+ * every tick. If homa->dynamic_overcommit is set, it periodically adjusts
+ * homa->overcommit_current based on the measured utilization of the incoming
+ * link (homa->max_overcommit belongs to the administrator and is never
+ * modified). The goal is to use the smallest overcommitment that keeps the link
+ * busy: more overcommitment helps when some senders don't respond quickly
+ * to grants, but too much of it fills switch buffers and can cause
+ * throughput to collapse. Since grant_window is derived from the number
+ * of active RPCs (unless window_param is set), it follows automatically.
+ * @homa:         Overall data about the Homa protocol implementation.
+ * @total_bytes:  Total value of the data_bytes_received metric across
+ *                all cores.
+ */
+void homa_grant_tune_overcommit(struct homa *homa, __u64 total_bytes)
+{
+	__u64 bytes, capacity;
+	int util, change, overcommit;
+
+	if (!homa->dynamic_overcommit || (homa->link_mbps <= 0)) {
+		homa->overcommit_prev_bytes = total_bytes;
+		homa->overcommit_tick_count = 0;
+		return;
+	}
+	homa->overcommit_tick_count++;
+	if (homa->overcommit_tick_count < homa->overcommit_ticks)
+		return;
+
+	/* Timer ticks are 1 ms, during which the link can carry
+	 * 125 bytes for each Mbps of bandwidth.
+	 */
+	bytes = total_bytes - homa->overcommit_prev_bytes;
+	capacity = 125ULL * homa->link_mbps * homa->overcommit_tick_count;
+	util = (1000*bytes)/capacity;
+	homa->overcommit_prev_bytes = total_bytes;
+	homa->overcommit_tick_count = 0;
+
+	overcommit = READ_ONCE(homa->overcommit_current);
+	change = 0;
+	if (homa->num_grantable_rpcs <= overcommit) {
+		/* We're already granting to every message that needs
+		 * grants, so the utilization says nothing about whether
+		 * more overcommitment would help.
+		 */
+	} else if (util < HOMA_OVERCOMMIT_LOW_UTIL) {
+		if ((homa->overcommit_last_change > 0)
+				&& (util < homa->overcommit_prev_util)) {
+			/* The last increase made things worse (most likely
+			 * because of buffer overflows); back off.
+			 */
+			change = -1;
+		} else
+			change = 1;
+	} else if (util > HOMA_OVERCOMMIT_HIGH_UTIL)
+		change = -1;
+
+	if ((overcommit + change) > homa->overcommit_max)
+		change = homa->overcommit_max - overcommit;
+	if ((overcommit + change) < homa->overcommit_min)
+		change = homa->overcommit_min - overcommit;
+	homa->overcommit_prev_util = util;
+	homa->overcommit_last_change = change;
+	if (change == 0)
+		return;
+
+	/* The sysctl handler may have changed the value since we read it
+	 * (e.g. dynamic_overcommit was just disabled); if so, its value
+	 * wins.
+	 */
+	if (cmpxchg(&homa->overcommit_current, overcommit, overcommit + change)
+			!= overcommit) {
+		homa->overcommit_last_change = 0;
+		return;
+	}
+	tt_record3("homa_grant_tune_overcommit changing overcommit_current "
+			"from %d to %d, utilization %d",
+			overcommit, overcommit + change, util);
+	if (change > 0)
+		INC_METRIC(overcommit_increases, 1);
+	else
+		INC_METRIC(overcommit_decreases, 1);
+
+	/* The recalculation also reconsiders any messages staged under the
+	 * old overcommit_current.
+	 */
+	homa_grant_recalc(homa, 0);
+}
+
 /**
  * homa_grant_free_rpc() - This function is invoked when an RPC is freed;
  * it cleans up any state related to grants for that RPC's incoming message.
@@ -594,8 +1079,14 @@ void homa_grant_free_rpc(struct homa_rpc *rpc)
 {
 	struct homa *homa = rpc->hsk->homa;
 
-	if (!list_empty(&rpc->grantable_links)) {
+	if (smp_load_acquire(&rpc->msgin.staged)
+			|| !list_empty(&rpc->grantable_links)) {
 		homa_grantable_lock(homa, 0);
+
+		/* If the RPC is staged, this will move it to the grantable
+		 * lists, so it can be removed in the normal way.
+		 */
+		homa_grant_add_staged(homa);
 		homa_grant_remove_rpc(rpc);
 		if (atomic_read(&rpc->msgin.rank) >= 0) {
 			/* Very tricky code below. We have to unlock the RPC before
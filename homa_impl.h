@@ -31,15 +31,22 @@
 #include <linux/icmp.h>
 #include <linux/init.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/kcov.h>
 #include <linux/kthread.h>
 #include <linux/completion.h>
+#include <linux/errqueue.h>
+#include <linux/hrtimer.h>
 #include <linux/proc_fs.h>
+#include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <linux/socket.h>
+#include <linux/workqueue.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/protocol.h>
@@ -76,6 +83,32 @@ extern void mock_rcu_read_unlock(void);
 
 #define kmalloc mock_kmalloc
 extern void *mock_kmalloc(size_t size, gfp_t flags);
+
+#undef cpu_to_node
+#define cpu_to_node mock_cpu_to_node
+extern int mock_cpu_to_node(int cpu);
+
+#undef nr_node_ids
+#define nr_node_ids mock_nr_node_ids
+extern int mock_nr_node_ids;
+
+#undef page_to_nid
+#define page_to_nid mock_page_to_nid
+extern int mock_page_to_nid(const struct page *page);
+
+#undef page_address
+#define page_address mock_page_address
+extern void *mock_page_address(const struct page *page);
+
+#define put_page mock_put_page
+extern void mock_put_page(struct page *page);
+
+#undef alloc_page
+#define alloc_page mock_alloc_page
+extern struct page *mock_alloc_page(gfp_t gfp_mask);
+
+#define get_page mock_get_page
+extern void mock_get_page(struct page *page);
 #endif
 
 /* Null out things that confuse VSCode Intellisense */
@@ -94,6 +127,7 @@ struct homa_sock;
 struct homa_rpc;
 struct homa_rpc_bucket;
 struct homa;
+struct homa_pacer;
 struct homa_peer;
 
 /* Declarations used in this file, so they can't be made at the end. */
@@ -101,7 +135,7 @@ extern void     homa_bucket_lock_slow(struct homa_rpc_bucket *bucket, __u64 id);
 extern int      homa_grantable_lock_slow(struct homa *homa, int recalc);
 extern void     homa_peer_lock_slow(struct homa_peer *peer);
 extern void     homa_sock_lock_slow(struct homa_sock *hsk);
-extern void     homa_throttle_lock_slow(struct homa *homa);
+extern void     homa_throttle_lock_slow(struct homa_pacer *pacer);
 
 extern struct homa_core *homa_cores[];
 
@@ -120,7 +154,8 @@ enum homa_packet_type {
 	FREEZE             = 0x16,
 	NEED_ACK           = 0x17,
 	ACK                = 0x18,
-	BOGUS              = 0x19,      /* Used only in unit tests. */
+	MULTI_GRANT        = 0x19,
+	BOGUS              = 0x1a,      /* Used only in unit tests. */
 	/* If you add a new type here, you must also do the following:
 	 * 1. Change BOGUS so it is the highest opcode
 	 * 2. Add support for the new opcode in homa_print_packet,
@@ -193,6 +228,37 @@ enum homa_packet_type {
  */
 #define HOMA_MAX_GRANTS 10
 
+/**
+ * define HOMA_GRANT_BUCKETS - Number of buckets in homa->grantable_peers.
+ * Peers are assigned to buckets based on the bytes_remaining of their
+ * highest priority RPC (see homa_grant_bucket); must not exceed
+ * BITS_PER_LONG, since homa->grantable_nonempty is a single word.
+ */
+#define HOMA_GRANT_BUCKETS 64
+
+/**
+ * define HOMA_GRANT_BUCKET_SHIFT - Message sizes are divided by
+ * 2^HOMA_GRANT_BUCKET_SHIFT before being mapped to buckets in
+ * homa->grantable_peers.
+ */
+#define HOMA_GRANT_BUCKET_SHIFT 6
+
+/**
+ * define HOMA_GRANT_WEIGHT_SCALE - homa_grant_remaining multiplies bytes
+ * remaining by this value before dividing by the grant weight. It must be
+ * at least HOMA_MAX_GRANT_WEIGHT squared: two weighted values that differ
+ * at all then differ by at least 1 after scaling, so the truncated results
+ * order messages exactly as bytes_remaining/grant_weight would.
+ */
+#define HOMA_GRANT_WEIGHT_SCALE (HOMA_MAX_GRANT_WEIGHT * HOMA_MAX_GRANT_WEIGHT)
+
+/**
+ * define HOMA_MAX_PACERS - Number of entries in homa->pacers; the
+ * num_pacers sysctl parameter must never be greater than this. Must not
+ * exceed BITS_PER_LONG, since homa->pacers_throttled is a single word.
+ */
+#define HOMA_MAX_PACERS 8
+
 /**
  * struct homa_cache_line - An object whose size equals that of a cache line.
  */
@@ -390,6 +456,57 @@ _Static_assert(sizeof(struct grant_header) <= HOMA_MAX_HEADER,
 		"grant_header too large for HOMA_MAX_HEADER; must "
 		"adjust HOMA_MAX_HEADER");
 
+/**
+ * define HOMA_MAX_MULTI_GRANTS - Maximum number of grants that can be
+ * carried in a single MULTI_GRANT packet.
+ */
+#define HOMA_MAX_MULTI_GRANTS 4
+
+/**
+ * struct homa_grant_entry - Describes a single grant within a MULTI_GRANT
+ * packet. The fields have the same meanings as the corresponding fields
+ * of a grant_header.
+ */
+struct homa_grant_entry {
+	/**
+	 * @sender_id: Id of the RPC being granted, in the same form as
+	 * common_header.sender_id.
+	 */
+	__be64 sender_id;
+
+	/** @offset: See grant_header. */
+	__be32 offset;
+
+	/** @priority: See grant_header. */
+	__u8 priority;
+
+	/** @resend_all: See grant_header. */
+	__u8 resend_all;
+} __attribute__((packed));
+
+/**
+ * struct multi_grant_header - Wire format for MULTI_GRANT packets, which
+ * carry grants for several RPCs at once. All of the RPCs must involve the
+ * same pair of sockets (i.e. they would all have the same common header,
+ * except for sender_id); common.sender_id is the same as
+ * grants[0].sender_id. These packets are generated by homa_grant_flush.
+ */
+struct multi_grant_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/**
+	 * @num_grants: number of (leading) elements in @grants that
+	 * are valid.
+	 */
+	__be16 num_grants;
+
+	struct homa_grant_entry grants[HOMA_MAX_MULTI_GRANTS];
+} __attribute__((packed));
+_Static_assert(sizeof(struct multi_grant_header) <= HOMA_MAX_HEADER,
+		"multi_grant_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
 /**
  * struct resend_header - Wire format for RESEND packets.
  *
@@ -483,6 +600,14 @@ struct cutoffs_header {
 	 * this packet.
 	 */
 	__be16 cutoff_version;
+
+	/**
+	 * @unsched_bytes: if nonzero, the sender of this packet is
+	 * experiencing incast, and the recipient should send at most this
+	 * many unscheduled bytes in new messages to the sender. 0 means
+	 * the recipient should use its normal limit.
+	 */
+	__be32 unsched_bytes;
 } __attribute__((packed));
 _Static_assert(sizeof(struct cutoffs_header) <= HOMA_MAX_HEADER,
 		"cutoffs_header too large for HOMA_MAX_HEADER; must "
@@ -592,6 +717,16 @@ struct homa_message_out {
 	 */
 	int gso_pkt_data;
 
+	/**
+	 * @skb_index: If non-NULL, a kmalloc-ed array with one entry for
+	 * each @gso_pkt_data bytes of the message: entry i refers to the
+	 * sk_buff in @packets that contains byte i*@gso_pkt_data. Built
+	 * the first time data is retransmitted (see homa_skb_index_build),
+	 * so that homa_resend_data can find packets without scanning the
+	 * whole message.
+	 */
+	struct sk_buff **skb_index;
+
 	/**
 	 * @unscheduled: Initial bytes of message that we'll send
 	 * without waiting for grants.
@@ -616,6 +751,202 @@ struct homa_message_out {
 	__u64 init_cycles;
 };
 
+/* Flag bits for the @flags argument of homa_message_out_init. */
+#define HOMA_OUT_XMIT              1
+#define HOMA_OUT_ZEROCOPY          2
+#define HOMA_OUT_REGION            4
+
+/**
+ * define HOMA_ZCOPY_SEG_FRAGS - Worst-case number of skb frags needed to
+ * hold one segment of a zero-copy message (header plus data pages).
+ * Used to limit the number of segments in each zero-copy sk_buff.
+ */
+#define HOMA_ZCOPY_SEG_FRAGS(max_pkt_data) \
+		(2 + DIV_ROUND_UP(max_pkt_data, PAGE_SIZE))
+
+/**
+ * struct homa_zcopy - Keeps track of the user pages for an outgoing
+ * message sent with MSG_ZEROCOPY (pinned pages or the send region), so that
+ * the application can be notified when Homa no longer references them.
+ */
+struct homa_zcopy {
+	/**
+	 * @ubuf: Attached to each of the message's sk_buffs; its refcount
+	 * counts those sk_buffs (plus one for homa_message_out_init while
+	 * the message is being created). The callback runs once all of
+	 * them have been freed.
+	 */
+	struct ubuf_info ubuf;
+
+	/**
+	 * @hsk: Socket on whose error queue the notification will be
+	 * placed. We hold a reference to its struct sock.
+	 */
+	struct homa_sock *hsk;
+
+	/** @id: Id of the RPC; returned to the application in the notice. */
+	__u64 id;
+
+	/**
+	 * @copied: True means some or all of the message had to be copied
+	 * (the pages couldn't be used in place); reported to the
+	 * application with SO_EE_CODE_ZEROCOPY_COPIED.
+	 */
+	bool copied;
+
+	/**
+	 * @in_region: True means the message was sent from the socket's
+	 * send region, so the notification goes to the region's completion
+	 * ring if possible (the error queue is used only if the ring is
+	 * missing or full).
+	 */
+	bool in_region;
+
+	/**
+	 * @region_offset: If @in_region is true, the offset of the message's
+	 * first byte within the send region; this is what gets added to
+	 * the completion ring.
+	 */
+	__u32 region_offset;
+
+	/**
+	 * @notify_skb: Preallocated buffer for the notification (the
+	 * callback may be invoked in contexts where allocation is risky).
+	 */
+	struct sk_buff *notify_skb;
+};
+
+/**
+ * struct homa_skb_builder - Holds the information needed to create the
+ * sk_buffs for an outgoing message (see homa_new_data_packet). Each
+ * thread creating sk_buffs for a message has its own copy.
+ */
+struct homa_skb_builder {
+	/** @rpc: RPC whose outgoing message is being created. */
+	struct homa_rpc *rpc;
+
+	/**
+	 * @mtu: Largest size for an on-the-wire packet (including all
+	 * headers through IP header, but not Ethernet header).
+	 */
+	int mtu;
+
+	/**
+	 * @max_pkt_data: Largest amount of Homa message data that fits
+	 * in an on-the-wire packet.
+	 */
+	int max_pkt_data;
+
+	/**
+	 * @gso_size: Space required in each sk_buff (pre-GSO), starting
+	 * with IP header.
+	 */
+	int gso_size;
+
+	/**
+	 * @repl_length: Number of bytes of headers that are replicated in
+	 * every packet by GSO/TSO.
+	 */
+	int repl_length;
+
+	/** @gso_type: Value to use for gso_type in multi-packet sk_buffs. */
+	unsigned int gso_type;
+
+	/**
+	 * @zcopy: Non-NULL means the message is being sent with zero copy.
+	 * The user's pages are attached only if @zcopy_pages is true
+	 * (otherwise the data is copied, but the application still gets a
+	 * notification).
+	 */
+	struct homa_zcopy *zcopy;
+
+	/** @zcopy_pages: See @zcopy. */
+	bool zcopy_pages;
+
+	/**
+	 * @region: Non-NULL means the message is being sent from this
+	 * send region (@zcopy_pages will also be true).
+	 */
+	struct homa_send_region *region;
+
+	/**
+	 * @region_offset: If @region is non-NULL, the offset within the
+	 * region of the next byte of data to add to a packet.
+	 */
+	__u64 region_offset;
+
+	/**
+	 * @hdr_page: Holds segment headers for zero-copy packets (other
+	 * than the first segment in each sk_buff); we own one reference
+	 * to it.
+	 */
+	struct page *hdr_page;
+
+	/** @hdr_offset: Offset within @hdr_page of the next free byte. */
+	int hdr_offset;
+
+	/**
+	 * @hdr: Template for the initial part of the data header (everything
+	 * except the data_segment), which is the same for every sk_buff in
+	 * the message; it is filled in once and then copied into each
+	 * sk_buff.
+	 */
+	struct data_header hdr;
+};
+
+/**
+ * define HOMA_MAX_COPY_HELPERS - Maximum number of idle cores that can
+ * help to create the sk_buffs for a single outgoing message.
+ */
+#define HOMA_MAX_COPY_HELPERS 4
+
+/**
+ * struct homa_copy_helper - Describes a range of an outgoing message whose
+ * sk_buffs are created by a work item running on an idle core, in
+ * parallel with the sending thread (see homa_copy_helpers_start).
+ */
+struct homa_copy_helper {
+	/** @work: Used to schedule homa_copy_helper_main. */
+	struct work_struct work;
+
+	/** @builder: The helper's own copy of the message information. */
+	struct homa_skb_builder builder;
+
+	/**
+	 * @mm: Address space of the sending process (the helper copies
+	 * from it while the sender waits for the helper to complete).
+	 */
+	struct mm_struct *mm;
+
+	/** @iter: Describes the data for this range in user space. */
+	struct iov_iter iter;
+
+	/** @start: Offset within the message of the range's first byte. */
+	int start;
+
+	/** @end: Offset within the message just after the range. */
+	int end;
+
+	/**
+	 * @packets: sk_buffs created by the helper, linked through
+	 * homa_next_skb. Ownership passes to the sender once @done
+	 * completes.
+	 */
+	struct sk_buff *packets;
+
+	/** @last_link: Link field of the last sk_buff in @packets. */
+	struct sk_buff **last_link;
+
+	/** @num_skbs: Number of sk_buffs in @packets. */
+	int num_skbs;
+
+	/** @err: Nonzero means the helper failed; this is a negative errno. */
+	int err;
+
+	/** @done: Completed by the helper once it has finished. */
+	struct completion done;
+};
+
 /**
  * struct homa_gap - Represents a range of bytes within a message that have
  * not yet been received.
@@ -631,6 +962,48 @@ struct homa_gap {
 	struct list_head links;
 };
 
+/**
+ * struct homa_heap_node - Embedded in a structure in order to make it
+ * part of a struct homa_heap. Nodes are ordered first by @key, then by
+ * @seq, so nodes with equal keys come out in order of insertion.
+ */
+struct homa_heap_node {
+	/** @key: Nodes with smaller keys come out of the heap first. */
+	__u64 key;
+
+	/**
+	 * @seq: Value of the heap's next_seq when this node was inserted;
+	 * used to break ties between equal keys.
+	 */
+	__u64 seq;
+
+	/** @child: Leftmost child of this node, or NULL if none. */
+	struct homa_heap_node *child;
+
+	/** @next: Next sibling to the right of this node, or NULL. */
+	struct homa_heap_node *next;
+
+	/**
+	 * @prev: Sibling to the left of this node; if this node is the
+	 * leftmost child, refers to the parent instead. NULL for the root.
+	 */
+	struct homa_heap_node *prev;
+};
+
+/**
+ * struct homa_heap - A min-heap of homa_heap_nodes, implemented as a
+ * pairing heap. The nodes are intrusive, so no memory is allocated:
+ * insertion and decrease-key are O(1), and removal is O(log n) amortized.
+ * The heap provides no synchronization.
+ */
+struct homa_heap {
+	/** @root: The node with the smallest key, or NULL if empty. */
+	struct homa_heap_node *root;
+
+	/** @next_seq: Value of @seq for the next node inserted. */
+	__u64 next_seq;
+};
+
 /**
  * struct homa_message_in - Holds the state of a message received by
  * this machine; used for both requests and responses.
@@ -699,15 +1072,45 @@ struct homa_message_in {
 	 */
 	__u64 birth;
 
+	/**
+	 * @grant_weight: copy of the socket's grant_weight, made when this
+	 * structure was initialized (so the message's position in the
+	 * grantable lists can't change if the socket's weight changes).
+	 */
+	int grant_weight;
+
+	/**
+	 * @staged: nonzero means this RPC needs grants but hasn't yet been
+	 * added to the grantable lists; instead, it is linked through
+	 * @staged_links into the grantable_staged list of some core (see
+	 * homa_grant_add_staged). Cleared (with release semantics) only
+	 * after the RPC has been added to the grantable lists.
+	 */
+	int staged;
+
+	/**
+	 * @staged_remaining: the value of homa_grant_remaining for this
+	 * message, recorded (with the RPC locked) when it was staged.
+	 * homa_grant_add_staged doesn't hold RPC locks, so it positions
+	 * staged RPCs using this value rather than the live one.
+	 */
+	__s64 staged_remaining;
+
+	/** @staged_links: used to link this RPC into a staging list. */
+	struct llist_node staged_links;
+
 	/**
 	 * @num_bpages: The number of entries in @bpage_offsets used for this
-	 * message (0 means buffers not allocated yet).
+	 * message (0 means buffers not allocated yet). Under buffer pressure,
+	 * space may be allocated for only a prefix of the message (see
+	 * homa_pool_covered); it is extended as grants are issued.
 	 */
 	__u32 num_bpages;
 
 	/** @bpage_offsets: Describes buffer space allocated for this message.
 	 * Each entry is an offset from the start of the buffer region.
-	 * All but the last pointer refer to areas of size HOMA_BPAGE_SIZE.
+	 * All but the last pointer refer to full bpages (the bpage size is
+	 * determined by hsk->buffer_pool).
 	 */
 	__u32 bpage_offsets[HOMA_MAX_BPAGES];
 };
@@ -932,6 +1335,12 @@ struct homa_rpc {
 	 */
 	struct list_head buf_links;
 
+	/**
+	 * @buf_wait_start: if the RPC is on @hsk->waiting_for_bufs, the time
+	 * (in get_cycles units) when it was added.
+	 */
+	__u64 buf_wait_start;
+
 	/**
 	 * @active_links: For linking this object into @hsk->active_rpcs.
 	 * The next field will be LIST_POISON1 if this RPC hasn't yet been
@@ -956,12 +1365,32 @@ struct homa_rpc {
 	struct list_head grantable_links;
 
 	/**
-	 * @throttled_links: Used to link this RPC into homa->throttled_rpcs.
-	 * If this RPC isn't in homa->throttled_rpcs, this is an empty
-	 * list pointing to itself.
+	 * @throttled_links: Used to link this RPC into the throttled_rpcs
+	 * list of a pacer shard. If this RPC isn't in any throttled_rpcs,
+	 * this is an empty list pointing to itself.
 	 */
 	struct list_head throttled_links;
 
+	/**
+	 * @srpt_node: Used to link this RPC into the srpt_heap of a pacer
+	 * shard, keyed on bytes remaining to transmit. Valid only when
+	 * @throttled_links is nonempty.
+	 */
+	struct homa_heap_node srpt_node;
+
+	/**
+	 * @fifo_node: Used to link this RPC into the fifo_heap of a pacer
+	 * shard, keyed on msgout.init_cycles. Valid only when
+	 * @throttled_links is nonempty.
+	 */
+	struct homa_heap_node fifo_node;
+
+	/**
+	 * @pacer: The pacer shard whose throttled_rpcs contains this RPC.
+	 * Valid only when @throttled_links is nonempty.
+	 */
+	struct homa_pacer *pacer;
+
 	/**
 	 * @silent_ticks: Number of times homa_timer has been invoked
 	 * since the last time a packet indicating progress was received
@@ -1136,6 +1565,20 @@ struct homa_bpage {
 			 */
 			int owner;
 
+			/**
+			 * @size_class: if @owner is set, the size class
+			 * (index into homa_pool_core.classes) for which the
+			 * owner is using this page.
+			 */
+			int size_class;
+
+			/**
+			 * @node: NUMA node where this bpage's memory lives,
+			 * or -1 if not known yet (e.g. because the
+			 * application hasn't touched the memory).
+			 */
+			int node;
+
 			/**
 			 * @expiration: time (in get_cycles units) after
 			 * which it's OK to steal this page from its current
@@ -1149,42 +1592,152 @@ _Static_assert(sizeof(struct homa_bpage) == sizeof(struct homa_cache_line),
 		"homa_bpage overflowed a cache line");
 
 /**
- * struct homa_pool_core - Holds core-specific data for a homa_pool (a bpage
- * out of which that core is allocating small chunks).
+ * define HOMA_POOL_CACHE_SIZE - Maximum number of free bpage indices that
+ * can be cached by a single core in struct homa_pool_core (they are claimed
+ * from the pool's free map in batches).
  */
-struct homa_pool_core {
+#define HOMA_POOL_CACHE_SIZE 8
+
+/**
+ * define HOMA_POOL_NUM_CLASSES - Number of size classes used when
+ * allocating space for the last (partial) bpage of a message. Each core
+ * allocates from a different bpage for each class; see class_limits in
+ * homa_pool.c for the sizes.
+ */
+#define HOMA_POOL_NUM_CLASSES 6
+
+/**
+ * struct homa_pool_class - Describes the bpage that a core is using to
+ * allocate partial-bpage buffers in a particular size class.
+ */
+struct homa_pool_class {
+	/**
+	 * @page_hint: Index of bpage in pool->descriptors, which may be
+	 * owned by this core for this class. If so, we'll use it for
+	 * allocating partial pages in this class.
+	 */
+	int page_hint;
+
+	/**
+	 * @allocated: if the page given by @page_hint is owned by this
+	 * core, this variable gives the number of (initial) bytes that
+	 * have already been allocated from the page. Always a multiple
+	 * of the cache line size.
+	 */
+	int allocated;
+};
+
+/**
+ * struct homa_pool_stats - Statistics about a homa_pool that are gathered
+ * separately on each core; see struct homa_buf_stats in homa.h for
+ * details.
+ */
+struct homa_pool_stats {
 	union {
 		/**
-		 * @cache_line: Ensures that each object is exactly one
-		 * cache line long.
+		 * @cache_lines: Ensures that each object is exactly two
+		 * cache lines long.
 		 */
-		struct homa_cache_line cache_line;
+		struct homa_cache_line cache_lines[2];
 		struct {
 			/**
-			 * @page_hint: Index of bpage in pool->descriptors,
-			 * which may be owned by this core. If so, we'll use it
-			 * for allocating partial pages.
+			 * @partial_bpages: number of partially-allocated
+			 * bpages that filled up on this core.
 			 */
-			int page_hint;
+			__u64 partial_bpages;
 
 			/**
-			 * @allocated: if the page given by @page_hint is
-			 * owned by this core, this variable gives the number of
-			 * (initial) bytes that have already been allocated
-			 * from the page.
+			 * @partial_waste: total bytes in @partial_bpages
+			 * that were never allocated.
+			 */
+			__u64 partial_waste;
+
+			/**
+			 * @waits: number of RPCs that finished waiting for
+			 * buffer space on this core.
+			 */
+			__u64 waits;
+
+			/**
+			 * @wait_cycles: total time (in get_cycles units)
+			 * spent waiting by the RPCs in @waits.
+			 */
+			__u64 wait_cycles;
+
+			/**
+			 * @scan_lengths: histogram of free map words
+			 * examined by calls to homa_pool_get_pages on this
+			 * core (see homa_buf_stats.scan_lengths).
+			 */
+			__u64 scan_lengths[HOMA_SCAN_BUCKETS];
+		};
+	};
+};
+_Static_assert(sizeof(struct homa_pool_stats) == 2*sizeof(struct homa_cache_line),
+		"homa_pool_stats overflowed two cache lines");
+
+/**
+ * struct homa_pool_core - Holds core-specific data for a homa_pool (the
+ * bpages out of which that core is allocating small chunks, a small
+ * cache of free bpages, and statistics).
+ */
+struct homa_pool_core {
+	union {
+		/**
+		 * @cache_lines: Ensures that each object is exactly two
+		 * cache lines long.
+		 */
+		struct homa_cache_line cache_lines[2];
+		struct {
+			/**
+			 * @cache_lock: Protects @num_cached and @cache. Normally
+			 * only acquired by this core, so it is uncontended;
+			 * other cores lock it only when the pool is nearly
+			 * empty and they need to reclaim cached pages.
 			 */
-			int allocated;
+			spinlock_t cache_lock;
 
 			/**
-			 * @next_candidate: when searching for free bpages,
-			 * check this index next.
+			 * @next_candidate: when searching the free map for
+			 * this core's preferred NUMA node, start with this
+			 * word.
 			 */
 			int next_candidate;
+
+			/** @node: NUMA node that this core belongs to. */
+			int node;
+
+			/**
+			 * @num_cached: number of valid entries in @cache.
+			 */
+			int num_cached;
+
+			/**
+			 * @cache: indexes of free bpages that have been
+			 * claimed from pool->free_map by this core but not
+			 * yet allocated. These bpages have zero reference
+			 * counts and are included in pool->free_bpages.
+			 * The next bpage to allocate is at the end.
+			 */
+			__u32 cache[HOMA_POOL_CACHE_SIZE];
+
+			/**
+			 * @classes: one entry for each size class used for
+			 * partial-bpage allocations.
+			 */
+			struct homa_pool_class classes[HOMA_POOL_NUM_CLASSES];
 		};
 	};
+
+	/**
+	 * @stats: statistics for this core. These are in separate cache
+	 * lines from the fields above, since they are occasionally read
+	 * by other cores.
+	 */
+	struct homa_pool_stats stats;
 };
-_Static_assert(sizeof(struct homa_pool_core) == sizeof(struct homa_cache_line),
-		"homa_pool_core overflowed a cache line");
+_Static_assert(sizeof(struct homa_pool_core) == 4*sizeof(struct homa_cache_line),
+		"homa_pool_core overflowed four cache lines");
 
 /**
  * struct homa_pool - Describes a pool of buffer space for incoming
@@ -1209,9 +1762,49 @@ struct homa_pool {
 	/** @num_bpages: total number of bpages in the pool. */
 	int num_bpages;
 
+	/**
+	 * @bpage_shift: log base 2 of the number of bytes in each bpage
+	 * of this pool.
+	 */
+	int bpage_shift;
+
 	/** @descriptors: kmalloced area containing one entry for each bpage. */
 	struct homa_bpage *descriptors;
 
+	/**
+	 * @free_map: kmalloced area holding @num_maps bitmaps, each with one
+	 * bit for each bpage. A bit is set if the corresponding bpage has
+	 * a zero reference count and hasn't been claimed by any core. Each
+	 * free bpage appears in exactly one map: the one for the NUMA node
+	 * of its memory (the last map holds bpages whose node isn't known).
+	 * Bits are claimed in batches with cmpxchg, so no locks are needed
+	 * to allocate free bpages.
+	 */
+	unsigned long *free_map;
+
+	/** @num_map_words: number of words in each map in @free_map. */
+	int num_map_words;
+
+	/**
+	 * @num_nodes: number of NUMA nodes in the system. If this is 1,
+	 * then no attempt is made to track the nodes of bpages.
+	 */
+	int num_nodes;
+
+	/**
+	 * @num_maps: number of bitmaps in @free_map (1 if @num_nodes is 1,
+	 * otherwise @num_nodes + 1).
+	 */
+	int num_maps;
+
+	/**
+	 * @copy_node: NUMA node of the core that most recently copied
+	 * message data to user space for this socket (-1 if none yet).
+	 * New bpages are allocated from this node if possible, since that's
+	 * where the data will be written.
+	 */
+	int copy_node;
+
 	/**
 	 * @free_bpages: the number of pages still available for allocation
 	 * by homa_pool_get pages. This equals the number of pages with zero
@@ -1221,18 +1814,99 @@ struct homa_pool {
 	atomic_t free_bpages;
 
 	/**
-	 * The number of free bpages required to satisfy the needs of the
-	 * first RPC on @hsk->waiting_for_bufs, or INT_MAX if that queue
+	 * The number of free bpages required for the first RPC on
+	 * @hsk->waiting_for_bufs to make progress, or INT_MAX if that queue
 	 * is empty.
 	 */
 	int bpages_needed;
 
+	/**
+	 * @partial_rpc: the only RPC that is allowed to hold buffer space
+	 * covering less than its entire message (NULL if none). If several
+	 * large messages each held part of the pool, none of them might be
+	 * able to extend its space and the pool would deadlock; instead, the
+	 * highest-priority message gets to make progress with partial space
+	 * and the others must wait until their entire messages fit. Set only
+	 * while the socket lock is held.
+	 */
+	struct homa_rpc *partial_rpc;
+
+	/**
+	 * @reserved: while @partial_rpc is first on @hsk->waiting_for_bufs,
+	 * this is the number of free bpages it needs; other RPCs may not
+	 * allocate bpages that would leave fewer than this many free.
+	 * Otherwise this is 0.
+	 */
+	int reserved;
+
+	/**
+	 * @check_waiting_needed: nonzero means that bpages were freed (or
+	 * collected from the return ring) by code that couldn't invoke
+	 * homa_pool_check_waiting itself (because it might hold an RPC
+	 * lock); homa_pool_check_waiting should be invoked
+	 * once that lock has been released.
+	 */
+	int check_waiting_needed;
+
 	/** @cores: core-specific info; dynamically allocated. */
 	struct homa_pool_core *cores;
 
 	/** @num_cores: number of elements in @cores. */
 	int num_cores;
 
+	/**
+	 * @ring: kernel mapping of the application's return ring (see
+	 * struct homa_return_ring in homa.h), or NULL if the application
+	 * didn't request one. Changes only while @ring_lock is held.
+	 */
+	struct homa_return_ring *ring;
+
+	/**
+	 * @ring_lock: held while removing entries from @ring, so that only
+	 * one core drains the ring at a time.
+	 */
+	spinlock_t ring_lock;
+
+	/** @ring_entries: number of entries in @ring (a power of 2). */
+	int ring_entries;
+
+	/**
+	 * @ring_tail: number of entries that have been removed from @ring.
+	 * This is the authoritative copy; ring->tail is only informational
+	 * for the application, which could overwrite it.
+	 */
+	__u32 ring_tail;
+
+	/** @ring_pages: vmalloc-ed array of the pinned pages for @ring. */
+	struct page **ring_pages;
+
+	/** @ring_num_pages: number of entries in @ring_pages. */
+	int ring_num_pages;
+
+	/**
+	 * @ring_mm: the mm_struct that @ring_pages are charged to as
+	 * locked memory.
+	 */
+	struct mm_struct *ring_mm;
+
+	/**
+	 * @pinned_pages: if the application requested HOMA_BUF_PIN, this
+	 * vmalloc-ed array holds the pinned pages of the region, in order,
+	 * and homa_copy_to_user writes to them through their kernel
+	 * mappings. NULL means the region isn't pinned.
+	 */
+	struct page **pinned_pages;
+
+	/** @num_pinned: number of entries in @pinned_pages. */
+	int num_pinned;
+
+	/**
+	 * @pinned_mm: the mm_struct that @pinned_pages are charged to as
+	 * locked memory (a reference is held, so the charge can be undone
+	 * when the pages are unpinned).
+	 */
+	struct mm_struct *pinned_mm;
+
 	/**
 	 * @check_waiting_invoked: incremented during unit tests when
 	 * homa_pool_check_waiting is invoked.
@@ -1240,6 +1914,79 @@ struct homa_pool {
 	int check_waiting_invoked;
 };
 
+/**
+ * struct homa_send_region - Describes a region of application memory
+ * registered with SO_HOMA_SET_SEND_BUF. The region is pinned once, when
+ * it is registered; MSG_ZEROCOPY messages that lie in the region are then
+ * transmitted directly from its pages, without copying them and without
+ * pinning them again.
+ */
+struct homa_send_region {
+	/**
+	 * @start: Application's address for the first byte of the region,
+	 * or NULL if no region has been registered. Set (with release
+	 * semantics) only after all of the other fields are valid.
+	 */
+	char __user *start;
+
+	/**
+	 * @length: Number of bytes at @start that can hold message data
+	 * (this excludes the completion ring, if there is one).
+	 */
+	__u64 length;
+
+	/**
+	 * @pages: vmalloc-ed array of the pinned pages that hold the first
+	 * @length bytes of the region, in order.
+	 */
+	struct page **pages;
+
+	/** @num_pages: number of entries in @pages. */
+	int num_pages;
+
+	/**
+	 * @mm: the mm_struct that @pages are charged to as locked memory
+	 * (a reference is held, so the charge can be undone when the pages
+	 * are unpinned).
+	 */
+	struct mm_struct *mm;
+
+	/**
+	 * @ring: kernel mapping of the application's completion ring (see
+	 * struct homa_send_ring in homa.h), or NULL if the application
+	 * didn't request one. Changes only while @ring_lock is held.
+	 */
+	struct homa_send_ring *ring;
+
+	/**
+	 * @ring_lock: held while adding entries to @ring, since messages
+	 * can complete concurrently on different cores.
+	 */
+	spinlock_t ring_lock;
+
+	/** @ring_entries: number of entries in @ring (a power of 2). */
+	int ring_entries;
+
+	/**
+	 * @ring_head: number of entries that have been added to @ring.
+	 * This is the authoritative copy; ring->head is only informational
+	 * for the application, which could overwrite it.
+	 */
+	__u32 ring_head;
+
+	/** @ring_pages: vmalloc-ed array of the pinned pages for @ring. */
+	struct page **ring_pages;
+
+	/** @ring_num_pages: number of entries in @ring_pages. */
+	int ring_num_pages;
+
+	/**
+	 * @ring_mm: the mm_struct that @ring_pages are charged to as
+	 * locked memory.
+	 */
+	struct mm_struct *ring_mm;
+};
+
 /**
  * struct homa_sock - Information about an open socket.
  */
@@ -1378,6 +2125,20 @@ struct homa_sock {
 	 * @buffer_pool: used to allocate buffer space for incoming messages.
 	 */
 	struct homa_pool buffer_pool;
+
+	/**
+	 * @send_region: pinned memory from which outgoing messages can be
+	 * transmitted without copying; registered with SO_HOMA_SET_SEND_BUF.
+	 */
+	struct homa_send_region send_region;
+
+	/**
+	 * @grant_weight: weight of this socket's incoming messages when
+	 * choosing messages to grant (see homa_grant_outranks). Set with
+	 * the SO_HOMA_GRANT_WEIGHT socket option; always between 1 and
+	 * HOMA_MAX_GRANT_WEIGHT.
+	 */
+	int grant_weight;
 };
 
 /**
@@ -1477,6 +2238,14 @@ struct homa_peer {
 	 */
 	__be16 cutoff_version;
 
+	/**
+	 * @unsched_bytes: if nonzero, new messages sent to this peer may
+	 * include at most this many unscheduled bytes. This is set from
+	 * CUTOFFS packets while the peer is experiencing incast; 0 means
+	 * use homa->unsched_bytes.
+	 */
+	int unsched_bytes;
+
 	/**
 	 * last_update_jiffies: time in jiffies when we sent the most
 	 * recent CUTOFFS packet to this peer.
@@ -1493,12 +2262,19 @@ struct homa_peer {
 	struct list_head grantable_rpcs;
 
 	/**
-	 * @grantable_links: Used to link this peer into homa->grantable_peers.
-	 * If this RPC is not linked into homa->grantable_peers, this is an
-	 * empty list pointing to itself.
+	 * @grantable_links: Used to link this peer into one of the buckets
+	 * in homa->grantable_peers. If this RPC is not linked into
+	 * homa->grantable_peers, this is an empty list pointing to itself.
 	 */
 	struct list_head grantable_links;
 
+	/**
+	 * @grant_bucket: Index of the bucket in homa->grantable_peers
+	 * containing this peer; meaningful only if @grantable_links is
+	 * nonempty.
+	 */
+	int grant_bucket;
+
 	/**
 	 * @peertab_links: Links this object into a bucket of its
 	 * homa_peertab.
@@ -1576,6 +2352,101 @@ enum homa_freeze_type {
 	NEED_ACK_MISSING_DATA  = 6,
 };
 
+/**
+ * struct homa_pacer - One shard of the pacer: a list of RPCs whose output
+ * is throttled, plus a kernel thread that transmits their packets. Homa
+ * can run several shards in parallel (see homa->num_pacers) so that a
+ * single core doesn't limit output throughput on fast links; all of the
+ * shards share the link budget in homa->link_idle_time.
+ */
+struct homa_pacer {
+	/**
+	 * @mutex: Ensures that only one instance of homa_pacer_xmit
+	 * runs at a time for this shard. Only used in "try" mode: never
+	 * block on this.
+	 */
+	struct spinlock mutex __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/** @homa: Overall data about the Homa protocol implementation. */
+	struct homa *homa;
+
+	/** @index: Index of this shard in homa->pacers. */
+	int index;
+
+	/**
+	 * @fifo_count: When this becomes <= zero, it's time for the
+	 * pacer to allow the oldest RPC in this shard to transmit.
+	 */
+	int fifo_count;
+
+	/**
+	 * @wake_time: get_cycles() time when the pacer thread for this
+	 * shard last woke up (if it is running) or 0 if it is sleeping.
+	 */
+	__u64 wake_time;
+
+	/**
+	 * @throttle_lock: Used to synchronize access to @throttled_rpcs,
+	 * @srpt_heap, and @fifo_heap. To insert or remove an RPC from
+	 * throttled_rpcs, must first acquire the RPC's socket lock, then
+	 * this lock.
+	 */
+	struct spinlock throttle_lock;
+
+	/**
+	 * @throttled_rpcs: Contains all homa_rpcs in this shard that have
+	 * bytes ready for transmission, but which couldn't be sent without
+	 * exceeding the queue limits for transmission. The list is in no
+	 * particular order (see @srpt_heap and @fifo_heap). Manipulate only
+	 * with "_rcu" functions.
+	 */
+	struct list_head throttled_rpcs;
+
+	/**
+	 * @srpt_heap: Contains the same RPCs as @throttled_rpcs (linked
+	 * through srpt_node), ordered by the number of bytes remaining to
+	 * transmit (as of the last time the pacer transmitted from them).
+	 */
+	struct homa_heap srpt_heap;
+
+	/**
+	 * @fifo_heap: Contains the same RPCs as @throttled_rpcs (linked
+	 * through fifo_node), ordered by msgout.init_cycles.
+	 */
+	struct homa_heap fifo_heap;
+
+	/**
+	 * @throttle_add: The get_cycles() time when the most recent RPC
+	 * was added to @throttled_rpcs.
+	 */
+	__u64 throttle_add;
+
+	/**
+	 * @head_bytes: The number of bytes left to transmit in the first
+	 * RPC on @throttled_rpcs, or INT_MAX if the list is empty. Read by
+	 * other shards without synchronization (see homa_pacer_outranked),
+	 * so it is only a hint.
+	 */
+	int head_bytes;
+
+	/**
+	 * @kthread: Kernel thread that transmits packets from
+	 * @throttled_rpcs in a way that limits queue buildup in the NIC.
+	 * NULL if the shard has never been enabled.
+	 */
+	struct task_struct *kthread;
+
+	/** @kthread_done: Completed when @kthread exits. */
+	struct completion kthread_done;
+
+	/**
+	 * @timer: Used to wake up @kthread when the NIC queue has drained
+	 * enough for it to transmit again (see homa_pacer_arm_timer), so
+	 * the thread doesn't have to spin while waiting.
+	 */
+	struct hrtimer timer;
+};
+
 /**
  * struct homa - Overall information about the Homa protocol implementation.
  *
@@ -1622,11 +2493,21 @@ struct homa {
 
 	/**
 	 * @grantable_peers: Contains all peers with entries in their
-	 * grantable_rpcs lists. The list is sorted in priority order of
-	 * the highest priority RPC for each peer (fewer ungranted bytes ->
-	 * higher priority).
+	 * grantable_rpcs lists, divided into buckets according to the
+	 * bytes_remaining of the highest priority RPC for each peer (see
+	 * homa_grant_bucket). Lower-numbered buckets hold higher priority
+	 * peers, and each bucket is sorted in priority order, so walking
+	 * the nonempty buckets in order (see homa_grant_next_peer) visits
+	 * peers in priority order. Dividing the peers into buckets keeps
+	 * insertions cheap when there are many grantable peers.
 	 */
-	struct list_head grantable_peers;
+	struct list_head grantable_peers[HOMA_GRANT_BUCKETS];
+
+	/**
+	 * @grantable_nonempty: Bit i is set if grantable_peers[i] is
+	 * nonempty.
+	 */
+	unsigned long grantable_nonempty;
 
 	/**
 	 * @grantable_rpcs: Contains all RPCs that have not been fully
@@ -1678,72 +2559,50 @@ struct homa {
 	struct homa_rpc *active_rpcs[HOMA_MAX_GRANTS];
 
 	/**
-	 * @bytes_remaining: entry i in this array contains a copy of
-	 * active_rpcs[i]->msgin.bytes_remaining. These values can be
-	 * updated by the corresponding RPCs without holding the grantable
-	 * lock. Perfect consistency isn't required; this is used only to
-	 * detect when the priority ordering of messages changes.
-	 */
-	atomic_t active_remaining[HOMA_MAX_GRANTS];
-
-	/**
-	 * @grant_nonfifo: How many bytes should be granted using the
-	 * normal priority system between grants to the oldest message.
-	 */
-	int grant_nonfifo;
-
-	/**
-	 * @grant_nonfifo_left: Counts down bytes using the normal
-	 * priority mechanism. When this reaches zero, it's time to grant
-	 * to the old message.
-	 */
-	int grant_nonfifo_left;
-
-	/**
-	 * @pacer_mutex: Ensures that only one instance of homa_pacer_xmit
-	 * runs at a time. Only used in "try" mode: never block on this.
-	 */
-	struct spinlock pacer_mutex __attribute__((aligned(CACHE_LINE_SIZE)));
-
-	/**
-	 * @pacer_fifo_fraction: The fraction of time (in thousandths) when
-	 * the pacer should transmit next from the oldest message, rather
-	 * than the highest-priority message. Set externally via sysctl.
+	 * @active_remaining: entry i in this array contains
+	 * homa_grant_remaining(active_rpcs[i]) (bytes remaining divided
+	 * by the socket's grant weight, in fixed point), so comparisons
+	 * against it agree exactly with homa_grant_outranks. These values
+	 * can be updated by the corresponding RPCs without holding the
+	 * grantable lock. Perfect consistency isn't required; this is used
+	 * only to detect when the priority ordering of messages changes.
 	 */
-	int pacer_fifo_fraction;
+	atomic64_t active_remaining[HOMA_MAX_GRANTS];
 
 	/**
-	 * @pacer_fifo_count: When this becomes <= zero, it's time for the
-	 * pacer to allow the oldest RPC to transmit.
+	 * @grant_nonfifo_left: Counts down bytes granted using the normal
+	 * priority mechanism. When this reaches zero, it's time for a
+	 * FIFO grant to the oldest message (see homa_grant_fifo).
 	 */
-	int pacer_fifo_count;
+	atomic_t grant_nonfifo_left;
 
 	/**
-	 * @pacer_start: get_cycles() time when the pacer last woke up
-	 * (if the pacer is running) or 0 if the pacer is sleeping.
+	 * @pacers: Shards of the pacer; only the first @num_pacers receive
+	 * newly throttled RPCs. A shard's thread is created the first time
+	 * the shard is enabled (see homa_pacer_start).
 	 */
-	__u64 pacer_wake_time;
+	struct homa_pacer pacers[HOMA_MAX_PACERS];
 
 	/**
-	 * @throttle_lock: Used to synchronize access to @throttled_rpcs. To
-	 * insert or remove an RPC from throttled_rpcs, must first acquire
-	 * the RPC's socket lock, then this lock.
+	 * @pacers_throttled: Bit i is set if pacers[i].throttled_rpcs is
+	 * nonempty. Modify only with atomic bit operations, while holding
+	 * the throttle lock for the shard.
 	 */
-	struct spinlock throttle_lock;
+	unsigned long pacers_throttled;
 
 	/**
-	 * @throttled_rpcs: Contains all homa_rpcs that have bytes ready
-	 * for transmission, but which couldn't be sent without exceeding
-	 * the queue limits for transmission. Manipulate only with "_rcu"
-	 * functions.
+	 * @num_pacers: Number of entries in @pacers to which throttled
+	 * RPCs are assigned. Set externally via sysctl (see
+	 * homa_sysctl_num_pacers); each of these shards has a thread.
 	 */
-	struct list_head throttled_rpcs;
+	int num_pacers;
 
 	/**
-	 * @throttle_add: The get_cycles() time when the most recent RPC
-	 * was added to @throttled_rpcs.
+	 * @pacer_fifo_fraction: The fraction of time (in thousandths) when
+	 * the pacer should transmit next from the oldest message, rather
+	 * than the highest-priority message. Set externally via sysctl.
 	 */
-	__u64 throttle_add;
+	int pacer_fifo_fraction;
 
 	/**
 	 * @throttle_min_bytes: If a packet has fewer bytes than this, then it
@@ -1767,6 +2626,14 @@ struct homa {
 	 */
 	atomic_t total_incoming __attribute__((aligned(CACHE_LINE_SIZE)));
 
+	/**
+	 * @num_staged_rpcs: the number of RPCs currently in the
+	 * grantable_staged lists of all cores (these RPCs are not included
+	 * in @num_grantable_rpcs). Lets homa_grant_add_staged skip the
+	 * scan of all cores when there is nothing to do.
+	 */
+	atomic_t num_staged_rpcs;
+
 	/**
 	 * @next_client_port: A client port number to consider for the
 	 * next Homa socket; increments monotonically. Current value may
@@ -1869,10 +2736,60 @@ struct homa {
 	 */
 	int cutoff_version;
 
+	/**
+	 * @incast_rpcs: if at least this many new incoming requests arrive
+	 * during a single timer tick, we assume that an incast is underway
+	 * and ask senders to reduce their unscheduled bytes (see
+	 * homa_incast_check). 0 disables incast detection. Set externally
+	 * via sysctl.
+	 */
+	int incast_rpcs;
+
+	/**
+	 * @incast_unsched_bytes: during an incast, peers are asked to send
+	 * no more than this many unscheduled bytes in new messages to us.
+	 * Set externally via sysctl.
+	 */
+	int incast_unsched_bytes;
+
+	/**
+	 * @incast_ticks: an incast is considered over once this many
+	 * consecutive timer ticks have passed without any sign of incast.
+	 * Set externally via sysctl.
+	 */
+	int incast_ticks;
+
+	/**
+	 * @incast_unsched_limit: the limit on unscheduled bytes currently
+	 * being advertised to peers in CUTOFFS packets, or 0 if there is no
+	 * incast underway and peers should use their normal @unsched_bytes.
+	 */
+	int incast_unsched_limit;
+
+	/**
+	 * @incast_quiet_ticks: number of consecutive timer ticks during the
+	 * current incast in which no incast was detected.
+	 */
+	int incast_quiet_ticks;
+
+	/**
+	 * @incast_prev_requests: total value of the requests_received
+	 * metric across all cores as of the previous timer tick.
+	 */
+	__u64 incast_prev_requests;
+
+	/**
+	 * @fifo_grant_interval: a "pity" grant is sent to the oldest
+	 * outstanding message each time this many bytes have been granted
+	 * using the normal priority mechanism. Set externally via sysctl.
+	 */
+	int fifo_grant_interval;
+
 	/**
 	 * @fifo_grant_increment: how many additional bytes to grant in
-	 * a "pity" grant sent to the oldest outstanding message. Set
-	 * externally via sysctl.
+	 * a "pity" grant sent to the oldest outstanding message. Computed
+	 * from @fifo_grant_interval and @grant_fifo_fraction; 0 means FIFO
+	 * grants are disabled.
 	 */
 	int fifo_grant_increment;
 
@@ -1883,12 +2800,87 @@ struct homa {
 	 */
 	int grant_fifo_fraction;
 
+	/**
+	 * @batch_grants: nonzero means that grants generated during a
+	 * SoftIRQ batch are collected and sent at the end of the batch,
+	 * with grants for the same peer and sockets combined into
+	 * MULTI_GRANT packets. Set externally via sysctl; off by default,
+	 * since all peers must understand MULTI_GRANT packets before this
+	 * is enabled (see protocol.md).
+	 */
+	int batch_grants;
+
 	/**
 	 * @max_overcommit: The maximum number of messages to which Homa will
-	 * send grants at any given point in time.  Set externally via sysctl.
+	 * send grants at any given point in time.  Set externally via sysctl;
+	 * Homa never modifies it (see @overcommit_current).
 	 */
 	int max_overcommit;
 
+	/**
+	 * @overcommit_current: the number of messages to which Homa actually
+	 * sends grants at once. Equal to @max_overcommit unless
+	 * @dynamic_overcommit is set, in which case it is adjusted by
+	 * homa_grant_tune_overcommit, between @overcommit_min and
+	 * @overcommit_max. Read without synchronization, so it must be
+	 * written with WRITE_ONCE (or cmpxchg).
+	 */
+	int overcommit_current;
+
+	/**
+	 * @dynamic_overcommit: nonzero means that @overcommit_current is
+	 * adjusted periodically based on measured utilization of the
+	 * incoming link (see homa_grant_tune_overcommit). Set externally
+	 * via sysctl.
+	 */
+	int dynamic_overcommit;
+
+	/**
+	 * @overcommit_min: lower bound on @overcommit_current when
+	 * @dynamic_overcommit is set. Set externally via sysctl.
+	 */
+	int overcommit_min;
+
+	/**
+	 * @overcommit_max: upper bound on @overcommit_current when
+	 * @dynamic_overcommit is set. Set externally via sysctl.
+	 */
+	int overcommit_max;
+
+	/**
+	 * @overcommit_ticks: when @dynamic_overcommit is set,
+	 * @overcommit_current is reconsidered once every this many timer
+	 * ticks. Set externally via sysctl.
+	 */
+	int overcommit_ticks;
+
+	/**
+	 * @overcommit_tick_count: number of timer ticks since
+	 * @overcommit_current was last reconsidered.
+	 */
+	int overcommit_tick_count;
+
+	/**
+	 * @overcommit_prev_bytes: total value of the data_bytes_received
+	 * metric across all cores when @overcommit_current was last
+	 * reconsidered.
+	 */
+	__u64 overcommit_prev_bytes;
+
+	/**
+	 * @overcommit_prev_util: utilization of the incoming link (in
+	 * thousandths) measured the last time @overcommit_current was
+	 * reconsidered.
+	 */
+	int overcommit_prev_util;
+
+	/**
+	 * @overcommit_last_change: the most recent adjustment made to
+	 * @overcommit_current by homa_grant_tune_overcommit (+1, -1, or 0 if
+	 * the last evaluation made no change).
+	 */
+	int overcommit_last_change;
+
 	/**
 	 * @max_incoming: Homa will try to ensure that the total number of
 	 * bytes senders have permission to send to this host (either
@@ -1959,14 +2951,7 @@ struct homa {
 	int max_dead_buffs;
 
 	/**
-	 * @pacer_kthread: Kernel thread that transmits packets from
-	 * throttled_rpcs in a way that limits queue buildup in the
-	 * NIC.
-	 */
-	struct task_struct *pacer_kthread;
-
-	/**
-	 * @pacer_exit: true means that the pacer thread should exit as
+	 * @pacer_exit: true means that the pacer threads should exit as
 	 * soon as possible.
 	 */
 	bool pacer_exit;
@@ -1992,6 +2977,23 @@ struct homa {
 	 */
 	__u32 cycles_per_kbyte;
 
+	/**
+	 * @bql_feedback: nonzero means that @link_idle_time is periodically
+	 * corrected using the byte queue limits (dql) information for the
+	 * output device (bytes passed to the driver but not yet reported as
+	 * transmitted); see homa_nic_queue_sync. If the device doesn't
+	 * provide this information, the model based on @cycles_per_kbyte
+	 * is used alone. Set externally via sysctl.
+	 */
+	int bql_feedback;
+
+	/**
+	 * @bql_next_sample: get_cycles() time after which
+	 * homa_nic_queue_sync will next read the dql information (used
+	 * to limit the overhead of reading it).
+	 */
+	__u64 bql_next_sample;
+
 	/**
 	 * @verbose: Nonzero enables additional logging. Set externally via
 	 * sysctl.
@@ -2018,6 +3020,34 @@ struct homa {
 	 */
 	int gso_force_software;
 
+	/**
+	 * @xmit_chunk_bytes: When a message longer than twice this many
+	 * bytes is sent with HOMA_OUT_XMIT, the sending thread transmits
+	 * packets itself after copying each chunk of this many bytes, so
+	 * that copying the rest of the message overlaps with transmission
+	 * of what has already been copied. Zero (the default) disables
+	 * this. Set externally via sysctl.
+	 */
+	int xmit_chunk_bytes;
+
+	/**
+	 * @copy_helper_bytes: If nonzero, messages at least twice this long
+	 * (that aren't sent with zero copy) get help from idle cores in
+	 * creating their sk_buffs; each core copies at least this many bytes.
+	 * Zero disables copy helpers. Set externally via sysctl.
+	 */
+	int copy_helper_bytes;
+
+	/**
+	 * @skb_cache_size: Maximum number of sk_buffs from reaped outgoing
+	 * messages that will be kept on each core for reuse by later
+	 * messages (0 disables the cache). Set externally via sysctl.
+	 * Disabled by default: homa_skb_recycle resets sk_buffs by hand,
+	 * following the Linux 6.1 sk_buff layout, so the cache should only
+	 * be enabled on kernels where that reset has been validated.
+	 */
+	int skb_cache_size;
+
 	/**
 	 * @gro_policy: An OR'ed together collection of bits that determine
 	 * how Homa packets should be steered for SoftIRQ handling.  A value
@@ -2215,6 +3245,12 @@ struct homa_metrics {
 	 */
 	__u64 packets_received[BOGUS-DATA];
 
+	/**
+	 * @data_bytes_received: total bytes of message data in all incoming
+	 * DATA packets (including retransmissions).
+	 */
+	__u64 data_bytes_received;
+
 	/** @priority_bytes: total bytes sent at each priority level. */
 	__u64 priority_bytes[HOMA_MAX_PRIORITIES];
 
@@ -2243,6 +3279,37 @@ struct homa_metrics {
 	 */
 	__u64 responses_queued;
 
+	/**
+	 * @incasts: total number of times that homa_incast_check decided
+	 * that an incast had begun.
+	 */
+	__u64 incasts;
+
+	/**
+	 * @incast_ticks: total number of timer ticks during which an
+	 * incast was in progress.
+	 */
+	__u64 incast_ticks;
+
+	/**
+	 * @overcommit_increases: total number of times that
+	 * homa_grant_tune_overcommit increased homa->overcommit_current.
+	 */
+	__u64 overcommit_increases;
+
+	/**
+	 * @overcommit_decreases: total number of times that
+	 * homa_grant_tune_overcommit decreased homa->overcommit_current.
+	 */
+	__u64 overcommit_decreases;
+
+	/**
+	 * @unsched_limited_msgs: total number of outgoing messages whose
+	 * unscheduled bytes were reduced because the destination asked for
+	 * it in a CUTOFFS packet (it was experiencing incast).
+	 */
+	__u64 unsched_limited_msgs;
+
 	/**
 	 * @fast_wakeups: total number of times that a message arrived for
 	 * a receiving thread that was polling in homa_wait_for_message.
@@ -2395,10 +3462,18 @@ struct homa_metrics {
 
 	/**
 	 * @pacer_cycles: total time spent executing in homa_pacer_main
-	 * (not including blocked time), as measured with get_cycles().
+	 * (not including blocked time, or time sleeping while waiting
+	 * for the NIC queue to drain), as measured with get_cycles().
 	 */
 	__u64 pacer_cycles;
 
+	/**
+	 * @pacer_timer_sleeps: total number of times that a pacer thread
+	 * armed its hrtimer and slept because the NIC queue was too long
+	 * for it to transmit.
+	 */
+	__u64 pacer_timer_sleeps;
+
 	/**
 	 * @pacer_lost_cycles: unnecessary delays in transmitting packets
 	 * (i.e. wasted output bandwidth) because the pacer was slow or got
@@ -2406,9 +3481,22 @@ struct homa_metrics {
 	 */
 	__u64 pacer_lost_cycles;
 
+	/**
+	 * @bql_samples: total number of times that homa_nic_queue_sync
+	 * reset link_idle_time based on dql information from a device.
+	 */
+	__u64 bql_samples;
+
+	/**
+	 * @bql_unavailable: total number of times that homa_nic_queue_sync
+	 * couldn't find dql information for a device, so link_idle_time
+	 * was left as computed by the model.
+	 */
+	__u64 bql_unavailable;
+
 	/**
 	 * @pacer_bytes: total number of bytes transmitted when
-	 * @homa->throttled_rpcs is nonempty.
+	 * any pacer shard has throttled RPCs.
 	 */
 	__u64 pacer_bytes;
 
@@ -2426,8 +3514,9 @@ struct homa_metrics {
 	__u64 pacer_needed_help;
 
 	/**
-	 * @throttled_cycles: total amount of time that @homa->throttled_rpcs
-	 * is nonempty, as measured with get_cycles().
+	 * @throttled_cycles: total amount of time that throttled_rpcs
+	 * lists are nonempty, as measured with get_cycles() (summed over
+	 * all pacer shards).
 	 */
 	__u64 throttled_cycles;
 
@@ -2609,6 +3698,33 @@ struct homa_metrics {
 	 */
 	__u64 grantable_lock_misses;
 
+	/**
+	 * @grantable_lock_acquires: total number of times that
+	 * homa->grantable_lock was acquired; grantable_lock_cycles divided
+	 * by this gives the average hold time.
+	 */
+	__u64 grantable_lock_acquires;
+
+	/**
+	 * @grantable_staged_rpcs: total number of new grantable RPCs that
+	 * were staged in a per-core list, rather than acquiring
+	 * homa->grantable_lock to add them to the grantable lists.
+	 */
+	__u64 grantable_staged_rpcs;
+
+	/**
+	 * @grantable_peer_inserts: total number of times a peer was
+	 * inserted (or reinserted) into homa->grantable_peers.
+	 */
+	__u64 grantable_peer_inserts;
+
+	/**
+	 * @grantable_peer_checks: number of peers examined in
+	 * homa->grantable_peers while finding insertion points (i.e., the
+	 * cost of @grantable_peer_inserts).
+	 */
+	__u64 grantable_peer_checks;
+
 	/**
 	 * @grantable_rpcs_integral: cumulative sum of time_delta*grantable,
 	 * where time_delta is a get_cycles time and grantable is the
@@ -2641,6 +3757,26 @@ struct homa_metrics {
 	 */
 	__u64 grant_priority_bumps;
 
+	/**
+	 * @grant_incremental_bumps: cumulative number of priority bumps
+	 * that were handled by homa_grant_promote (reordering the active
+	 * RPCs in place) rather than a full homa_grant_recalc.
+	 */
+	__u64 grant_incremental_bumps;
+
+	/**
+	 * @grant_recalcs_avoided: cumulative number of calls to
+	 * homa_grant_check_rpc for already-grantable messages that
+	 * completed without invoking homa_grant_recalc.
+	 */
+	__u64 grant_recalcs_avoided;
+
+	/**
+	 * @grants_coalesced: total number of grants that were sent as
+	 * part of MULTI_GRANT packets rather than individual GRANT packets.
+	 */
+	__u64 grants_coalesced;
+
 	/**
 	 * @fifo_grants: total number of times that grants were sent to
 	 * the oldest message.
@@ -2689,12 +3825,6 @@ struct homa_metrics {
 	 */
 	__u64 throttle_list_adds;
 
-	/**
-	 * @throttle_list_checks: number of list elements examined in
-	 * calls to homa_add_to_throttled.
-	 */
-	__u64 throttle_list_checks;
-
 	/**
 	 * @unacked_overflows: total number of times that homa_peer_add_ack
 	 * found insufficient space for the new id and hence had to send an
@@ -2715,6 +3845,45 @@ struct homa_metrics {
 	 */
 	__u64 bpage_reuses;
 
+	/**
+	 * @bpage_cache_hits: total number of bpages allocated by
+	 * homa_pool_get_pages from a core's cache of free bpages, without
+	 * accessing the pool's free map.
+	 */
+	__u64 bpage_cache_hits;
+
+	/**
+	 * @bpage_map_words: total number of words of pool free maps
+	 * examined by homa_pool_get_pages while searching for free bpages.
+	 */
+	__u64 bpage_map_words;
+
+	/**
+	 * @bpage_scan_lengths: histogram of the number of free map words
+	 * examined by individual calls to homa_pool_get_pages (see
+	 * homa_buf_stats.scan_lengths for bucket boundaries).
+	 */
+	__u64 bpage_scan_lengths[HOMA_SCAN_BUCKETS];
+
+	/**
+	 * @bpage_partial_fills: total number of partially-allocated bpages
+	 * that filled up (so a new bpage was needed for the size class).
+	 */
+	__u64 bpage_partial_fills;
+
+	/**
+	 * @bpage_partial_waste: total bytes in the bpages counted by
+	 * @bpage_partial_fills that were never allocated (padding plus
+	 * unused space at the end).
+	 */
+	__u64 bpage_partial_waste;
+
+	/**
+	 * @buffer_wait_cycles: total time spent by RPCs on
+	 * hsk->waiting_for_bufs, in get_cycles units.
+	 */
+	__u64 buffer_wait_cycles;
+
 	/**
 	 * @buffer_alloc_failures: total number of times that
 	 * homa_pool_allocate was unable to allocate buffer space for
@@ -2722,6 +3891,40 @@ struct homa_metrics {
 	 */
 	__u64 buffer_alloc_failures;
 
+	/**
+	 * @buffer_partial_allocs: total number of times that
+	 * homa_pool_allocate couldn't allocate space for an entire incoming
+	 * message, so it allocated space only for the granted bytes.
+	 */
+	__u64 buffer_partial_allocs;
+
+	/**
+	 * @buffer_extend_failures: total number of times that grants
+	 * for an incoming message were limited because additional buffer
+	 * space couldn't be allocated for it.
+	 */
+	__u64 buffer_extend_failures;
+
+	/**
+	 * @bpage_ring_returns: total number of bpages returned by
+	 * applications through return rings (rather than recvmsg).
+	 */
+	__u64 bpage_ring_returns;
+
+	/**
+	 * @bpage_local_allocs: total number of bpages allocated by
+	 * homa_pool_get_pages whose memory is on the preferred NUMA node
+	 * (only counted when the node of the bpage is known).
+	 */
+	__u64 bpage_local_allocs;
+
+	/**
+	 * @bpage_remote_allocs: total number of bpages allocated by
+	 * homa_pool_get_pages whose memory is on a NUMA node other than
+	 * the preferred one.
+	 */
+	__u64 bpage_remote_allocs;
+
 	/**
 	 * @linux_pkt_alloc_bytes: total bytes allocated in new packet buffers
 	 * by the NIC driver because of packet cache underflows.
@@ -2761,11 +3964,88 @@ struct homa_metrics {
 	 */
 	__u64 gro_data_bypasses;
 
+	/**
+	 * @zerocopy_bytes: total bytes of outgoing message data that were
+	 * attached to sk_buffs directly from user pages, rather than being
+	 * copied (messages sent with MSG_ZEROCOPY).
+	 */
+	__u64 zerocopy_bytes;
+
+	/**
+	 * @zerocopy_notify_drops: total number of zero-copy completion
+	 * notifications that were discarded because the socket's error
+	 * queue was full.
+	 */
+	__u64 zerocopy_notify_drops;
+
+	/**
+	 * @send_ring_overflows: total number of completions for messages
+	 * sent from the send region that couldn't be added to the
+	 * socket's completion ring because it was full (they were reported
+	 * on the error queue instead).
+	 */
+	__u64 send_ring_overflows;
+
+	/**
+	 * @copy_helpers: total number of times an idle core was asked to
+	 * help create the sk_buffs for an outgoing message.
+	 */
+	__u64 copy_helpers;
+
+	/**
+	 * @helper_copy_bytes: total number of bytes of outgoing message
+	 * data placed in sk_buffs by copy helpers.
+	 */
+	__u64 helper_copy_bytes;
+
+	/**
+	 * @recycled_skbs: total number of sk_buffs for outgoing DATA
+	 * packets that were taken from a per-core cache rather than
+	 * allocated with alloc_skb.
+	 */
+	__u64 recycled_skbs;
+
+	/**
+	 * @resent_shared_bytes: total number of bytes of retransmitted
+	 * data that were sent by sharing the pages of the original
+	 * packets (zero copy) rather than copying.
+	 */
+	__u64 resent_shared_bytes;
+
 	/** @temp: For temporary use during testing. */
 #define NUM_TEMP_METRICS 10
 	__u64 temp[NUM_TEMP_METRICS];
 };
 
+/**
+ * define HOMA_MAX_DEFERRED_GRANTS - Maximum number of grants that can be
+ * held in homa_core->deferred_grants before they must be transmitted.
+ */
+#define HOMA_MAX_DEFERRED_GRANTS 16
+
+/**
+ * struct homa_deferred_grant - Holds information about a grant whose
+ * transmission has been deferred until the end of a SoftIRQ batch
+ * (see homa_grant_xmit).
+ */
+struct homa_deferred_grant {
+	/**
+	 * @hsk: socket from which the grant will be sent. Safe to
+	 * reference until the end of homa_softirq because sockets are
+	 * freed via RCU.
+	 */
+	struct homa_sock *hsk;
+
+	/** @peer: host to which the grant will be sent. */
+	struct homa_peer *peer;
+
+	/** @dport: port on @peer to which the grant will be sent. */
+	__u16 dport;
+
+	/** @grant: the contents of the grant. */
+	struct homa_grant_entry grant;
+};
+
 /**
  * struct homa_core - Homa allocates one of these structures for each
  * core, to hold information that needs to be kept on a per-core basis.
@@ -2850,6 +4130,46 @@ struct homa_core {
 	 */
 	int rpcs_locked;
 
+	/**
+	 * @grantable_staged: new RPCs that need grants, which were
+	 * discovered by SoftIRQ on this core but couldn't affect the current
+	 * set of active RPCs. They are added to this list without acquiring
+	 * homa->grantable_lock, and moved to the grantable lists by the
+	 * next thread that recalculates grants (see homa_grant_add_staged).
+	 */
+	struct llist_head grantable_staged;
+
+	/**
+	 * @defer_grants: nonzero means that homa_softirq is running on
+	 * this core and homa->batch_grants is set, so outgoing grants
+	 * should be collected in @deferred_grants rather than sent
+	 * immediately.
+	 */
+	int defer_grants;
+
+	/**
+	 * @num_deferred_grants: number of valid entries in
+	 * @deferred_grants.
+	 */
+	int num_deferred_grants;
+
+	/**
+	 * @deferred_grants: grants waiting to be transmitted at the end of
+	 * the current SoftIRQ batch (see homa_grant_flush).
+	 */
+	struct homa_deferred_grant deferred_grants[HOMA_MAX_DEFERRED_GRANTS];
+
+	/**
+	 * @skb_cache: sk_buffs from reaped outgoing messages that have
+	 * been reset so they can be reused for new outgoing DATA packets
+	 * (see homa_skb_new), linked through homa_next_skb. Accessed only
+	 * on this core, with BHs disabled.
+	 */
+	struct sk_buff *skb_cache;
+
+	/** @num_cached_skbs: number of sk_buffs in @skb_cache. */
+	int num_cached_skbs;
+
 	/** @metrics: performance statistics for this core. */
 	struct homa_metrics metrics;
 };
@@ -2878,6 +4198,12 @@ struct homa_skb_info {
 	 * segments in this packet.
 	 */
 	int data_bytes;
+
+	/**
+	 * @offset: offset within the message of the first byte of data
+	 * in this packet.
+	 */
+	int offset;
 };
 
 #define INC_METRIC(metric, count) \
@@ -3026,6 +4352,21 @@ static inline struct sk_buff **homa_next_skb(struct sk_buff *skb)
 	return (struct sk_buff **) (skb_end_pointer(skb) - sizeof(char*));
 }
 
+/**
+ * homa_pool_covered() - Return the number of bytes at the beginning of
+ * an RPC's incoming message for which buffer space has been allocated.
+ * @rpc:    RPC whose message is of interest; must be locked by caller.
+ *
+ * Return:  See above; the result will be >= rpc->msgin.length if space has
+ *          been allocated for the entire message. Space for the partial
+ *          bpage at the end of a message is allocated only when all of
+ *          the full bpages have been allocated.
+ */
+static inline int homa_pool_covered(struct homa_rpc *rpc)
+{
+	return rpc->msgin.num_bpages << rpc->hsk->buffer_pool.bpage_shift;
+}
+
 /**
  * port_hash() - Hash function for port numbers.
  * @port:   Port number being looked up.
@@ -3154,6 +4495,75 @@ static inline void homa_unprotect_rpcs(struct homa_sock *hsk)
 	atomic_dec(&hsk->protect_count);
 }
 
+/**
+ * homa_grant_bucket() - Returns the index of the bucket in
+ * homa->grantable_peers for a peer whose highest priority RPC has a
+ * given number of bytes remaining. Bucket boundaries grow geometrically
+ * (4 buckets per power of two), so small messages are separated finely
+ * and large ones coarsely; the mapping is monotonic, so lower buckets
+ * always hold higher priority peers.
+ * @bytes_remaining:  Value of msgin.bytes_remaining for the peer's
+ *                    highest priority RPC.
+ */
+static inline int homa_grant_bucket(int bytes_remaining)
+{
+	int units = bytes_remaining >> HOMA_GRANT_BUCKET_SHIFT;
+	int bits, bucket;
+
+	if (units < 4)
+		return (units < 0) ? 0 : units;
+	bits = fls(units);
+	bucket = 4*(bits - 2) + ((units >> (bits - 3)) & 3);
+	if (bucket >= HOMA_GRANT_BUCKETS)
+		bucket = HOMA_GRANT_BUCKETS - 1;
+	return bucket;
+}
+
+/**
+ * homa_grant_remaining() - Returns the bytes remaining for an incoming
+ * message divided by the grant weight of its socket, in fixed point (scaled
+ * by HOMA_GRANT_WEIGHT_SCALE, so no precision is lost); this is the value
+ * used to rank messages for grants (see homa_grant_outranks).
+ * @rpc:    RPC whose msgin has been initialized.
+ */
+static inline __s64 homa_grant_remaining(struct homa_rpc *rpc)
+{
+	return ((__s64) rpc->msgin.bytes_remaining * HOMA_GRANT_WEIGHT_SCALE)
+			/ rpc->msgin.grant_weight;
+}
+
+/**
+ * homa_grant_next_peer() - Used to iterate over homa->grantable_peers
+ * in priority order. The caller must hold the grantable lock.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @peer:    The peer most recently returned by this function, or NULL
+ *           to start a new iteration.
+ * Return:   The next peer in priority order after @peer, or NULL if
+ *           there are no more grantable peers.
+ */
+static inline struct homa_peer *homa_grant_next_peer(struct homa *homa,
+		struct homa_peer *peer)
+{
+	unsigned long mask;
+	int bucket;
+
+	if (peer == NULL) {
+		bucket = 0;
+	} else {
+		if (!list_is_last(&peer->grantable_links,
+				&homa->grantable_peers[peer->grant_bucket]))
+			return list_next_entry(peer, grantable_links);
+		bucket = peer->grant_bucket + 1;
+		if (bucket >= HOMA_GRANT_BUCKETS)
+			return NULL;
+	}
+	mask = homa->grantable_nonempty & (~0UL << bucket);
+	if (mask == 0)
+		return NULL;
+	return list_first_entry(&homa->grantable_peers[__ffs(mask)],
+			struct homa_peer, grantable_links);
+}
+
 /**
  * homa_grantable_lock() - Acquire the grantable lock. If the lock
  * isn't immediately available, record stats on the waiting time.
@@ -3185,28 +4595,29 @@ static inline void homa_grantable_unlock(struct homa *homa)
 {
 	INC_METRIC(grantable_lock_cycles, get_cycles()
 			- homa->grantable_lock_time);
+	INC_METRIC(grantable_lock_acquires, 1);
 	spin_unlock_bh(&homa->grantable_lock);
 }
 
 /**
- * homa_throttle_lock() - Acquire the throttle lock. If the lock
- * isn't immediately available, record stats on the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * homa_throttle_lock() - Acquire the throttle lock for a pacer shard. If
+ * the lock isn't immediately available, record stats on the waiting time.
+ * @pacer:   Shard whose lock should be acquired.
  */
-static inline void homa_throttle_lock(struct homa *homa)
+static inline void homa_throttle_lock(struct homa_pacer *pacer)
 {
-	if (!spin_trylock_bh(&homa->throttle_lock)) {
-		homa_throttle_lock_slow(homa);
+	if (!spin_trylock_bh(&pacer->throttle_lock)) {
+		homa_throttle_lock_slow(pacer);
 	}
 }
 
 /**
- * homa_throttle_unlock() - Release the throttle lock.
- * @homa:    Overall data about the Homa protocol implementation.
+ * homa_throttle_unlock() - Release the throttle lock for a pacer shard.
+ * @pacer:   Shard whose lock should be released.
  */
-static inline void homa_throttle_unlock(struct homa *homa)
+static inline void homa_throttle_unlock(struct homa_pacer *pacer)
 {
-	spin_unlock_bh(&homa->throttle_lock);
+	spin_unlock_bh(&pacer->throttle_lock);
 }
 
 /** skb_is_ipv6() - Return true if the packet is encapsulated with IPv6,
@@ -3314,6 +4725,8 @@ extern void     homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 extern void     homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb);
 extern void     homa_add_to_throttled(struct homa_rpc *rpc);
 extern void     homa_append_metric(struct homa *homa, const char* format, ...);
+extern void     homa_apply_grant(struct homa_rpc *rpc, int offset,
+		    int priority, int resend_all);
 extern int      homa_backlog_rcv(struct sock *sk, struct sk_buff *skb);
 extern int      homa_bind(struct socket *sk, struct sockaddr *addr,
                     int addr_len);
@@ -3321,12 +4734,14 @@ extern void     homa_bucket_unlock(struct homa_rpc_bucket *bucket, __u64 id);
 extern void     homa_check_rpc(struct homa_rpc *rpc);
 extern int      homa_check_nic_queue(struct homa *homa, struct sk_buff *skb,
                     bool force);
-extern struct homa_rpc
-	       *homa_choose_fifo_grant(struct homa *homa);
 extern struct homa_interest
                *homa_choose_interest(struct homa *homa, struct list_head *head,
 	            int offset);
 extern void     homa_close(struct sock *sock, long timeout);
+extern void     homa_copy_helper_main(struct work_struct *work);
+extern struct homa_copy_helper
+               *homa_copy_helpers_start(struct homa_skb_builder *b,
+		    struct iov_iter *iter, int *num_helpers);
 extern int      homa_copy_to_user(struct homa_rpc *rpc);
 extern void     homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk);
 extern void     homa_data_from_server(struct sk_buff *skb,
@@ -3359,19 +4774,33 @@ extern void     homa_get_resend_range(struct homa_message_in *msgin,
 extern int      homa_getsockopt(struct sock *sk, int level, int optname,
                     char __user *optval, int __user *option);
 extern void     homa_grant_add_rpc(struct homa_rpc *rpc);
+extern void     homa_grant_add_staged(struct homa *homa);
 extern void     homa_grant_check_rpc(struct homa_rpc *rpc);
+extern void     homa_grant_fifo(struct homa *homa);
 extern void     homa_grant_find_oldest(struct homa *homa);
+extern void     homa_grant_flush(struct homa_core *core);
 extern void     homa_grant_free_rpc(struct homa_rpc *rpc);
+extern void     homa_grant_insert_peer(struct homa *homa,
+                    struct homa_peer *peer);
 extern int      homa_grant_outranks(struct homa_rpc *rpc1,
 		    struct homa_rpc *rpc2);
 extern int      homa_grant_pick_rpcs(struct homa *homa, struct homa_rpc **rpcs,
 		    int max_rpcs);
+extern void     homa_grant_promote(struct homa_rpc *rpc, struct homa *homa);
 extern void     homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
 extern void     homa_grant_recalc(struct homa *homa, int locked);
 extern void     homa_grant_remove_rpc(struct homa_rpc *rpc);
 extern int      homa_grant_send(struct homa_rpc *rpc, struct homa *homa);
+extern void     homa_grant_set_priority(struct homa *homa,
+		    struct homa_rpc *rpc, int rank);
+extern void     homa_grant_tune_overcommit(struct homa *homa,
+		    __u64 total_bytes);
+extern void     homa_grant_unlink_peer(struct homa *homa,
+                    struct homa_peer *peer);
 extern int      homa_grant_update_incoming(struct homa_rpc *rpc,
 		    struct homa *homa);
+extern void     homa_grant_xmit(struct homa_rpc *rpc,
+		    struct grant_header *grant);
 extern int      homa_gro_complete(struct sk_buff *skb, int thoff);
 extern void     homa_gro_gen2(struct sk_buff *skb);
 extern void     homa_gro_gen3(struct sk_buff *skb);
@@ -3382,8 +4811,16 @@ extern struct sk_buff
                *homa_gso_segment(struct sk_buff *skb,
 		    netdev_features_t features);
 extern int      homa_hash(struct sock *sk);
+extern void     homa_heap_decrease_key(struct homa_heap *heap,
+		    struct homa_heap_node *node, __u64 key);
+extern void     homa_heap_insert(struct homa_heap *heap,
+		    struct homa_heap_node *node, __u64 key);
+extern void     homa_heap_remove(struct homa_heap *heap,
+		    struct homa_heap_node *node);
 extern enum hrtimer_restart
                 homa_hrtimer(struct hrtimer *timer);
+extern void     homa_incast_check(struct homa *homa,
+		    __u64 total_requests);
 extern int      homa_init(struct homa *homa);
 extern void     homa_incoming_sysctl_changed(struct homa *homa);
 extern int      homa_ioc_abort(struct sock *sk, unsigned long arg);
@@ -3392,21 +4829,33 @@ extern void     homa_log_throttled(struct homa *homa);
 extern int      homa_message_in_init(struct homa_rpc *rpc, int length,
 		    int unsched);
 extern int      homa_message_out_init(struct homa_rpc *rpc,
-		    struct iov_iter *iter, int xmit);
+		    struct iov_iter *iter, int flags);
 extern loff_t   homa_metrics_lseek(struct file *file, loff_t offset,
 		    int whence);
 extern int      homa_metrics_open(struct inode *inode, struct file *file);
 extern ssize_t  homa_metrics_read(struct file *file, char __user *buffer,
                     size_t length, loff_t *offset);
 extern int      homa_metrics_release(struct inode *inode, struct file *file);
+extern void     homa_multi_grant_pkt(struct sk_buff *skb,
+		    struct homa_sock *hsk);
 extern void     homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_rpc *rpc);
+extern struct sk_buff
+               *homa_new_data_packet(struct homa_skb_builder *b,
+		    struct iov_iter *iter, int offset, int length);
+extern void     homa_nic_queue_sync(struct homa *homa,
+		    struct net_device *dev);
 extern int      homa_offload_end(void);
 extern int      homa_offload_init(void);
 extern void     homa_outgoing_sysctl_changed(struct homa *homa);
-extern int      homa_pacer_main(void *transportInfo);
+extern bool     homa_pacer_arm_timer(struct homa_pacer *pacer);
+extern int      homa_pacer_main(void *arg);
+extern int      homa_pacer_outranked(struct homa_pacer *pacer);
+extern int      homa_pacer_start(struct homa *homa, int num_pacers);
 extern void     homa_pacer_stop(struct homa *homa);
-extern void     homa_pacer_xmit(struct homa *homa);
+extern enum hrtimer_restart
+		homa_pacer_timer(struct hrtimer *timer);
+extern void     homa_pacer_xmit(struct homa_pacer *pacer);
 extern void     homa_peertab_destroy(struct homa_peertab *peertab);
 extern struct homa_peer **
 		    homa_peertab_get_peers(struct homa_peertab *peertab,
@@ -3427,16 +4876,34 @@ extern void     homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now);
 extern __poll_t homa_poll(struct file *file, struct socket *sock,
                     struct poll_table_struct *wait);
 extern int      homa_pool_allocate(struct homa_rpc *rpc);
+extern int      homa_pool_attach_ring(struct homa_pool *pool,
+		    void __user *ring, int entries);
 extern void     homa_pool_check_waiting(struct homa_pool *pool);
+extern int      homa_pool_copy_pinned(struct homa_pool *pool,
+		    struct sk_buff *skb, int offset, void __user *dst,
+		    int length);
 extern void     homa_pool_destroy(struct homa_pool *pool);
+extern int      homa_pool_drain_ring(struct homa_pool *pool);
 extern void    *homa_pool_get_buffer(struct homa_rpc *rpc, int offset,
 		    int *available);
+extern int      homa_pool_extend(struct homa_rpc *rpc, int end);
+extern void     homa_pool_forget_rpc(struct homa_pool *pool,
+		    struct homa_rpc *rpc);
 extern int      homa_pool_get_pages(struct homa_pool *pool, int num_pages,
 		    __u32 *pages, int leave_locked);
+extern void     homa_pool_get_stats(struct homa_pool *pool,
+		    struct homa_buf_stats *stats);
 extern int      homa_pool_init(struct homa_sock *hsk, void *buf_region,
-		    __u64 region_size);
+		    __u64 region_size, int bpage_shift);
+extern void     homa_pool_learn_nodes(struct homa_pool *pool,
+		    int num_buffers, __u32 *buffers);
+extern void     homa_pool_move_pins(struct homa_pool *dst,
+		    struct homa_pool *src);
+extern int      homa_pool_pin(struct homa_pool *pool, void __user *region,
+		    __u64 length);
 extern void     homa_pool_release_buffers(struct homa_pool *pool,
 		    int num_buffers, __u32 *buffers);
+extern void     homa_pool_set_copy_node(struct homa_pool *pool);
 extern char    *homa_print_ipv4_addr(__be32 addr);
 extern char    *homa_print_ipv6_addr(const struct in6_addr *addr);
 extern char    *homa_print_metrics(struct homa *homa);
@@ -3475,12 +4942,30 @@ extern struct homa_rpc
 		    int *created);
 extern int      homa_rpc_reap(struct homa_sock *hsk, int count);
 extern void     homa_send_ipis(void);
+extern int      homa_send_region_append(struct homa_send_region *region,
+		    struct sk_buff *skb, __u64 offset, int length);
+extern void     homa_send_region_destroy(struct homa_send_region *region);
+extern __s64    homa_send_region_find(struct homa_send_region *region,
+		    struct iov_iter *iter);
+extern int      homa_send_region_init(struct homa_sock *hsk,
+		    void __user *start, __u64 length, int ring_entries);
+extern bool     homa_send_region_post(struct homa_send_region *region,
+		    __u32 offset);
 extern int      homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t len);
 extern int      homa_sendpage(struct sock *sk, struct page *page, int offset,
                     size_t size, int flags);
 extern int      homa_setsockopt(struct sock *sk, int level, int optname,
                     sockptr_t __user optval, unsigned int optlen);
 extern int      homa_shutdown(struct socket *sock, int how);
+extern void     homa_skb_cache_flush(struct homa_core *core);
+extern int      homa_skb_index_build(struct homa_rpc *rpc);
+extern int      homa_skb_data_bytes(struct homa_rpc *rpc, int offset,
+		    int end);
+extern struct sk_buff
+               *homa_skb_new(int size);
+extern void     homa_skb_recycle(struct homa *homa, struct sk_buff *skb);
+extern int      homa_skb_share_data(struct sk_buff *to, struct sk_buff *from,
+		    int offset, int length);
 extern int      homa_snprintf(char *buffer, int size, int used,
                     const char* format, ...)
                     __attribute__((format(printf, 4, 5)));
@@ -3503,6 +4988,8 @@ extern int      homa_softirq(struct sk_buff *skb);
 extern void     homa_spin(int ns);
 extern char    *homa_symbol_for_state(struct homa_rpc *rpc);
 extern char    *homa_symbol_for_type(uint8_t type);
+extern int      homa_sysctl_num_pacers(struct ctl_table *table, int write,
+                    void __user *buffer, size_t *lenp, loff_t *ppos);
 extern int      homa_sysctl_softirq_cores(struct ctl_table *table, int write,
                     void __user *buffer, size_t *lenp, loff_t *ppos);
 extern void     homa_timer(struct homa *homa);
@@ -3526,6 +5013,12 @@ extern void     homa_xmit_data(struct homa_rpc *rpc, bool force);
 extern void     __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc,
                     int priority);
 extern void     homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk);
+extern int      homa_zcopy_append(struct sk_buff *skb, struct iov_iter *iter,
+		    int length);
+extern void     homa_zcopy_complete(struct sk_buff *skb,
+		    struct ubuf_info *ubuf, bool success);
+extern struct homa_zcopy
+               *homa_zcopy_new(struct homa_rpc *rpc);
 
 /**
  * homa_check_pacer() - This method is invoked at various places in Homa to
@@ -3539,7 +5032,11 @@ extern void     homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk);
  */
 static inline void homa_check_pacer(struct homa *homa, int softirq)
 {
-	if (list_empty(&homa->throttled_rpcs))
+	unsigned long mask = READ_ONCE(homa->pacers_throttled);
+	struct homa_pacer *pacer = NULL;
+	int i;
+
+	if (mask == 0)
 		return;
 
 	/* The "/2" in the line below gives homa_pacer_main the first chance
@@ -3549,8 +5046,18 @@ static inline void homa_check_pacer(struct homa *homa, int softirq)
 	if ((get_cycles() + homa->max_nic_queue_cycles/2) <
 			atomic64_read(&homa->link_idle_time))
 		return;
-	tt_record("homa_check_pacer calling homa_pacer_xmit");
-	homa_pacer_xmit(homa);
+
+	/* Help the shard with the shortest message. */
+	while (mask) {
+		i = __ffs(mask);
+		mask &= mask - 1;
+		if ((pacer == NULL) || (READ_ONCE(homa->pacers[i].head_bytes)
+				< READ_ONCE(pacer->head_bytes)))
+			pacer = &homa->pacers[i];
+	}
+	tt_record1("homa_check_pacer calling homa_pacer_xmit for shard %d",
+			pacer->index);
+	homa_pacer_xmit(pacer);
 	INC_METRIC(pacer_needed_help, 1);
 }
 
@@ -3569,5 +5076,4 @@ static inline struct dst_entry *homa_get_dst(struct homa_peer *peer,
 	return peer->dst;
 }
 
-extern struct completion homa_pacer_kthread_done;
 #endif /* _HOMA_IMPL_H */
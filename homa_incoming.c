@@ -30,6 +30,8 @@ int homa_message_in_init(struct homa_rpc *rpc, int length, int unsched)
 	atomic_set(&rpc->msgin.rank, -1);
 	rpc->msgin.priority = 0;
 	rpc->msgin.resend_all = 0;
+	rpc->msgin.staged = 0;
+	rpc->msgin.grant_weight = READ_ONCE(rpc->hsk->grant_weight);
 	rpc->msgin.num_bpages = 0;
 	err = homa_pool_allocate(rpc);
 	if (err != 0)
@@ -182,6 +184,7 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 #else
 #define MAX_SKBS 20
 #endif
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
 	struct sk_buff *skbs[MAX_SKBS];
 	int n = 0;             /* Number of filled entries in skbs. */
 	int error = 0;
@@ -189,6 +192,8 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 	int end_offset = 0;
 	int i;
 
+	homa_pool_set_copy_node(pool);
+
 	/* Tricky note: we can't hold the RPC lock while we're actually
 	 * copying to user space, because (a) it's illegal to hold a spinlock
 	 * while copying to user space and (b) we'd like for homa_softirq
@@ -245,6 +250,16 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 					}
 					chunk_size = buf_bytes;
 				}
+				if (pool->pinned_pages) {
+					error = homa_pool_copy_pinned(pool,
+							skbs[i],
+							sizeof(*h) + copied,
+							dst, chunk_size);
+					if (error)
+						goto free_skbs;
+					copied += chunk_size;
+					continue;
+				}
 				error = import_single_range(READ, dst,
 						chunk_size, &iov, &iter);
 				if (error)
@@ -386,6 +401,18 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 		h = (struct data_header *) skb->data;
 		next = skb->next;
 
+		if (h->common.type == MULTI_GRANT) {
+			/* These packets refer to several RPCs, so they must
+			 * be processed without holding an RPC lock. They are
+			 * short, so homa_softirq always dispatches them
+			 * individually.
+			 */
+			BUG_ON(rpc != NULL);
+			INC_METRIC(packets_received[MULTI_GRANT - DATA], 1);
+			homa_multi_grant_pkt(skb, hsk);
+			continue;
+		}
+
 		/* Relinquish the RPC lock temporarily if it's needed
 		 * elsewhere.
 		 */
@@ -459,6 +486,8 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 					num_acks++;
 				}
 			}
+			INC_METRIC(data_bytes_received,
+					ntohl(h->seg.segment_length));
 			homa_data_pkt(skb, rpc);
 			INC_METRIC(packets_received[DATA - DATA], 1);
 			break;
@@ -512,6 +541,12 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 	if (rpc != NULL)
 		homa_grant_check_rpc(rpc);
 
+	/* Buffer allocation may have freed bpages while the RPC was
+	 * locked (see homa_pool_check_waiting).
+	 */
+	if (READ_ONCE(hsk->buffer_pool.check_waiting_needed))
+		homa_pool_check_waiting(&hsk->buffer_pool);
+
 	while (num_acks > 0) {
 		num_acks--;
 		homa_rpc_acked(hsk, &saddr, &acks[num_acks]);
@@ -580,6 +615,17 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 		INC_METRIC(dropped_data_no_bufs, ntohl(h->seg.segment_length));
 		goto discard;
 	}
+	if (unlikely((ntohl(h->seg.offset) + ntohl(h->seg.segment_length))
+			> homa_pool_covered(rpc))) {
+		/* Only part of the message has buffer space so far, and
+		 * this packet is beyond it.
+		 */
+		tt_record3("Dropping packet beyond buffer space: id %d, "
+				"offset %d, covered %d", rpc->id,
+				ntohl(h->seg.offset), homa_pool_covered(rpc));
+		INC_METRIC(dropped_data_no_bufs, ntohl(h->seg.segment_length));
+		goto discard;
+	}
 
 	homa_add_packet(rpc, skb);
 
@@ -609,6 +655,7 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 						htonl(homa->unsched_cutoffs[i]);
 			}
 			h2.cutoff_version = htons(homa->cutoff_version);
+			h2.unsched_bytes = htonl(homa->incast_unsched_limit);
 			homa_xmit_control(CUTOFFS, &h2, sizeof(h2), rpc);
 			rpc->peer->last_update_jiffies = jiffies;
 		}
@@ -634,24 +681,84 @@ void homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 			"resend_all %d",
 			homa_local_id(h->common.sender_id), ntohl(h->offset),
 			h->priority, h->resend_all);
-	if (rpc->state == RPC_OUTGOING) {
-		int new_offset = ntohl(h->offset);
+	homa_apply_grant(rpc, ntohl(h->offset), h->priority, h->resend_all);
+	kfree_skb(skb);
+}
 
-		if (h->resend_all)
-			homa_resend_data(rpc, 0, rpc->msgout.next_xmit_offset,
-					h->priority);
+/**
+ * homa_multi_grant_pkt() - Handler for incoming MULTI_GRANT packets.
+ * @skb:     Incoming packet; size already verified large enough for header.
+ *           This function now owns the packet.
+ * @hsk:     Socket on which the packet was received. No RPC locks may
+ *           be held by the caller.
+ */
+void homa_multi_grant_pkt(struct sk_buff *skb, struct homa_sock *hsk)
+{
+	const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
+	struct multi_grant_header *h = (struct multi_grant_header *) skb->data;
+	int sport = ntohs(h->common.sport);
+	int i, count;
 
-		if (new_offset > rpc->msgout.granted) {
-			rpc->msgout.granted = new_offset;
-			if (new_offset > rpc->msgout.length)
-				rpc->msgout.granted = rpc->msgout.length;
+	count = ntohs(h->num_grants);
+	if (count > HOMA_MAX_MULTI_GRANTS)
+		count = HOMA_MAX_MULTI_GRANTS;
+	for (i = 0; i < count; i++) {
+		struct homa_grant_entry *grant = &h->grants[i];
+		__u64 id = homa_local_id(grant->sender_id);
+		struct homa_rpc *rpc;
+
+		if (homa_is_client(id))
+			rpc = homa_find_client_rpc(hsk, id);
+		else
+			rpc = homa_find_server_rpc(hsk, &saddr, sport, id);
+		if (unlikely(!rpc)) {
+			tt_record3("Discarding multi-grant entry for unknown "
+					"RPC, id %u, peer 0x%x:%d",
+					id, tt_addr(saddr), sport);
+			if (homa_is_client(id))
+				INC_METRIC(unknown_rpcs, 1);
+			continue;
 		}
-		rpc->msgout.sched_priority = h->priority;
-		homa_xmit_data(rpc, false);
+		tt_record4("processing multi-grant entry for id %llu, "
+				"offset %d, priority %d, resend_all %d",
+				id, ntohl(grant->offset), grant->priority,
+				grant->resend_all);
+		rpc->silent_ticks = 0;
+		rpc->peer->outstanding_resends = 0;
+		homa_apply_grant(rpc, ntohl(grant->offset), grant->priority,
+				grant->resend_all);
+		homa_rpc_unlock(rpc);
 	}
 	kfree_skb(skb);
 }
 
+/**
+ * homa_apply_grant() - Update the outgoing message for an RPC to reflect
+ * a grant that has been received for it, and transmit any newly granted
+ * data.
+ * @rpc:         RPC that was granted. Must be locked by the caller.
+ * @offset:      New grant offset for the message.
+ * @priority:    Priority to use for scheduled packets.
+ * @resend_all:  Nonzero means retransmit all data sent so far.
+ */
+void homa_apply_grant(struct homa_rpc *rpc, int offset, int priority,
+		int resend_all)
+{
+	if (rpc->state != RPC_OUTGOING)
+		return;
+	if (resend_all)
+		homa_resend_data(rpc, 0, rpc->msgout.next_xmit_offset,
+				priority);
+
+	if (offset > rpc->msgout.granted) {
+		rpc->msgout.granted = offset;
+		if (offset > rpc->msgout.length)
+			rpc->msgout.granted = rpc->msgout.length;
+	}
+	rpc->msgout.sched_priority = priority;
+	homa_xmit_data(rpc, false);
+}
+
 /**
  * homa_resend_pkt() - Handler for incoming RESEND packets
  * @skb:     Incoming packet; size already verified large enough for header.
@@ -768,7 +875,8 @@ done:
 
 /**
  * homa_cutoffs_pkt() - Handler for incoming CUTOFFS packets
- * @skb:     Incoming packet; size already verified large enough for header.
+ * @skb:     Incoming packet; size already verified large enough for header
+ *           (except possibly unsched_bytes, which older peers omit).
  *           This function now owns the packet.
  * @hsk:     Socket on which the packet was received.
  */
@@ -785,6 +893,14 @@ void homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk)
 		for (i = 1; i <HOMA_MAX_PRIORITIES; i++)
 			peer->unsched_cutoffs[i] = ntohl(h->unsched_cutoffs[i]);
 		peer->cutoff_version = h->cutoff_version;
+
+		/* Older versions of Homa send CUTOFFS packets without
+		 * unsched_bytes; they never limit unscheduled bytes.
+		 */
+		if (skb->len >= sizeof(struct cutoffs_header))
+			peer->unsched_bytes = ntohl(h->unsched_bytes);
+		else
+			peer->unsched_bytes = 0;
 	}
 	kfree_skb(skb);
 }
@@ -875,88 +991,6 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	kfree_skb(skb);
 }
 
-/**
- * homa_choose_fifo_grant() - This function is invoked occasionally to give
- * a high-priority grant to the oldest incoming message. We do this in
- * order to reduce the starvation that SRPT can cause for long messages.
- * Note: this method is obsolete and should never be invoked; it's code is
- * being retained until fifo grants are reimplemented using the new grant
- * mechanism.
- * @homa:    Overall data about the Homa protocol implementation. The
- *           grantable_lock must be held by the caller.
- * Return: An RPC to which to send a FIFO grant, or NULL if there is
- *         no appropriate RPC. This method doesn't actually send a grant,
- *         but it updates @msgin.granted to reflect the desired grant.
- *         Also updates homa->total_incoming.
- */
-struct homa_rpc *homa_choose_fifo_grant(struct homa *homa)
-{
-	struct homa_rpc *rpc, *oldest;
-	__u64 oldest_birth;
-	int granted;
-
-	oldest = NULL;
-	oldest_birth = ~0;
-
-	/* Find the oldest message that doesn't currently have an
-	 * outstanding "pity grant".
-	 */
-	list_for_each_entry(rpc, &homa->grantable_rpcs, grantable_links) {
-		int received, on_the_way;
-
-		if (rpc->msgin.birth >= oldest_birth)
-			continue;
-
-		received = (rpc->msgin.length
-				- rpc->msgin.bytes_remaining);
-		on_the_way = rpc->msgin.granted - received;
-		if (on_the_way > homa->unsched_bytes) {
-			/* The last "pity" grant hasn't been used
-			 * up yet.
-			 */
-			continue;
-		}
-		oldest = rpc;
-		oldest_birth = rpc->msgin.birth;
-	}
-	if (oldest == NULL)
-		return NULL;
-	INC_METRIC(fifo_grants, 1);
-	if ((oldest->msgin.length - oldest->msgin.bytes_remaining)
-			== oldest->msgin.granted)
-		INC_METRIC(fifo_grants_no_incoming, 1);
-
-	oldest->silent_ticks = 0;
-	granted = homa->fifo_grant_increment;
-	oldest->msgin.granted += granted;
-	if (oldest->msgin.granted >= oldest->msgin.length) {
-		granted -= oldest->msgin.granted - oldest->msgin.length;
-		oldest->msgin.granted = oldest->msgin.length;
-		// homa_remove_grantable_locked(homa, oldest);
-	}
-
-	/* Try to update homa->total_incoming; if we can't lock
-	 * the RPC, just skip it (waiting could deadlock), and it
-	 * will eventually get updated elsewhere.
-	 */
-	if (homa_bucket_try_lock(oldest->bucket, oldest->id,
-			"homa_choose_fifo_grant")) {
-		homa_grant_update_incoming(oldest, homa);
-		homa_rpc_unlock(oldest);
-	}
-
-	if (oldest->msgin.granted < (oldest->msgin.length
-				- oldest->msgin.bytes_remaining)) {
-		/* We've already received all of the bytes in the new
-		 * grant; most likely this means that the sender sent extra
-		 * data after the last fifo grant (e.g. by rounding up to a
-		 * TSO packet). Don't send this grant.
-		 */
-		return NULL;
-	}
-	return oldest;
-}
-
 /**
  * homa_rpc_abort() - Terminate an RPC.
  * @rpc:     RPC to be terminated.  Must be locked by caller.
@@ -1505,14 +1539,40 @@ void homa_incoming_sysctl_changed(struct homa *homa)
 
 	if (homa->grant_fifo_fraction > 500)
 		homa->grant_fifo_fraction = 500;
+	if (homa->fifo_grant_interval < 0)
+		homa->fifo_grant_interval = 0;
 	tmp = homa->grant_fifo_fraction;
-	if (tmp != 0)
-		tmp = (1000*homa->fifo_grant_increment)/tmp
-				- homa->fifo_grant_increment;
-	homa->grant_nonfifo = tmp;
+	tmp = (tmp*homa->fifo_grant_interval)/(1000 - tmp);
+	homa->fifo_grant_increment = tmp;
+	atomic_set(&homa->grant_nonfifo_left, homa->fifo_grant_interval);
 
 	if (homa->max_overcommit > HOMA_MAX_GRANTS)
 		homa->max_overcommit = HOMA_MAX_GRANTS;
+	if (homa->overcommit_max > HOMA_MAX_GRANTS)
+		homa->overcommit_max = HOMA_MAX_GRANTS;
+	if (homa->overcommit_min < 1)
+		homa->overcommit_min = 1;
+	if (homa->overcommit_min > homa->overcommit_max)
+		homa->overcommit_min = homa->overcommit_max;
+	if (homa->dynamic_overcommit) {
+		/* Keep the tuned value (homa_grant_tune_overcommit), but
+		 * within the overcommit bounds.
+		 */
+		int overcommit = READ_ONCE(homa->overcommit_current);
+
+		if (overcommit < homa->overcommit_min)
+			overcommit = homa->overcommit_min;
+		if (overcommit > homa->overcommit_max)
+			overcommit = homa->overcommit_max;
+		WRITE_ONCE(homa->overcommit_current, overcommit);
+	} else
+		WRITE_ONCE(homa->overcommit_current, homa->max_overcommit);
+
+	/* A limit of 0 would prevent senders from ever telling us about
+	 * new messages.
+	 */
+	if (homa->incast_unsched_bytes < 1)
+		homa->incast_unsched_bytes = 1;
 
 	/* Code below is written carefully to avoid integer underflow or
 	 * overflow under expected usage patterns. Be careful when changing!
@@ -221,6 +221,16 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			INC_METRIC(gro_grant_bypasses, 1);
 			goto bypass;
 		}
+	} else if (h_new->common.type == MULTI_GRANT) {
+		tt_record4("homa_gro_receive got multi-grant from 0x%x "
+				"id %llu, count %d, priority %d",
+				saddr, homa_local_id(h_new->common.sender_id),
+				ntohs(((struct multi_grant_header *)
+				h_new)->num_grants), priority);
+		if ((homa->gro_policy & HOMA_GRO_FAST_GRANTS) && !busy) {
+			INC_METRIC(gro_grant_bypasses, 1);
+			goto bypass;
+		}
 	} else
 		tt_record4("homa_gro_receive got packet from 0x%x "
 				"id %llu, type 0x%x, priority %d",
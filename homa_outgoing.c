@@ -37,36 +37,60 @@ inline static void set_priority(struct sk_buff *skb, struct homa_sock *hsk,
  *           will be unlocked while copying data, but will be locked again
  *           before returning.
  * @iter:    Describes location(s) of message data in user space.
- * @xmit:    Nonzero means this method should start transmitting packets;
- *           zero means the caller will initiate transmission.
+ * @flags:   OR-ed combination of HOMA_OUT_XMIT (start transmitting packets;
+ *           otherwise the caller will initiate transmission),
+ *           HOMA_OUT_ZEROCOPY (attach the user's pages to the packets
+ *           instead of copying the data; the application is notified
+ *           via the socket's error queue once the pages are no longer
+ *           in use), and HOMA_OUT_REGION (the data lies in the socket's
+ *           send region; its pinned pages are attached to the packets,
+ *           and the application is notified via the region's completion
+ *           ring).
  *
  * Return:   0 for success, or a negative errno for failure. It is is possible
  *           for the RPC to be freed while this function is active. If that
  *           happens, copying will cease, -EINVAL will be returned, and
  *           rpc->state will be RPC_DEAD.
  */
-int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
+int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter,
+		int flags)
 {
-	/* Geometry information for packets:
-	 * mtu:              largest size for an on-the-wire packet (including
-	 *                   all headers through IP header, but not Ethernet
-	 *                   header).
-	 * max_pkt_data:     largest amount of Homa message data that
-	 *                   fits in an on-the-wire packet.
-	 * gso_size:         space required in each sk_buff (pre-GSO), starting
-	 *                   with IP header.
+	struct homa *homa = rpc->hsk->homa;
+
+	/* Geometry of packets and other information needed to create
+	 * them (see homa_new_data_packet).
 	 */
-	int mtu, max_pkt_data, gso_size;
+	struct homa_skb_builder b;
 
-	/* Bytes of the message that haven't yet been copied into skbs. */
-	int bytes_left;
+	/* Offset within the message of the first byte that hasn't yet
+	 * been placed in an skb.
+	 */
+	int offset;
 
 	int err;
 	struct sk_buff **last_link;
 	struct dst_entry *dst;
-	int overlap_xmit, repl_length, pkts_per_gso;
-	unsigned int gso_type;
+	int overlap_xmit, pkts_per_gso;
+	int xmit = flags & HOMA_OUT_XMIT;
+
+	/* If nonzero, this thread transmits packets itself each time it
+	 * has copied this many more bytes (see xmit_chunk_bytes in struct
+	 * homa); @xmit_offset is the offset just after the last byte that
+	 * had been copied the last time it did so.
+	 */
+	int xmit_chunk = 0;
+	int xmit_offset = 0;
 
+	/* Helpers (running on idle cores) that create the sk_buffs for
+	 * later parts of the message; @next_helper is the index of the
+	 * first one whose packets haven't yet been added to the message.
+	 */
+	struct homa_copy_helper *helpers = NULL;
+	int num_helpers = 0;
+	int next_helper = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.rpc = rpc;
 	rpc->msgout.length = iter->count;
 	rpc->msgout.num_skbs = 0;
 	rpc->msgout.copied_from_user = 0;
@@ -74,7 +98,14 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	rpc->msgout.next_xmit = &rpc->msgout.packets;
 	rpc->msgout.next_xmit_offset = 0;
 	atomic_set(&rpc->msgout.active_xmits, 0);
-	rpc->msgout.unscheduled = rpc->hsk->homa->unsched_bytes;
+	rpc->msgout.unscheduled = homa->unsched_bytes;
+	if (unlikely(rpc->peer->unsched_bytes != 0)
+			&& (rpc->msgout.unscheduled > rpc->peer->unsched_bytes)
+			&& (rpc->msgout.length > rpc->peer->unsched_bytes)) {
+		/* The destination is experiencing incast. */
+		rpc->msgout.unscheduled = rpc->peer->unsched_bytes;
+		INC_METRIC(unsched_limited_msgs, 1);
+	}
 	if (rpc->msgout.unscheduled > rpc->msgout.length)
 		rpc->msgout.unscheduled = rpc->msgout.length;
 	rpc->msgout.sched_priority = 0;
@@ -88,165 +119,750 @@ int homa_message_out_init(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		goto error;
 	}
 
+	if (flags & HOMA_OUT_REGION) {
+		__s64 region_offset = homa_send_region_find(
+				&rpc->hsk->send_region, iter);
+
+		if (region_offset < 0) {
+			err = -EINVAL;
+			goto error;
+		}
+		b.region = &rpc->hsk->send_region;
+		b.region_offset = region_offset;
+	}
+
 	/* Compute the geometry of packets, both how they will end up on the
 	 * wire and large they will be here (before GSO).
 	 */
 	dst = homa_get_dst(rpc->peer, rpc->hsk);
-	mtu = dst_mtu(dst);
-	max_pkt_data = mtu - rpc->hsk->ip_header_length
+	b.mtu = dst_mtu(dst);
+	b.max_pkt_data = b.mtu - rpc->hsk->ip_header_length
 			- sizeof(struct data_header);
-	gso_size = dst->dev->gso_max_size;
-	if (gso_size > rpc->hsk->homa->max_gso_size)
-		gso_size = rpc->hsk->homa->max_gso_size;
+	b.gso_size = dst->dev->gso_max_size;
+	if (b.gso_size > homa->max_gso_size)
+		b.gso_size = homa->max_gso_size;
 
 	/* Round gso_size down to an even # of mtus. */
-	repl_length = rpc->hsk->ip_header_length
+	b.repl_length = rpc->hsk->ip_header_length
 			+ sizeof32(struct data_header)
 			- sizeof32(struct data_segment);
-	pkts_per_gso = (gso_size - repl_length)/(mtu - repl_length);
+	pkts_per_gso = (b.gso_size - b.repl_length)/(b.mtu - b.repl_length);
+	if (b.region || ((flags & HOMA_OUT_ZEROCOPY) && iter_is_iovec(iter)
+			&& (iter->nr_segs == 1))) {
+		/* Each segment needs several frags (its header plus the
+		 * pages its data spans), so limit the segments per sk_buff
+		 * to what MAX_SKB_FRAGS allows. Only a single contiguous
+		 * user buffer is sent in place; anything else is copied.
+		 */
+		int seg_frags = HOMA_ZCOPY_SEG_FRAGS(b.max_pkt_data);
+		int max_pkts = 1 + (MAX_SKB_FRAGS - seg_frags + 1)
+				/ seg_frags;
+
+		if (pkts_per_gso > max_pkts)
+			pkts_per_gso = max_pkts;
+		b.zcopy_pages = true;
+	}
 	if (pkts_per_gso == 0)
 		pkts_per_gso = 1;
-	rpc->msgout.gso_pkt_data = pkts_per_gso * max_pkt_data;
-	gso_size = repl_length + (pkts_per_gso * (mtu - repl_length));
+	rpc->msgout.gso_pkt_data = pkts_per_gso * b.max_pkt_data;
+	b.gso_size = b.repl_length + (pkts_per_gso * (b.mtu - b.repl_length));
 	UNIT_LOG("; ", "mtu %d, max_pkt_data %d, gso_size %d, gso_pkt_data %d",
-			mtu, max_pkt_data, gso_size, rpc->msgout.gso_pkt_data);
+			b.mtu, b.max_pkt_data, b.gso_size,
+			rpc->msgout.gso_pkt_data);
 
 	/* It's unclear what gso_type should be to force software GSO; the
 	 * value below seems to work...
 	 */
-	gso_type = (rpc->hsk->homa->gso_force_software) ? 0xd : SKB_GSO_TCPV6;
+	b.gso_type = (homa->gso_force_software) ? 0xd : SKB_GSO_TCPV6;
+
+	/* Fill in the parts of the data header that are the same in
+	 * every sk_buff (cutoff_version is refreshed at transmit time).
+	 */
+	memset(&b.hdr, 0, sizeof(b.hdr));
+	b.hdr.common.sport = htons(rpc->hsk->port);
+	b.hdr.common.dport = htons(rpc->dport);
+	homa_set_doff(&b.hdr);
+	b.hdr.common.type = DATA;
+	b.hdr.common.sender_id = cpu_to_be64(rpc->id);
+	b.hdr.message_length = htonl(rpc->msgout.length);
+	b.hdr.incoming = htonl(rpc->msgout.unscheduled);
+	b.hdr.cutoff_version = rpc->peer->cutoff_version;
+	b.hdr.retransmit = 0;
 
 	overlap_xmit = rpc->msgout.length > 2*rpc->msgout.gso_pkt_data;
+	if (xmit && homa->xmit_chunk_bytes
+			&& (rpc->msgout.length > 2*homa->xmit_chunk_bytes))
+		xmit_chunk = homa->xmit_chunk_bytes;
 	rpc->msgout.granted = rpc->msgout.unscheduled;
 	atomic_or(RPC_COPYING_FROM_USER, &rpc->flags);
+	if (flags & (HOMA_OUT_ZEROCOPY | HOMA_OUT_REGION)) {
+		homa_rpc_unlock(rpc);
+		b.zcopy = homa_zcopy_new(rpc);
+		homa_rpc_lock(rpc, "homa_message_out_init4");
+		if (unlikely(!b.zcopy)) {
+			err = -ENOMEM;
+			goto error;
+		}
+		b.zcopy->copied = !b.zcopy_pages;
+		b.zcopy->in_region = (b.region != NULL);
+		b.zcopy->region_offset = b.region_offset;
+	} else if (homa->copy_helper_bytes > 0) {
+		homa_rpc_unlock(rpc);
+		helpers = homa_copy_helpers_start(&b, iter, &num_helpers);
+		homa_rpc_lock(rpc, "homa_message_out_init5");
+	}
 
 	/* Copy message data from user space and form sk_buffs. Each
 	 * iteration of the outer loop creates one sk_buff, which may
-	 * contain info for multiple packets on the wire (via TSO or GSO).
+	 * contain info for multiple packets on the wire (via TSO or GSO),
+	 * or adds all of the sk_buffs created by one helper.
 	 */
 	tt_record3("starting copy from user space for id %d, length %d, "
 			"unscheduled %d",
 			rpc->id, rpc->msgout.length, rpc->msgout.unscheduled);
 	last_link = &rpc->msgout.packets;
-	for (bytes_left = rpc->msgout.length; bytes_left > 0; ) {
-		struct data_header *h;
-		struct data_segment *seg;
-		int skb_bytes_left, offset;
-		struct sk_buff *skb;
-		struct homa_skb_info *homa_info;
+	for (offset = 0; offset < rpc->msgout.length; ) {
+		struct homa_copy_helper *helper = NULL;
+		struct sk_buff *skb = NULL;
+		int end, length;
 
 		homa_rpc_unlock(rpc);
-
-		/* Figure out how much data will go in this skb. */
-		skb_bytes_left = rpc->msgout.gso_pkt_data;
-		offset = rpc->msgout.length - bytes_left;
-		if ((offset < rpc->msgout.unscheduled) &&
-				((offset + skb_bytes_left)
-				> rpc->msgout.unscheduled)) {
-			/* Insert a packet boundary at the unscheduled limit,
-			 * so we don't transmit extra data.
-			 */
-			skb_bytes_left = rpc->msgout.unscheduled - offset;
-		}
-		if (skb_bytes_left > bytes_left)
-			skb_bytes_left = bytes_left;
-
-		skb = alloc_skb(HOMA_SKB_EXTRA + gso_size
-				+ sizeof32(struct homa_skb_info), GFP_KERNEL);
-		if (unlikely(!skb)) {
-			err = -ENOMEM;
-			homa_rpc_lock(rpc, "homa_message_out_init");
-			goto error;
-		}
-		if ((skb_bytes_left > max_pkt_data)
-				&& (rpc->msgout.gso_pkt_data > max_pkt_data)) {
-			skb_shinfo(skb)->gso_size = sizeof(struct data_segment)
-					+ max_pkt_data;
-			skb_shinfo(skb)->gso_type = gso_type;
-		}
-		skb_shinfo(skb)->gso_segs = 0;
-		homa_info = homa_get_skb_info(skb);
-
-		/* Fill in the initial portion (which will be replicated in
-		 * every network packet by GSO/TSO).
-		 */
-		skb_reserve(skb, rpc->hsk->ip_header_length + HOMA_SKB_EXTRA);
-		skb_reset_transport_header(skb);
-		h = (struct data_header *) skb_put(skb,
-				sizeof(*h) - sizeof(struct data_segment));
-		h->common.sport = htons(rpc->hsk->port);
-		h->common.dport = htons(rpc->dport);
-		homa_set_doff(h);
-		h->common.type = DATA;
-		h->common.sender_id = cpu_to_be64(rpc->id);
-		h->message_length = htonl(rpc->msgout.length);
-		h->incoming = htonl(rpc->msgout.unscheduled);
-		h->cutoff_version = rpc->peer->cutoff_version;
-		h->retransmit = 0;
-		homa_info->wire_bytes = 0;
-		homa_info->data_bytes = 0;
-
-		/* Each iteration of the following loop adds one segment
-		 * (which will become a separate packet after GSO) to the buffer.
-		 */
-		do {
-			int seg_size;
-			seg = (struct data_segment *) skb_put(skb, sizeof(*seg));
-			seg->offset = htonl(rpc->msgout.length - bytes_left);
-			if (skb_bytes_left <= max_pkt_data)
-				seg_size = skb_bytes_left;
-			else
-				seg_size = max_pkt_data;
-			seg->segment_length = htonl(seg_size);
-			seg->ack.client_id = 0;
-			homa_peer_get_acks(rpc->peer, 1, &seg->ack);
-			if (copy_from_iter(skb_put(skb, seg_size), seg_size,
-					iter) != seg_size) {
-				err = -EFAULT;
-				kfree_skb(skb);
-				homa_rpc_lock(rpc, "homa_message_out_init2");
+		if ((next_helper < num_helpers)
+				&& (offset == helpers[next_helper].start)) {
+			helper = &helpers[next_helper];
+			next_helper++;
+			wait_for_completion(&helper->done);
+			err = helper->err;
+			if (unlikely(err)) {
+				homa_free_skbs(helper->packets);
+				homa_rpc_lock(rpc, "homa_message_out_init");
 				goto error;
 			}
-			bytes_left -= seg_size;
-			(skb_shinfo(skb)->gso_segs)++;
-			skb_bytes_left -= seg_size;
-			homa_info->wire_bytes += mtu
-					- (max_pkt_data - seg_size)
-					+ HOMA_ETH_OVERHEAD;
-			homa_info->data_bytes += seg_size;
-		} while (skb_bytes_left > 0);
+			iov_iter_advance(iter, helper->end - helper->start);
+			end = helper->end;
+		} else {
+			end = (next_helper < num_helpers)
+					? helpers[next_helper].start
+					: rpc->msgout.length;
+			length = homa_skb_data_bytes(rpc, offset, end);
+			skb = homa_new_data_packet(&b, iter, offset, length);
+			if (unlikely(IS_ERR(skb))) {
+				err = PTR_ERR(skb);
+				homa_rpc_lock(rpc, "homa_message_out_init");
+				goto error;
+			}
+			end = offset + length;
+		}
 
 		homa_rpc_lock(rpc, "homa_message_out_init3");
 		if (rpc->state == RPC_DEAD) {
 			/* RPC was freed while we were copying. */
 			err = -EINVAL;
-			kfree_skb(skb);
+			if (helper)
+				homa_free_skbs(helper->packets);
+			else
+				kfree_skb(skb);
 			goto error;
 		}
-		*last_link = skb;
-		last_link = &(homa_get_skb_info(skb)->next_skb);
-		*last_link = NULL;
-		rpc->msgout.num_skbs++;
-		rpc->msgout.copied_from_user = rpc->msgout.length - bytes_left;
-		if (overlap_xmit && list_empty(&rpc->throttled_links) && xmit
-				&& (offset < rpc->msgout.granted)) {
+		if (helper) {
+			*last_link = helper->packets;
+			last_link = helper->last_link;
+			rpc->msgout.num_skbs += helper->num_skbs;
+		} else {
+			*last_link = skb;
+			last_link = &(homa_get_skb_info(skb)->next_skb);
+			*last_link = NULL;
+			rpc->msgout.num_skbs++;
+		}
+		rpc->msgout.copied_from_user = end;
+		if (xmit_chunk) {
+			/* Transmit what we have so far, then copy the next
+			 * chunk while the NIC sends it.
+			 */
+			if ((end - xmit_offset) >= xmit_chunk) {
+				homa_xmit_data(rpc, false);
+				xmit_offset = end;
+			}
+		} else if (overlap_xmit && list_empty(&rpc->throttled_links)
+				&& xmit && (offset < rpc->msgout.granted)) {
 			tt_record1("waking up pacer for id %d", rpc->id);
 			homa_add_to_throttled(rpc);
 		}
+		offset = end;
 	}
 	tt_record2("finished copy from user space for id %d, length %d",
 			rpc->id, rpc->msgout.length);
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
 	INC_METRIC(sent_msg_bytes, rpc->msgout.length);
-	if (!overlap_xmit && xmit)
+	if (b.hdr_page)
+		put_page(b.hdr_page);
+	if (b.zcopy)
+		homa_zcopy_complete(NULL, &b.zcopy->ubuf, true);
+	kfree(helpers);
+	if (xmit && (!overlap_xmit || xmit_chunk))
 		homa_xmit_data(rpc, false);
 	return 0;
 
     error:
+	if (next_helper < num_helpers) {
+		/* Helpers still refer to the RPC, so wait for them to
+		 * finish (the RPC can't be reaped until
+		 * RPC_COPYING_FROM_USER is cleared).
+		 */
+		homa_rpc_unlock(rpc);
+		for ( ; next_helper < num_helpers; next_helper++) {
+			wait_for_completion(&helpers[next_helper].done);
+			homa_free_skbs(helpers[next_helper].packets);
+		}
+		homa_rpc_lock(rpc, "homa_message_out_init6");
+	}
+	kfree(helpers);
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
+	if (b.hdr_page)
+		put_page(b.hdr_page);
+	if (b.zcopy)
+		homa_zcopy_complete(NULL, &b.zcopy->ubuf, true);
 	return err;
 }
 
+/**
+ * homa_skb_data_bytes() - Determine how much message data to place in
+ * the next sk_buff of an outgoing message.
+ * @rpc:     RPC whose message is being created; rpc->msgout.gso_pkt_data
+ *           and rpc->msgout.unscheduled must be valid.
+ * @offset:  Offset within the message of the first byte for the sk_buff.
+ * @end:     The sk_buff must not contain any bytes at or after this offset.
+ *
+ * Return:   The number of bytes of message data for the sk_buff.
+ */
+int homa_skb_data_bytes(struct homa_rpc *rpc, int offset, int end)
+{
+	int length = rpc->msgout.gso_pkt_data;
+
+	if ((offset < rpc->msgout.unscheduled) &&
+			((offset + length) > rpc->msgout.unscheduled)) {
+		/* Insert a packet boundary at the unscheduled limit,
+		 * so we don't transmit extra data.
+		 */
+		length = rpc->msgout.unscheduled - offset;
+	}
+	if (length > end - offset)
+		length = end - offset;
+	return length;
+}
+
+/**
+ * homa_new_data_packet() - Create an sk_buff for part of an outgoing
+ * message and fill it in with headers and message data (which is either
+ * copied from user space or attached as frags for zero-copy messages).
+ * The RPC need not be locked; this function may run concurrently with
+ * other invocations for the same message on different cores, as long as
+ * they use different builders and byte ranges.
+ * @b:       Describes the message and the geometry of its packets.
+ * @iter:    Describes the location of the message data in user space;
+ *           will be advanced past the data that is added.
+ * @offset:  Offset within the message of the first byte for the sk_buff.
+ * @length:  Number of bytes of message data to place in the sk_buff.
+ *
+ * Return:   The new sk_buff, or an ERR_PTR value if an error occurred.
+ */
+struct sk_buff *homa_new_data_packet(struct homa_skb_builder *b,
+		struct iov_iter *iter, int offset, int length)
+{
+	struct homa_rpc *rpc = b->rpc;
+	struct homa_skb_info *homa_info;
+	struct data_segment *seg;
+	struct data_header *h;
+	struct sk_buff *skb;
+	int err;
+
+	/* Zero-copy sk_buffs hold only the initial headers in their
+	 * linear part; others are full size, so recycled ones can be used.
+	 */
+	if (b->zcopy_pages)
+		skb = alloc_skb(HOMA_SKB_EXTRA + b->repl_length
+				+ sizeof32(struct data_segment)
+				+ sizeof32(struct homa_skb_info), GFP_KERNEL);
+	else
+		skb = homa_skb_new(HOMA_SKB_EXTRA + b->gso_size
+				+ sizeof32(struct homa_skb_info));
+	if (unlikely(!skb))
+		return ERR_PTR(-ENOMEM);
+	if (b->zcopy_pages)
+		skb_zcopy_set(skb, &b->zcopy->ubuf, NULL);
+	if ((length > b->max_pkt_data)
+			&& (rpc->msgout.gso_pkt_data > b->max_pkt_data)) {
+		skb_shinfo(skb)->gso_size = sizeof(struct data_segment)
+				+ b->max_pkt_data;
+		skb_shinfo(skb)->gso_type = b->gso_type;
+	}
+	skb_shinfo(skb)->gso_segs = 0;
+	homa_info = homa_get_skb_info(skb);
+
+	/* Fill in the initial portion (which will be replicated in
+	 * every network packet by GSO/TSO).
+	 */
+	skb_reserve(skb, rpc->hsk->ip_header_length + HOMA_SKB_EXTRA);
+	skb_reset_transport_header(skb);
+	h = (struct data_header *) skb_put(skb,
+			sizeof(*h) - sizeof(struct data_segment));
+	memcpy(h, &b->hdr, sizeof(*h) - sizeof(struct data_segment));
+	homa_info->wire_bytes = 0;
+	homa_info->data_bytes = 0;
+	homa_info->offset = offset;
+
+	/* Each iteration of the following loop adds one segment
+	 * (which will become a separate packet after GSO) to the buffer.
+	 */
+	do {
+		int seg_size;
+		if (b->zcopy_pages && (skb_shinfo(skb)->gso_segs > 0)) {
+			/* The header must be a frag, since it follows
+			 * data that is in frags.
+			 */
+			if (!b->hdr_page || (b->hdr_offset + sizeof32(*seg))
+					> PAGE_SIZE) {
+				if (b->hdr_page)
+					put_page(b->hdr_page);
+				b->hdr_page = alloc_page(GFP_KERNEL);
+				if (unlikely(!b->hdr_page)) {
+					err = -ENOMEM;
+					goto error;
+				}
+				b->hdr_offset = 0;
+			}
+			get_page(b->hdr_page);
+			seg = (struct data_segment *)
+					(page_address(b->hdr_page)
+					+ b->hdr_offset);
+			skb_fill_page_desc(skb, skb_shinfo(skb)->nr_frags,
+					b->hdr_page, b->hdr_offset,
+					sizeof(*seg));
+			skb->len += sizeof(*seg);
+			skb->data_len += sizeof(*seg);
+			skb->truesize += sizeof(*seg);
+			b->hdr_offset += sizeof32(*seg);
+		} else {
+			seg = (struct data_segment *) skb_put(skb,
+					sizeof(*seg));
+		}
+		seg->offset = htonl(offset);
+		if (length <= b->max_pkt_data)
+			seg_size = length;
+		else
+			seg_size = b->max_pkt_data;
+		seg->segment_length = htonl(seg_size);
+		seg->ack.client_id = 0;
+		homa_peer_get_acks(rpc->peer, 1, &seg->ack);
+		if (b->zcopy_pages) {
+			if (b->region) {
+				err = homa_send_region_append(b->region, skb,
+						b->region_offset, seg_size);
+				b->region_offset += seg_size;
+			} else {
+				err = homa_zcopy_append(skb, iter, seg_size);
+			}
+			if (unlikely(err))
+				goto error;
+			INC_METRIC(zerocopy_bytes, seg_size);
+		} else if (copy_from_iter(skb_put(skb, seg_size),
+				seg_size, iter) != seg_size) {
+			err = -EFAULT;
+			goto error;
+		}
+		offset += seg_size;
+		(skb_shinfo(skb)->gso_segs)++;
+		length -= seg_size;
+		homa_info->wire_bytes += b->mtu
+				- (b->max_pkt_data - seg_size)
+				+ HOMA_ETH_OVERHEAD;
+		homa_info->data_bytes += seg_size;
+	} while (length > 0);
+	return skb;
+
+    error:
+	kfree_skb(skb);
+	return ERR_PTR(err);
+}
+
+/**
+ * homa_copy_helpers_start() - If there are idle cores, ask some of them
+ * to help create the sk_buffs for an outgoing message, so that it can be
+ * copied from user space more quickly. The message is divided into ranges
+ * of roughly equal size; the caller handles the first range and each
+ * helper handles one of the others. Must be invoked in the context of the
+ * sending process, with no locks held.
+ * @b:            Information about the message (must not use zero copy).
+ * @iter:         Describes the message data in user space; not modified.
+ * @num_helpers:  The number of helpers started is stored here.
+ *
+ * Return:        A kmalloc-ed array of @num_helpers helpers, in order of
+ *                their ranges, or NULL if no helpers were started. The
+ *                caller must wait for each helper to complete and then
+ *                free the array.
+ */
+struct homa_copy_helper *homa_copy_helpers_start(struct homa_skb_builder *b,
+		struct iov_iter *iter, int *num_helpers)
+{
+	struct homa_rpc *rpc = b->rpc;
+	struct homa *homa = rpc->hsk->homa;
+	int length = rpc->msgout.length;
+	int cores[HOMA_MAX_COPY_HELPERS];
+	struct homa_copy_helper *helpers;
+	int max_helpers, range, count, core, i, n;
+	__u64 busy_time;
+
+	*num_helpers = 0;
+	max_helpers = length/homa->copy_helper_bytes - 1;
+	if (max_helpers > HOMA_MAX_COPY_HELPERS)
+		max_helpers = HOMA_MAX_COPY_HELPERS;
+	if (max_helpers <= 0)
+		return NULL;
+
+	/* Find idle cores, starting with the ones just after this one. */
+	busy_time = get_cycles() - homa->busy_cycles;
+	count = 0;
+	core = raw_smp_processor_id();
+	for (i = 1; (i < nr_cpu_ids) && (count < max_helpers); i++) {
+		core++;
+		if (core >= nr_cpu_ids)
+			core = 0;
+		if ((homa_cores[core]->last_active < busy_time)
+				&& (homa_cores[core]->last_app_active
+				< busy_time))
+			cores[count++] = core;
+	}
+	if (count == 0)
+		return NULL;
+
+	/* Ranges contain an integral number of sk_buffs (except for the
+	 * last one), so the packets are the same as if there were no
+	 * helpers. Rounding could leave some helpers with nothing to do.
+	 */
+	range = DIV_ROUND_UP(length, count + 1);
+	range = roundup(range, rpc->msgout.gso_pkt_data);
+	n = (length - 1)/range;
+	if (n > count)
+		n = count;
+	if (n == 0)
+		return NULL;
+	helpers = kmalloc(n * sizeof(*helpers), GFP_KERNEL);
+	if (!helpers)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		struct homa_copy_helper *helper = &helpers[i];
+
+		INIT_WORK(&helper->work, homa_copy_helper_main);
+		init_completion(&helper->done);
+		helper->builder = *b;
+		helper->mm = current->mm;
+		helper->iter = *iter;
+		helper->start = (i + 1) * range;
+		helper->end = helper->start + range;
+		if (helper->end > length)
+			helper->end = length;
+		iov_iter_advance(&helper->iter, helper->start);
+		helper->packets = NULL;
+		helper->last_link = &helper->packets;
+		helper->num_skbs = 0;
+		helper->err = 0;
+		tt_record3("homa_copy_helpers_start starting helper on core %d "
+				"for id %d, offset %d", cores[i], rpc->id,
+				helper->start);
+		queue_work_on(cores[i], system_highpri_wq, &helper->work);
+	}
+	INC_METRIC(copy_helpers, n);
+	*num_helpers = n;
+	return helpers;
+}
+
+/**
+ * homa_copy_helper_main() - Top-level function for a copy helper (see
+ * homa_copy_helpers_start); runs on an idle core and creates the sk_buffs
+ * for one range of an outgoing message.
+ * @work:   The work field of a struct homa_copy_helper.
+ */
+void homa_copy_helper_main(struct work_struct *work)
+{
+	struct homa_copy_helper *helper = container_of(work,
+			struct homa_copy_helper, work);
+	struct homa_rpc *rpc = helper->builder.rpc;
+	int offset = helper->start;
+	struct sk_buff *skb;
+	int length;
+
+	/* Borrow the sender's address space, so that we can copy from
+	 * its buffers. The sender waits for us, so the mm can't go away.
+	 */
+	kthread_use_mm(helper->mm);
+	while (offset < helper->end) {
+		length = homa_skb_data_bytes(rpc, offset, helper->end);
+		skb = homa_new_data_packet(&helper->builder, &helper->iter,
+				offset, length);
+		if (unlikely(IS_ERR(skb))) {
+			helper->err = PTR_ERR(skb);
+			break;
+		}
+		*helper->last_link = skb;
+		helper->last_link = &(homa_get_skb_info(skb)->next_skb);
+		*helper->last_link = NULL;
+		helper->num_skbs++;
+		offset += length;
+	}
+	kthread_unuse_mm(helper->mm);
+	INC_METRIC(helper_copy_bytes, offset - helper->start);
+	complete(&helper->done);
+}
+
+/**
+ * homa_skb_new() - Return an sk_buff for an outgoing DATA packet, reusing
+ * one from the current core's cache if possible (see homa_skb_recycle),
+ * so that the steady-state send path doesn't need to call alloc_skb.
+ * @size:   Number of bytes of space needed in the sk_buff (the same
+ *          value that would be passed to alloc_skb).
+ *
+ * Return:  An empty sk_buff with at least @size bytes of space, or NULL
+ *          if memory couldn't be allocated.
+ */
+struct sk_buff *homa_skb_new(int size)
+{
+	struct homa_core *core;
+	struct sk_buff *skb;
+
+	local_bh_disable();
+	core = homa_cores[raw_smp_processor_id()];
+	skb = core->skb_cache;
+	if (skb) {
+		core->skb_cache = homa_get_skb_info(skb)->next_skb;
+		core->num_cached_skbs--;
+	}
+	local_bh_enable();
+	if (skb) {
+		if (likely(skb_end_offset(skb) >= size)) {
+			/* These are set at allocation time by __alloc_skb,
+			 * so they must describe this allocation, not the
+			 * original one.
+			 */
+			skb->alloc_cpu = raw_smp_processor_id();
+			skb_set_kcov_handle(skb, kcov_common_handle());
+			INC_METRIC(recycled_skbs, 1);
+			return skb;
+		}
+
+		/* Packet geometry must have changed (e.g. different
+		 * gso_size), so the cached buffer is too small.
+		 */
+		kfree_skb(skb);
+	}
+	return alloc_skb(size, GFP_KERNEL);
+}
+
+/**
+ * homa_skb_recycle() - Invoked when an sk_buff from an outgoing message
+ * is no longer needed. If possible, the sk_buff is reset to the state
+ * alloc_skb would have left it in, and saved in the current core's cache
+ * for use by homa_skb_new; otherwise it is freed. The reset mirrors
+ * __alloc_skb and __finalize_skb_around as of Linux 6.1 (the fields that
+ * depend on the allocating context are set in homa_skb_new); it must be
+ * rechecked against those functions when moving to a new kernel version.
+ * @homa:   Overall data about the Homa protocol implementation.
+ * @skb:    sk_buff to recycle; the caller no longer owns it.
+ */
+void homa_skb_recycle(struct homa *homa, struct sk_buff *skb)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+	struct homa_core *core;
+
+	/* The memset below clears everything before @tail; the fields that
+	 * describe the buffer itself must come after it.
+	 */
+	BUILD_BUG_ON(offsetof(struct sk_buff, end)
+			< offsetof(struct sk_buff, tail));
+	BUILD_BUG_ON(offsetof(struct sk_buff, head)
+			< offsetof(struct sk_buff, tail));
+	BUILD_BUG_ON(offsetof(struct sk_buff, truesize)
+			< offsetof(struct sk_buff, tail));
+	BUILD_BUG_ON(offsetof(struct sk_buff, users)
+			< offsetof(struct sk_buff, tail));
+
+	/* Only reuse buffers that nobody else can still be using and
+	 * that are no more complex than what homa_new_data_packet creates
+	 * (the driver may still own a reference, or a tap may have
+	 * cloned the packet). Buffers allocated from emergency reserves
+	 * (pfmemalloc) are returned to the allocator rather than kept.
+	 */
+	if ((homa->skb_cache_size <= 0) || (refcount_read(&skb->users) != 1)
+			|| skb_cloned(skb) || skb_is_nonlinear(skb)
+			|| skb_zcopy(skb) || skb->destructor || skb->head_frag
+			|| skb_has_extensions(skb) || skb->pfmemalloc)
+		goto free;
+
+	skb_dst_drop(skb);
+	nf_reset_ct(skb);
+	memset(shinfo, 0, offsetof(struct skb_shared_info, dataref));
+	atomic_set(&shinfo->dataref, 1);
+	memset(skb, 0, offsetof(struct sk_buff, tail));
+	skb->data = skb->head;
+	skb_reset_tail_pointer(skb);
+	skb->mac_header = (typeof(skb->mac_header))~0U;
+	skb->transport_header = (typeof(skb->transport_header))~0U;
+
+	local_bh_disable();
+	core = homa_cores[raw_smp_processor_id()];
+	if (core->num_cached_skbs < homa->skb_cache_size) {
+		homa_get_skb_info(skb)->next_skb = core->skb_cache;
+		core->skb_cache = skb;
+		core->num_cached_skbs++;
+		skb = NULL;
+	}
+	local_bh_enable();
+	if (!skb)
+		return;
+
+    free:
+	kfree_skb(skb);
+}
+
+/**
+ * homa_skb_cache_flush() - Free all of the sk_buffs in a core's cache
+ * of recycled buffers.
+ * @core:   Core whose cache should be emptied.
+ */
+void homa_skb_cache_flush(struct homa_core *core)
+{
+	homa_free_skbs(core->skb_cache);
+	core->skb_cache = NULL;
+	core->num_cached_skbs = 0;
+}
+
+/**
+ * homa_zcopy_new() - Allocate and initialize the information needed to
+ * send a message with zero copy.
+ * @rpc:     RPC whose outgoing message will be sent with zero copy.
+ *
+ * Return:   The new struct, whose ubuf has a single reference (owned by
+ *           the caller, who must eventually release it by invoking
+ *           homa_zcopy_complete), or NULL if memory couldn't be allocated.
+ */
+struct homa_zcopy *homa_zcopy_new(struct homa_rpc *rpc)
+{
+	struct homa_zcopy *zcopy;
+
+	zcopy = kmalloc(sizeof(*zcopy), GFP_KERNEL);
+	if (unlikely(!zcopy))
+		return NULL;
+	zcopy->notify_skb = alloc_skb(0, GFP_KERNEL);
+	if (unlikely(!zcopy->notify_skb)) {
+		kfree(zcopy);
+		return NULL;
+	}
+	zcopy->ubuf.callback = homa_zcopy_complete;
+	refcount_set(&zcopy->ubuf.refcnt, 1);
+	zcopy->ubuf.flags = SKBFL_ZEROCOPY_FRAG | SKBFL_DONT_ORPHAN;
+	zcopy->hsk = rpc->hsk;
+	sock_hold(&rpc->hsk->inet.sk);
+	zcopy->id = rpc->id;
+	zcopy->copied = false;
+	zcopy->in_region = false;
+	zcopy->region_offset = 0;
+	return zcopy;
+}
+
+/**
+ * homa_zcopy_append() - Attach user pages to an sk_buff as frags, so that
+ * the data can be transmitted without copying it.
+ * @skb:     Packet buffer to which the data should be added.
+ * @iter:    Describes the user data; will be advanced past the bytes
+ *           that were added.
+ * @length:  Number of bytes to add.
+ *
+ * Return:   0 for success, or a negative errno (the sk_buff may contain
+ *           some of the data in this case).
+ */
+int homa_zcopy_append(struct sk_buff *skb, struct iov_iter *iter, int length)
+{
+	struct page *pages[MAX_SKB_FRAGS];
+
+	while (length > 0) {
+		int frag = skb_shinfo(skb)->nr_frags;
+		ssize_t bytes;
+		size_t start;
+		int i;
+
+		if (frag >= MAX_SKB_FRAGS)
+			return -EMSGSIZE;
+		bytes = iov_iter_get_pages2(iter, pages, length,
+				MAX_SKB_FRAGS - frag, &start);
+		if (unlikely(bytes <= 0))
+			return bytes ? bytes : -EFAULT;
+		skb->len += bytes;
+		skb->data_len += bytes;
+		skb->truesize += bytes;
+		length -= bytes;
+		for (i = 0; bytes > 0; i++) {
+			int chunk = min_t(size_t, bytes, PAGE_SIZE - start);
+
+			skb_fill_page_desc(skb, frag + i, pages[i], start,
+					chunk);
+			bytes -= chunk;
+			start = 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * homa_zcopy_complete() - This function is the callback for the ubuf_info
+ * in a struct homa_zcopy; it is invoked when an sk_buff referring to the
+ * user's pages is freed (and also when homa_message_out_init drops its own
+ * reference). Once the last reference is gone, it tells the application
+ * that it can reuse the message buffer: messages sent from the socket's
+ * send region are reported in the region's completion ring if possible;
+ * otherwise a notification is queued on the socket's error queue
+ * (SO_EE_ORIGIN_ZEROCOPY, with the RPC id in ee_info (low-order 32 bits)
+ * and ee_data (high-order 32 bits)).
+ * @skb:      The sk_buff being freed (NULL when called from
+ *            homa_message_out_init).
+ * @ubuf:     The ubuf field of a struct homa_zcopy.
+ * @success:  False means the kernel had to copy the pages.
+ */
+void homa_zcopy_complete(struct sk_buff *skb, struct ubuf_info *ubuf,
+		bool success)
+{
+	struct homa_zcopy *zcopy = container_of(ubuf, struct homa_zcopy, ubuf);
+	struct sock *sk = &zcopy->hsk->inet.sk;
+	struct sock_exterr_skb *serr;
+	struct sk_buff *notify;
+
+	if (!success)
+		zcopy->copied = true;
+	if (!refcount_dec_and_test(&ubuf->refcnt))
+		return;
+
+	notify = zcopy->notify_skb;
+	if (zcopy->in_region && homa_send_region_post(&zcopy->hsk->send_region,
+			zcopy->region_offset)) {
+		kfree_skb(notify);
+		goto done;
+	}
+	serr = SKB_EXT_ERR(notify);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee.ee_errno = 0;
+	serr->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr->ee.ee_info = (__u32) zcopy->id;
+	serr->ee.ee_data = (__u32) (zcopy->id >> 32);
+	if (zcopy->copied)
+		serr->ee.ee_code = SO_EE_CODE_ZEROCOPY_COPIED;
+	if (sock_queue_err_skb(sk, notify)) {
+		INC_METRIC(zerocopy_notify_drops, 1);
+		kfree_skb(notify);
+	}
+
+	done:
+	sock_put(sk);
+	kfree(zcopy);
+}
+
 /**
  * homa_xmit_control() - Send a control packet to the other end of an RPC.
  * @type:      Packet type, such as DATA.
@@ -427,6 +1043,7 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 
 		if ((rpc->msgout.length - rpc->msgout.next_xmit_offset)
 				>= homa->throttle_min_bytes) {
+			homa_nic_queue_sync(homa, rpc->peer->dst->dev);
 			if (!homa_check_nic_queue(homa, skb, force)) {
 				tt_record1("homa_xmit_data adding id %u to "
 						"throttle queue", rpc->id);
@@ -539,17 +1156,27 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 	if (end <= start)
 		return;
 
+	/* Use the index (if possible) to find the first packet that
+	 * could overlap the range, rather than scanning from the start
+	 * of the message.
+	 */
+	skb = rpc->msgout.packets;
+	if (start >= rpc->msgout.length)
+		skb = NULL;
+	else if ((start > 0) && (rpc->msgout.skb_index
+			|| (homa_skb_index_build(rpc) == 0)))
+		skb = rpc->msgout.skb_index[start/rpc->msgout.gso_pkt_data];
+
 	/* The nested loop below scans each data_segment in each
 	 * packet, looking for those that overlap the range of
 	 * interest.
 	 */
-	for (skb = rpc->msgout.packets; skb !=  NULL;
-			skb = homa_get_skb_info(skb)->next_skb) {
-		int seg_offset = (skb_transport_header(skb) - skb->head)
+	for ( ; skb !=  NULL; skb = homa_get_skb_info(skb)->next_skb) {
+		int seg_offset = skb_transport_offset(skb)
 				+ sizeof32(struct data_header)
 				- sizeof32(struct data_segment);
 		int offset, length, count;
-		struct data_segment *seg;
+		struct data_segment *seg, seg_buf;
 		struct data_header *h;
 
 		count = skb_shinfo(skb)->gso_segs;
@@ -559,8 +1186,13 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 				seg_offset += sizeof32(*seg) + length) {
 			struct sk_buff *new_skb;
 			struct homa_skb_info *homa_info;
+			bool in_frags;
 
-			seg = (struct data_segment *) (skb->head + seg_offset);
+			/* Segment headers may be in frags (zero copy). */
+			seg = skb_header_pointer(skb, seg_offset,
+					sizeof(seg_buf), &seg_buf);
+			if (unlikely(!seg))
+				break;
 			offset = ntohl(seg->offset);
 			length = ntohl(seg->segment_length);
 
@@ -571,9 +1203,16 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 
 			/* This segment must be retransmitted. Sending packets
 			 * isn't idempotent (packet state gets updated during
-			 * sends) so copy the packet data into a clean sk_buff.
+			 * sends) so create a clean sk_buff for it. If the
+			 * data is in frags (zero copy), the new sk_buff just
+			 * refers to the same pages; otherwise the data is
+			 * copied (the linear part of an sk_buff can't be
+			 * shared).
 			 */
-			new_skb = alloc_skb(length + sizeof(struct data_header)
+			in_frags = (seg_offset + sizeof32(*seg))
+					>= skb_headlen(skb);
+			new_skb = alloc_skb((in_frags ? 0 : length)
+					+ sizeof(struct data_header)
 					+ rpc->hsk->ip_header_length
 					+ HOMA_SKB_EXTRA, GFP_KERNEL);
 			if (unlikely(!new_skb)) {
@@ -588,7 +1227,20 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			__skb_put_data(new_skb, skb_transport_header(skb),
 					sizeof32(struct data_header)
 					- sizeof32(struct data_segment));
-			__skb_put_data(new_skb, seg, sizeof32(*seg) + length);
+			__skb_put_data(new_skb, seg, sizeof32(*seg));
+			if (in_frags) {
+				skb_zcopy_set(new_skb, skb_zcopy(skb), NULL);
+				if (homa_skb_share_data(new_skb, skb,
+						seg_offset + sizeof32(*seg),
+						length) != 0) {
+					kfree_skb(new_skb);
+					continue;
+				}
+				INC_METRIC(resent_shared_bytes, length);
+			} else {
+				__skb_put_data(new_skb, ((char *) seg)
+						+ sizeof32(*seg), length);
+			}
 			h = ((struct data_header *) skb_transport_header(new_skb));
 			h->retransmit = 1;
 			if ((offset + length) <= rpc->msgout.granted)
@@ -605,6 +1257,7 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 					+ rpc->hsk->ip_header_length
 					+ HOMA_ETH_OVERHEAD;
 			homa_info->data_bytes = length;
+			homa_info->offset = offset;
 			tt_record3("retransmitting offset %d, length %d, id %d",
 					offset, length, rpc->id);
 			homa_check_nic_queue(rpc->hsk->homa, new_skb, true);
@@ -639,6 +1292,104 @@ resend_done:
 	}
 }
 
+/**
+ * homa_skb_index_build() - Create rpc->msgout.skb_index, which makes it
+ * possible to find the packet containing a given offset without scanning
+ * the entire message.
+ * @rpc:     RPC whose outgoing message should be indexed. Must be locked.
+ *
+ * Return:   0 for success, otherwise a negative errno (in which case
+ *           rpc->msgout.skb_index is still NULL); -EAGAIN means the
+ *           message is still being copied from user space.
+ */
+int homa_skb_index_build(struct homa_rpc *rpc)
+{
+	struct homa_message_out *msgout = &rpc->msgout;
+	struct sk_buff **index;
+	struct sk_buff *skb;
+	int entries, i;
+
+	if (atomic_read(&rpc->flags) & RPC_COPYING_FROM_USER)
+		return -EAGAIN;
+	entries = DIV_ROUND_UP(msgout->length, msgout->gso_pkt_data);
+	index = kmalloc(entries * sizeof(*index), GFP_ATOMIC);
+	if (unlikely(!index))
+		return -ENOMEM;
+
+	/* Packets appear in order of offset and cover the whole message,
+	 * so the packets for consecutive entries can be found in a single
+	 * pass.
+	 */
+	i = 0;
+	for (skb = msgout->packets; skb != NULL;
+			skb = homa_get_skb_info(skb)->next_skb) {
+		struct homa_skb_info *homa_info = homa_get_skb_info(skb);
+		int skb_end = homa_info->offset + homa_info->data_bytes;
+
+		while ((i < entries) && ((i * msgout->gso_pkt_data) < skb_end))
+			index[i++] = skb;
+	}
+	if (unlikely(i < entries)) {
+		/* Shouldn't ever happen (message is incomplete). */
+		kfree(index);
+		return -EINVAL;
+	}
+	msgout->skb_index = index;
+	return 0;
+}
+
+/**
+ * homa_skb_share_data() - Add frags to an sk_buff that refer to data in
+ * the frags of another sk_buff, so that the data can be transmitted again
+ * without copying it.
+ * @to:      sk_buff to which the frags should be added.
+ * @from:    sk_buff containing the data; the data must be entirely in
+ *           its frags.
+ * @offset:  Offset of the first byte of data within @from (as with
+ *           skb_copy_bits).
+ * @length:  Number of bytes of data to share.
+ *
+ * Return:   0 for success, otherwise a negative errno. If an error
+ *           occurs, @to may contain some of the data, so the caller
+ *           should discard it.
+ */
+int homa_skb_share_data(struct sk_buff *to, struct sk_buff *from,
+		int offset, int length)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(from);
+	int frag_start = skb_headlen(from);
+	int i;
+
+	if (offset < frag_start)
+		return -EINVAL;
+	for (i = 0; (i < shinfo->nr_frags) && (length > 0); i++) {
+		skb_frag_t *frag = &shinfo->frags[i];
+		int size = skb_frag_size(frag);
+		int chunk;
+
+		if (offset >= (frag_start + size)) {
+			frag_start += size;
+			continue;
+		}
+		if (skb_shinfo(to)->nr_frags >= MAX_SKB_FRAGS)
+			return -EMSGSIZE;
+		chunk = frag_start + size - offset;
+		if (chunk > length)
+			chunk = length;
+		skb_frag_ref(from, i);
+		skb_fill_page_desc(to, skb_shinfo(to)->nr_frags,
+				skb_frag_page(frag),
+				skb_frag_off(frag) + offset - frag_start, chunk);
+		to->len += chunk;
+		to->data_len += chunk;
+		to->truesize += chunk;
+		offset += chunk;
+		length -= chunk;
+		frag_start += size;
+	}
+	return (length == 0) ? 0 : -EINVAL;
+}
+
 /**
  * homa_outgoing_sysctl_changed() - Invoked whenever a sysctl value is changed;
  * any output-related parameters that depend on sysctl-settable values.
@@ -656,6 +1407,82 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
 	tmp = homa->max_nic_queue_ns;
 	tmp = (tmp*cpu_khz)/1000000;
 	homa->max_nic_queue_cycles = tmp;
+	if (homa->num_pacers < 1)
+		homa->num_pacers = 1;
+	if (homa->num_pacers > HOMA_MAX_PACERS)
+		homa->num_pacers = HOMA_MAX_PACERS;
+}
+
+/**
+ * homa_pacers_wake_time() - Returns the earliest time at which any of the
+ * pacer threads with throttled RPCs woke up, or 0 if all of them are
+ * sleeping.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+static __u64 homa_pacers_wake_time(struct homa *homa)
+{
+	unsigned long mask = READ_ONCE(homa->pacers_throttled);
+	__u64 wake, result = 0;
+	int i;
+
+	while (mask) {
+		i = __ffs(mask);
+		mask &= mask - 1;
+		wake = READ_ONCE(homa->pacers[i].wake_time);
+		if ((wake != 0) && ((result == 0) || (wake < result)))
+			result = wake;
+	}
+	return result;
+}
+
+/**
+ * homa_nic_queue_sync() - If homa->bql_feedback is set, correct
+ * homa->link_idle_time using the byte queue limits information for a
+ * network device: the bytes that have been passed to the driver but not
+ * yet reported as transmitted give a measured NIC queue length, which
+ * replaces the one predicted by the model (the model drifts if other
+ * protocols share the link or link_mbps is wrong). The information is
+ * read at most once every max_nic_queue_cycles/4.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @dev:     Device that will transmit Homa's next packet (may be NULL).
+ */
+void homa_nic_queue_sync(struct homa *homa, struct net_device *dev)
+{
+#ifdef CONFIG_BQL
+	unsigned int inflight = 0;
+	unsigned int queued = 0;
+	__u64 now;
+	int i;
+
+	if (!homa->bql_feedback)
+		return;
+	now = get_cycles();
+	if (now < READ_ONCE(homa->bql_next_sample))
+		return;
+	WRITE_ONCE(homa->bql_next_sample, now
+			+ (homa->max_nic_queue_cycles >> 2));
+
+	for (i = 0; dev && (i < dev->real_num_tx_queues); i++) {
+		struct dql *dql = &netdev_get_tx_queue(dev, i)->dql;
+		unsigned int num_queued = READ_ONCE(dql->num_queued);
+
+		queued |= num_queued;
+		inflight += num_queued - READ_ONCE(dql->num_completed);
+	}
+
+	/* If the driver doesn't implement BQL then num_queued never
+	 * advances; in that case there's no information to use.
+	 */
+	if (queued == 0) {
+		INC_METRIC(bql_unavailable, 1);
+		return;
+	}
+	atomic64_set(&homa->link_idle_time, now
+			+ (((__u64) inflight) * homa->cycles_per_kbyte)/1000);
+	tt_record1("homa_nic_queue_sync found %d bytes in NIC queue",
+			inflight);
+	INC_METRIC(bql_samples, 1);
+#endif
 }
 
 /**
@@ -687,12 +1514,14 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 		if (((clock + homa->max_nic_queue_cycles) < idle) && !force
 				&& !(homa->flags & HOMA_FLAG_DONT_THROTTLE))
 			return 0;
-		if (!list_empty(&homa->throttled_rpcs))
+		if (READ_ONCE(homa->pacers_throttled))
 			INC_METRIC(pacer_bytes, bytes);
 		if (idle < clock) {
-			if (homa->pacer_wake_time) {
-				__u64 lost = (homa->pacer_wake_time > idle)
-						? clock - homa->pacer_wake_time
+			__u64 wake_time = homa_pacers_wake_time(homa);
+
+			if (wake_time) {
+				__u64 lost = (wake_time > idle)
+						? clock - wake_time
 						: clock - idle;
 				INC_METRIC(pacer_lost_cycles, lost);
 				tt_record1("pacer lost %d cycles", lost);
@@ -710,69 +1539,168 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 }
 
 /**
- * homa_pacer_main() - Top-level function for the pacer thread.
- * @transportInfo:  Pointer to struct homa.
+ * homa_pacer_main() - Top-level function for a pacer thread.
+ * @arg:    Pointer to the struct homa_pacer for the thread's shard.
  *
  * Return:         Always 0.
  */
-int homa_pacer_main(void *transportInfo)
+int homa_pacer_main(void *arg)
 {
-	struct homa *homa = (struct homa *) transportInfo;
+	struct homa_pacer *pacer = (struct homa_pacer *) arg;
+	struct homa *homa = pacer->homa;
 
-	homa->pacer_wake_time = get_cycles();
+	pacer->wake_time = get_cycles();
 	while (1) {
 		if (homa->pacer_exit) {
-			homa->pacer_wake_time = 0;
+			pacer->wake_time = 0;
 			break;
 		}
-		homa_pacer_xmit(homa);
-
-		/* Sleep this thread if the throttled list is empty. Even
-		 * if the throttled list isn't empty, call the scheduler
-		 * to give other processes a chance to run (if we don't,
-		 * softirq handlers can get locked out, which prevents
-		 * incoming packets from being handled).
+		homa_pacer_xmit(pacer);
+
+		/* Sleep this thread if the throttled list is empty. If
+		 * the NIC queue is too long to transmit, sleep until it
+		 * has drained (rather than spinning). Otherwise call the
+		 * scheduler to give other processes a chance to run (if
+		 * we don't, softirq handlers can get locked out, which
+		 * prevents incoming packets from being handled).
 		 */
 		set_current_state(TASK_INTERRUPTIBLE);
-		if (list_first_or_null_rcu(&homa->throttled_rpcs,
+		if (list_first_or_null_rcu(&pacer->throttled_rpcs,
 				struct homa_rpc, throttled_links) == NULL)
-			tt_record("pacer sleeping");
-		else
+			tt_record1("pacer %d sleeping", pacer->index);
+		else if (!homa_pacer_arm_timer(pacer))
 			__set_current_state(TASK_RUNNING);
-		INC_METRIC(pacer_cycles, get_cycles() - homa->pacer_wake_time);
-		homa->pacer_wake_time = 0;
+		INC_METRIC(pacer_cycles, get_cycles() - pacer->wake_time);
+		pacer->wake_time = 0;
 		schedule();
-		homa->pacer_wake_time = get_cycles();
+		pacer->wake_time = get_cycles();
 		__set_current_state(TASK_RUNNING);
 	}
-	kthread_complete_and_exit(&homa_pacer_kthread_done, 0);
+	/* Only this thread arms the timer, so it can't be rearmed here. */
+	hrtimer_cancel(&pacer->timer);
+	kthread_complete_and_exit(&pacer->kthread_done, 0);
 	return 0;
 }
 
 /**
- * homa_pacer_xmit() - Transmit packets from  the throttled list. Note:
- * this function may be invoked from either process context or softirq (BH)
- * level. This function is invoked from multiple places, not just in the
- * pacer thread. The reason for this is that (as of 10/2019) Linux's scheduling
- * of the pacer thread is unpredictable: the thread may block for long periods
- * of time (e.g., because it is assigned to the same CPU as a busy interrupt
- * handler). This can result in poor utilization of the network link. So,
- * this method gets invoked from other places as well, to increase the
- * likelihood that we keep the link busy. Those other invocations are not
- * guaranteed to happen, so the pacer thread provides a backstop.
- * @homa:    Overall data about the Homa protocol implementation.
+ * homa_pacer_arm_timer() - If the NIC queue is currently too long for
+ * a pacer shard to transmit, arm the shard's hrtimer so that it will wake
+ * up the pacer thread when the queue has drained to the point where
+ * transmission can resume.
+ * @pacer:   Shard whose thread is about to sleep.
+ *
+ * Return:   True means the timer was armed, so the caller should sleep;
+ *           false means the NIC queue is already short enough.
  */
-void homa_pacer_xmit(struct homa *homa)
+bool homa_pacer_arm_timer(struct homa_pacer *pacer)
 {
+	struct homa *homa = pacer->homa;
+	__u64 idle_time, now, limit;
+
+	/* Must use the same limit as homa_pacer_xmit. */
+	limit = homa->max_nic_queue_cycles;
+	if (homa_pacer_outranked(pacer))
+		limit = limit/2;
+	now = get_cycles();
+	idle_time = atomic64_read(&homa->link_idle_time);
+	if ((now + limit) >= idle_time)
+		return false;
+	hrtimer_start(&pacer->timer,
+			ns_to_ktime(((idle_time - limit - now) * 1000000)
+			/ cpu_khz), HRTIMER_MODE_REL);
+	INC_METRIC(pacer_timer_sleeps, 1);
+	return true;
+}
+
+/**
+ * homa_pacer_timer() - This function is invoked by the hrtimer mechanism
+ * to wake up a pacer thread once the NIC queue has drained. Runs at
+ * IRQ level.
+ * @timer:   The timer that triggered; embedded in a struct homa_pacer.
+ *
+ * Return:   Always HRTIMER_NORESTART.
+ */
+enum hrtimer_restart homa_pacer_timer(struct hrtimer *timer)
+{
+	struct homa_pacer *pacer = container_of(timer, struct homa_pacer,
+			timer);
+
+	wake_up_process(pacer->kthread);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * homa_pacer_set_head() - Update the head_bytes hint for a pacer shard,
+ * along with its bit in homa->pacers_throttled. The caller must hold
+ * the shard's throttle lock.
+ * @pacer:   Shard whose throttled list may have changed.
+ */
+static void homa_pacer_set_head(struct homa_pacer *pacer)
+{
+	if (pacer->srpt_heap.root == NULL) {
+		WRITE_ONCE(pacer->head_bytes, INT_MAX);
+		clear_bit(pacer->index, &pacer->homa->pacers_throttled);
+		return;
+	}
+	WRITE_ONCE(pacer->head_bytes, pacer->srpt_heap.root->key);
+	if (!test_bit(pacer->index, &pacer->homa->pacers_throttled))
+		set_bit(pacer->index, &pacer->homa->pacers_throttled);
+}
+
+/**
+ * homa_pacer_outranked() - Determine whether some other pacer shard
+ * appears to have a throttled message with fewer bytes left to transmit
+ * than the first message in a given shard. The decision is based on
+ * head_bytes hints, which may be slightly out of date.
+ * @pacer:   Shard of interest.
+ * Return:   Nonzero if another shard has a shorter message.
+ */
+int homa_pacer_outranked(struct homa_pacer *pacer)
+{
+	struct homa *homa = pacer->homa;
+	unsigned long mask = READ_ONCE(homa->pacers_throttled)
+			& ~(1UL << pacer->index);
+	int bytes = READ_ONCE(pacer->head_bytes);
+	int i;
+
+	while (mask) {
+		i = __ffs(mask);
+		mask &= mask - 1;
+		if (READ_ONCE(homa->pacers[i].head_bytes) < bytes)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * homa_pacer_xmit() - Transmit packets from the throttled list of a pacer
+ * shard. Note: this function may be invoked from either process context or
+ * softirq (BH) level. This function is invoked from multiple places, not
+ * just in the pacer thread. The reason for this is that (as of 10/2019)
+ * Linux's scheduling of the pacer thread is unpredictable: the thread may
+ * block for long periods of time (e.g., because it is assigned to the same
+ * CPU as a busy interrupt handler). This can result in poor utilization of
+ * the network link. So, this method gets invoked from other places as well,
+ * to increase the likelihood that we keep the link busy. Those other
+ * invocations are not guaranteed to happen, so the pacer thread provides
+ * a backstop.
+ * @pacer:   Shard whose throttled RPCs should be transmitted.
+ */
+void homa_pacer_xmit(struct homa_pacer *pacer)
+{
+	struct homa *homa = pacer->homa;
 	struct homa_rpc *rpc;
+	bool outranked;
         int i;
 
 	/* Make sure only one instance of this function executes at a
-	 * time.
+	 * time for this shard.
 	 */
-	if (!spin_trylock_bh(&homa->pacer_mutex))
+	if (!spin_trylock_bh(&pacer->mutex))
 		return;
 
+	outranked = homa_pacer_outranked(pacer);
+
 	/* Each iteration through the following loop sends one packet. We
 	 * limit the number of passes through this loop in order to cap the
 	 * time spent in one call to this function (see note in
@@ -781,18 +1709,24 @@ void homa_pacer_xmit(struct homa *homa)
 	for (i = 0; i < 5; i++) {
 		__u64 idle_time, now;
 
-		/* If the NIC queue is too long, wait until it gets shorter. */
 		now = get_cycles();
 		idle_time = atomic64_read(&homa->link_idle_time);
-		while ((now + homa->max_nic_queue_cycles) < idle_time) {
-			/* If we've xmitted at least one packet then
-			 * return (this helps with testing and also
-			 * allows homa_pacer_main to yield the core).
-			 */
-			if (i != 0)
-				goto done;
-			now = get_cycles();
-		}
+
+		/* All of the shards share the link. If another shard has a
+		 * shorter message, let it have the NIC queue unless the
+		 * queue is getting short (this approximates SRPT across
+		 * shards without letting the link go idle).
+		 */
+		if (outranked && ((now + homa->max_nic_queue_cycles/2)
+				< idle_time))
+			goto done;
+
+		/* If the NIC queue is too long, return rather than
+		 * waiting; homa_pacer_main will sleep until the queue
+		 * gets shorter (see homa_pacer_arm_timer).
+		 */
+		if ((now + homa->max_nic_queue_cycles) < idle_time)
+			goto done;
 		/* Note: when we get here, it's possible that the NIC queue is
 		 * still too long because other threads have queued packets,
 		 * but we transmit anyway so we don't starve (see perf.text
@@ -807,35 +1741,26 @@ void homa_pacer_xmit(struct homa *homa)
 		 * throttle lock while locking the RPC is important because
 		 * it keeps the RPC from being deleted before it can be locked.
 		 */
-		homa_throttle_lock(homa);
-		homa->pacer_fifo_count -= homa->pacer_fifo_fraction;
-		if (homa->pacer_fifo_count <= 0) {
-			__u64 oldest = ~0;
-			struct homa_rpc *cur;
-
-			homa->pacer_fifo_count += 1000;
-			rpc = NULL;
-			list_for_each_entry_rcu(cur, &homa->throttled_rpcs,
-					throttled_links) {
-				if (cur->msgout.init_cycles < oldest) {
-					rpc = cur;
-					oldest = cur->msgout.init_cycles;
-				}
-			}
-		} else
-			rpc = list_first_or_null_rcu(&homa->throttled_rpcs,
-					struct homa_rpc, throttled_links);
-		if (rpc == NULL) {
-			homa_throttle_unlock(homa);
+		homa_throttle_lock(pacer);
+		if (pacer->srpt_heap.root == NULL) {
+			homa_throttle_unlock(pacer);
 			break;
 		}
+		pacer->fifo_count -= homa->pacer_fifo_fraction;
+		if (pacer->fifo_count <= 0) {
+			pacer->fifo_count += 1000;
+			rpc = container_of(pacer->fifo_heap.root,
+					struct homa_rpc, fifo_node);
+		} else
+			rpc = container_of(pacer->srpt_heap.root,
+					struct homa_rpc, srpt_node);
 		if (!homa_bucket_try_lock(rpc->bucket, rpc->id,
 				"homa_pacer_xmit")) {
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(pacer);
 			INC_METRIC(pacer_skipped_rpcs, 1);
 			break;
 		}
-		homa_throttle_unlock(homa);
+		homa_throttle_unlock(pacer);
 
 		tt_record4("pacer calling homa_xmit_data for rpc id %llu, "
 				"port %d, offset %d, bytes_left %d",
@@ -843,98 +1768,161 @@ void homa_pacer_xmit(struct homa *homa)
 				rpc->msgout.next_xmit_offset,
 				rpc->msgout.length - rpc->msgout.next_xmit_offset);
 		homa_xmit_data(rpc, true);
+		homa_throttle_lock(pacer);
+		if (list_empty(&rpc->throttled_links)) {
+			homa_throttle_unlock(pacer);
+			homa_rpc_unlock(rpc);
+			continue;
+		}
 		if (!*rpc->msgout.next_xmit || (rpc->msgout.next_xmit_offset
 				>= rpc->msgout.granted)) {
 			/* Nothing more to transmit from this message (right now),
 			 * so remove it from the throttled list.
 			 */
-			homa_throttle_lock(homa);
-			if (!list_empty(&rpc->throttled_links)) {
-				tt_record2("pacer removing id %d from "
-						"throttled list, offset %d",
-						rpc->id,
-						rpc->msgout.next_xmit_offset);
-				list_del_rcu(&rpc->throttled_links);
-				if (list_empty(&homa->throttled_rpcs))
-					INC_METRIC(throttled_cycles, get_cycles()
-							- homa->throttle_add);
-
-				/* Note: this reinitialization is only safe
-				 * because the pacer only looks at the first
-				 * element of the list, rather than traversing
-				 * it (and besides, we know the pacer isn't
-				 * active concurrently, since this code *is*
-				 * the pacer). It would not be safe under more
-				 * general usage patterns.
-				 */
-				INIT_LIST_HEAD_RCU(&rpc->throttled_links);
-			}
-			homa_throttle_unlock(homa);
+			tt_record2("pacer removing id %d from "
+					"throttled list, offset %d",
+					rpc->id,
+					rpc->msgout.next_xmit_offset);
+			list_del_rcu(&rpc->throttled_links);
+			homa_heap_remove(&pacer->srpt_heap, &rpc->srpt_node);
+			homa_heap_remove(&pacer->fifo_heap, &rpc->fifo_node);
+			if (list_empty(&pacer->throttled_rpcs))
+				INC_METRIC(throttled_cycles, get_cycles()
+						- pacer->throttle_add);
+
+			/* Note: this reinitialization is only safe
+			 * because the pacer never traverses the list
+			 * (and besides, we know the pacer isn't active
+			 * concurrently, since this code *is* the pacer).
+			 * It would not be safe under more general usage
+			 * patterns.
+			 */
+			INIT_LIST_HEAD_RCU(&rpc->throttled_links);
+		} else {
+			/* Bytes remaining only decrease, so the RPC can
+			 * only move closer to the front of the heap.
+			 */
+			homa_heap_decrease_key(&pacer->srpt_heap,
+					&rpc->srpt_node, rpc->msgout.length
+					- rpc->msgout.next_xmit_offset);
 		}
+		homa_pacer_set_head(pacer);
+		homa_throttle_unlock(pacer);
 		homa_rpc_unlock(rpc);
 	}
     done:
-	spin_unlock_bh(&homa->pacer_mutex);
+	spin_unlock_bh(&pacer->mutex);
 }
 
 /**
- * homa_pacer_stop() - Will cause the pacer thread to exit (waking it up
- * if necessary); doesn't return until after the pacer thread has exited.
+ * homa_pacer_start() - Make sure that each of the first @num_pacers pacer
+ * shards has a thread. Threads are created only when their shard is first
+ * used, and they run until homa_pacer_stop is invoked.
+ * @homa:        Overall data about the Homa protocol implementation.
+ * @num_pacers:  Number of shards that need threads; must not exceed
+ *               HOMA_MAX_PACERS.
+ *
+ * Return:  Either zero (for success) or a negative errno value.
+ */
+int homa_pacer_start(struct homa *homa, int num_pacers)
+{
+	struct task_struct *thread;
+	int i, err;
+
+	for (i = 0; i < num_pacers; i++) {
+		struct homa_pacer *pacer = &homa->pacers[i];
+
+		if (READ_ONCE(pacer->kthread))
+			continue;
+		thread = kthread_create(homa_pacer_main, pacer,
+				"homa_pacer%d", i);
+		if (IS_ERR(thread)) {
+			err = PTR_ERR(thread);
+			printk(KERN_ERR "couldn't create homa pacer thread: "
+					"error %d\n", err);
+			return err;
+		}
+
+		/* The thread for shard 0 may run anywhere (it is the only
+		 * one used by default). Other threads are spread across
+		 * the online cores; since the NIC's transmit queue is
+		 * normally chosen based on the sending core (XPS), this
+		 * also spreads the shards across transmit queues.
+		 */
+		if (i > 0)
+			kthread_bind(thread, cpumask_local_spread(
+					(i * nr_cpu_ids)/HOMA_MAX_PACERS,
+					NUMA_NO_NODE));
+
+		/* A concurrent sysctl write may have started this shard;
+		 * the thread hasn't run yet, so it can simply be stopped.
+		 */
+		if (cmpxchg(&pacer->kthread, NULL, thread) != NULL) {
+			kthread_stop(thread);
+			continue;
+		}
+		wake_up_process(thread);
+	}
+	return 0;
+}
+
+/**
+ * homa_pacer_stop() - Will cause all of the pacer threads to exit (waking
+ * them up if necessary); doesn't return until after the threads have
+ * exited.
  * @homa:    Overall data about the Homa protocol implementation.
  */
 void homa_pacer_stop(struct homa *homa)
 {
+	int i;
+
 	homa->pacer_exit = true;
-	wake_up_process(homa->pacer_kthread);
-	kthread_stop(homa->pacer_kthread);
-	homa->pacer_kthread = NULL;
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		struct homa_pacer *pacer = &homa->pacers[i];
+
+		if (!pacer->kthread)
+			continue;
+		wake_up_process(pacer->kthread);
+		kthread_stop(pacer->kthread);
+		wait_for_completion(&pacer->kthread_done);
+		pacer->kthread = NULL;
+	}
 }
 
 /**
  * homa_add_to_throttled() - Make sure that an RPC is on the throttled list
- * and wake up the pacer thread if necessary.
+ * of a pacer shard and wake up the shard's pacer thread if necessary.
+ * RPCs are assigned to shards based on their peer, so all of the
+ * throttled messages to a given peer are transmitted in SRPT order.
  * @rpc:     RPC with outbound packets that have been granted but can't be
  *           sent because of NIC queue restrictions.
  */
 void homa_add_to_throttled(struct homa_rpc *rpc)
 {
 	struct homa *homa = rpc->hsk->homa;
-	struct homa_rpc *candidate;
-	int bytes_left;
-	int checks = 0;
+	struct homa_pacer *pacer;
 	__u64 now;
 
 	if (!list_empty(&rpc->throttled_links)) {
 		return;
 	}
+	pacer = &homa->pacers[hash_32(rpc->peer->addr.in6_u.u6_addr32[3],
+			16) % READ_ONCE(homa->num_pacers)];
 	now = get_cycles();
-	if (!list_empty(&homa->throttled_rpcs))
-		INC_METRIC(throttled_cycles, now - homa->throttle_add);
-	homa->throttle_add = now;
-	bytes_left = rpc->msgout.length - rpc->msgout.next_xmit_offset;
-	homa_throttle_lock(homa);
-	list_for_each_entry_rcu(candidate, &homa->throttled_rpcs,
-			throttled_links) {
-		int bytes_left_cand;
-		checks++;
-
-		/* Watch out: the pacer might have just transmitted the last
-		 * packet from candidate.
-		 */
-		bytes_left_cand = candidate->msgout.length -
-				candidate->msgout.next_xmit_offset;
-		if (bytes_left_cand > bytes_left) {
-			list_add_tail_rcu(&rpc->throttled_links,
-					&candidate->throttled_links);
-			goto done;
-		}
-	}
-	list_add_tail_rcu(&rpc->throttled_links, &homa->throttled_rpcs);
-done:
-	homa_throttle_unlock(homa);
-	wake_up_process(homa->pacer_kthread);
+	if (!list_empty(&pacer->throttled_rpcs))
+		INC_METRIC(throttled_cycles, now - pacer->throttle_add);
+	pacer->throttle_add = now;
+	homa_throttle_lock(pacer);
+	rpc->pacer = pacer;
+	list_add_tail_rcu(&rpc->throttled_links, &pacer->throttled_rpcs);
+	homa_heap_insert(&pacer->srpt_heap, &rpc->srpt_node,
+			rpc->msgout.length - rpc->msgout.next_xmit_offset);
+	homa_heap_insert(&pacer->fifo_heap, &rpc->fifo_node,
+			rpc->msgout.init_cycles);
+	homa_pacer_set_head(pacer);
+	homa_throttle_unlock(pacer);
+	wake_up_process(pacer->kthread);
 	INC_METRIC(throttle_list_adds, 1);
-	INC_METRIC(throttle_list_checks, checks);
 //	tt_record("woke up pacer thread");
 }
 
@@ -945,46 +1933,58 @@ done:
  */
 void homa_remove_from_throttled(struct homa_rpc *rpc)
 {
+	struct homa_pacer *pacer = rpc->pacer;
+
 	if (unlikely(!list_empty(&rpc->throttled_links))) {
 		UNIT_LOG("; ", "removing id %llu from throttled list", rpc->id);
-		homa_throttle_lock(rpc->hsk->homa);
+		homa_throttle_lock(pacer);
 		list_del(&rpc->throttled_links);
-		if (list_empty(&rpc->hsk->homa->throttled_rpcs))
+		homa_heap_remove(&pacer->srpt_heap, &rpc->srpt_node);
+		homa_heap_remove(&pacer->fifo_heap, &rpc->fifo_node);
+		if (list_empty(&pacer->throttled_rpcs))
 			INC_METRIC(throttled_cycles, get_cycles()
-					- rpc->hsk->homa->throttle_add);
-		homa_throttle_unlock(rpc->hsk->homa);
+					- pacer->throttle_add);
+		homa_pacer_set_head(pacer);
+		homa_throttle_unlock(pacer);
 		INIT_LIST_HEAD(&rpc->throttled_links);
 	}
 }
 
 /**
  * homa_log_throttled() - Print information to the system log about the
- * RPCs on the throttled list.
+ * RPCs on the throttled lists of all pacer shards.
  * @homa:   Overall information about the Homa transport.
  */
 void homa_log_throttled(struct homa *homa)
 {
+	struct homa_pacer *pacer;
 	struct homa_rpc *rpc;
 	int rpcs = 0;
 	int64_t bytes = 0;
+	int i;
 
 	printk(KERN_NOTICE "Printing throttled list\n");
-	homa_throttle_lock(homa);
-	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
-		rpcs++;
-		if (!homa_bucket_try_lock(rpc->bucket, rpc->id,
-				"homa_log_throttled")) {
-			printk(KERN_NOTICE "Skipping throttled RPC: locked\n");
-			continue;
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		pacer = &homa->pacers[i];
+		homa_throttle_lock(pacer);
+		list_for_each_entry_rcu(rpc, &pacer->throttled_rpcs,
+				throttled_links) {
+			rpcs++;
+			if (!homa_bucket_try_lock(rpc->bucket, rpc->id,
+					"homa_log_throttled")) {
+				printk(KERN_NOTICE "Skipping throttled RPC: "
+						"locked\n");
+				continue;
+			}
+			if (*rpc->msgout.next_xmit != NULL)
+				bytes += rpc->msgout.length
+						- rpc->msgout.next_xmit_offset;
+			if (rpcs <= 20)
+				homa_rpc_log(rpc);
+			homa_rpc_unlock(rpc);
 		}
-		if (*rpc->msgout.next_xmit != NULL)
-			bytes += rpc->msgout.length
-					- rpc->msgout.next_xmit_offset;
-		if (rpcs <= 20)
-			homa_rpc_log(rpc);
-		homa_rpc_unlock(rpc);
+		homa_throttle_unlock(pacer);
 	}
-	homa_throttle_unlock(homa);
 	printk(KERN_NOTICE "Finished printing throttle list: %d rpcs, "
 			"%lld bytes\n", rpcs, bytes);
 }
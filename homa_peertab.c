@@ -192,9 +192,11 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-1] = 0;
 	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-2] = INT_MAX;
 	peer->cutoff_version = 0;
+	peer->unsched_bytes = 0;
 	peer->last_update_jiffies = 0;
 	INIT_LIST_HEAD(&peer->grantable_rpcs);
 	INIT_LIST_HEAD(&peer->grantable_links);
+	peer->grant_bucket = 0;
 	hlist_add_head_rcu(&peer->peertab_links, &peertab->buckets[bucket]);
 	peer->outstanding_resends = 0;
 	peer->most_recent_resend = 0;
@@ -205,6 +205,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "batch_grants",
+		.data		= &homa_data.batch_grants,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "bpage_lease_usecs",
 		.data		= &homa_data.bpage_lease_usecs,
@@ -212,6 +219,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "bql_feedback",
+		.data		= &homa_data.bql_feedback,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "busy_usecs",
 		.data		= &homa_data.busy_usecs,
@@ -219,6 +233,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "copy_helper_bytes",
+		.data		= &homa_data.copy_helper_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "cutoff_version",
 		.data		= &homa_data.cutoff_version,
@@ -234,8 +255,15 @@ static struct ctl_table homa_ctl_table[] = {
 		.proc_handler	= proc_dointvec
 	},
 	{
-		.procname	= "fifo_grant_increment",
-		.data		= &homa_data.fifo_grant_increment,
+		.procname	= "dynamic_overcommit",
+		.data		= &homa_data.dynamic_overcommit,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "fifo_grant_interval",
+		.data		= &homa_data.fifo_grant_interval,
 		.maxlen		= sizeof(int),
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
@@ -289,6 +317,27 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "incast_rpcs",
+		.data		= &homa_data.incast_rpcs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "incast_ticks",
+		.data		= &homa_data.incast_ticks,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "incast_unsched_bytes",
+		.data		= &homa_data.incast_unsched_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "link_mbps",
 		.data		= &homa_data.link_mbps,
@@ -366,6 +415,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "num_pacers",
+		.data		= &homa_data.num_pacers,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_sysctl_num_pacers
+	},
 	{
 		.procname	= "num_priorities",
 		.data		= &homa_data.num_priorities,
@@ -373,6 +429,27 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "overcommit_max",
+		.data		= &homa_data.overcommit_max,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "overcommit_min",
+		.data		= &homa_data.overcommit_min,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "overcommit_ticks",
+		.data		= &homa_data.overcommit_ticks,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "pacer_fifo_fraction",
 		.data		= &homa_data.pacer_fifo_fraction,
@@ -422,6 +499,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "skb_cache_size",
+		.data		= &homa_data.skb_cache_size,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "temp",
 		.data		= homa_data.temp,
@@ -478,20 +562,32 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "xmit_chunk_bytes",
+		.data		= &homa_data.xmit_chunk_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{}
 };
 
-/* Sizes of the headers for each Homa packet type, in bytes. */
+/* Minimum sizes of the headers for each Homa packet type, in bytes.
+ * CUTOFFS packets from peers running older versions of Homa don't
+ * include unsched_bytes, so they must be accepted without it (see
+ * homa_cutoffs_pkt).
+ */
 static __u16 header_lengths[] = {
 	sizeof32(struct data_header),
 	sizeof32(struct grant_header),
 	sizeof32(struct resend_header),
 	sizeof32(struct unknown_header),
 	sizeof32(struct busy_header),
-	sizeof32(struct cutoffs_header),
+	offsetof(struct cutoffs_header, unsched_bytes),
 	sizeof32(struct freeze_header),
 	sizeof32(struct need_ack_header),
-	sizeof32(struct ack_header)
+	sizeof32(struct ack_header),
+	sizeof32(struct multi_grant_header)
 };
 
 /* Used to remove sysctl values when the module is unloaded. */
@@ -800,7 +896,7 @@ int homa_socket(struct sock *sk)
 }
 
 /**
- * homa_setsockopt() - Implements the getsockopt system call for Homa sockets.
+ * homa_setsockopt() - Implements the setsockopt system call for Homa sockets.
  * @sk:      Socket on which the system call was invoked.
  * @level:   Level at which the operation should be handled; will always
  *           be IPPROTO_HOMA.
@@ -813,16 +909,58 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 		unsigned int optlen)
 {
 	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_return_ring *ring = NULL;
+	struct homa_set_send_buf_args send_args;
 	struct homa_set_buf_args args;
 	__u64 start = get_cycles();
+	struct homa_pool setup;
+	__u64 length;
+	int weight;
 	int ret;
 
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_GRANT_WEIGHT)) {
+		if (optlen != sizeof(weight))
+			return -EINVAL;
+		if (copy_from_sockptr(&weight, optval, sizeof(weight)))
+			return -EFAULT;
+		if ((weight < 1) || (weight > HOMA_MAX_GRANT_WEIGHT))
+			return -EINVAL;
+
+		/* Messages that are already being received keep their
+		 * existing weight (see homa_message_in_init).
+		 */
+		WRITE_ONCE(hsk->grant_weight, weight);
+		return 0;
+	}
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_SET_SEND_BUF)) {
+		if (optlen != sizeof(send_args))
+			return -EINVAL;
+		if (copy_from_sockptr(&send_args, optval, sizeof(send_args)))
+			return -EFAULT;
+		if (send_args._pad != 0)
+			return -EINVAL;
+		return homa_send_region_init(hsk,
+				(void __user *) send_args.start,
+				send_args.length, send_args.ring_entries);
+	}
+
+	/* Older applications don't know about the bpage_shift or flags
+	 * fields; they get the default behavior for those fields.
+	 */
 	if ((level != IPPROTO_HOMA) || (optname != SO_HOMA_SET_BUF)
-			|| (optlen != sizeof(struct homa_set_buf_args)))
+			|| ((optlen != sizeof(struct homa_set_buf_args))
+			&& (optlen != offsetof(struct homa_set_buf_args,
+			flags))
+			&& (optlen != offsetof(struct homa_set_buf_args,
+			bpage_shift))))
 		return -EINVAL;
 
+	memset(&args, 0, sizeof(args));
 	if (copy_from_sockptr(&args, optval, optlen))
 		return -EFAULT;
+	if (args.flags & ~HOMA_BUF_PIN)
+		return -EINVAL;
 
 	/* Do a trivial test to make sure we can at least write the first
 	 * page of the region.
@@ -830,9 +968,53 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 	if (copy_to_user(args.start, &args, sizeof(args)))
 		return -EFAULT;
 
-	homa_sock_lock(hsk, "homa_setsockopt SO_HOMA_SET_BUF");
-	ret = homa_pool_init(hsk, args.start, args.length);
-	homa_sock_unlock(hsk);
+	/* If there is a return ring, it occupies the end of the region. */
+	length = args.length;
+	if (args.ring_entries) {
+		if ((args.ring_entries > HOMA_MAX_RING_ENTRIES)
+				|| (args.ring_entries & (args.ring_entries - 1))
+				|| (args.length < sizeof(struct homa_return_ring)
+				+ args.ring_entries*sizeof(__u32)))
+			return -EINVAL;
+		ring = homa_return_ring_addr(args.start, args.length,
+				args.ring_entries);
+		if ((char *) ring < (char *) args.start)
+			return -EINVAL;
+		length = ((char *) ring) - ((char *) args.start);
+	}
+
+	/* The ring and pinned pages are set up in @setup, which no other
+	 * thread can see, and moved into the socket's pool just before it
+	 * is initialized (incoming messages can start using the pool as
+	 * soon as homa_pool_init returns). If anything fails, or the socket
+	 * already has a pool, only the resources created by this call are
+	 * released; an existing pool is never touched.
+	 */
+	memset(&setup, 0, sizeof(setup));
+	spin_lock_init(&setup.ring_lock);
+	ret = 0;
+	if (args.ring_entries)
+		ret = homa_pool_attach_ring(&setup, (void __user *) ring,
+				args.ring_entries);
+	if ((ret == 0) && (args.flags & HOMA_BUF_PIN))
+		ret = homa_pool_pin(&setup, args.start, length);
+	if (ret == 0) {
+		homa_sock_lock(hsk, "homa_setsockopt SO_HOMA_SET_BUF");
+		if (hsk->buffer_pool.region) {
+			ret = -EBUSY;
+		} else {
+			homa_pool_move_pins(&hsk->buffer_pool, &setup);
+			ret = homa_pool_init(hsk, args.start, length,
+					args.bpage_shift);
+			if (ret != 0)
+				homa_pool_move_pins(&setup, &hsk->buffer_pool);
+		}
+		homa_sock_unlock(hsk);
+	}
+
+	/* Unpinning can sleep, so it can't be done with the socket locked. */
+	homa_pool_destroy(&setup);
+
 	INC_METRIC(so_set_buf_calls, 1);
 	INC_METRIC(so_set_buf_cycles, get_cycles() - start);
 	return ret;
@@ -842,18 +1024,47 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 /**
  * homa_getsockopt() - Implements the getsockopt system call for Homa sockets.
  * @sk:      Socket on which the system call was invoked.
- * @level:   ??
- * @optname: Identifies a particular setsockopt operation.
+ * @level:   Level at which the operation should be handled; will always
+ *           be IPPROTO_HOMA.
+ * @optname: Identifies a particular getsockopt operation.
  * @optval:  Address in user space where the option's value should be stored.
- * @option:  ??.
+ * @optlen:  Address in user space of the number of bytes available at
+ *           @optval; updated to hold the number of bytes actually stored.
  * Return:   0 on success, otherwise a negative errno.
  */
 int homa_getsockopt(struct sock *sk, int level, int optname,
-    char __user *optval, int __user *option) {
-	printk(KERN_WARNING "unimplemented getsockopt invoked on Homa socket:"
-			" level %d, optname %d\n", level, optname);
-	return -EINVAL;
+    char __user *optval, int __user *optlen) {
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_buf_stats stats;
+	int len, result_len, weight;
+	void *result;
+
+	if ((level == IPPROTO_HOMA) && (optname == SO_HOMA_BUF_STATS)) {
+		homa_pool_get_stats(&hsk->buffer_pool, &stats);
+		result = &stats;
+		result_len = sizeof(stats);
+	} else if ((level == IPPROTO_HOMA)
+			&& (optname == SO_HOMA_GRANT_WEIGHT)) {
+		weight = READ_ONCE(hsk->grant_weight);
+		result = &weight;
+		result_len = sizeof(weight);
+	} else {
+		printk(KERN_WARNING "unimplemented getsockopt invoked on "
+				"Homa socket: level %d, optname %d\n", level,
+				optname);
+		return -EINVAL;
+	}
+	if (copy_from_user(&len, optlen, sizeof(len)))
+		return -EFAULT;
+	if (len < result_len)
+		return -EINVAL;
 
+	len = result_len;
+	if (copy_to_user(optval, result, len))
+		return -EFAULT;
+	if (copy_to_user(optlen, &len, sizeof(len)))
+		return -EFAULT;
+	return 0;
 }
 
 /**
@@ -872,6 +1083,7 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 	int result = 0;
 	struct homa_rpc *rpc = NULL;
 	sockaddr_in_union *addr = (sockaddr_in_union *) msg->msg_name;
+	int out_flags = HOMA_OUT_XMIT;
 
 	homa_cores[raw_smp_processor_id()]->last_app_active = start;
 	if (unlikely(!msg->msg_control_is_user)) {
@@ -884,6 +1096,17 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 		result = -EFAULT;
 		goto error;
 	}
+	if (msg->msg_flags & MSG_ZEROCOPY) {
+		/* Messages in the socket's send region are transmitted from
+		 * its (already pinned) pages; others have their pages pinned
+		 * here.
+		 */
+		if (homa_send_region_find(&hsk->send_region,
+				&msg->msg_iter) >= 0)
+			out_flags |= HOMA_OUT_REGION;
+		else
+			out_flags |= HOMA_OUT_ZEROCOPY;
+	}
 	if (addr->in6.sin6_family != sk->sk_family) {
 		result = -EAFNOSUPPORT;
 		goto error;
@@ -914,7 +1137,7 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 			goto error;
 		}
 		rpc->completion_cookie = args.completion_cookie;
-		result = homa_message_out_init(rpc, &msg->msg_iter, 1);
+		result = homa_message_out_init(rpc, &msg->msg_iter, out_flags);
 		if (result)
 			goto error;
 		args.id = rpc->id;
@@ -969,7 +1192,7 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
 		}
 		rpc->state = RPC_OUTGOING;
 
-		result = homa_message_out_init(rpc, &msg->msg_iter, 1);
+		result = homa_message_out_init(rpc, &msg->msg_iter, out_flags);
 		if (result && (rpc->state != RPC_DEAD))
 			goto error;
 		homa_rpc_unlock(rpc);
@@ -995,7 +1218,8 @@ error:
  * @sk:          Socket on which the system call was invoked.
  * @msg:         Controlling information for the receive.
  * @len:         Total bytes of space available in msg->msg_iov; not used.
- * @flags:       Flags from system call, not including MSG_DONTWAIT; ignored.
+ * @flags:       Flags from system call, not including MSG_DONTWAIT; only
+ *               MSG_ERRQUEUE is used.
  * @addr_len:    Store the length of the sender address here
  * Return:       The length of the message on success, otherwise a negative
  *               errno.
@@ -1012,6 +1236,12 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 
 	INC_METRIC(recv_calls, 1);
 	homa_cores[raw_smp_processor_id()]->last_app_active = start;
+	if (unlikely(flags & MSG_ERRQUEUE)) {
+		/* Zero-copy completion notifications (the caller supplies
+		 * its own control buffer for these).
+		 */
+		return inet_recv_error(sk, msg, len, addr_len);
+	}
 	if (unlikely(!msg->msg_control)) {
 		/* This test isn't strictly necessary, but it provides a
 		 * hook for testing kernel call times.
@@ -1040,6 +1270,8 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		result = -EINVAL;
 		goto done;
 	}
+	homa_pool_learn_nodes(&hsk->buffer_pool, control.num_bpages,
+			control.bpage_offsets);
 	homa_pool_release_buffers(&hsk->buffer_pool, control.num_bpages,
 			control.bpage_offsets);
 	control.num_bpages = 0;
@@ -1135,7 +1367,7 @@ done:
 	finish = get_cycles();
 	tt_record3("homa_recvmsg returning id %d, length %d, bpage0 %d",
 			control.id, result,
-			control.bpage_offsets[0] >> HOMA_BPAGE_SHIFT);
+			control.bpage_offsets[0] >> hsk->buffer_pool.bpage_shift);
 	INC_METRIC(recv_cycles, finish - start);
 	return result;
 }
@@ -1235,6 +1467,7 @@ int homa_v4_early_demux_handler(struct sk_buff *skb) {
  * Return: Always 0
  */
 int homa_softirq(struct sk_buff *skb) {
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
 	struct common_header *h;
 	struct sk_buff *packets, *other_pkts, *next;
 	struct sk_buff **prev_link, **other_link;
@@ -1246,7 +1479,7 @@ int homa_softirq(struct sk_buff *skb) {
 
 	start = get_cycles();
 	INC_METRIC(softirq_calls, 1);
-	homa_cores[raw_smp_processor_id()]->last_active = start;
+	core->last_active = start;
 	if ((start - last) > 1000000) {
 		int scaled_ms = (int) (10*(start-last)/cpu_khz);
 		if ((scaled_ms >= 50) && (scaled_ms < 10000)) {
@@ -1261,6 +1494,11 @@ int homa_softirq(struct sk_buff *skb) {
 	}
 	last = start;
 
+	/* Grants generated while processing this batch will be sent at the
+	 * end, so that grants for the same peer can be combined.
+	 */
+	core->defer_grants = homa->batch_grants;
+
 	/* skb may actually contain many distinct packets, linked through
 	 * skb_shinfo(skb)->frag_list by the Homa GRO mechanism. Make a
 	 * pass through the list to process all of the short packets,
@@ -1393,7 +1631,9 @@ int homa_softirq(struct sk_buff *skb) {
 		packets = other_pkts;
 	}
 
-	atomic_dec(&homa_cores[raw_smp_processor_id()]->softirq_backlog);
+	homa_grant_flush(core);
+	core->defer_grants = 0;
+	atomic_dec(&core->softirq_backlog);
 	INC_METRIC(softirq_cycles, get_cycles() - start);
 	return 0;
 }
@@ -1518,6 +1758,8 @@ __poll_t homa_poll(struct file *file, struct socket *sock,
 	if (!list_empty(&homa_sk(sk)->ready_requests) ||
 			!list_empty(&homa_sk(sk)->ready_responses))
 		mask |= POLLIN | POLLRDNORM;
+	if (!skb_queue_empty_lockless(&sk->sk_error_queue))
+		mask |= POLLERR;
 	return mask;
 }
 
@@ -1620,6 +1862,7 @@ int homa_metrics_release(struct inode *inode, struct file *file)
 int homa_dointvec(struct ctl_table *table, int write,
 		void __user *buffer, size_t *lenp, loff_t *ppos)
 {
+	int overcommit = READ_ONCE(homa->overcommit_current);
 	int result;
 	result = proc_dointvec(table, write, buffer, lenp, ppos);
 	if (write) {
@@ -1629,6 +1872,13 @@ int homa_dointvec(struct ctl_table *table, int write,
 		homa_incoming_sysctl_changed(homa);
 		homa_outgoing_sysctl_changed(homa);
 
+		/* New messages may have been staged based on the old
+		 * overcommit_current (see homa_grant_check_rpc); recalculate
+		 * so they are reconsidered right away.
+		 */
+		if (READ_ONCE(homa->overcommit_current) != overcommit)
+			homa_grant_recalc(homa, 0);
+
 		/* For this value, only call the method when this
 		 * particular value was written (don't want to increment
 		 * cutoff_version otherwise).
@@ -1681,6 +1931,45 @@ int homa_dointvec(struct ctl_table *table, int write,
 	return result;
 }
 
+/**
+ * homa_sysctl_num_pacers() - This function is invoked to handle sysctl
+ * requests for the "num_pacers" target. A shard must have a thread before
+ * homa->num_pacers covers it (see homa_add_to_throttled), so the new value
+ * is parsed into a local variable and published only after the threads
+ * have been created.
+ * @table:    sysctl table describing value to be read or written.
+ * @write:    Nonzero means value is being written, 0 means read.
+ * @buffer:   Address in user space of the input/output data.
+ * @lenp:     Not exactly sure.
+ * @ppos:     Not exactly sure.
+ *
+ * Return: 0 for success, nonzero for error.
+ */
+int homa_sysctl_num_pacers(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct ctl_table table_copy;
+	int result, num_pacers;
+
+	if (!write)
+		return proc_dointvec(table, write, buffer, lenp, ppos);
+	num_pacers = homa->num_pacers;
+	table_copy = *table;
+	table_copy.data = &num_pacers;
+	result = proc_dointvec(&table_copy, write, buffer, lenp, ppos);
+	if (result != 0)
+		return result;
+	if (num_pacers < 1)
+		num_pacers = 1;
+	if (num_pacers > HOMA_MAX_PACERS)
+		num_pacers = HOMA_MAX_PACERS;
+	result = homa_pacer_start(homa, num_pacers);
+	if (result != 0)
+		return result;
+	WRITE_ONCE(homa->num_pacers, num_pacers);
+	return 0;
+}
+
 /**
  * homa_sysctl_softirq_cores() - This function is invoked to handle sysctl
  * requests for the "gen3_softirq_cores" target, which requires special
@@ -12,50 +12,95 @@
 /* Used when determining how many bpages to consider for allocation. */
 #define MIN_EXTRA 4
 
-/* When running unit tests, allow HOMA_BPAGE_SIZE and HOMA_BPAGE_SHIFT
- * to be overriden.
+/* Number of return ring entries passed to homa_pool_release_buffers
+ * in each call.
  */
-#ifdef __UNIT_TEST__
-#include "mock.h"
-#undef HOMA_BPAGE_SIZE
-#define HOMA_BPAGE_SIZE mock_bpage_size
-#undef HOMA_BPAGE_SHIFT
-#define HOMA_BPAGE_SHIFT mock_bpage_shift
-#endif
+#define RING_BATCH 16
+
+/* Upper limits (in bytes) on the partial-bpage sizes that are allocated
+ * in each size class, except the last class, which handles all sizes
+ * larger than the last limit here. Small messages are packed densely in
+ * bpages of their own, so a bpage full of small allocations isn't given
+ * up just because a larger fragment doesn't fit.
+ */
+static const int class_limits[HOMA_POOL_NUM_CLASSES-1] = {
+	64, 256, 1024, 4096, 16384};
+
+/* Returns the number of bytes in each bpage of a pool. */
+#define BPAGE_SIZE(pool) (1 << (pool)->bpage_shift)
 
 /**
- * set_bpages_needed() - Set the bpages_needed field of @pool based
- * on the length of the first RPC that's waiting for buffer space.
- * The caller must own the lock for @pool->hsk.
+ * homa_pool_map() - Return the free map for bpages on a given NUMA node.
+ * @pool:    Pool containing the free maps.
+ * @node:    NUMA node of interest; a value outside the range of known nodes
+ *           (such as -1) selects the map for bpages whose node isn't known.
+ * Return:   The first word of the desired map.
  */
-static void inline set_bpages_needed(struct homa_pool *pool) {
-	struct homa_rpc *rpc = list_first_entry(&pool->hsk->waiting_for_bufs,
-			struct homa_rpc, buf_links);
-	pool->bpages_needed = (rpc->msgin.length + HOMA_BPAGE_SIZE - 1)
-			>> HOMA_BPAGE_SHIFT;
+static inline unsigned long *homa_pool_map(struct homa_pool *pool, int node)
+{
+	int map = ((node >= 0) && (node < pool->num_nodes)) ? node
+			: pool->num_maps - 1;
+
+	return pool->free_map + map*pool->num_map_words;
+}
+
+/**
+ * homa_pool_page_node() - Find the NUMA node where a page of user memory
+ * resides.
+ * @addr:    User-space address within the page; must be in the address
+ *           space of the current process.
+ * Return:   The NUMA node containing the page, or -1 if the page isn't
+ *           currently mapped (it won't be faulted in here).
+ */
+static int homa_pool_page_node(void *addr)
+{
+	struct page *page;
+	int node;
+
+	if (get_user_pages_fast_only((unsigned long) addr, 1, 0, &page) != 1)
+		return -1;
+	node = page_to_nid(page);
+	put_page(page);
+	return node;
 }
 
 /**
  * homa_pool_init() - Initialize a homa_pool; any previous contents of the
- * objects are overwritten.
+ * objects are overwritten, except for the return ring and pinned pages
+ * (see homa_pool_attach_ring, homa_pool_pin, and homa_pool_move_pins),
+ * which must be set up before the pool is initialized, since incoming
+ * messages can use the pool as soon as this function returns.
  * @hsk:          Socket containing the pool to initialize.
  * @region:       First byte of the memory region for the pool, allocated
  *                by the application; must be page-aligned.
- * @region_size   Total number of bytes available at @buf_region.
+ * @region_size:  Total number of bytes available at @buf_region.
+ * @bpage_shift:  Log base 2 of the number of bytes in each bpage; 0 means
+ *                use HOMA_BPAGE_SHIFT.
  * Return: Either zero (for success) or a negative errno for failure.
  */
-int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
+int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size,
+		int bpage_shift)
 {
 	int i, result;
 	struct homa_pool *pool = &hsk->buffer_pool;
 
 	if (((__u64) region) & ~PAGE_MASK)
 		return -EINVAL;
+	if (bpage_shift == 0)
+		bpage_shift = HOMA_BPAGE_SHIFT;
+	if ((bpage_shift < HOMA_BPAGE_SHIFT)
+			|| (bpage_shift > HOMA_MAX_BPAGE_SHIFT))
+		return -EINVAL;
 	pool->hsk = hsk;
 	pool->region = (char *) region;
-	pool->num_bpages = region_size >> HOMA_BPAGE_SHIFT;
+	pool->bpage_shift = bpage_shift;
+	pool->num_bpages = region_size >> bpage_shift;
 	pool->descriptors = NULL;
 	pool->cores = NULL;
+	pool->free_map = NULL;
+	pool->num_nodes = nr_node_ids;
+	pool->num_maps = (pool->num_nodes > 1) ? pool->num_nodes + 1 : 1;
+	pool->copy_node = -1;
 	if (pool->num_bpages < MIN_POOL_SIZE) {
 		result = -EINVAL;
 		goto error;
@@ -72,10 +117,15 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 		spin_lock_init(&bp->lock);
 		atomic_set(&bp->refs, 0);
 		bp->owner = -1;
+		bp->size_class = 0;
 		bp->expiration = 0;
+		bp->node = -1;
 	}
 	atomic_set(&pool->free_bpages, pool->num_bpages);
 	pool->bpages_needed = INT_MAX;
+	pool->partial_rpc = NULL;
+	pool->reserved = 0;
+	pool->check_waiting_needed = 0;
 
 	/* Allocate and initialize core-specific data. */
 	pool->cores = (struct homa_pool_core *) kmalloc(nr_cpu_ids *
@@ -86,12 +136,45 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 	}
 	pool->num_cores = nr_cpu_ids;
 	for (i = 0; i < pool->num_cores; i++) {
-		pool->cores[i].page_hint = 0;
-		pool->cores[i].allocated = 0;
+		int j;
+
+		spin_lock_init(&pool->cores[i].cache_lock);
 		pool->cores[i].next_candidate = 0;
+		pool->cores[i].num_cached = 0;
+		pool->cores[i].node = cpu_to_node(i);
+		for (j = 0; j < HOMA_POOL_NUM_CLASSES; j++) {
+			pool->cores[i].classes[j].page_hint = 0;
+			pool->cores[i].classes[j].allocated = 0;
+		}
+		memset(&pool->cores[i].stats, 0, sizeof(pool->cores[i].stats));
 	}
 	pool->check_waiting_invoked = 0;
 
+	/* Initially all bpages are free. On NUMA machines, find out where
+	 * each bpage lives so it can go in the right map. Pages that the
+	 * application hasn't touched yet have no node; they go in the
+	 * last map and their nodes are learned later, once data has been
+	 * written to them (see homa_pool_learn_nodes).
+	 */
+	pool->num_map_words = BITS_TO_LONGS(pool->num_bpages);
+	pool->free_map = (unsigned long *) kmalloc(pool->num_maps
+			* pool->num_map_words * sizeof(unsigned long),
+			GFP_ATOMIC);
+	if (!pool->free_map) {
+		result = -ENOMEM;
+		goto error;
+	}
+	memset(pool->free_map, 0, pool->num_maps * pool->num_map_words
+			* sizeof(unsigned long));
+	for (i = 0; i < pool->num_bpages; i++) {
+		struct homa_bpage *bp = &pool->descriptors[i];
+
+		if (pool->num_maps > 1)
+			bp->node = homa_pool_page_node(pool->region
+					+ (((__u64) i) << bpage_shift));
+		__set_bit(i, homa_pool_map(pool, bp->node));
+	}
+
 	return 0;
 
 	error:
@@ -103,6 +186,156 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
 	return result;
 }
 
+/**
+ * homa_pool_pin_range() - Pin a range of pages in the current process's
+ * address space, so that they can later be accessed without going through
+ * user addresses. The pages are charged to the process's locked memory
+ * (so they are subject to RLIMIT_MEMLOCK unless the process has
+ * CAP_IPC_LOCK), as for other long-term pins such as io_uring's registered
+ * buffers. Must not be invoked with any spinlocks held.
+ * @start:      Application's address for the first page; must be
+ *              page-aligned.
+ * @num_pages:  Number of pages to pin.
+ * @gup_flags:  Flags to pass to pin_user_pages_fast (FOLL_LONGTERM is
+ *              always added).
+ * @mmp:        The mm_struct that the pages were charged to is stored
+ *              here, with a reference held; it must be passed to
+ *              homa_pool_unpin_range when the pages are released.
+ * Return:      A vmalloc-ed array of the pinned pages, in order (it must
+ *              eventually be released with homa_pool_unpin_range), or an
+ *              ERR_PTR value if the range couldn't be pinned. -ENOMEM
+ *              means either there wasn't enough memory or the pages
+ *              would exceed the process's locked memory limit.
+ */
+static struct page **homa_pool_pin_range(unsigned long start, int num_pages,
+		unsigned int gup_flags, struct mm_struct **mmp)
+{
+	struct mm_struct *mm = current->mm;
+	struct page **pages;
+	int pinned = 0;
+	int result, n;
+
+	result = account_locked_vm(mm, num_pages, true);
+	if (result != 0)
+		return ERR_PTR(result);
+	pages = (struct page **) vmalloc(num_pages * sizeof(*pages));
+	if (!pages) {
+		result = -ENOMEM;
+		goto error;
+	}
+
+	/* pin_user_pages_fast may pin fewer pages than requested, so
+	 * keep going until the whole range is pinned.
+	 */
+	while (pinned < num_pages) {
+		n = pin_user_pages_fast(start
+				+ (((unsigned long) pinned) << PAGE_SHIFT),
+				num_pages - pinned, gup_flags | FOLL_LONGTERM,
+				pages + pinned);
+		if (n <= 0) {
+			result = (n < 0) ? n : -EFAULT;
+			goto error;
+		}
+		pinned += n;
+	}
+
+	/* The charge must eventually be undone against this mm, even if
+	 * the pages are released by a different process (or after this
+	 * one has exited).
+	 */
+	mmgrab(mm);
+	*mmp = mm;
+	return pages;
+
+	error:
+	if (pinned > 0)
+		unpin_user_pages(pages, pinned);
+	if (pages)
+		vfree(pages);
+	account_locked_vm(mm, num_pages, false);
+	return ERR_PTR(result);
+}
+
+/**
+ * homa_pool_unpin_range() - Release the pages pinned by homa_pool_pin_range
+ * and undo their locked-memory charge. Must not be invoked with any
+ * spinlocks held.
+ * @pages:      Array returned by homa_pool_pin_range; it is freed here.
+ * @num_pages:  Number of entries in @pages.
+ * @mm:         The mm_struct returned by homa_pool_pin_range; its
+ *              reference is released here.
+ * @dirty:      True means Homa may have written to the pages, so they
+ *              must be marked dirty.
+ */
+static void homa_pool_unpin_range(struct page **pages, int num_pages,
+		struct mm_struct *mm, bool dirty)
+{
+	if (dirty)
+		unpin_user_pages_dirty_lock(pages, num_pages, true);
+	else
+		unpin_user_pages(pages, num_pages);
+	vfree(pages);
+	account_locked_vm(mm, num_pages, false);
+	mmdrop(mm);
+}
+
+/**
+ * homa_pool_map_user() - Pin a range of the current process's memory and
+ * map it into the kernel's address space, so that it can be accessed from
+ * any context (used for rings shared with the application). The pages are
+ * charged to the process's locked memory, as in homa_pool_pin_range. Must
+ * not be invoked with any spinlocks held.
+ * @addr:       Application's address for the first byte of the range.
+ * @size:       Number of bytes in the range.
+ * @pagesp:     A vmalloc-ed array of the pinned pages is stored here; it
+ *              must eventually be released with homa_pool_unmap_user.
+ * @num_pagesp: The number of entries in *@pagesp is stored here.
+ * @mmp:        The mm_struct that the pages were charged to is stored
+ *              here; it must be passed to homa_pool_unmap_user.
+ * Return:      The kernel address corresponding to @addr, or an ERR_PTR
+ *              value if the range couldn't be pinned or mapped.
+ */
+static void *homa_pool_map_user(void __user *addr, size_t size,
+		struct page ***pagesp, int *num_pagesp,
+		struct mm_struct **mmp)
+{
+	unsigned long first = ((unsigned long) addr) & PAGE_MASK;
+	unsigned long end = ((unsigned long) addr) + size;
+	int num_pages = (end - first + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	struct mm_struct *mm;
+	struct page **pages;
+	void *mapping;
+
+	pages = homa_pool_pin_range(first, num_pages, FOLL_WRITE, &mm);
+	if (IS_ERR(pages))
+		return pages;
+	mapping = vmap(pages, num_pages, VM_MAP, PAGE_KERNEL);
+	if (!mapping) {
+		homa_pool_unpin_range(pages, num_pages, mm, false);
+		return ERR_PTR(-ENOMEM);
+	}
+	*pagesp = pages;
+	*num_pagesp = num_pages;
+	*mmp = mm;
+	return mapping + (((unsigned long) addr) - first);
+}
+
+/**
+ * homa_pool_unmap_user() - Release the resources allocated by
+ * homa_pool_map_user.
+ * @kaddr:      Kernel address returned by homa_pool_map_user.
+ * @pages:      Array of pinned pages returned by homa_pool_map_user;
+ *              it is freed here.
+ * @num_pages:  Number of entries in @pages.
+ * @mm:         The mm_struct returned by homa_pool_map_user.
+ */
+static void homa_pool_unmap_user(void *kaddr, struct page **pages,
+		int num_pages, struct mm_struct *mm)
+{
+	vunmap((void *) (((unsigned long) kaddr) & PAGE_MASK));
+	homa_pool_unpin_range(pages, num_pages, mm, true);
+}
+
 /**
  * homa_pool_destroy() - Destructor for homa_pool. After this method
  * returns, the object should not be used unless it has been reinitialized.
@@ -110,13 +343,449 @@ int homa_pool_init(struct homa_sock *hsk, void *region, __u64 region_size)
  */
 void homa_pool_destroy(struct homa_pool *pool)
 {
+	struct homa_return_ring *ring;
+
+	/* The ring and pinned pages are released even if the pool was never
+	 * initialized (homa_pool_init may have failed after they were set
+	 * up).
+	 */
+
+	/* Once the ring pointer has been cleared (with the lock held), no
+	 * one else can be accessing the ring, so it's safe to unmap it.
+	 */
+	spin_lock_bh(&pool->ring_lock);
+	ring = pool->ring;
+	pool->ring = NULL;
+	spin_unlock_bh(&pool->ring_lock);
+	if (ring) {
+		homa_pool_unmap_user(ring, pool->ring_pages,
+				pool->ring_num_pages, pool->ring_mm);
+		pool->ring_pages = NULL;
+		pool->ring_mm = NULL;
+	}
+	if (pool->pinned_pages) {
+		homa_pool_unpin_range(pool->pinned_pages, pool->num_pinned,
+				pool->pinned_mm, true);
+		pool->pinned_pages = NULL;
+		pool->num_pinned = 0;
+		pool->pinned_mm = NULL;
+	}
+
 	if (!pool->region)
 		return;
 	kfree(pool->descriptors);
 	kfree(pool->cores);
+	kfree(pool->free_map);
 	pool->region = NULL;
 }
 
+/**
+ * homa_pool_attach_ring() - Arrange for the application to return bpages
+ * to a pool through a struct homa_return_ring. Must be invoked in the
+ * context of the application's process, without holding any spinlocks
+ * (the ring is pinned in memory and mapped into the kernel, so it can
+ * later be accessed from any context).
+ * @pool:     Pool that will receive the returned bpages; normally it
+ *            hasn't yet been initialized with homa_pool_init.
+ * @ring:     Application's address for the ring.
+ * @entries:  Number of entries in the ring's offsets array; must be a
+ *            power of 2.
+ * Return:    Either zero (for success) or a negative errno for failure.
+ */
+int homa_pool_attach_ring(struct homa_pool *pool, void __user *ring,
+		int entries)
+{
+	struct homa_return_ring *kring;
+	struct mm_struct *mm;
+	struct page **pages;
+	int num_pages;
+
+	kring = homa_pool_map_user(ring, sizeof(struct homa_return_ring)
+			+ entries*sizeof(__u32), &pages, &num_pages, &mm);
+	if (IS_ERR(kring))
+		return PTR_ERR(kring);
+	WRITE_ONCE(kring->head, 0);
+	WRITE_ONCE(kring->tail, 0);
+	WRITE_ONCE(kring->size, entries);
+	pool->ring_entries = entries;
+	pool->ring_tail = 0;
+	pool->ring_pages = pages;
+	pool->ring_num_pages = num_pages;
+	pool->ring_mm = mm;
+	spin_lock_bh(&pool->ring_lock);
+	pool->ring = kring;
+	spin_unlock_bh(&pool->ring_lock);
+	return 0;
+}
+
+/**
+ * homa_pool_pin() - Pin all of the pages in a pool's region, so that
+ * homa_pool_copy_pinned can be used to copy data into the region. Must be
+ * invoked in the context of the application's process, without holding
+ * any spinlocks.
+ * @pool:     Pool whose region should be pinned; normally it hasn't yet
+ *            been initialized with homa_pool_init.
+ * @region:   First byte of the pool's region; must be page-aligned.
+ * @length:   Number of bytes in the region (any partial page at the end
+ *            is not pinned).
+ * Return:    Either zero (for success) or a negative errno for failure;
+ *            -ENOMEM means the region would exceed the application's
+ *            locked memory limit (RLIMIT_MEMLOCK).
+ */
+int homa_pool_pin(struct homa_pool *pool, void __user *region, __u64 length)
+{
+	int num_pages = length >> PAGE_SHIFT;
+	struct page **pages;
+
+	struct mm_struct *mm;
+
+	pages = homa_pool_pin_range((unsigned long) region, num_pages,
+			FOLL_WRITE, &mm);
+	if (IS_ERR(pages))
+		return PTR_ERR(pages);
+	pool->num_pinned = num_pages;
+	pool->pinned_pages = pages;
+	pool->pinned_mm = mm;
+	return 0;
+}
+
+/**
+ * homa_pool_move_pins() - Transfer the return ring and pinned pages (if
+ * any) from one pool to another. This allows SO_HOMA_SET_BUF to set them
+ * up in a private pool, where a failure can't affect a pool that is in use.
+ * @dst:   Pool that will own the ring and pinned pages; it must not
+ *         currently have either. If it has been initialized, the caller
+ *         must hold its socket's lock.
+ * @src:   Pool that currently owns the ring and pinned pages; it must not
+ *         be visible to any other thread (or it must be uninitialized and
+ *         its socket's lock must be held). On return it has neither.
+ */
+void homa_pool_move_pins(struct homa_pool *dst, struct homa_pool *src)
+{
+	struct homa_return_ring *ring;
+
+	dst->ring_entries = src->ring_entries;
+	dst->ring_tail = src->ring_tail;
+	dst->ring_pages = src->ring_pages;
+	dst->ring_num_pages = src->ring_num_pages;
+	dst->ring_mm = src->ring_mm;
+	dst->pinned_pages = src->pinned_pages;
+	dst->num_pinned = src->num_pinned;
+	dst->pinned_mm = src->pinned_mm;
+
+	spin_lock_bh(&src->ring_lock);
+	ring = src->ring;
+	src->ring = NULL;
+	spin_unlock_bh(&src->ring_lock);
+	spin_lock_bh(&dst->ring_lock);
+	dst->ring = ring;
+	spin_unlock_bh(&dst->ring_lock);
+
+	src->ring_pages = NULL;
+	src->ring_num_pages = 0;
+	src->ring_mm = NULL;
+	src->pinned_pages = NULL;
+	src->num_pinned = 0;
+	src->pinned_mm = NULL;
+}
+
+/**
+ * homa_pool_copy_pinned() - Copy data from an incoming packet into a
+ * pool's region through the kernel mappings of the region's pinned pages
+ * (this is faster than copying to the user address, and it can't fault).
+ * Consecutive pages are copied together if they are contiguous in the
+ * kernel's address space (e.g. they are part of the same hugepage).
+ * @pool:     Pool containing the destination; its region must be pinned
+ *            (pool->pinned_pages must be non-NULL).
+ * @skb:      Packet containing the data.
+ * @offset:   Offset within @skb of the first byte to copy.
+ * @dst:      User address of the destination; must lie within the
+ *            pool's region, as must the @length bytes after it.
+ * @length:   Number of bytes to copy.
+ * Return:    Either zero (for success) or a negative errno for failure.
+ */
+int homa_pool_copy_pinned(struct homa_pool *pool, struct sk_buff *skb,
+		int offset, void __user *dst, int length)
+{
+	__u64 region_offset = ((char __user *) dst) - pool->region;
+	int index = region_offset >> PAGE_SHIFT;
+	int page_offset = region_offset & (PAGE_SIZE - 1);
+	int chunk, err;
+	char *kdst;
+
+	while (length > 0) {
+		kdst = page_address(pool->pinned_pages[index]) + page_offset;
+		chunk = PAGE_SIZE - page_offset;
+		index++;
+		while ((chunk < length) && (index < pool->num_pinned)
+				&& (page_address(pool->pinned_pages[index])
+				== kdst + chunk)) {
+			chunk += PAGE_SIZE;
+			index++;
+		}
+		if (chunk > length)
+			chunk = length;
+		err = skb_copy_bits(skb, offset, kdst, chunk);
+		if (err)
+			return err;
+		offset += chunk;
+		length -= chunk;
+		page_offset = 0;
+	}
+	return 0;
+}
+
+/**
+ * homa_pool_drain_ring() - Release all of the bpages that the application
+ * has added to a pool's return ring. The caller must eventually invoke
+ * homa_pool_check_waiting, as for homa_pool_release_buffers.
+ * @pool:    Pool whose ring should be drained.
+ * Return:   The number of bpages released (0 if the pool has no ring or
+ *           another core is already draining it).
+ */
+int homa_pool_drain_ring(struct homa_pool *pool)
+{
+	__u32 offsets[RING_BATCH];
+	struct homa_return_ring *ring;
+	int count = 0;
+	__u32 head, tail;
+	int n;
+
+	if (!READ_ONCE(pool->ring))
+		return 0;
+	if (!spin_trylock_bh(&pool->ring_lock))
+		return 0;
+	ring = pool->ring;
+	if (!ring)
+		goto done;
+	head = smp_load_acquire(&ring->head);
+	tail = pool->ring_tail;
+	if ((head - tail) > pool->ring_entries) {
+		/* The application has corrupted the ring; there's no way
+		 * to tell which entries are valid, so ignore all of them.
+		 */
+		tt_record3("Discarding corrupted return ring for port %d, "
+				"head %d, tail %d", pool->hsk->port, head,
+				tail);
+		tail = head;
+	}
+	while (tail != head) {
+		for (n = 0; (n < RING_BATCH) && (tail != head); n++, tail++)
+			offsets[n] = READ_ONCE(ring->offsets[tail
+					& (pool->ring_entries - 1)]);
+		homa_pool_release_buffers(pool, n, offsets);
+		count += n;
+	}
+	pool->ring_tail = tail;
+	smp_store_release(&ring->tail, tail);
+	INC_METRIC(bpage_ring_returns, count);
+
+	done:
+	spin_unlock_bh(&pool->ring_lock);
+	return count;
+}
+
+/**
+ * homa_pool_claim_word() - Claim free bpages from a single word of a
+ * pool's free map, using a single cmpxchg for all of them.
+ * @map:        Free map containing the word (one of the maps in
+ *              pool->free_map).
+ * @word:       Index of the word in @map.
+ * @count:      Maximum number of bpages to claim.
+ * @pages:      Indexes of the claimed bpages are stored here.
+ * Return:      The number of bpages claimed (0 if the word has no free
+ *              bpages).
+ */
+static inline int homa_pool_claim_word(unsigned long *map, int word,
+		int count, __u32 *pages)
+{
+	unsigned long *addr = &map[word];
+	unsigned long old, new, prev;
+	int claimed;
+
+	old = READ_ONCE(*addr);
+	while (old) {
+		/* Lowest-numbered bpages are claimed first, so that a small
+		 * number of bpages gets reused over and over when the pool
+		 * isn't heavily loaded (reduces cache footprint).
+		 */
+		new = old;
+		claimed = 0;
+		while (new && (claimed < count)) {
+			pages[claimed] = word*BITS_PER_LONG + __ffs(new);
+			new &= new - 1;
+			claimed++;
+		}
+		prev = cmpxchg(addr, old, new);
+		if (prev == old)
+			return claimed;
+		old = prev;
+	}
+	return 0;
+}
+
+/**
+ * homa_pool_claim_map() - Claim free bpages from a pool's free maps.
+ * @pool:       Pool from which to claim bpages.
+ * @core:       Information for the current core.
+ * @node:       Preferred NUMA node for the bpages.
+ * @count:      Maximum number of bpages to claim.
+ * @pages:      Indexes of the claimed bpages are stored here.
+ * @scanned:    Incremented by the number of map words examined.
+ * Return:      The number of bpages claimed (may be less than @count if
+ *              the maps don't contain enough free bpages).
+ */
+static int homa_pool_claim_map(struct homa_pool *pool,
+		struct homa_pool_core *core, int node, int count,
+		__u32 *pages, int *scanned)
+{
+	unsigned long *map = homa_pool_map(pool, node);
+	int claimed = 0;
+	int limit, extra, limit_words, start, i, m;
+
+	/* If we don't need to use all of the bpages in the pool, then
+	 * start out by considering only the ones with low indexes. This
+	 * will reduce the cache footprint for the pool by reusing a few
+	 * bpages over and over. Limit is chosen to make sure there are a
+	 * reasonable number of free pages in the range.
+	 */
+	limit = pool->num_bpages - atomic_read(&pool->free_bpages);
+	extra = limit>>2;
+	limit += (extra < MIN_EXTRA) ? MIN_EXTRA : extra;
+	limit_words = BITS_TO_LONGS(limit);
+	if (limit_words > pool->num_map_words)
+		limit_words = pool->num_map_words;
+	start = core->next_candidate;
+	if (start >= limit_words)
+		start = 0;
+
+	for (i = 0; i < pool->num_map_words; i++) {
+		int word, n;
+
+		/* Words below the limit are considered first (starting at
+		 * next_candidate and wrapping around); the rest of the map
+		 * is considered only if that isn't sufficient.
+		 */
+		if (i < limit_words)
+			word = (start + i) % limit_words;
+		else
+			word = i;
+		INC_METRIC(bpage_map_words, 1);
+		(*scanned)++;
+		n = homa_pool_claim_word(map, word, count - claimed,
+				pages + claimed);
+		if (n == 0)
+			continue;
+		core->next_candidate = word;
+		claimed += n;
+		if (claimed == count)
+			return claimed;
+	}
+
+	/* The preferred node has run out of free bpages. Try bpages of
+	 * unknown location next (they may well turn out to be local),
+	 * then bpages on other nodes.
+	 */
+	for (m = pool->num_maps - 1; m >= 0; m--) {
+		unsigned long *other = pool->free_map
+				+ m*pool->num_map_words;
+
+		if (other == map)
+			continue;
+		for (i = 0; i < pool->num_map_words; i++) {
+			INC_METRIC(bpage_map_words, 1);
+			(*scanned)++;
+			claimed += homa_pool_claim_word(other, i,
+					count - claimed, pages + claimed);
+			if (claimed == count)
+				return claimed;
+		}
+	}
+	return claimed;
+}
+
+/**
+ * homa_pool_drain_caches() - Invoked when a pool's free map is empty;
+ * takes free bpages from the caches of other cores.
+ * @pool:       Pool from which to claim bpages.
+ * @core:       Information for the current core (its cache lock must be
+ *              held by the caller).
+ * @count:      Maximum number of bpages to claim.
+ * @pages:      Indexes of the claimed bpages are stored here.
+ * Return:      The number of bpages claimed.
+ */
+static int homa_pool_drain_caches(struct homa_pool *pool,
+		struct homa_pool_core *core, int count, __u32 *pages)
+{
+	int claimed = 0;
+	int i;
+
+	for (i = 0; (i < pool->num_cores) && (claimed < count); i++) {
+		struct homa_pool_core *other = &pool->cores[i];
+
+		if ((other == core) || (READ_ONCE(other->num_cached) == 0))
+			continue;
+
+		/* Must use trylock here to avoid deadlock, since we already
+		 * hold our own cache lock.
+		 */
+		if (!spin_trylock_bh(&other->cache_lock))
+			continue;
+		while ((other->num_cached > 0) && (claimed < count)) {
+			other->num_cached--;
+			pages[claimed] = other->cache[other->num_cached];
+			claimed++;
+		}
+		spin_unlock_bh(&other->cache_lock);
+	}
+	return claimed;
+}
+
+/**
+ * homa_pool_steal_page() - Search a pool for a bpage that is owned by
+ * some core but whose lease has expired, and take it over.
+ * @pool:       Pool from which to steal a bpage.
+ * @now:        Current time, in get_cycles units.
+ * Return:      The index of the stolen bpage (its reference count will be
+ *              zero and it will be unowned), or -1 if there were no
+ *              bpages available for stealing.
+ */
+static int homa_pool_steal_page(struct homa_pool *pool, __u64 now)
+{
+	int i;
+
+	for (i = 0; i < pool->num_bpages; i++) {
+		struct homa_bpage *bpage = &pool->descriptors[i];
+
+		/* Do a quick check without locking the page, and if the
+		 * page looks promising, then lock it and check again (must
+		 * check again in case someone else snuck in and grabbed
+		 * the page).
+		 */
+		if ((atomic_read(&bpage->refs) != 1) || (bpage->owner < 0)
+				|| (bpage->expiration > now))
+			continue;
+		if (!spin_trylock_bh(&bpage->lock))
+			continue;
+		if ((atomic_read(&bpage->refs) != 1) || (bpage->owner < 0)
+				|| (bpage->expiration > now)) {
+			spin_unlock_bh(&bpage->lock);
+			continue;
+		}
+		atomic_set(&bpage->refs, 0);
+		bpage->owner = -1;
+		spin_unlock_bh(&bpage->lock);
+
+		/* This page wasn't counted in pool->free_bpages, so we
+		 * don't need to consume one of the pages reserved by our
+		 * caller.
+		 */
+		atomic_inc(&pool->free_bpages);
+		return i;
+	}
+	return -1;
+}
+
 /**
  * homa_pool_get_pages() - Allocate one or more full pages from the pool.
  * @pool:         Pool from which to allocate pages
@@ -135,146 +804,364 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 {
 	int alloced = 0;
 	__u64 now = get_cycles();
-	int limit = 0;
 	int core_num = raw_smp_processor_id();
 	struct homa_pool_core *core = &pool->cores[core_num];
+	int node = READ_ONCE(pool->copy_node);
+	int scanned = 0;
+	int i;
+
+	/* Prefer bpages on the node where the data will be copied out to
+	 * the application (if known); otherwise assume that's this core's
+	 * node.
+	 */
+	if (node < 0)
+		node = core->node;
 
-	if (atomic_sub_return(num_pages, &pool->free_bpages) < 0) {
+	while (atomic_sub_return(num_pages, &pool->free_bpages) < 0) {
 		atomic_add(num_pages, &pool->free_bpages);
-		return -1;
+
+		/* Before giving up, collect any bpages that the application
+		 * has returned through its ring. Some of them may satisfy
+		 * waiting RPCs, but the caller may hold an RPC lock, so
+		 * homa_pool_check_waiting can't be invoked here; have it
+		 * invoked later.
+		 */
+		if (homa_pool_drain_ring(pool) == 0)
+			return -1;
+		WRITE_ONCE(pool->check_waiting_needed, 1);
 	}
 
 	/* Once we get to this point we know we will be able to find
-	 * enough free pages; now we just have to find them.
+	 * enough free pages; now we just have to find them. They come
+	 * from the following places, in order of preference: this core's
+	 * cache, the free map, other cores' caches, and finally owned
+	 * pages whose leases have expired.
 	 */
+	spin_lock_bh(&core->cache_lock);
 	while (alloced != num_pages) {
-		struct homa_bpage *bpage;
-		int cur, ref_count;
-
-		/* If we don't need to use all of the bpages in the pool,
-		 * then try to use only the ones with low indexes. This
-		 * will reduce the cache footprint for the pool by reusing
-		 * a few bpages over and over. Specifically this code will
-		 * not consider any candidate page whose index is >= limit.
-		 * Limit is chosen to make sure there are a reasonable
-		 * number of free pages in the range, so we won't have to
-		 * check a huge number of pages.
-		 */
-		if (limit == 0) {
-			int extra;
-			limit = pool->num_bpages
-					- atomic_read(&pool->free_bpages);
-			extra = limit>>2;
-			limit += (extra < MIN_EXTRA) ? MIN_EXTRA : extra;
-			if (limit > pool->num_bpages)
-				limit = pool->num_bpages;
+		int needed = num_pages - alloced;
+		int batch, n;
+
+		if (core->num_cached > 0) {
+			n = (core->num_cached < needed) ? core->num_cached
+					: needed;
+			for (i = 0; i < n; i++) {
+				core->num_cached--;
+				pages[alloced] = core->cache[core->num_cached];
+				alloced++;
+			}
+			INC_METRIC(bpage_cache_hits, n);
+			continue;
 		}
 
-		cur = core->next_candidate;
-		core->next_candidate++;
-		if (cur >= limit) {
-			core->next_candidate = 0;
+		/* Refill the cache from the free map with a single batch, but
+		 * don't hoard pages in the cache when the pool is nearly
+		 * full.
+		 */
+		batch = atomic_read(&pool->free_bpages) >> 3;
+		if (batch > HOMA_POOL_CACHE_SIZE)
+			batch = HOMA_POOL_CACHE_SIZE;
+		if (needed < batch) {
+			n = homa_pool_claim_map(pool, core, node, batch,
+					core->cache, &scanned);
 
-			/* Must recompute the limit for each new loop through
-			 * the bpage array: we may need to consider a larger
-			 * range of pages because of concurrent allocations.
+			/* Reverse the claimed pages so that the lowest-numbered
+			 * ones get allocated first.
 			 */
-			limit = 0;
-			continue;
+			for (i = 0; i < n/2; i++) {
+				__u32 tmp = core->cache[i];
+
+				core->cache[i] = core->cache[n-1-i];
+				core->cache[n-1-i] = tmp;
+			}
+			core->num_cached = n;
+			if (n > 0)
+				continue;
+		} else {
+			n = homa_pool_claim_map(pool, core, node, needed,
+					&pages[alloced], &scanned);
+			alloced += n;
+			if (n > 0)
+				continue;
 		}
-		bpage = &pool->descriptors[cur];
 
-		/* Figure out whether this candidate is free (or can be
-		 * stolen). Do a quick check without locking the page, and
-		 * if the page looks promising, then lock it and check again
-		 * (must check again in case someone else snuck in and
-		 * grabbed the page).
-		 */
-		ref_count = atomic_read(&bpage->refs);
-		if ((ref_count >= 2) || ((ref_count == 1) && ((bpage->owner < 0)
-				|| (bpage->expiration > now))))
-			continue;
-		if (!spin_trylock_bh(&bpage->lock))
-			continue;
-		ref_count = atomic_read(&bpage->refs);
-		if ((ref_count >= 2) || ((ref_count == 1) && ((bpage->owner < 0)
-				|| (bpage->expiration > now)))) {
-			spin_unlock_bh(&bpage->lock);
+		n = homa_pool_drain_caches(pool, core, needed, &pages[alloced]);
+		alloced += n;
+		if (n > 0)
 			continue;
+
+		n = homa_pool_steal_page(pool, now);
+		if (n >= 0) {
+			pages[alloced] = n;
+			alloced++;
+		}
+	}
+	spin_unlock_bh(&core->cache_lock);
+
+	i = (scanned == 0) ? 0 : fls(scanned);
+	if (i >= HOMA_SCAN_BUCKETS)
+		i = HOMA_SCAN_BUCKETS - 1;
+	core->stats.scan_lengths[i]++;
+	INC_METRIC(bpage_scan_lengths[i], 1);
+
+	for (i = 0; i < num_pages; i++) {
+		struct homa_bpage *bpage = &pool->descriptors[pages[i]];
+
+		if ((pool->num_maps > 1) && (bpage->node >= 0)) {
+			if (bpage->node == node)
+				INC_METRIC(bpage_local_allocs, 1);
+			else
+				INC_METRIC(bpage_remote_allocs, 1);
 		}
-		if (bpage->owner >= 0)
-			atomic_inc(&pool->free_bpages);
 		if (set_owner) {
+			spin_lock_bh(&bpage->lock);
 			atomic_set(&bpage->refs, 2);
 			bpage->owner = core_num;
 			bpage->expiration = now
 					+ pool->hsk->homa->bpage_lease_cycles;
+			spin_unlock_bh(&bpage->lock);
 		} else {
 			atomic_set(&bpage->refs, 1);
 			bpage->owner = -1;
 		}
-		spin_unlock_bh(&bpage->lock);
-		pages[alloced] = cur;
-		alloced++;
 	}
 	return 0;
 }
 
 /**
- * homa_pool_allocate() - Allocate buffer space for an RPC.
- * @rpc:  RPC that needs space allocated for its incoming message (space must
- *        not already have been allocated). The fields @msgin->num_buffers
- *        and @msgin->buffers are filled in. Must be locked by caller.
- * Return: The return value is normally 0, which means either buffer space
- * was allocated or the @rpc was queued on @hsk->waiting. If a fatal error
- * occurred, such as no buffer pool present, then a negative errno is
- * returned.
+ * homa_pool_size_class() - Returns the size class to use for a partial
+ * bpage allocation.
+ * @size:    Number of bytes in the allocation.
+ * Return:   Index in homa_pool_core.classes.
  */
-int homa_pool_allocate(struct homa_rpc *rpc)
+static inline int homa_pool_size_class(int size)
+{
+	int i;
+
+	for (i = 0; i < HOMA_POOL_NUM_CLASSES-1; i++) {
+		if (size <= class_limits[i])
+			return i;
+	}
+	return HOMA_POOL_NUM_CLASSES-1;
+}
+
+/**
+ * homa_pool_grant_limit() - Return the largest value that an RPC's
+ * msgin.granted may take, given the buffer space currently allocated
+ * for the message.
+ * @rpc:    RPC to check; must be locked by caller.
+ * Return:  See above. Senders can transmit a full GSO packet that starts
+ *          just before the granted offset, so buffer space must extend
+ *          homa->max_gso_size bytes beyond the granted offset (unless it
+ *          covers the entire message). The result may be negative.
+ */
+static inline int homa_pool_grant_limit(struct homa_rpc *rpc)
+{
+	int covered = homa_pool_covered(rpc);
+
+	if (covered >= rpc->msgin.length)
+		return rpc->msgin.length;
+	return covered - rpc->hsk->homa->max_gso_size;
+}
+
+/**
+ * homa_pool_target() - Figure out which bpages must be allocated for an
+ * RPC in order to cover a given prefix of its incoming message.
+ * @rpc:    RPC whose message will be covered.
+ * @end:    The goal is to allow rpc->msgin.granted to reach this value
+ *          (see homa_pool_grant_limit).
+ * @tail:   Set to 1 if the partial bpage at the end of the message must
+ *          also be allocated, 0 otherwise.
+ * Return:  The number of full bpages that must be allocated for the
+ *          message (including any that are already allocated).
+ */
+static inline int homa_pool_target(struct homa_rpc *rpc, int end, int *tail)
 {
 	struct homa_pool *pool = &rpc->hsk->buffer_pool;
-	int full_pages, partial, i, core_id;
-	__u32 pages[HOMA_MAX_BPAGES];
-	struct homa_pool_core *core;
-	struct homa_bpage *bpage;
-	__u64 now = get_cycles();
-	struct homa_rpc *other;
+	int full_pages = rpc->msgin.length >> pool->bpage_shift;
+	int pages;
 
-	if (!pool->region)
-		return -ENOMEM;
+	end += rpc->hsk->homa->max_gso_size;
+	pages = (end + BPAGE_SIZE(pool) - 1) >> pool->bpage_shift;
+	if ((end >= rpc->msgin.length) || (pages > full_pages)) {
+		*tail = (rpc->msgin.length & (BPAGE_SIZE(pool)-1)) != 0;
+		return full_pages;
+	}
+	*tail = 0;
+	return pages;
+}
+
+/**
+ * homa_pool_pages_needed() - Return the number of additional bpages
+ * that must be allocated for an RPC in order to allow its granted offset
+ * to reach a given value.
+ * @rpc:    RPC whose incoming message is being considered.
+ * @end:    Desired value for rpc->msgin.granted.
+ * Return:  See above (a partial bpage at the end of the message counts as
+ *          one bpage).
+ */
+static inline int homa_pool_pages_needed(struct homa_rpc *rpc, int end)
+{
+	int full_pages, tail;
+
+	if (homa_pool_covered(rpc) >= rpc->msgin.length)
+		return 0;
+	full_pages = homa_pool_target(rpc, end, &tail);
+	if (full_pages < rpc->msgin.num_bpages)
+		full_pages = rpc->msgin.num_bpages;
+	return full_pages - rpc->msgin.num_bpages + tail;
+}
 
-	/* First allocate any full bpages that are needed. */
-	full_pages = rpc->msgin.length >> HOMA_BPAGE_SHIFT;
-	if (unlikely(full_pages)) {
-		if (homa_pool_get_pages(pool, full_pages, pages, 0) != 0)
-			goto out_of_space;
-		for (i = 0; i < full_pages; i++)
-			rpc->msgin.bpage_offsets[i] = pages[i] << HOMA_BPAGE_SHIFT;
+/**
+ * homa_pool_next_end() - Return the granted offset that an RPC waiting
+ * for buffer space must be able to reach in order to make progress.
+ * @rpc:    RPC on hsk->waiting_for_bufs.
+ */
+static inline int homa_pool_next_end(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+
+	/* Only pool->partial_rpc can make progress with space for just
+	 * part of its message; if some other RPC holds that role, this
+	 * one needs space for its entire message.
+	 */
+	if ((pool->partial_rpc != NULL) && (pool->partial_rpc != rpc))
+		return rpc->msgin.length;
+	if (rpc->msgin.num_bpages == 0)
+		return rpc->msgin.granted;
+	return homa_pool_grant_limit(rpc) + 1;
+}
+
+/**
+ * set_bpages_needed() - Set the bpages_needed and reserved fields of @pool
+ * based on the needs of the first RPC that's waiting for buffer space.
+ * The caller must own the lock for @pool->hsk.
+ */
+static void inline set_bpages_needed(struct homa_pool *pool) {
+	struct homa_rpc *rpc = list_first_entry_or_null(
+			&pool->hsk->waiting_for_bufs, struct homa_rpc,
+			buf_links);
+
+	if (!rpc) {
+		pool->bpages_needed = INT_MAX;
+		pool->reserved = 0;
+		return;
 	}
-	rpc->msgin.num_bpages = full_pages;
+	pool->bpages_needed = homa_pool_pages_needed(rpc,
+			homa_pool_next_end(rpc));
+	if (pool->bpages_needed < 1)
+		pool->bpages_needed = 1;
+	pool->reserved = (rpc == pool->partial_rpc) ? pool->bpages_needed : 0;
+}
 
-	/* The last chunk may be less than a full bpage; for this we use
-	 * the bpage that we own (and reuse it for multiple messages).
+/**
+ * homa_pool_claim_partial() - Invoked when there isn't enough free space
+ * for an RPC's entire message; decides whether the RPC may allocate space
+ * for just part of its message, and if so makes it pool->partial_rpc.
+ * @rpc:    RPC that needs buffer space; must be locked by caller, and
+ *          must not have any buffer space yet.
+ * Return:  Nonzero means @rpc is now pool->partial_rpc; zero means it
+ *          must wait until its entire message fits.
+ */
+static int homa_pool_claim_partial(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+	struct homa_rpc *first;
+	int result = 0;
+
+	homa_sock_lock(pool->hsk, "homa_pool_claim_partial");
+	if (pool->partial_rpc != NULL)
+		goto done;
+
+	/* Partial space goes only to the highest-priority message (the
+	 * one with the fewest bytes remaining).
 	 */
-	partial = rpc->msgin.length & (HOMA_BPAGE_SIZE-1);
-	if (unlikely(partial == 0))
-		goto success;
+	first = list_first_entry_or_null(&pool->hsk->waiting_for_bufs,
+			struct homa_rpc, buf_links);
+	if (first && (first != rpc) && (first->msgin.bytes_remaining
+			< rpc->msgin.bytes_remaining))
+		goto done;
+	pool->partial_rpc = rpc;
+	set_bpages_needed(pool);
+	result = 1;
+
+	done:
+	homa_sock_unlock(pool->hsk);
+	return result;
+}
+
+/**
+ * homa_pool_release_partial() - Invoked when @rpc no longer needs to be
+ * pool->partial_rpc (e.g. its entire message is now covered), so that
+ * another RPC can take that role.
+ * @rpc:    RPC that is currently pool->partial_rpc. Must be locked by
+ *          caller.
+ */
+static void homa_pool_release_partial(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+
+	homa_sock_lock(pool->hsk, "homa_pool_release_partial");
+	if (pool->partial_rpc == rpc) {
+		pool->partial_rpc = NULL;
+		set_bpages_needed(pool);
+	}
+	homa_sock_unlock(pool->hsk);
+}
+
+/**
+ * homa_pool_alloc_partial() - Allocate space for the last part of an
+ * RPC's message, which is less than a full bpage, and append it to
+ * rpc->msgin.bpage_offsets.
+ * @rpc:    RPC whose message needs space; all of its full bpages must
+ *          already have been allocated. Must be locked by caller.
+ * Return:  0 for success, or -ENOMEM if no space was available.
+ */
+static int homa_pool_alloc_partial(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+	int partial, core_id, size_class;
+	struct homa_pool_class *sclass;
+	struct homa_pool_core *core;
+	struct homa_bpage *bpage;
+	__u64 now = get_cycles();
+	__u32 pages[1];
+
+	/* For this we use a bpage that we own (and reuse it for multiple
+	 * messages). Each size class has its own bpage, and allocations
+	 * are rounded up to cache line boundaries so that messages never
+	 * share cache lines.
+	 */
+	partial = rpc->msgin.length & (BPAGE_SIZE(pool)-1);
+	size_class = homa_pool_size_class(partial);
 	core_id = raw_smp_processor_id();
 	core = &pool->cores[core_id];
-	bpage = &pool->descriptors[core->page_hint];
+	core->stats.partial_waste += ALIGN(partial, CACHE_LINE_SIZE) - partial;
+	INC_METRIC(bpage_partial_waste, ALIGN(partial, CACHE_LINE_SIZE)
+			- partial);
+	partial = ALIGN(partial, CACHE_LINE_SIZE);
+	sclass = &core->classes[size_class];
+	bpage = &pool->descriptors[sclass->page_hint];
 	if (!spin_trylock_bh(&bpage->lock)) {
 		tt_record("beginning wait for bpage lock");
 		spin_lock_bh(&bpage->lock);
 		tt_record("ending wait for bpage lock");
 	}
-	if (bpage->owner != core_id) {
+	if ((bpage->owner != core_id) || (bpage->size_class != size_class)) {
 		spin_unlock_bh(&bpage->lock);
 		goto new_page;
 	}
-	if ((core->allocated + partial) > HOMA_BPAGE_SIZE) {
+	if ((sclass->allocated + partial) > BPAGE_SIZE(pool)) {
+		/* The page has filled up. */
+		core->stats.partial_bpages++;
+		core->stats.partial_waste += BPAGE_SIZE(pool)
+				- sclass->allocated;
+		INC_METRIC(bpage_partial_fills, 1);
+		INC_METRIC(bpage_partial_waste, BPAGE_SIZE(pool)
+				- sclass->allocated);
 		if (atomic_read(&bpage->refs) == 1) {
 			/* Bpage is totally free, so we can reuse it. */
-			core->allocated = 0;
+			sclass->allocated = 0;
 			INC_METRIC(bpage_reuses, 1);
 		} else {
 			bpage->owner = -1;
@@ -295,40 +1182,93 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 
 	/* Can't use the current page; get another one. */
 	new_page:
-	if (homa_pool_get_pages(pool, 1, pages, 1) != 0) {
-		homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
-				rpc->msgin.bpage_offsets);
-		rpc->msgin.num_bpages = 0;
-		goto out_of_space;
-	}
-	core->page_hint = pages[0];
-	core->allocated = 0;
+	if (homa_pool_get_pages(pool, 1, pages, 1) != 0)
+		return -ENOMEM;
+	pool->descriptors[pages[0]].size_class = size_class;
+	sclass->page_hint = pages[0];
+	sclass->allocated = 0;
 
 	allocate_partial:
-	rpc->msgin.bpage_offsets[rpc->msgin.num_bpages] = core->allocated
-			+ (core->page_hint << HOMA_BPAGE_SHIFT);
+	rpc->msgin.bpage_offsets[rpc->msgin.num_bpages] = sclass->allocated
+			+ (sclass->page_hint << pool->bpage_shift);
 	rpc->msgin.num_bpages++;
-	core->allocated += partial;
+	sclass->allocated += partial;
+	return 0;
+}
 
-	success:
-	tt_record4("Allocated %d bpage pointers on port %d for id %d, "
-			"free_bpages now %d",
-			rpc->msgin.num_bpages, pool->hsk->port, rpc->id,
-			atomic_read(&pool->free_bpages));
+/**
+ * homa_pool_alloc_range() - Allocate additional buffer space for an RPC
+ * so that its granted offset can reach a given value. Either all of the
+ * needed space is allocated, or none of it.
+ * @rpc:    RPC that needs space; must be locked by caller.
+ * @end:    Desired value for rpc->msgin.granted.
+ * Return:  0 for success, or -ENOMEM if there wasn't enough free space.
+ */
+static int homa_pool_alloc_range(struct homa_rpc *rpc, int end)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+	int full_pages, first, i, tail;
+	__u32 pages[HOMA_MAX_BPAGES];
+
+	if (homa_pool_covered(rpc) >= rpc->msgin.length)
+		return 0;
+	full_pages = homa_pool_target(rpc, end, &tail);
+	first = rpc->msgin.num_bpages;
+	if (full_pages > first) {
+		/* Don't take bpages that pool->partial_rpc is waiting for. */
+		if ((rpc != READ_ONCE(pool->partial_rpc))
+				&& ((atomic_read(&pool->free_bpages)
+				- (full_pages - first))
+				< READ_ONCE(pool->reserved)))
+			return -ENOMEM;
+		if (homa_pool_get_pages(pool, full_pages - first, pages, 0)
+				!= 0)
+			return -ENOMEM;
+		for (i = first; i < full_pages; i++)
+			rpc->msgin.bpage_offsets[i] = pages[i - first]
+					<< pool->bpage_shift;
+		rpc->msgin.num_bpages = full_pages;
+	}
+	if (tail && (homa_pool_alloc_partial(rpc) != 0)) {
+		homa_pool_release_buffers(pool, rpc->msgin.num_bpages - first,
+				&rpc->msgin.bpage_offsets[first]);
+		rpc->msgin.num_bpages = first;
+
+		/* Can't check for waiting RPCs here (the RPC is locked). */
+		WRITE_ONCE(pool->check_waiting_needed, 1);
+		return -ENOMEM;
+	}
+	if ((rpc == READ_ONCE(pool->partial_rpc))
+			&& (homa_pool_covered(rpc) >= rpc->msgin.length))
+		homa_pool_release_partial(rpc);
 	return 0;
+}
 
-	/* We get here if there wasn't enough buffer space for this
-	 * message; add the RPC to hsk->waiting_for_bufs.
-	 */
-	out_of_space:
-	INC_METRIC(buffer_alloc_failures, 1);
-	tt_record4("Buffer allocation failed, port %d, id %d, length %d, "
-			"free_bpages %d", pool->hsk->port, rpc->id,
-			rpc->msgin.length,
-			atomic_read(&pool->free_bpages));
-	homa_sock_lock(pool->hsk, "homa_pool_allocate");
+/**
+ * homa_pool_wait() - Add an RPC to hsk->waiting_for_bufs (if it isn't
+ * already there), so that it will be retried when buffer space is freed.
+ * pool->partial_rpc always goes first (the pool can deadlock unless it
+ * eventually completes); other RPCs are sorted by bytes remaining, so that
+ * buffer space goes first to the messages that will also be favored for
+ * grants.
+ * @rpc:    RPC that needs more buffer space; must be locked by caller.
+ */
+static void homa_pool_wait(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+	struct homa_rpc *other;
+
+	homa_sock_lock(pool->hsk, "homa_pool_wait");
+	if (!list_empty(&rpc->buf_links))
+		goto done;
+	if (rpc == pool->partial_rpc) {
+		list_add_rcu(&rpc->buf_links, &pool->hsk->waiting_for_bufs);
+		goto queued;
+	}
 	list_for_each_entry(other, &pool->hsk->waiting_for_bufs, buf_links) {
-		if (other->msgin.length > rpc->msgin.length) {
+		if (other == pool->partial_rpc)
+			continue;
+		if (other->msgin.bytes_remaining > rpc->msgin.bytes_remaining) {
 			list_add_tail(&rpc->buf_links, &other->buf_links);
 			goto queued;
 		}
@@ -336,9 +1276,103 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 	list_add_tail_rcu(&rpc->buf_links, &pool->hsk->waiting_for_bufs);
 
 	queued:
+	rpc->buf_wait_start = get_cycles();
 	set_bpages_needed(pool);
+
+	done:
 	homa_sock_unlock(pool->hsk);
+}
+
+/**
+ * homa_pool_allocate() - Allocate buffer space for an RPC.
+ * @rpc:  RPC that needs space allocated for its incoming message (space must
+ *        not already have been allocated). The fields @msgin->num_buffers
+ *        and @msgin->buffers are filled in. Must be locked by caller.
+ * Return: The return value is normally 0, which means either buffer space
+ * was allocated or the @rpc was queued on @hsk->waiting. If a fatal error
+ * occurred, such as no buffer pool present, then a negative errno is
+ * returned.
+ */
+int homa_pool_allocate(struct homa_rpc *rpc)
+{
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+
+	if (!pool->region)
+		return -ENOMEM;
+
+	/* Normally space is allocated for the entire message at once. If
+	 * there isn't enough space for that, allocate just enough for the
+	 * bytes granted so far; homa_pool_extend will allocate more as
+	 * grants are issued. This allows a large message to make progress
+	 * when the pool is nearly full, rather than waiting until the pool
+	 * can hold the entire message. Only one message at a time may do
+	 * this (see pool->partial_rpc).
+	 */
+	if (homa_pool_alloc_range(rpc, rpc->msgin.length) == 0)
+		goto success;
+	if ((rpc->msgin.granted < rpc->msgin.length)
+			&& homa_pool_claim_partial(rpc)) {
+		if (homa_pool_alloc_range(rpc, rpc->msgin.granted) == 0) {
+			INC_METRIC(buffer_partial_allocs, 1);
+			goto success;
+		}
+		homa_pool_release_partial(rpc);
+	}
+
+	/* We get here if there wasn't enough buffer space for this
+	 * message; add the RPC to hsk->waiting_for_bufs.
+	 */
+	INC_METRIC(buffer_alloc_failures, 1);
+	tt_record4("Buffer allocation failed, port %d, id %d, length %d, "
+			"free_bpages %d", pool->hsk->port, rpc->id,
+			rpc->msgin.length,
+			atomic_read(&pool->free_bpages));
+	homa_pool_wait(rpc);
 	return 0;
+
+	success:
+	tt_record4("Allocated %d bpage pointers on port %d for id %d, "
+			"free_bpages now %d",
+			rpc->msgin.num_bpages, pool->hsk->port, rpc->id,
+			atomic_read(&pool->free_bpages));
+	return 0;
+}
+
+/**
+ * homa_pool_extend() - This function is invoked before issuing new grants
+ * for an RPC; it allocates additional buffer space for the message, if
+ * needed, so that the new grants can be received.
+ * @rpc:    RPC whose message is about to receive more grants. Must be
+ *          locked by caller, and some buffer space must already have
+ *          been allocated for it.
+ * @end:    The desired new value for rpc->msgin.granted.
+ * Return:  The largest value that rpc->msgin.granted may now take. This
+ *          will be less than @end if buffer space ran out; in that case
+ *          the RPC has been queued on hsk->waiting_for_bufs so that it will
+ *          be retried when space is freed. Only pool->partial_rpc can
+ *          get here without its entire message already covered.
+ */
+int homa_pool_extend(struct homa_rpc *rpc, int end)
+{
+	int limit = homa_pool_grant_limit(rpc);
+
+	if (end <= limit)
+		return limit;
+	if (homa_pool_alloc_range(rpc, end) == 0)
+		return homa_pool_grant_limit(rpc);
+
+	/* Couldn't get enough space for all of the new grants; see if
+	 * we can at least make a bit of progress.
+	 */
+	if ((end > limit + 1) && (homa_pool_alloc_range(rpc, limit + 1) == 0))
+		return homa_pool_grant_limit(rpc);
+	INC_METRIC(buffer_extend_failures, 1);
+	tt_record4("Buffer extension failed, port %d, id %d, granted %d, "
+			"free_bpages %d", rpc->hsk->port, rpc->id,
+			rpc->msgin.granted,
+			atomic_read(&rpc->hsk->buffer_pool.free_bpages));
+	homa_pool_wait(rpc);
+	return limit;
 }
 
 /**
@@ -355,15 +1389,17 @@ int homa_pool_allocate(struct homa_rpc *rpc)
  */
 void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 {
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
 	int bpage_index, bpage_offset;
 
-	bpage_index = offset >> HOMA_BPAGE_SHIFT;
+	bpage_index = offset >> pool->bpage_shift;
 	BUG_ON(bpage_index >= rpc->msgin.num_bpages);
-	bpage_offset = offset & (HOMA_BPAGE_SIZE-1);
-	*available = (bpage_index < (rpc->msgin.num_bpages-1))
-			? HOMA_BPAGE_SIZE - bpage_offset
+	bpage_offset = offset & (BPAGE_SIZE(pool)-1);
+	*available = (bpage_index < ((rpc->msgin.length - 1)
+			>> pool->bpage_shift))
+			? BPAGE_SIZE(pool) - bpage_offset
 			: rpc->msgin.length - offset;
-	return rpc->hsk->buffer_pool.region + rpc->msgin.bpage_offsets[bpage_index]
+	return pool->region + rpc->msgin.bpage_offsets[bpage_index]
 			+ bpage_offset;
 }
 
@@ -384,11 +1420,18 @@ void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 	if (!pool->region)
 		return;
 	for (i = 0; i < num_buffers; i++) {
-		__u32 bpage_index = buffers[i] >> HOMA_BPAGE_SHIFT;
+		__u32 bpage_index = buffers[i] >> pool->bpage_shift;
 		struct homa_bpage *bpage= &pool->descriptors[bpage_index];
 		if (bpage_index < pool->num_bpages) {
-			 if (atomic_dec_return(&bpage->refs) == 0)
-				 atomic_inc(&pool->free_bpages);
+			if (atomic_dec_return(&bpage->refs) == 0) {
+				/* The page must appear in the free map before
+				 * it is counted in free_bpages.
+				 */
+				set_bit(bpage_index, homa_pool_map(pool,
+						READ_ONCE(bpage->node)));
+				smp_mb__before_atomic();
+				atomic_inc(&pool->free_bpages);
+			}
 		}
 	}
 	tt_record3("Released %d bpages, free_bpages for port %d now %d",
@@ -396,6 +1439,76 @@ void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 			atomic_read(&pool->free_bpages));
 }
 
+/**
+ * homa_pool_learn_nodes() - Find out which NUMA nodes hold bpages whose
+ * locations aren't yet known, so that they can be placed in the right free
+ * map when they are released. Must be invoked in the context of the process
+ * that owns the pool's memory.
+ * @pool:         Pool that the buffer space belongs to.
+ * @num_buffers:  Number of buffers to check.
+ * @buffers:      Points to @num_buffers values, each of which is an offset
+ *                from the start of the pool to a buffer whose data has
+ *                already been written (so its memory is mapped).
+ */
+void homa_pool_learn_nodes(struct homa_pool *pool, int num_buffers,
+		__u32 *buffers)
+{
+	int i;
+
+	if (!pool->region || (pool->num_maps == 1))
+		return;
+	for (i = 0; i < num_buffers; i++) {
+		__u32 bpage_index = buffers[i] >> pool->bpage_shift;
+		struct homa_bpage *bpage;
+		int node;
+
+		if (bpage_index >= pool->num_bpages)
+			continue;
+		bpage = &pool->descriptors[bpage_index];
+		if (READ_ONCE(bpage->node) >= 0)
+			continue;
+		node = homa_pool_page_node(pool->region
+				+ (((__u64) bpage_index) << pool->bpage_shift));
+		if (node >= 0)
+			WRITE_ONCE(bpage->node, node);
+	}
+}
+
+/**
+ * homa_pool_set_copy_node() - Invoked when message data is about to be
+ * copied from a pool to user space; records the NUMA node of the current
+ * core so that future bpages will be allocated on that node if possible.
+ * @pool:   Pool that the data will be copied from.
+ */
+void homa_pool_set_copy_node(struct homa_pool *pool)
+{
+	int node;
+
+	if (pool->num_maps == 1)
+		return;
+	node = cpu_to_node(raw_smp_processor_id());
+	if (READ_ONCE(pool->copy_node) != node)
+		WRITE_ONCE(pool->copy_node, node);
+}
+
+/**
+ * homa_pool_end_wait() - Record statistics for an RPC that has just been
+ * removed from hsk->waiting_for_bufs.
+ * @pool:   Pool that the RPC was waiting for.
+ * @rpc:    The RPC.
+ */
+static inline void homa_pool_end_wait(struct homa_pool *pool,
+		struct homa_rpc *rpc)
+{
+	struct homa_pool_stats *stats =
+			&pool->cores[raw_smp_processor_id()].stats;
+	__u64 cycles = get_cycles() - rpc->buf_wait_start;
+
+	stats->waits++;
+	stats->wait_cycles += cycles;
+	INC_METRIC(buffer_wait_cycles, cycles);
+}
+
 /**
  * homa_pool_check_waiting() - Checks to see if there are enough free
  * bpages to wake up any RPCs that were blocked. Whenever
@@ -410,11 +1523,12 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 #ifdef __UNIT_TEST__
 	pool->check_waiting_invoked += 1;
 #endif
+	WRITE_ONCE(pool->check_waiting_needed, 0);
 	while (atomic_read(&pool->free_bpages) >= pool->bpages_needed) {
 		struct homa_rpc *rpc;
 		homa_sock_lock(pool->hsk, "buffer pool");
 		if (list_empty(&pool->hsk->waiting_for_bufs)) {
-			pool->bpages_needed = INT_MAX;
+			set_bpages_needed(pool);
 			homa_sock_unlock(pool->hsk);
 			break;
 		}
@@ -433,16 +1547,22 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 			continue;
 		}
 		list_del_init(&rpc->buf_links);
-		if (list_empty(&pool->hsk->waiting_for_bufs))
-			pool->bpages_needed = INT_MAX;
-		else
-			set_bpages_needed(pool);
+		homa_pool_end_wait(pool, rpc);
+		set_bpages_needed(pool);
 		homa_sock_unlock(pool->hsk);
 		tt_record4("Retrying buffer allocation for id %d, length %d, "
 				"free_bpages %d, new bpages_needed %d",
 				rpc->id, rpc->msgin.length,
 				atomic_read(&pool->free_bpages),
 				pool->bpages_needed);
+		if (rpc->msgin.num_bpages > 0) {
+			/* The RPC already has some buffer space, but it was
+			 * unable to extend it for new grants. Let the grant
+			 * mechanism try again.
+			 */
+			homa_grant_check_rpc(rpc);
+			continue;
+		}
 		homa_pool_allocate(rpc);
 		if (rpc->msgin.num_bpages > 0) {
 			/* Allocation succeeded; "wake up" the RPC. */
@@ -451,4 +1571,306 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 		} else
 			homa_rpc_unlock(rpc);
 	}
-}
\ No newline at end of file
+}
+
+/**
+ * homa_pool_forget_rpc() - Invoked when an RPC is being deleted; removes
+ * all references to it from a pool.
+ * @pool:    Pool that @rpc may be waiting for. The caller must hold the
+ *           lock for @pool->hsk.
+ * @rpc:     RPC that is being deleted.
+ */
+void homa_pool_forget_rpc(struct homa_pool *pool, struct homa_rpc *rpc)
+{
+	list_del_init(&rpc->buf_links);
+	if (!pool->region)
+		return;
+	if (pool->partial_rpc == rpc)
+		pool->partial_rpc = NULL;
+	set_bpages_needed(pool);
+}
+
+/**
+ * homa_pool_get_stats() - Collect information about the occupancy and
+ * efficiency of a pool (for SO_HOMA_BUF_STATS).
+ * @pool:    Pool of interest. The socket lock must not be held by caller.
+ * @stats:   Information about @pool is stored here.
+ */
+void homa_pool_get_stats(struct homa_pool *pool, struct homa_buf_stats *stats)
+{
+	struct homa_rpc *rpc;
+	__u64 wait_cycles = 0;
+	int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!pool->region)
+		return;
+	stats->num_bpages = pool->num_bpages;
+	stats->free_bpages = atomic_read(&pool->free_bpages);
+	for (i = 0; i < pool->num_bpages; i++) {
+		if (READ_ONCE(pool->descriptors[i].owner) >= 0)
+			stats->owned_bpages++;
+	}
+	for (i = 0; i < pool->num_cores; i++) {
+		struct homa_pool_stats *core_stats = &pool->cores[i].stats;
+
+		stats->partial_bpages += core_stats->partial_bpages;
+		stats->partial_waste += core_stats->partial_waste;
+		stats->waits += core_stats->waits;
+		wait_cycles += core_stats->wait_cycles;
+		for (j = 0; j < HOMA_SCAN_BUCKETS; j++)
+			stats->scan_lengths[j] += core_stats->scan_lengths[j];
+	}
+	stats->wait_usecs = (wait_cycles * 1000)/cpu_khz;
+
+	homa_sock_lock(pool->hsk, "homa_pool_get_stats");
+	list_for_each_entry(rpc, &pool->hsk->waiting_for_bufs, buf_links)
+		stats->waiting_rpcs++;
+	homa_sock_unlock(pool->hsk);
+}
+
+/**
+ * homa_send_region_init() - Register a send region for a socket (this
+ * implements SO_HOMA_SET_SEND_BUF). The region's pages are pinned here, so
+ * that MSG_ZEROCOPY messages in the region can be attached to sk_buffs
+ * without copying or pinning. Must be invoked in the context of the
+ * application's process, without holding any spinlocks.
+ * @hsk:          Socket for which the region is being registered.
+ * @start:        Application's address for the first byte of the region;
+ *                must be page-aligned.
+ * @length:       Total number of bytes in the region.
+ * @ring_entries: If nonzero, a struct homa_send_ring with this many
+ *                entries occupies the end of the region (see
+ *                homa_send_ring_addr). Must be a power of 2.
+ * Return:        Either zero (for success) or a negative errno for
+ *                failure. -EBUSY means the socket already has a send
+ *                region (a region can only be registered once, since
+ *                messages in flight may refer to it).
+ */
+int homa_send_region_init(struct homa_sock *hsk, void __user *start,
+		__u64 length, int ring_entries)
+{
+	struct homa_send_region *region = &hsk->send_region;
+	struct homa_send_ring *ring = NULL, *kring = NULL;
+	struct mm_struct *mm, *ring_mm = NULL;
+	struct page **ring_pages = NULL;
+	__u64 msg_length = length;
+	int ring_num_pages = 0;
+	struct page **pages;
+	int num_pages;
+	int result;
+
+	if (((unsigned long) start) & ~PAGE_MASK)
+		return -EINVAL;
+
+	/* If there is a completion ring, it occupies the end of the
+	 * region.
+	 */
+	if (ring_entries) {
+		if ((ring_entries < 0) || (ring_entries > HOMA_MAX_RING_ENTRIES)
+				|| (ring_entries & (ring_entries - 1))
+				|| (length < sizeof(struct homa_send_ring)
+				+ ring_entries*sizeof(__u32)))
+			return -EINVAL;
+		ring = homa_send_ring_addr(start, length, ring_entries);
+		if ((char __user *) ring < (char __user *) start)
+			return -EINVAL;
+		msg_length = ((char __user *) ring) - ((char __user *) start);
+	}
+
+	/* Offsets in the ring are 32 bits. */
+	if ((msg_length == 0) || (msg_length > (1ULL << 32)))
+		return -EINVAL;
+	num_pages = (msg_length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	/* Homa only reads the message pages, but they must still be pinned
+	 * for writing: a read-only pin of private memory could pin the
+	 * zero page or a page shared copy-on-write, and later writes by the
+	 * application would then go to new pages, leaving Homa to transmit
+	 * stale data.
+	 */
+	pages = homa_pool_pin_range((unsigned long) start, num_pages,
+			FOLL_WRITE, &mm);
+	if (IS_ERR(pages))
+		return PTR_ERR(pages);
+	if (ring_entries) {
+		kring = homa_pool_map_user(ring, sizeof(struct homa_send_ring)
+				+ ring_entries*sizeof(__u32), &ring_pages,
+				&ring_num_pages, &ring_mm);
+		if (IS_ERR(kring)) {
+			result = PTR_ERR(kring);
+			kring = NULL;
+			goto error;
+		}
+		WRITE_ONCE(kring->head, 0);
+		WRITE_ONCE(kring->tail, 0);
+		WRITE_ONCE(kring->size, ring_entries);
+	}
+
+	homa_sock_lock(hsk, "homa_send_region_init");
+	if (region->start) {
+		homa_sock_unlock(hsk);
+		result = -EBUSY;
+		goto error;
+	}
+	region->length = msg_length;
+	region->pages = pages;
+	region->num_pages = num_pages;
+	region->mm = mm;
+	region->ring_entries = ring_entries;
+	region->ring_head = 0;
+	region->ring_pages = ring_pages;
+	region->ring_num_pages = ring_num_pages;
+	region->ring_mm = ring_mm;
+	spin_lock_bh(&region->ring_lock);
+	region->ring = kring;
+	spin_unlock_bh(&region->ring_lock);
+
+	/* homa_message_out_init reads @start without the socket lock. */
+	smp_store_release(&region->start, (char __user *) start);
+	homa_sock_unlock(hsk);
+	return 0;
+
+	error:
+	if (kring)
+		homa_pool_unmap_user(kring, ring_pages, ring_num_pages,
+				ring_mm);
+	homa_pool_unpin_range(pages, num_pages, mm, false);
+	return result;
+}
+
+/**
+ * homa_send_region_destroy() - Release all of the resources associated
+ * with a socket's send region. Any sk_buffs still referring to the
+ * region's pages hold their own references to them, so it's safe to
+ * unpin the pages even if some messages haven't completed.
+ * @region:   Region to destroy; it may never have been initialized.
+ */
+void homa_send_region_destroy(struct homa_send_region *region)
+{
+	struct homa_send_ring *ring;
+
+	if (!region->start)
+		return;
+
+	/* Once the ring pointer has been cleared (with the lock held),
+	 * homa_send_region_post can no longer access the ring, so it's
+	 * safe to unmap it.
+	 */
+	spin_lock_bh(&region->ring_lock);
+	ring = region->ring;
+	region->ring = NULL;
+	spin_unlock_bh(&region->ring_lock);
+	if (ring) {
+		homa_pool_unmap_user(ring, region->ring_pages,
+				region->ring_num_pages, region->ring_mm);
+		region->ring_pages = NULL;
+		region->ring_mm = NULL;
+	}
+	homa_pool_unpin_range(region->pages, region->num_pages, region->mm,
+			false);
+	region->pages = NULL;
+	region->num_pages = 0;
+	region->mm = NULL;
+	region->start = NULL;
+}
+
+/**
+ * homa_send_region_append() - Attach pages from a send region to an
+ * sk_buff as frags, so that the data can be transmitted without copying.
+ * No pinning is needed (the region is already pinned), just an additional
+ * reference for each frag.
+ * @region:  Region containing the data.
+ * @skb:     Packet buffer to which the data should be added.
+ * @offset:  Offset within @region of the first byte to add.
+ * @length:  Number of bytes to add; the range must lie within the region.
+ *
+ * Return:   0 for success, or a negative errno (the sk_buff may contain
+ *           some of the data in this case).
+ */
+int homa_send_region_append(struct homa_send_region *region,
+		struct sk_buff *skb, __u64 offset, int length)
+{
+	while (length > 0) {
+		int frag = skb_shinfo(skb)->nr_frags;
+		int page_offset = offset & ~PAGE_MASK;
+		int chunk = min_t(int, length, PAGE_SIZE - page_offset);
+		struct page *page;
+
+		if (frag >= MAX_SKB_FRAGS)
+			return -EMSGSIZE;
+		page = region->pages[offset >> PAGE_SHIFT];
+		get_page(page);
+		skb_fill_page_desc(skb, frag, page, page_offset, chunk);
+		skb->len += chunk;
+		skb->data_len += chunk;
+		skb->truesize += chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+/**
+ * homa_send_region_find() - Determine whether an outgoing message lies
+ * entirely within a socket's send region (so it can be transmitted from
+ * the region's pages).
+ * @region:  Send region for the socket; it may not have been initialized.
+ * @iter:    Describes the message's data.
+ * Return:   The offset within @region of the message's first byte, or -1
+ *           if the message doesn't lie in @region (or isn't a single
+ *           contiguous user buffer).
+ */
+__s64 homa_send_region_find(struct homa_send_region *region,
+		struct iov_iter *iter)
+{
+	char __user *start = smp_load_acquire(&region->start);
+	char __user *addr;
+
+	if (!start || !iter_is_iovec(iter) || (iter->nr_segs != 1))
+		return -1;
+	addr = ((char __user *) iter->iov->iov_base) + iter->iov_offset;
+	if ((addr < start) || ((addr - start) + iter->count > region->length))
+		return -1;
+	return addr - start;
+}
+
+/**
+ * homa_send_region_post() - Tell the application that Homa no longer
+ * needs the pages of a message sent from a send region, by adding the
+ * message's offset to the region's completion ring. May be invoked in
+ * softirq context.
+ * @region:  Region from which the message was sent.
+ * @offset:  Offset within @region of the message's first byte.
+ * Return:   True means the offset was added to the ring; false means
+ *           the region has no ring or the ring is full, so the caller
+ *           must notify the application some other way.
+ */
+bool homa_send_region_post(struct homa_send_region *region, __u32 offset)
+{
+	struct homa_send_ring *ring;
+	bool result = false;
+
+	spin_lock_bh(&region->ring_lock);
+	ring = region->ring;
+	if (!ring)
+		goto done;
+
+	/* If the application has corrupted @tail, the ring looks full,
+	 * which is harmless.
+	 */
+	if ((region->ring_head - READ_ONCE(ring->tail))
+			>= region->ring_entries) {
+		INC_METRIC(send_ring_overflows, 1);
+		goto done;
+	}
+	WRITE_ONCE(ring->offsets[region->ring_head
+			& (region->ring_entries - 1)], offset);
+	region->ring_head++;
+	smp_store_release(&ring->head, region->ring_head);
+	result = true;
+
+	done:
+	spin_unlock_bh(&region->ring_lock);
+	return result;
+}
@@ -15,14 +15,23 @@
  *              object.
  * @buf_region: Location of the buffer region that was allocated for
  *              this socket.
+ * @bpage_shift: Log base 2 of the bpage size for the socket; must match
+ *              the bpage_shift passed to SO_HOMA_SET_BUF (if that was 0,
+ *              use HOMA_BPAGE_SHIFT).
+ * @ring:       Return ring for the socket, if one was requested with
+ *              SO_HOMA_SET_BUF (use homa_return_ring_addr to find it).
+ *              May be shared by any number of receivers.
  */
-homa::receiver::receiver(int fd, void *buf_region)
+homa::receiver::receiver(int fd, void *buf_region, int bpage_shift,
+		struct homa_return_ring *ring)
 	: fd(fd)
 	, hdr()
 	, control()
 	, source()
         , msg_length(-1)
         , buf_region(reinterpret_cast<char *>(buf_region))
+        , bpage_shift(bpage_shift)
+        , ring(ring)
 {
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.msg_name = &source;
@@ -103,10 +112,46 @@ void homa::receiver::release()
 	if (control.num_bpages == 0)
 		return;
 
-	/* This recvmsg request will do nothing except return buffer space. */
-	control.flags = HOMA_RECVMSG_NONBLOCKING;
-	control.id = 0;
-	recvmsg(fd, &hdr, 0);
+	if (!release_to_ring()) {
+		/* This recvmsg request will do nothing except return buffer
+		 * space.
+		 */
+		control.flags = HOMA_RECVMSG_NONBLOCKING;
+		control.id = 0;
+		recvmsg(fd, &hdr, 0);
+	}
 	control.num_bpages = 0;
 	msg_length = -1;
+}
+
+/**
+ * homa::receiver::release_to_ring() - Return the bpages for the current
+ * message to Homa by adding them to the socket's return ring (no system
+ * call is needed). Thread-safe with respect to other receivers sharing
+ * the ring.
+ * Return:  True means the bpages were added to the ring; false means there
+ *          is no ring or it didn't have enough space.
+ */
+bool homa::receiver::release_to_ring()
+{
+	uint32_t head, tail, i;
+	bool result = false;
+
+	if (!ring)
+		return false;
+	while (__atomic_exchange_n(&ring->lock, 1, __ATOMIC_ACQUIRE)) {
+		/* Spin. */
+	}
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if ((head - tail + control.num_bpages) <= ring->size) {
+		for (i = 0; i < control.num_bpages; i++)
+			ring->offsets[(head + i) & (ring->size - 1)] =
+					control.bpage_offsets[i];
+		__atomic_store_n(&ring->head, head + control.num_bpages,
+				__ATOMIC_RELEASE);
+		result = true;
+	}
+	__atomic_store_n(&ring->lock, 0, __ATOMIC_RELEASE);
+	return result;
 }
\ No newline at end of file
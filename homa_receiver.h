@@ -22,7 +22,7 @@ namespace homa {
  * Typical usage:
  * - Call receive, which will invoke Homa to receive an incoming message.
  * - Access the message using methods such as get and copy_out (note: if
- *   the message is shorter than HOMA_BPAGE_SIZE then it will be contiguous).
+ *   the message is shorter than a bpage then it will be contiguous).
  * - Call receive to get the next message. This releases all of the resources
  *   associated with the previous message, so you can no longer access that.
  * - Access the new message ...
@@ -34,7 +34,8 @@ namespace homa {
  */
 class receiver {
 public:
-	receiver(int fd, void *buf_regio);
+	receiver(int fd, void *buf_region, int bpage_shift = HOMA_BPAGE_SHIFT,
+			struct homa_return_ring *ring = nullptr);
 	~receiver();
 
 	/**
@@ -46,11 +47,13 @@ public:
 	 */
 	inline size_t contiguous(size_t offset) const
 	{
+		size_t bpage_size = size_t(1) << bpage_shift;
+
 		if (static_cast<ssize_t>(offset) >= msg_length)
 			return 0;
-		if ((offset >> HOMA_BPAGE_SHIFT) == (control.num_bpages-1))
+		if ((offset >> bpage_shift) == (control.num_bpages-1))
 			return msg_length - offset;
-		return HOMA_BPAGE_SIZE - (offset & (HOMA_BPAGE_SIZE-1));
+		return bpage_size - (offset & (bpage_size-1));
 	}
 
 	/**
@@ -82,13 +85,14 @@ public:
 	 */
 	template<typename T>
 	inline T* get(size_t offset, T* storage = nullptr) const {
-		int buf_num = offset >> HOMA_BPAGE_SHIFT;
+		int buf_num = offset >> bpage_shift;
 		if (static_cast<ssize_t>(offset + sizeof(T)) > msg_length)
 			return nullptr;
 		if (contiguous(offset) >= sizeof(T))
 			return reinterpret_cast<T*>(buf_region
 					+ control.bpage_offsets[buf_num]
-					+ (offset & (HOMA_BPAGE_SIZE - 1)));
+					+ (offset & ((size_t(1) << bpage_shift)
+					- 1)));
 		if (storage)
 			copy_out(storage, offset, sizeof(T));
 		return storage;
@@ -159,5 +163,20 @@ protected:
 
 	/** @buf_region: First byte of buffer space for this message. */
 	char *buf_region;
+
+	/**
+	 * @bpage_shift: Log base 2 of the bpage size for the socket (must
+	 * match the value passed to SO_HOMA_SET_BUF).
+	 */
+	int bpage_shift;
+
+	/**
+	 * @ring: Return ring for the socket (see homa_return_ring_addr),
+	 * or nullptr if the socket doesn't have one. If non-null, release
+	 * returns bpages through the ring rather than calling recvmsg.
+	 */
+	struct homa_return_ring *ring;
+
+	bool release_to_ring();
 };
 }    // namespace homa
\ No newline at end of file
@@ -117,6 +117,7 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	hsk->ip_header_length = (hsk->inet.sk.sk_family == AF_INET)
 			? HOMA_IPV4_HEADER_LENGTH : HOMA_IPV6_HEADER_LENGTH;
 	hsk->shutdown = false;
+	hsk->grant_weight = 1;
 	while (1) {
 		if (homa->next_client_port < HOMA_MIN_DEFAULT_PORT) {
 			homa->next_client_port = HOMA_MIN_DEFAULT_PORT;
@@ -154,6 +155,9 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 		bucket->id = i + 1000000;
 	}
 	memset(&hsk->buffer_pool, 0, sizeof(hsk->buffer_pool));
+	spin_lock_init(&hsk->buffer_pool.ring_lock);
+	memset(&hsk->send_region, 0, sizeof(hsk->send_region));
+	spin_lock_init(&hsk->send_region.ring_lock);
 	spin_unlock_bh(&socktab->write_lock);
 }
 
@@ -207,6 +211,7 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	homa_sock_unlock(hsk);
 
 	homa_pool_destroy(&hsk->buffer_pool);
+	homa_send_region_destroy(&hsk->send_region);
 
 	i = 0;
 	while (!list_empty(&hsk->dead_rpcs)) {
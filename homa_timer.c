@@ -133,6 +133,63 @@ void homa_check_rpc(struct homa_rpc *rpc)
 				ntohl(resend.length));
 }
 
+/**
+ * homa_incast_check() - Invoked once per timer tick to decide whether
+ * this host is the target of an incast. When an incast starts or ends,
+ * homa->cutoff_version is changed so that homa_data_pkt will send CUTOFFS
+ * packets to tell senders about the new limit on unscheduled bytes.
+ * @homa:            Overall data about the Homa protocol implementation.
+ * @total_requests:  Total value of the requests_received metric across
+ *                   all cores.
+ */
+void homa_incast_check(struct homa *homa, __u64 total_requests)
+{
+	__u64 new_requests = total_requests - homa->incast_prev_requests;
+	int incast, changed = 0;
+
+	homa->incast_prev_requests = total_requests;
+
+	/* An incast shows up either as a burst of new requests or as
+	 * more bytes in transit to us than grants alone can produce (the
+	 * excess must be unscheduled data; FIFO grants can exceed
+	 * max_incoming by one increment).
+	 */
+	incast = (homa->incast_rpcs != 0)
+			&& ((new_requests >= homa->incast_rpcs)
+			|| (atomic_read(&homa->total_incoming)
+			> (homa->max_incoming + homa->fifo_grant_increment)));
+	if (incast) {
+		homa->incast_quiet_ticks = 0;
+		if (homa->incast_unsched_limit == 0) {
+			tt_record2("incast detected: %d new requests, "
+					"total_incoming %d", new_requests,
+					atomic_read(&homa->total_incoming));
+			homa->incast_unsched_limit = homa->incast_unsched_bytes;
+			changed = 1;
+			INC_METRIC(incasts, 1);
+		}
+	} else if (homa->incast_unsched_limit != 0) {
+		homa->incast_quiet_ticks++;
+		if (homa->incast_quiet_ticks >= homa->incast_ticks) {
+			tt_record("incast over");
+			homa->incast_unsched_limit = 0;
+			homa->incast_quiet_ticks = 0;
+			changed = 1;
+		}
+	}
+
+	if (changed) {
+		/* Cutoff versions are only 16 bits on the wire, and 0 means
+		 * "no CUTOFFS received yet", so skip it.
+		 */
+		homa->cutoff_version = (homa->cutoff_version + 1) & 0xffff;
+		if (homa->cutoff_version == 0)
+			homa->cutoff_version = 1;
+	}
+	if (homa->incast_unsched_limit != 0)
+		INC_METRIC(incast_ticks, 1);
+}
+
 /**
  * homa_timer() - This function is invoked at regular intervals ("ticks")
  * to implement retries and aborts for Homa.
@@ -151,16 +208,22 @@ void homa_timer(struct homa *homa)
 	static __u64 prev_grant_count = 0;
 	static int zero_count = 0;
 	int core;
-	__u64 total_grants;
+	__u64 total_grants, total_requests, total_data_bytes;
 
 	start = get_cycles();
 	homa->timer_ticks++;
 
 	total_grants = 0;
+	total_requests = 0;
+	total_data_bytes = 0;
 	for (core = 0; core < nr_cpu_ids; core++) {
 		struct homa_metrics *m = &homa_cores[core]->metrics;
 		total_grants += m->packets_sent[GRANT-DATA];
+		total_requests += m->requests_received;
+		total_data_bytes += m->data_bytes_received;
 	}
+	homa_incast_check(homa, total_requests);
+	homa_grant_tune_overcommit(homa, total_data_bytes);
 
 	tt_record3("homa_timer found total_incoming %d, num_grantable_rpcs %d, "
 			"new grants %d",
@@ -197,6 +260,17 @@ void homa_timer(struct homa *homa)
 			INC_METRIC(timer_reap_cycles, get_cycles() - start);
 		}
 
+		/* Collect bpages that the application returned through its
+		 * return ring, in case no one else needs buffer space soon,
+		 * and retry waiting RPCs if bpages were freed by code that
+		 * couldn't do it itself.
+		 */
+		if (!hsk->shutdown
+				&& ((homa_pool_drain_ring(&hsk->buffer_pool) > 0)
+				|| READ_ONCE(hsk->buffer_pool
+				.check_waiting_needed)))
+			homa_pool_check_waiting(&hsk->buffer_pool);
+
 		if (list_empty(&hsk->active_rpcs) || hsk->shutdown)
 			continue;
 
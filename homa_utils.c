@@ -14,8 +14,6 @@ struct homa_core *homa_cores[NR_CPUS];
 /* Points to block of memory holding all homa_cores; used to free it. */
 char *core_memory;
 
-struct completion homa_pacer_kthread_done;
-
 /**
  * homa_init() - Constructor for homa objects.
  * @homa:   Object to initialize.
@@ -59,39 +57,61 @@ int homa_init(struct homa *homa)
 				core->gen3_softirq_cores[j] = -1;
 			core->last_app_active = 0;
 			core->held_skb = NULL;
+			core->skb_cache = NULL;
+			core->num_cached_skbs = 0;
 			core->held_bucket = 0;
 			core->rpcs_locked = 0;
+			init_llist_head(&core->grantable_staged);
+			core->defer_grants = 0;
+			core->num_deferred_grants = 0;
 			memset(&core->metrics, 0, sizeof(core->metrics));
 		}
 	}
 
-	homa->pacer_kthread = NULL;
-	init_completion(&homa_pacer_kthread_done);
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		struct homa_pacer *pacer = &homa->pacers[i];
+
+		spin_lock_init(&pacer->mutex);
+		pacer->homa = homa;
+		pacer->index = i;
+		pacer->fifo_count = 1;
+		pacer->wake_time = 0;
+		spin_lock_init(&pacer->throttle_lock);
+		INIT_LIST_HEAD_RCU(&pacer->throttled_rpcs);
+		pacer->srpt_heap.root = NULL;
+		pacer->srpt_heap.next_seq = 0;
+		pacer->fifo_heap.root = NULL;
+		pacer->fifo_heap.next_seq = 0;
+		pacer->throttle_add = 0;
+		pacer->head_bytes = INT_MAX;
+		pacer->kthread = NULL;
+		init_completion(&pacer->kthread_done);
+		hrtimer_init(&pacer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		pacer->timer.function = &homa_pacer_timer;
+	}
+	homa->pacers_throttled = 0;
+	homa->num_pacers = 1;
 	atomic64_set(&homa->next_outgoing_id, 2);
 	atomic64_set(&homa->link_idle_time, get_cycles());
 	spin_lock_init(&homa->grantable_lock);
 	homa->grantable_lock_time = 0;
 	atomic_set(&homa->grant_recalc_count, 0);
-	INIT_LIST_HEAD(&homa->grantable_peers);
+	for (i = 0; i < HOMA_GRANT_BUCKETS; i++)
+		INIT_LIST_HEAD(&homa->grantable_peers[i]);
+	homa->grantable_nonempty = 0;
 	INIT_LIST_HEAD(&homa->grantable_rpcs);
 	homa->num_grantable_rpcs = 0;
 	homa->last_grantable_change = get_cycles();
 	homa->max_grantable_rpcs = 0;
+	atomic_set(&homa->num_staged_rpcs, 0);
 	homa->oldest_rpc = NULL;
 	homa->num_active_rpcs = 0;
 	for (i = 0; i < HOMA_MAX_GRANTS; i++) {
 		homa->active_rpcs[i] = NULL;
-		atomic_set(&homa->active_remaining[i], 0);
+		atomic64_set(&homa->active_remaining[i], 0);
 	}
-	homa->grant_nonfifo = 0;
-	homa->grant_nonfifo_left = 0;
-	spin_lock_init(&homa->pacer_mutex);
+	atomic_set(&homa->grant_nonfifo_left, 0);
 	homa->pacer_fifo_fraction = 50;
-	homa->pacer_fifo_count = 1;
-	homa->pacer_wake_time = 0;
-	spin_lock_init(&homa->throttle_lock);
-	INIT_LIST_HEAD_RCU(&homa->throttled_rpcs);
-	homa->throttle_add = 0;
 	homa->throttle_min_bytes = 200;
 	atomic_set(&homa->total_incoming, 0);
 	homa->next_client_port = HOMA_MIN_DEFAULT_PORT;
@@ -124,9 +144,24 @@ int homa_init(struct homa *homa)
 #else
 	homa->cutoff_version = 1;
 #endif
-	homa->fifo_grant_increment = 10000;
+	homa->incast_rpcs = 100;
+	homa->incast_unsched_bytes = 2000;
+	homa->incast_ticks = 10;
+	homa->incast_unsched_limit = 0;
+	homa->incast_quiet_ticks = 0;
+	homa->incast_prev_requests = 0;
+	homa->fifo_grant_interval = 200000;
 	homa->grant_fifo_fraction = 50;
+	homa->batch_grants = 0;
 	homa->max_overcommit = 8;
+	homa->dynamic_overcommit = 0;
+	homa->overcommit_min = 2;
+	homa->overcommit_max = HOMA_MAX_GRANTS;
+	homa->overcommit_ticks = 4;
+	homa->overcommit_tick_count = 0;
+	homa->overcommit_prev_bytes = 0;
+	homa->overcommit_prev_util = 0;
+	homa->overcommit_last_change = 0;
 	homa->max_incoming = 400000;
 	homa->max_rpcs_per_peer = 1;
 	homa->resend_ticks = 5;
@@ -137,22 +172,21 @@ int homa_init(struct homa *homa)
 	homa->reap_limit = 10;
 	homa->dead_buffs_limit = 5000;
 	homa->max_dead_buffs = 0;
-	homa->pacer_kthread = kthread_run(homa_pacer_main, homa,
-			"homa_pacer");
-	if (IS_ERR(homa->pacer_kthread)) {
-		err = PTR_ERR(homa->pacer_kthread);
-		homa->pacer_kthread = NULL;
-		printk(KERN_ERR "couldn't create homa pacer thread: error %d\n",
-			err);
-		return err;
-	}
 	homa->pacer_exit = false;
+	err = homa_pacer_start(homa, homa->num_pacers);
+	if (err)
+		return err;
 	homa->max_nic_queue_ns = 2000;
 	homa->cycles_per_kbyte = 0;
+	homa->bql_feedback = 0;
+	homa->bql_next_sample = 0;
 	homa->verbose = 0;
 	homa->max_gso_size = 10000;
 	homa->max_gro_skbs = 20;
 	homa->gso_force_software = 0;
+	homa->xmit_chunk_bytes = 0;
+	homa->copy_helper_bytes = 0;
+	homa->skb_cache_size = 0;
 	homa->gro_policy = HOMA_GRO_NORMAL;
 	homa->busy_usecs = 100;
 	homa->gro_busy_usecs = 5;
@@ -178,15 +212,15 @@ int homa_init(struct homa *homa)
 void homa_destroy(struct homa *homa)
 {
 	int i;
-	if (homa->pacer_kthread) {
-		homa_pacer_stop(homa);
-		wait_for_completion(&homa_pacer_kthread_done);
-	}
+
+	homa_pacer_stop(homa);
 
 	/* The order of the following 2 statements matters! */
 	homa_socktab_destroy(&homa->port_map);
 	homa_peertab_destroy(&homa->peers);
 	if (core_memory) {
+		for (i = 0; i < nr_cpu_ids; i++)
+			homa_skb_cache_flush(homa_cores[i]);
 		vfree(core_memory);
 		core_memory = NULL;
 		for (i = 0; i < nr_cpu_ids; i++) {
@@ -248,6 +282,7 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->interest = NULL;
 	INIT_LIST_HEAD(&crpc->grantable_links);
 	INIT_LIST_HEAD(&crpc->throttled_links);
+	crpc->pacer = NULL;
 	crpc->silent_ticks = 0;
 	crpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	crpc->done_timer_ticks = 0;
@@ -349,6 +384,7 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->interest = NULL;
 	INIT_LIST_HEAD(&srpc->grantable_links);
 	INIT_LIST_HEAD(&srpc->throttled_links);
+	srpc->pacer = NULL;
 	srpc->silent_ticks = 0;
 	srpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	srpc->done_timer_ticks = 0;
@@ -493,7 +529,7 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	list_del_rcu(&rpc->active_links);
 	list_add_tail_rcu(&rpc->dead_links, &rpc->hsk->dead_rpcs);
 	__list_del_entry(&rpc->ready_links);
-	__list_del_entry(&rpc->buf_links);
+	homa_pool_forget_rpc(&rpc->hsk->buffer_pool, rpc);
 	if (rpc->interest != NULL) {
 		rpc->interest->reg_rpc = NULL;
 		wake_up_process(rpc->interest->thread);
@@ -551,8 +587,9 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 #define BATCH_MAX 20
 #endif
 	struct sk_buff *skbs[BATCH_MAX];
+	struct sk_buff *out_skbs[BATCH_MAX];
 	struct homa_rpc *rpcs[BATCH_MAX];
-	int num_skbs, num_rpcs;
+	int num_skbs, num_out_skbs, num_rpcs;
 	struct homa_rpc *rpc;
 	int i, batch_size;
 	int result;
@@ -568,7 +605,7 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 		if (batch_size > BATCH_MAX)
 			batch_size = BATCH_MAX;
 		count -= batch_size;
-		num_skbs = num_rpcs = 0;
+		num_skbs = num_out_skbs = num_rpcs = 0;
 
 		homa_sock_lock(hsk, "homa_rpc_reap");
 		if (atomic_read(&hsk->protect_count)) {
@@ -594,13 +631,15 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 			rpc->magic = 0;
 			if (rpc->msgout.length >= 0) {
 				while (rpc->msgout.packets) {
-					skbs[num_skbs] = rpc->msgout.packets;
+					out_skbs[num_out_skbs] =
+							rpc->msgout.packets;
 					rpc->msgout.packets = homa_get_skb_info(
 							rpc->msgout.packets)
 							->next_skb;
-					num_skbs++;
+					num_out_skbs++;
 					rpc->msgout.num_skbs--;
-					if (num_skbs >= batch_size)
+					if ((num_skbs + num_out_skbs)
+							>= batch_size)
 						goto release;
 				}
 			}
@@ -613,7 +652,8 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 						break;
 					skbs[num_skbs] = skb;
 					num_skbs++;
-					if (num_skbs >= batch_size)
+					if ((num_skbs + num_out_skbs)
+							>= batch_size)
 						goto release;
 				}
 			}
@@ -632,12 +672,14 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 		 * lock while doing this.
 		 */
 	release:
-		hsk->dead_skbs -= num_skbs;
+		hsk->dead_skbs -= num_skbs + num_out_skbs;
 		result = !list_empty(&hsk->dead_rpcs)
-				&& ((num_skbs + num_rpcs) != 0);
+				&& ((num_skbs + num_out_skbs + num_rpcs) != 0);
 		homa_sock_unlock(hsk);
 		for (i = 0; i < num_skbs; i++)
 			kfree_skb(skbs[i]);
+		for (i = 0; i < num_out_skbs; i++)
+			homa_skb_recycle(hsk->homa, out_skbs[i]);
 		for (i = 0; i < num_rpcs; i++) {
 			rpc = rpcs[i];
 			UNIT_LOG("; ", "reaped %llu", rpc->id);
@@ -668,6 +710,7 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 					kfree(gap);
 				}
 			}
+			kfree(rpc->msgout.skb_index);
 			tt_record1("homa_rpc_reap finished reaping id %d",
 					rpc->id);
 			rpc->state = 0;
@@ -943,6 +986,8 @@ int homa_validate_incoming(struct homa *homa, int verbose, int *link_errors)
 						rpc->msgin.rec_incoming);
 			if (rpc->msgin.granted >= rpc->msgin.length)
 				continue;
+			if (smp_load_acquire(&rpc->msgin.staged))
+				continue;
 			if (list_empty(&rpc->grantable_links)) {
 				tt_record1("homa_validate_incoming: RPC id %d "
 						"not linked in grantable list",
@@ -1070,7 +1115,7 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 	case DATA: {
 		struct data_header *h = (struct data_header *)
 				skb->data;
-		struct data_segment *seg;
+		struct data_segment *seg, seg_buf;
 		int seg_length = ntohl(h->seg.segment_length);
 		int bytes_left, i;
 		used = homa_snprintf(buffer, buf_len, used,
@@ -1094,8 +1139,10 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 			break;
 		used = homa_snprintf(buffer, buf_len, used, ", extra segs");
 		for (i = skb_shinfo(skb)->gso_segs - 1; i > 0; i--) {
-			seg = (struct data_segment *) (skb->data + skb->len
-					- bytes_left);
+			seg = skb_header_pointer(skb, skb->len - bytes_left,
+					sizeof(seg_buf), &seg_buf);
+			if (!seg)
+				break;
 			seg_length = ntohl(seg->segment_length);
 			used = homa_snprintf(buffer, buf_len, used,
 					" %d@%d", seg_length,
@@ -1139,6 +1186,11 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 				ntohl(h->unsched_cutoffs[6]),
 				ntohl(h->unsched_cutoffs[7]),
 				ntohs(h->cutoff_version));
+		if ((skb->len >= sizeof(struct cutoffs_header))
+				&& (h->unsched_bytes != 0))
+			used = homa_snprintf(buffer, buf_len, used,
+					", unsched_bytes %u",
+					ntohl(h->unsched_bytes));
 		break;
 	}
 	case FREEZE:
@@ -1161,6 +1213,23 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 		}
 		break;
 	}
+	case MULTI_GRANT: {
+		struct multi_grant_header *h = (struct multi_grant_header *)
+				skb->data;
+		int i, count;
+		count = ntohs(h->num_grants);
+		used = homa_snprintf(buffer, buf_len, used, ", grants");
+		for (i = 0; (i < count) && (i < HOMA_MAX_MULTI_GRANTS); i++) {
+			used = homa_snprintf(buffer, buf_len, used,
+					" [id %llu, offset %d, grant_prio %u%s]",
+					be64_to_cpu(h->grants[i].sender_id),
+					ntohl(h->grants[i].offset),
+					h->grants[i].priority,
+					h->grants[i].resend_all
+					? ", resend_all" : "");
+		}
+		break;
+	}
 	}
 
 	buffer[buf_len-1] = 0;
@@ -1184,7 +1253,7 @@ char *homa_print_packet_short(struct sk_buff *skb, char *buffer, int buf_len)
 	switch (common->type) {
 	case DATA: {
 		struct data_header *h = (struct data_header *) common;
-		struct data_segment *seg;
+		struct data_segment *seg, seg_buf;
 		int bytes_left, used, i;
 		int seg_length = ntohl(h->seg.segment_length);
 
@@ -1193,8 +1262,10 @@ char *homa_print_packet_short(struct sk_buff *skb, char *buffer, int buf_len)
 				seg_length, ntohl(h->seg.offset));
 		bytes_left = skb->len - sizeof32(*h) - seg_length;
 		for (i = skb_shinfo(skb)->gso_segs - 1; i > 0; i--) {
-			seg = (struct data_segment *) (skb->data + skb->len
-					- bytes_left);
+			seg = skb_header_pointer(skb, skb->len - bytes_left,
+					sizeof(seg_buf), &seg_buf);
+			if (!seg)
+				break;
 			seg_length = ntohl(seg->segment_length);
 			used = homa_snprintf(buffer, buf_len, used,
 					" %d@%d", seg_length,
@@ -1236,6 +1307,23 @@ char *homa_print_packet_short(struct sk_buff *skb, char *buffer, int buf_len)
 	case ACK:
 		snprintf(buffer, buf_len, "ACK");
 		break;
+	case MULTI_GRANT: {
+		struct multi_grant_header *h = (struct multi_grant_header *)
+				common;
+		int i, count, used;
+		count = ntohs(h->num_grants);
+		used = homa_snprintf(buffer, buf_len, 0, "MULTI_GRANT");
+		for (i = 0; (i < count) && (i < HOMA_MAX_MULTI_GRANTS); i++) {
+			used = homa_snprintf(buffer, buf_len, used,
+					" %llu:%d@%d%s",
+					be64_to_cpu(h->grants[i].sender_id),
+					ntohl(h->grants[i].offset),
+					h->grants[i].priority,
+					h->grants[i].resend_all
+					? " resend_all" : "");
+		}
+		break;
+	}
 	default:
 		snprintf(buffer, buf_len, "unknown packet type 0x%x",
 				common->type);
@@ -1374,6 +1462,8 @@ char *homa_symbol_for_type(uint8_t type)
 		return "NEED_ACK";
 	case ACK:
 		return "ACK";
+	case MULTI_GRANT:
+		return "MULTI_GRANT";
 	}
 
 	/* Using a static buffer can produce garbled text under concurrency,
@@ -1518,6 +1608,10 @@ char *homa_print_metrics(struct homa *homa)
 					symbol, m->packets_received[i-DATA],
 					symbol);
 		}
+		homa_append_metric(homa,
+				"data_bytes_received       %15llu  "
+				"Message bytes in incoming DATA packets\n",
+				m->data_bytes_received);
 		for (i = 0; i < HOMA_MAX_PRIORITIES; i++) {
 			homa_append_metric(homa,
 					"priority%d_bytes        %15llu  "
@@ -1547,6 +1641,27 @@ char *homa_print_metrics(struct homa *homa)
 				"responses_queued          %15llu  "
 				"Responses for which no thread was waiting\n",
 				m->responses_queued);
+		homa_append_metric(homa,
+				"incasts                   %15llu  "
+				"Times an incoming incast was detected\n",
+				m->incasts);
+		homa_append_metric(homa,
+				"incast_ticks              %15llu  "
+				"Timer ticks during which incast was active\n",
+				m->incast_ticks);
+		homa_append_metric(homa,
+				"overcommit_increases      %15llu  "
+				"Dynamic increases in overcommit_current\n",
+				m->overcommit_increases);
+		homa_append_metric(homa,
+				"overcommit_decreases      %15llu  "
+				"Dynamic decreases in overcommit_current\n",
+				m->overcommit_decreases);
+		homa_append_metric(homa,
+				"unsched_limited_msgs      %15llu  "
+				"Outgoing messages with unsched bytes reduced "
+				"for incast\n",
+				m->unsched_limited_msgs);
 		homa_append_metric(homa,
 				"fast_wakeups              %15llu  "
 				"Messages received while polling\n",
@@ -1665,6 +1780,11 @@ char *homa_print_metrics(struct homa *homa)
 				"pacer_cycles              %15llu  "
 				"Time spent in homa_pacer_main\n",
 				m->pacer_cycles);
+		homa_append_metric(homa,
+				"pacer_timer_sleeps        %15llu  "
+				"Pacer sleeps waiting for the NIC queue to "
+				"drain\n",
+				m->pacer_timer_sleeps);
 		homa_append_metric(homa,
 				"homa_cycles               %15llu  "
 				"Total time in all Homa-related functions\n",
@@ -1677,6 +1797,16 @@ char *homa_print_metrics(struct homa *homa)
 				"Lost transmission time because pacer was "
 				"slow\n",
 				m->pacer_lost_cycles);
+		homa_append_metric(homa,
+				"bql_samples               %15llu  "
+				"Corrections of link_idle_time from dql "
+				"info\n",
+				m->bql_samples);
+		homa_append_metric(homa,
+				"bql_unavailable           %15llu  "
+				"Times dql info was not available for "
+				"a device\n",
+				m->bql_unavailable);
 		homa_append_metric(homa,
 				"pacer_bytes               %15llu  "
 				"Bytes transmitted when the pacer was active\n",
@@ -1813,6 +1943,10 @@ char *homa_print_metrics(struct homa *homa)
 				"grantable_lock_misses     %15llu  "
 				"Grantable lock misses\n",
 				m->grantable_lock_misses);
+		homa_append_metric(homa,
+				"grantable_lock_acquires   %15llu  "
+				"Number of times grantable lock was acquired\n",
+				m->grantable_lock_acquires);
 		homa_append_metric(homa,
 				"grantable_lock_miss_cycles%15llu  "
 				"Time lost waiting for grantable lock\n",
@@ -1821,6 +1955,20 @@ char *homa_print_metrics(struct homa *homa)
 				"grantable_rpcs_integral   %15llu  "
 				"Integral of homa->num_grantable_rpcs*dt\n",
 				m->grantable_rpcs_integral);
+		homa_append_metric(homa,
+				"grantable_staged_rpcs     %15llu  "
+				"New grantable RPCs staged without grantable "
+				"lock\n",
+				m->grantable_staged_rpcs);
+		homa_append_metric(homa,
+				"grantable_peer_inserts    %15llu  "
+				"Insertions into homa->grantable_peers\n",
+				m->grantable_peer_inserts);
+		homa_append_metric(homa,
+				"grantable_peer_checks     %15llu  "
+				"Peers checked during grantable_peers "
+				"insertions\n",
+				m->grantable_peer_checks);
 		homa_append_metric(homa,
 				"grant_recalc_calls        %15llu  "
 				"Number of calls to homa_grant_recalc\n",
@@ -1839,6 +1987,20 @@ char *homa_print_metrics(struct homa *homa)
 				"Number of times an RPC moved up in the grant "
 				"priority order\n",
 				m->grant_priority_bumps);
+		homa_append_metric(homa,
+				"grant_incremental_bumps   %15llu  "
+				"Priority bumps handled without "
+				"homa_grant_recalc\n",
+				m->grant_incremental_bumps);
+		homa_append_metric(homa,
+				"grant_recalcs_avoided     %15llu  "
+				"homa_grant_check_rpc calls that didn't need "
+				"homa_grant_recalc\n",
+				m->grant_recalcs_avoided);
+		homa_append_metric(homa,
+				"grants_coalesced          %15llu  "
+				"Grants sent in MULTI_GRANT packets\n",
+				m->grants_coalesced);
 		homa_append_metric(homa,
 				"fifo_grants               %15llu  "
 				"Grants issued using FIFO priority\n",
@@ -1873,11 +2035,6 @@ char *homa_print_metrics(struct homa *homa)
 				"throttle_list_adds        %15llu  "
 				"Calls to homa_add_to_throttled\n",
 				m->throttle_list_adds);
-		homa_append_metric(homa,
-				"throttle_list_checks      %15llu  "
-				"List elements checked in "
-				"homa_add_to_throttled\n",
-				m->throttle_list_checks);
 		homa_append_metric(homa,
 				"ack_overflows             %15llu  "
 				"Explicit ACKs sent because peer->acks was "
@@ -1893,11 +2050,81 @@ char *homa_print_metrics(struct homa *homa)
 				"Buffer page could be reused because ref "
 				"count was zero\n",
 				m->bpage_reuses);
+		homa_append_metric(homa,
+				"bpage_cache_hits          %15llu  "
+				"Bpages allocated from a core's cache of "
+				"free bpages\n",
+				m->bpage_cache_hits);
+		homa_append_metric(homa,
+				"bpage_map_words           %15llu  "
+				"Free map words examined by "
+				"homa_pool_get_pages\n",
+				m->bpage_map_words);
+		homa_append_metric(homa,
+				"bpage_scans_0             %15llu  "
+				"homa_pool_get_pages calls that examined no "
+				"free map words\n",
+				m->bpage_scan_lengths[0]);
+		for (i = 1; i < HOMA_SCAN_BUCKETS - 1; i++) {
+			homa_append_metric(homa,
+				"bpage_scans_%-14d%15llu  "
+				"homa_pool_get_pages calls that examined "
+				"%d-%d free map words\n",
+				1 << (i-1), m->bpage_scan_lengths[i],
+				1 << (i-1), (1 << i) - 1);
+		}
+		homa_append_metric(homa,
+				"bpage_scans_%-14d%15llu  "
+				"homa_pool_get_pages calls that examined "
+				">= %d free map words\n",
+				1 << (HOMA_SCAN_BUCKETS-2),
+				m->bpage_scan_lengths[HOMA_SCAN_BUCKETS-1],
+				1 << (HOMA_SCAN_BUCKETS-2));
+		homa_append_metric(homa,
+				"bpage_partial_fills       %15llu  "
+				"Bpages used for partial allocations that "
+				"filled up\n",
+				m->bpage_partial_fills);
+		homa_append_metric(homa,
+				"bpage_partial_waste       %15llu  "
+				"Bytes never allocated in bpages counted by "
+				"bpage_partial_fills\n",
+				m->bpage_partial_waste);
 		homa_append_metric(homa,
 				"buffer_alloc_failures     %15llu  "
 				"homa_pool_allocate didn't find enough buffer "
 				"space for an RPC\n",
 				m->buffer_alloc_failures);
+		homa_append_metric(homa,
+				"buffer_partial_allocs     %15llu  "
+				"homa_pool_allocate allocated space only for "
+				"the granted part of a message\n",
+				m->buffer_partial_allocs);
+		homa_append_metric(homa,
+				"buffer_extend_failures    %15llu  "
+				"Grants limited because more buffer space "
+				"couldn't be allocated\n",
+				m->buffer_extend_failures);
+		homa_append_metric(homa,
+				"buffer_wait_cycles        %15llu  "
+				"Time spent by RPCs waiting for buffer "
+				"space\n",
+				m->buffer_wait_cycles);
+		homa_append_metric(homa,
+				"bpage_ring_returns        %15llu  "
+				"Bpages returned by apps through return "
+				"rings\n",
+				m->bpage_ring_returns);
+		homa_append_metric(homa,
+				"bpage_local_allocs        %15llu  "
+				"Bpages allocated on the preferred NUMA "
+				"node\n",
+				m->bpage_local_allocs);
+		homa_append_metric(homa,
+				"bpage_remote_allocs       %15llu  "
+				"Bpages allocated on a NUMA node other than "
+				"the preferred one\n",
+				m->bpage_remote_allocs);
 		homa_append_metric(homa,
 				"linux_pkt_alloc_bytes     %15llu  "
 				"Bytes allocated in new packets by NIC driver "
@@ -1926,6 +2153,39 @@ char *homa_print_metrics(struct homa *homa)
 				"Data packets passed directly to homa_softirq "
 				"by homa_gro_receive\n",
 				m->gro_data_bypasses);
+		homa_append_metric(homa,
+				"zerocopy_bytes            %15llu  "
+				"Message bytes sent from user pages without "
+				"copying\n",
+				m->zerocopy_bytes);
+		homa_append_metric(homa,
+				"zerocopy_notify_drops     %15llu  "
+				"Zero-copy notifications dropped (error queue "
+				"full)\n",
+				m->zerocopy_notify_drops);
+		homa_append_metric(homa,
+				"send_ring_overflows       %15llu  "
+				"Send-region completions not added to ring "
+				"(full)\n",
+				m->send_ring_overflows);
+		homa_append_metric(homa,
+				"copy_helpers              %15llu  "
+				"Idle cores asked to help copy outgoing "
+				"messages\n",
+				m->copy_helpers);
+		homa_append_metric(homa,
+				"helper_copy_bytes         %15llu  "
+				"Outgoing bytes copied by helper cores\n",
+				m->helper_copy_bytes);
+		homa_append_metric(homa,
+				"recycled_skbs             %15llu  "
+				"Outgoing sk_buffs reused from per-core "
+				"cache\n",
+				m->recycled_skbs);
+		homa_append_metric(homa,
+				"resent_shared_bytes       %15llu  "
+				"Retransmitted bytes sent without copying\n",
+				m->resent_shared_bytes);
 		for (i = 0; i < NUM_TEMP_METRICS;  i++)
 			homa_append_metric(homa,
 					"temp%-2d                  %15llu  "
@@ -2000,18 +2260,161 @@ void homa_free_skbs(struct sk_buff *head)
 	}
 }
 
+/**
+ * homa_heap_less() - Returns true if @a belongs ahead of @b in a heap.
+ * @a:    First node to compare.
+ * @b:    Second node to compare.
+ */
+static inline bool homa_heap_less(struct homa_heap_node *a,
+		struct homa_heap_node *b)
+{
+	return (a->key < b->key) || ((a->key == b->key) && (a->seq < b->seq));
+}
+
+/**
+ * homa_heap_meld() - Combine two heap-ordered trees into one.
+ * @a:       Root of the first tree (may be NULL). Must not have siblings.
+ * @b:       Root of the second tree (may be NULL). Must not have siblings.
+ *
+ * Return:   Root of the combined tree.
+ */
+static struct homa_heap_node *homa_heap_meld(struct homa_heap_node *a,
+		struct homa_heap_node *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (homa_heap_less(b, a))
+		swap(a, b);
+	b->prev = a;
+	b->next = a->child;
+	if (a->child)
+		a->child->prev = b;
+	a->child = b;
+	return a;
+}
+
+/**
+ * homa_heap_merge_pairs() - Combine a list of sibling trees into a single
+ * tree, using the standard two-pass pairing approach (first meld adjacent
+ * pairs left to right, then meld the results right to left). This is
+ * what keeps removal O(log n) amortized.
+ * @first:   Leftmost tree in a list linked through @next (may be NULL).
+ *
+ * Return:   Root of the combined tree.
+ */
+static struct homa_heap_node *homa_heap_merge_pairs(
+		struct homa_heap_node *first)
+{
+	struct homa_heap_node *pairs = NULL;
+	struct homa_heap_node *result = NULL;
+
+	/* First pass: the results are pushed on a stack (linked through
+	 * @next), which reverses their order for the second pass.
+	 */
+	while (first) {
+		struct homa_heap_node *a = first;
+		struct homa_heap_node *b = a->next;
+
+		first = b ? b->next : NULL;
+		a->next = a->prev = NULL;
+		if (b) {
+			b->next = b->prev = NULL;
+			a = homa_heap_meld(a, b);
+		}
+		a->next = pairs;
+		pairs = a;
+	}
+
+	while (pairs) {
+		struct homa_heap_node *next = pairs->next;
+
+		pairs->next = NULL;
+		result = homa_heap_meld(pairs, result);
+		pairs = next;
+	}
+	return result;
+}
+
+/**
+ * homa_heap_detach() - Unlink a (non-root) node, along with its subtree,
+ * from its parent and siblings.
+ * @node:   Node to detach; must not be the root of its heap.
+ */
+static void homa_heap_detach(struct homa_heap_node *node)
+{
+	if (node->prev->child == node)
+		node->prev->child = node->next;
+	else
+		node->prev->next = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	node->next = node->prev = NULL;
+}
+
+/**
+ * homa_heap_insert() - Add a node to a heap.
+ * @heap:    Heap in which to insert @node.
+ * @node:    Node to insert; must not currently be in any heap.
+ * @key:     Ordering key for @node.
+ */
+void homa_heap_insert(struct homa_heap *heap, struct homa_heap_node *node,
+		__u64 key)
+{
+	node->key = key;
+	node->seq = heap->next_seq++;
+	node->child = node->next = node->prev = NULL;
+	heap->root = homa_heap_meld(heap->root, node);
+}
+
+/**
+ * homa_heap_remove() - Remove a node from a heap.
+ * @heap:    Heap containing @node.
+ * @node:    Node to remove (need not be the smallest).
+ */
+void homa_heap_remove(struct homa_heap *heap, struct homa_heap_node *node)
+{
+	struct homa_heap_node *children = homa_heap_merge_pairs(node->child);
+
+	node->child = NULL;
+	if (node == heap->root) {
+		heap->root = children;
+		return;
+	}
+	homa_heap_detach(node);
+	heap->root = homa_heap_meld(heap->root, children);
+}
+
+/**
+ * homa_heap_decrease_key() - Reduce the key for a node that is already
+ * in a heap, and restore the heap ordering.
+ * @heap:    Heap containing @node.
+ * @node:    Node whose key has decreased.
+ * @key:     New key for @node; must not be larger than its current key.
+ */
+void homa_heap_decrease_key(struct homa_heap *heap,
+		struct homa_heap_node *node, __u64 key)
+{
+	node->key = key;
+	if (node == heap->root)
+		return;
+	homa_heap_detach(node);
+	heap->root = homa_heap_meld(heap->root, node);
+}
+
 /**
  * homa_throttle_lock_slow() - This function implements the slow path for
  * acquiring the throttle lock. It is invoked when the lock isn't immediately
  * available. It waits for the lock, but also records statistics about
  * the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @pacer:   Pacer shard whose throttle lock is needed.
  */
-void homa_throttle_lock_slow(struct homa *homa)
+void homa_throttle_lock_slow(struct homa_pacer *pacer)
 {
 	__u64 start = get_cycles();
 	tt_record("beginning wait for throttle lock");
-	spin_lock_bh(&homa->throttle_lock);
+	spin_lock_bh(&pacer->throttle_lock);
 	tt_record("ending wait for throttle lock");
 	INC_METRIC(throttle_lock_misses, 1);
 	INC_METRIC(throttle_lock_miss_cycles, get_cycles() - start);
@@ -29,26 +29,36 @@ extern void      *memcpy(void *dest, const void *src, size_t n);
  * the next call to the function will fail; bit 1 corresponds to the next
  * call after that, and so on.
  */
+int mock_alloc_page_errors = 0;
 int mock_alloc_skb_errors = 0;
 int mock_copy_data_errors = 0;
 int mock_copy_to_iter_errors = 0;
 int mock_copy_to_user_errors = 0;
 int mock_cpu_idle = 0;
+int mock_gup_errors = 0;
 int mock_import_single_range_errors = 0;
 int mock_import_iovec_errors = 0;
 int mock_ip6_xmit_errors = 0;
 int mock_ip_queue_xmit_errors = 0;
 int mock_kmalloc_errors = 0;
+int mock_locked_vm_errors = 0;
+int mock_queue_err_skb_errors = 0;
 int mock_route_errors = 0;
 int mock_spin_lock_held = 0;
 int mock_trylock_errors = 0;
 int mock_vmalloc_errors = 0;
+int mock_vmap_errors = 0;
 
 /* The return value from calls to signal_pending(). */
 int mock_signal_pending = 0;
 
+/* Used as the mm_struct for the current task during tests; mm_count
+ * should be zero at the end of each test (no references leaked).
+ */
+struct mm_struct mock_mm;
+
 /* Used as current task during tests. */
-struct task_struct mock_task;
+struct task_struct mock_task = {.mm = &mock_mm};
 
 /* If a test sets this variable to nonzero, ip_queue_xmit will log
  * outgoing packets using the long format rather than short.
@@ -72,12 +82,6 @@ int mock_log_rcu_sched = 0;
  */
 int mock_copy_to_user_dont_copy = 0;
 
-/* HOMA_BPAGE_SIZE will evaluate to this. */
-int mock_bpage_size = 0x10000;
-
-/* HOMA_BPAGE_SHIFT will evaluate to this. */
-int mock_bpage_shift = 16;
-
 /* Keeps track of all sk_buffs that are alive in the current test.
  * Reset for each test.
  */
@@ -102,6 +106,54 @@ static struct unit_hash *routes_in_use = NULL;
  */
 static struct unit_hash *vmallocs_in_use = NULL;
 
+/* Keeps track of all the mappings that have been created by vmap but
+ * not yet released by vunmap (value is the underlying malloced block).
+ * Reset for each test.
+ */
+static struct unit_hash *vmaps_in_use = NULL;
+
+/* Keeps track of all the pages returned by alloc_page or
+ * iov_iter_get_pages2 that still have references (the page is the first
+ * field of a struct mock_page). Reset for each test.
+ */
+static struct unit_hash *pages_in_use = NULL;
+
+/**
+ * struct mock_page - Used in place of struct page for pages allocated by
+ * the mock functions, so they can be reference-counted.
+ */
+struct mock_page {
+	/** @page: must be the first field. */
+	struct page page;
+
+	/** @refs: number of outstanding references to the page. */
+	int refs;
+
+	/** @data: value returned by page_address for this page. */
+	char *data;
+
+	/** @buf: malloc-ed block to free with the page (NULL for none). */
+	char *buf;
+};
+
+/* Number of pages pinned by pin_user_pages_fast but not yet unpinned. */
+int mock_pinned_pages = 0;
+
+/* The gup_flags argument from the most recent call to
+ * pin_user_pages_fast.
+ */
+unsigned int mock_gup_flags = 0;
+
+/* If true, pin_user_pages_fast returns reference-counted pages created
+ * with mock_page_new (so they can be attached to sk_buffs), and the pin
+ * reference is dropped by unpin_user_pages. Otherwise it returns the
+ * user addresses, cast to struct page *.
+ */
+bool mock_pin_tracked_pages = false;
+
+/* Number of pages charged by account_locked_vm but not yet uncharged. */
+long mock_locked_vm = 0;
+
 /* The number of locks that have been acquired but not yet released.
  * Should be 0 at the end of each test.
  */
@@ -129,6 +181,16 @@ bool mock_ipv6_default;
 /* Linux's idea of the current CPU number. */
 int cpu_number = 1;
 
+/* Number of NUMA nodes; mock_cpu_to_node places cores round-robin
+ * across nodes.
+ */
+int mock_nr_node_ids = 1;
+
+/* Pages whose addresses have any of these bits set are considered to
+ * be on NUMA node 1; all others are on node 0.
+ */
+unsigned long mock_numa_mask = 0;
+
 /* List of priorities for all outbound packets. */
 char mock_xmit_prios[1000];
 int mock_xmit_prios_offset = 0;
@@ -141,9 +203,15 @@ int mock_xmit_prios_offset = 0;
 int mock_mtu = 0;
 
 struct dst_ops mock_dst_ops = {.mtu = mock_get_mtu};
+/* Transmit queues for mock_net_device; tests can modify the dql
+ * counters in them to simulate byte queue limits info from a driver.
+ */
+struct netdev_queue mock_tx_queues[2];
 struct net_device mock_net_device = {
 		.gso_max_segs = 1000,
-		.gso_max_size = 0};
+		.gso_max_size = 0,
+		._tx = mock_tx_queues,
+		.real_num_tx_queues = 2};
 
 static struct hrtimer_clock_base clock_base;
 unsigned int cpu_khz = 1000000;
@@ -160,6 +228,19 @@ char sock_flow_table[RPS_SOCK_FLOW_TABLE_SIZE(1024)];
 struct rps_sock_flow_table *rps_sock_flow_table
 		= (struct rps_sock_flow_table *) sock_flow_table;
 __u32 rps_cpu_mask = 0x1f;
+struct workqueue_struct *system_highpri_wq = NULL;
+
+int account_locked_vm(struct mm_struct *mm, unsigned long pages, bool inc)
+{
+	if (!inc) {
+		mock_locked_vm -= pages;
+		return 0;
+	}
+	if (mock_check_error(&mock_locked_vm_errors))
+		return -ENOMEM;
+	mock_locked_vm += pages;
+	return 0;
+}
 
 extern void add_wait_queue(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry) {}
@@ -206,6 +287,13 @@ void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 
 void __check_object_size(const void *ptr, unsigned long n, bool to_user) {}
 
+void complete(struct completion *x) {}
+
+unsigned int cpumask_local_spread(unsigned int i, int node)
+{
+	return i;
+}
+
 size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 {
 	size_t bytes_left = bytes;
@@ -217,19 +305,15 @@ size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 		return 0;
 	}
 	while (bytes_left > 0) {
-		struct iovec *iov = (struct iovec *) iter->iov;
-		__u64 int_base = (__u64) iov->iov_base;
-		size_t chunk_bytes = iov->iov_len;
+		__u64 int_base = (__u64) iter->iov->iov_base
+				+ iter->iov_offset;
+		size_t chunk_bytes = iter->iov->iov_len - iter->iov_offset;
 		if (chunk_bytes > bytes_left)
 			chunk_bytes = bytes_left;
 		unit_log_printf("; ", "_copy_from_iter %lu bytes at %llu",
 				chunk_bytes, int_base);
 		bytes_left -= chunk_bytes;
-		iter->count -= chunk_bytes;
-		iov->iov_base = (void *) (int_base + chunk_bytes);
-		iov->iov_len -= chunk_bytes;
-		if (iov->iov_len == 0)
-			iter->iov++;
+		iov_iter_advance(iter, chunk_bytes);
 	}
 	return bytes;
 }
@@ -319,6 +403,18 @@ void get_random_bytes(void *buf, size_t nbytes)
 	memset(buf, 0, nbytes);
 }
 
+int get_user_pages_fast_only(unsigned long start, int nr_pages,
+		unsigned int gup_flags, struct page **pages)
+{
+	int i;
+
+	if (mock_check_error(&mock_gup_errors))
+		return 0;
+	for (i = 0; i < nr_pages; i++)
+		pages[i] = (struct page *) (start + i*PAGE_SIZE);
+	return nr_pages;
+}
+
 int hrtimer_cancel(struct hrtimer *timer)
 {
 	return 0;
@@ -343,7 +439,10 @@ void hrtimer_init(struct hrtimer *timer, clockid_t clock_id,
 }
 
 void hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim,
-		u64 range_ns, const enum hrtimer_mode mode) {}
+		u64 range_ns, const enum hrtimer_mode mode)
+{
+	unit_log_printf("; ", "hrtimer_start %lld ns", (long long) tim);
+}
 
 void __icmp_send(struct sk_buff *skb, int type, int code, __be32 info,
 		const struct ip_options *opt)
@@ -471,6 +570,13 @@ int inet_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg)
 	return 0;
 }
 
+int inet_recv_error(struct sock *sk, struct msghdr *msg, int len,
+		int *addr_len)
+{
+	unit_log_printf("; ", "inet_recv_error invoked");
+	return 0;
+}
+
 int inet_recvmsg(struct socket *sock, struct msghdr *msg, size_t size,
 		int flags)
 {
@@ -494,6 +600,21 @@ void inet_unregister_protosw(struct inet_protosw *p) {}
 void __init_swait_queue_head(struct swait_queue_head *q, const char *name,
 		struct lock_class_key *key) {}
 
+void iov_iter_advance(struct iov_iter *i, size_t bytes)
+{
+	if (bytes > i->count)
+		bytes = i->count;
+	i->count -= bytes;
+	bytes += i->iov_offset;
+	while ((i->nr_segs > 0) && (bytes > 0)
+			&& (bytes >= i->iov->iov_len)) {
+		bytes -= i->iov->iov_len;
+		i->iov++;
+		i->nr_segs--;
+	}
+	i->iov_offset = bytes;
+}
+
 void iov_iter_init(struct iov_iter *i, unsigned int direction,
 			const struct iovec *iov, unsigned long nr_segs,
 			size_t count)
@@ -506,6 +627,29 @@ void iov_iter_init(struct iov_iter *i, unsigned int direction,
 	i->count = count;
 }
 
+ssize_t iov_iter_get_pages2(struct iov_iter *i, struct page **pages,
+		size_t maxsize, unsigned int maxpages, size_t *start)
+{
+	__u64 int_base = (__u64) i->iov->iov_base + i->iov_offset;
+	size_t bytes = maxsize;
+	int n;
+
+	if (mock_check_error(&mock_gup_errors))
+		return -EFAULT;
+	if (bytes > i->iov->iov_len - i->iov_offset)
+		bytes = i->iov->iov_len - i->iov_offset;
+	*start = int_base & (PAGE_SIZE - 1);
+	if ((*start + bytes) > (maxpages * PAGE_SIZE))
+		bytes = maxpages * PAGE_SIZE - *start;
+	unit_log_printf("; ", "iov_iter_get_pages2 %lu bytes at %llu",
+			bytes, int_base);
+	for (n = 0; (n * PAGE_SIZE) < (*start + bytes); n++)
+		pages[n] = mock_page_new((char *) (int_base - *start
+				+ n * PAGE_SIZE), NULL);
+	iov_iter_advance(i, bytes);
+	return bytes;
+}
+
 void iov_iter_revert(struct iov_iter *i, size_t bytes)
 {
 	unit_log_printf("; ", "iov_iter_revert %lu", bytes);
@@ -678,6 +822,8 @@ void kfree(const void *block)
 
 void kfree_skb_reason(struct sk_buff *skb, enum skb_drop_reason reason)
 {
+	int i;
+
 	skb->users.refs.counter--;
 	if (skb->users.refs.counter > 0)
 		return;
@@ -687,6 +833,10 @@ void kfree_skb_reason(struct sk_buff *skb, enum skb_drop_reason reason)
 		return;
 	}
 	unit_hash_erase(buffs_in_use, skb);
+	if (skb_zcopy(skb))
+		skb_zcopy_clear(skb, true);
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
+		put_page(skb_frag_page(&skb_shinfo(skb)->frags[i]));
 	while (skb_shinfo(skb)->frag_list) {
 		struct sk_buff *next = skb_shinfo(skb)->frag_list->next;
 		kfree_skb(skb_shinfo(skb)->frag_list);
@@ -711,6 +861,8 @@ void *mock_kmalloc(size_t size, gfp_t flags)
 	return block;
 }
 
+void kthread_bind(struct task_struct *k, unsigned int cpu) {}
+
 struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 					   void *data, int node,
 					   const char namefmt[],
@@ -724,6 +876,10 @@ int kthread_stop(struct task_struct *k)
 	return 0;
 }
 
+void kthread_unuse_mm(struct mm_struct *mm) {}
+
+void kthread_use_mm(struct mm_struct *mm) {}
+
 #ifdef CONFIG_DEBUG_LIST
 bool __list_add_valid(struct list_head *new,
 		struct list_head *prev,
@@ -738,6 +894,18 @@ bool __list_del_entry_valid(struct list_head *entry)
 }
 #endif
 
+bool llist_add_batch(struct llist_node *new_first,
+		struct llist_node *new_last, struct llist_head *head)
+{
+	new_last->next = head->first;
+	head->first = new_first;
+	return new_last->next == NULL;
+}
+
+#ifdef CONFIG_TRACE_IRQFLAGS
+void __local_bh_disable_ip(unsigned long ip, unsigned int cnt) {}
+#endif
+
 void __local_bh_enable_ip(unsigned long ip, unsigned int cnt) {}
 
 void lock_sock_nested(struct sock *sk, int subclass)
@@ -752,6 +920,8 @@ ssize_t __modver_version_show(struct module_attribute *a,
 	return 0;
 }
 
+void __mmdrop(struct mm_struct *mm) {}
+
 void __mutex_init(struct mutex *lock, const char *name,
 			 struct lock_class_key *key)
 {
@@ -778,6 +948,10 @@ int netif_receive_skb(struct sk_buff *skb)
 	return 0;
 }
 
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+void nf_conntrack_destroy(struct nf_conntrack *nfct) {}
+#endif
+
 long prepare_to_wait_event(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry, int state)
 {
@@ -810,6 +984,25 @@ int proc_dointvec(struct ctl_table *table, int write,
 	return 0;
 }
 
+int pin_user_pages_fast(unsigned long start, int nr_pages,
+		unsigned int gup_flags, struct page **pages)
+{
+	int i;
+
+	mock_gup_flags = gup_flags;
+	if (mock_check_error(&mock_gup_errors))
+		return -EFAULT;
+	for (i = 0; i < nr_pages; i++) {
+		if (mock_pin_tracked_pages)
+			pages[i] = mock_page_new((char *) (start + i*PAGE_SIZE),
+					NULL);
+		else
+			pages[i] = (struct page *) (start + i*PAGE_SIZE);
+	}
+	mock_pinned_pages += nr_pages;
+	return nr_pages;
+}
+
 void proc_remove(struct proc_dir_entry *de)
 {
 	if (!proc_files_in_use
@@ -834,6 +1027,15 @@ void *__pskb_pull_tail(struct sk_buff *skb, int delta)
 	return NULL;
 }
 
+bool queue_work_on(int cpu, struct workqueue_struct *wq,
+		struct work_struct *work)
+{
+	/* Run the work immediately, so tests see its effects. */
+	unit_log_printf("; ", "queue_work_on core %d", cpu);
+	work->func(work);
+	return true;
+}
+
 void _raw_spin_lock(raw_spinlock_t *lock)
 {
 	mock_active_locks++;
@@ -897,11 +1099,23 @@ void __show_free_areas(unsigned int filter, nodemask_t *nodemask,
 
 void sk_common_release(struct sock *sk) {}
 
+void sk_free(struct sock *sk) {}
+
 int sk_set_peek_off(struct sock *sk, int val)
 {
 	return 0;
 }
 
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+	if (mock_check_error(&mock_copy_data_errors))
+		return -EFAULT;
+	unit_log_printf("; ", "skb_copy_bits: %d bytes: ", len);
+	unit_log_data(NULL, skb->data + offset, len);
+	memcpy(to, skb->data + offset, len);
+	return 0;
+}
+
 int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 		struct iov_iter *iter, int size)
 {
@@ -992,6 +1206,19 @@ int sock_common_setsockopt(struct socket *sock, int level, int optname,
 	return 0;
 }
 
+int sock_queue_err_skb(struct sock *sk, struct sk_buff *skb)
+{
+	struct sock_exterr_skb *serr = SKB_EXT_ERR(skb);
+
+	if (mock_check_error(&mock_queue_err_skb_errors))
+		return -ENOMEM;
+	unit_log_printf("; ", "sock_queue_err_skb: origin %d, info %u, "
+			"data %u, code %d", serr->ee.ee_origin,
+			serr->ee.ee_info, serr->ee.ee_data, serr->ee.ee_code);
+	kfree_skb(skb);
+	return 0;
+}
+
 int sock_no_accept(struct socket *sock, struct socket *newsock, int flags,
 		bool kern)
 {
@@ -1034,6 +1261,22 @@ void tasklet_init(struct tasklet_struct *t,
 
 void tasklet_kill(struct tasklet_struct *t) {}
 
+void unpin_user_pages(struct page **pages, unsigned long npages)
+{
+	unsigned long i;
+
+	/* put_page ignores pages not created by mock_page_new. */
+	for (i = 0; i < npages; i++)
+		put_page(pages[i]);
+	mock_pinned_pages -= npages;
+}
+
+void unpin_user_pages_dirty_lock(struct page **pages, unsigned long npages,
+		bool make_dirty)
+{
+	unpin_user_pages(pages, npages);
+}
+
 void unregister_net_sysctl_table(struct ctl_table_header *header) {}
 
 void vfree(const void *block)
@@ -1066,6 +1309,41 @@ void *vmalloc(size_t size)
 	return block;
 }
 
+void *vmap(struct page **pages, unsigned int count, unsigned long flags,
+		pgprot_t prot)
+{
+	void *block, *mapping;
+
+	if (mock_check_error(&mock_vmap_errors))
+		return NULL;
+
+	/* Mappings must be page-aligned. */
+	block = malloc((count + 1)*PAGE_SIZE);
+	if (!block) {
+		FAIL("malloc failed");
+		return NULL;
+	}
+	mapping = (void *) ((((unsigned long) block) + PAGE_SIZE - 1)
+			& PAGE_MASK);
+	if (!vmaps_in_use)
+		vmaps_in_use = unit_hash_new();
+	unit_hash_set(vmaps_in_use, mapping, block);
+	return mapping;
+}
+
+void vunmap(const void *addr)
+{
+	void *block;
+
+	block = vmaps_in_use ? unit_hash_get(vmaps_in_use, addr) : NULL;
+	if (block == NULL) {
+		FAIL("vunmap on unknown address");
+		return;
+	}
+	unit_hash_erase(vmaps_in_use, addr);
+	free(block);
+}
+
 void wait_for_completion(struct completion *x) {}
 
 long wait_woken(struct wait_queue_entry *wq_entry, unsigned mode,
@@ -1110,6 +1388,25 @@ int mock_check_error(int *errorMask)
 	return result;
 }
 
+/**
+ * mock_alloc_page() - Called instead of alloc_page when Homa is compiled
+ * for unit testing.
+ * @gfp_mask:  Ignored.
+ *
+ * Return:     A page with a single reference, or NULL if
+ *             mock_alloc_page_errors says to fail.
+ */
+struct page *mock_alloc_page(gfp_t gfp_mask)
+{
+	char *buf;
+
+	if (mock_check_error(&mock_alloc_page_errors))
+		return NULL;
+	buf = malloc(PAGE_SIZE);
+	memset(buf, 0, PAGE_SIZE);
+	return mock_page_new(buf, buf);
+}
+
 /**
  * mock_clear_xmit_prios() - Remove all information from the list of
  * transmit priorities.
@@ -1120,6 +1417,16 @@ void mock_clear_xmit_prios()
 	mock_xmit_prios[0] = 0;
 }
 
+/**
+ * mock_cpu_to_node() - Replacement for cpu_to_node; cores are assigned
+ * to NUMA nodes round-robin.
+ * @cpu:   Core whose node is desired.
+ */
+int mock_cpu_to_node(int cpu)
+{
+	return cpu % mock_nr_node_ids;
+}
+
 /**
  * mock_data_ready() - Invoked through sk->sk_data_ready; logs a message
  * to indicate that it was invoked.
@@ -1130,6 +1437,22 @@ void mock_data_ready(struct sock *sk)
 	unit_log_printf("; ", "sk->sk_data_ready invoked");
 }
 
+/**
+ * mock_get_page() - Replacement for get_page; increments the reference
+ * count for pages allocated by the mock functions (other pages are
+ * ignored).
+ * @page:  Page for which a new reference is needed.
+ */
+void mock_get_page(struct page *page)
+{
+	struct mock_page *mp = NULL;
+
+	if (pages_in_use)
+		mp = unit_hash_get(pages_in_use, page);
+	if (mp)
+		mp->refs++;
+}
+
 /**
  * mock_get_cycles() - Replacement for get_cycles; allows time to be
  * hard-while using mock_cycles variable.
@@ -1154,6 +1477,92 @@ unsigned int mock_get_mtu(const struct dst_entry *dst)
 	return mock_mtu;
 }
 
+/**
+ * mock_page_new() - Create a new reference-counted page.
+ * @data:   Address to return from page_address for this page.
+ * @buf:    Malloc-ed memory to free along with the page, or NULL.
+ *
+ * Return:  The new page, with a single reference.
+ */
+struct page *mock_page_new(char *data, char *buf)
+{
+	struct mock_page *mp = malloc(sizeof(*mp));
+
+	memset(mp, 0, sizeof(*mp));
+	mp->refs = 1;
+	mp->data = data;
+	mp->buf = buf;
+	if (!pages_in_use)
+		pages_in_use = unit_hash_new();
+	unit_hash_set(pages_in_use, mp, mp);
+	return &mp->page;
+}
+
+/**
+ * mock_page_refs() - Return the number of references to a page created
+ * by mock_page_new, or -1 if the page is unknown (or has been freed).
+ * @page:   Page of interest.
+ */
+int mock_page_refs(struct page *page)
+{
+	struct mock_page *mp = NULL;
+
+	if (pages_in_use)
+		mp = unit_hash_get(pages_in_use, page);
+	return mp ? mp->refs : -1;
+}
+
+/**
+ * mock_page_to_nid() - Replacement for page_to_nid; the "page" is actually
+ * a user address (see get_user_pages_fast_only above), and its node is
+ * determined by mock_numa_mask.
+ * @page:  Page whose node is desired.
+ */
+int mock_page_to_nid(const struct page *page)
+{
+	return (((unsigned long) page) & mock_numa_mask) ? 1 : 0;
+}
+
+/**
+ * mock_page_address() - Replacement for page_address; the "page" is
+ * usually an address (either a user address, from pin_user_pages_fast,
+ * or an address stored there by a test), so just return it. Pages
+ * created by mock_page_new return their data address.
+ * @page:  Page whose kernel address is desired.
+ */
+void *mock_page_address(const struct page *page)
+{
+	struct mock_page *mp = NULL;
+
+	if (pages_in_use)
+		mp = unit_hash_get(pages_in_use, page);
+	if (mp)
+		return mp->data;
+	return (void *) page;
+}
+
+/**
+ * mock_put_page() - Replacement for put_page; frees pages created by
+ * mock_page_new when their last reference goes away (other pages are
+ * ignored).
+ * @page:  Page to release.
+ */
+void mock_put_page(struct page *page)
+{
+	struct mock_page *mp = NULL;
+
+	if (pages_in_use)
+		mp = unit_hash_get(pages_in_use, page);
+	if (!mp)
+		return;
+	mp->refs--;
+	if (mp->refs > 0)
+		return;
+	unit_hash_erase(pages_in_use, mp);
+	free(mp->buf);
+	free(mp);
+}
+
 /**
  * mock_rcu_read_lock() - Called instead of rcu_read_lock when Homa is compiled
  * for unit testing.
@@ -1223,6 +1632,9 @@ struct sk_buff *mock_skb_new(struct in6_addr *saddr, struct common_header *h,
 	case ACK:
 		header_size = sizeof(struct ack_header);
 		break;
+	case MULTI_GRANT:
+		header_size = sizeof(struct multi_grant_header);
+		break;
 	default:
 		header_size = sizeof(struct common_header);
 		break;
@@ -1298,7 +1710,7 @@ void mock_sock_init(struct homa_sock *hsk, struct homa *homa, int port)
 	mock_mtu = UNIT_TEST_DATA_PER_PACKET + hsk->ip_header_length
 		+ sizeof(struct data_header);
 	mock_net_device.gso_max_size = mock_mtu;
-	homa_pool_init(hsk, (void *) 0x1000000, 100*HOMA_BPAGE_SIZE);
+	homa_pool_init(hsk, (void *) 0x1000000, 100*HOMA_BPAGE_SIZE, 0);
 }
 
 /**
@@ -1322,6 +1734,7 @@ void mock_teardown(void)
 {
 	cpu_number = 1;
 	cpu_khz = 1000000;
+	mock_alloc_page_errors = 0;
 	mock_alloc_skb_errors = 0;
 	mock_copy_data_errors = 0;
 	mock_copy_to_iter_errors = 0;
@@ -1334,21 +1747,29 @@ void mock_teardown(void)
 	mock_ip6_xmit_errors = 0;
 	mock_ip_queue_xmit_errors = 0;
 	mock_kmalloc_errors = 0;
+	mock_locked_vm_errors = 0;
+	mock_gup_errors = 0;
+	mock_gup_flags = 0;
+	mock_queue_err_skb_errors = 0;
+	mock_nr_node_ids = 1;
+	mock_numa_mask = 0;
+	mock_pin_tracked_pages = false;
 	mock_copy_to_user_dont_copy = 0;
-	mock_bpage_size = 0x10000;
-	mock_bpage_shift = 16;
 	mock_xmit_prios_offset = 0;
 	mock_xmit_prios[0] = 0;
 	mock_log_rcu_sched = 0;
 	mock_route_errors = 0;
 	mock_trylock_errors = 0;
 	mock_vmalloc_errors = 0;
+	mock_vmap_errors = 0;
 	memset(&mock_task, 0, sizeof(mock_task));
+	mock_task.mm = &mock_mm;
 	mock_signal_pending = 0;
 	mock_xmit_log_verbose = 0;
 	mock_xmit_log_homa_info = 0;
 	mock_mtu = 0;
 	mock_net_device.gso_max_size = 0;
+	memset(mock_tx_queues, 0, sizeof(mock_tx_queues));
 
 	int count = unit_hash_size(buffs_in_use);
 	if (count > 0)
@@ -1362,6 +1783,12 @@ void mock_teardown(void)
 	unit_hash_free(kmallocs_in_use);
 	kmallocs_in_use = NULL;
 
+	count = unit_hash_size(pages_in_use);
+	if (count > 0)
+		FAIL(" %u page(s) still in use after test", count);
+	unit_hash_free(pages_in_use);
+	pages_in_use = NULL;
+
 	count = unit_hash_size(proc_files_in_use);
 	if (count > 0)
 		FAIL(" %u proc file(s) still allocated after test", count);
@@ -1380,6 +1807,27 @@ void mock_teardown(void)
 	unit_hash_free(vmallocs_in_use);
 	vmallocs_in_use = NULL;
 
+	count = unit_hash_size(vmaps_in_use);
+	if (count > 0)
+		FAIL(" %u vmap(s) still mapped after test", count);
+	unit_hash_free(vmaps_in_use);
+	vmaps_in_use = NULL;
+
+	if (mock_pinned_pages != 0)
+		FAIL(" %d user page(s) still pinned after test",
+				mock_pinned_pages);
+	mock_pinned_pages = 0;
+
+	if (mock_locked_vm != 0)
+		FAIL(" %ld page(s) still charged to locked memory after test",
+				mock_locked_vm);
+	mock_locked_vm = 0;
+
+	if (atomic_read(&mock_mm.mm_count) != 0)
+		FAIL(" %d mm_struct reference(s) still held after test",
+				atomic_read(&mock_mm.mm_count));
+	atomic_set(&mock_mm.mm_count, 0);
+
 	if (mock_active_locks != 0)
 		FAIL(" %d locks still locked after test", mock_active_locks);
 	mock_active_locks = 0;
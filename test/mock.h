@@ -5,13 +5,15 @@
 /* Functions for mocking that are exported to test code. */
 
 extern int         cpu_number;
+extern int         mock_alloc_page_errors;
 extern int         mock_alloc_skb_errors;
-extern             int mock_bpage_size;
-extern             int mock_bpage_shift;
 extern int         mock_copy_data_errors;
 extern int         mock_copy_to_user_dont_copy;
 extern int         mock_copy_to_user_errors;
 extern int         mock_cpu_idle;
+extern int         mock_gup_errors;
+extern unsigned int
+		   mock_gup_flags;
 extern cycles_t    mock_cycles;
 extern int         mock_import_iovec_errors;
 extern int         mock_import_single_range_errors;
@@ -20,27 +22,48 @@ extern int         mock_ip_queue_xmit_errors;
 extern bool        mock_ipv6;
 extern bool        mock_ipv6_default;
 extern int         mock_kmalloc_errors;
+extern long        mock_locked_vm;
+extern int         mock_locked_vm_errors;
 extern char        mock_xmit_prios[];
 extern int         mock_log_rcu_sched;
 extern int         mock_max_grants;
 extern int         mock_mtu;
+extern int         mock_nr_node_ids;
+extern unsigned long
+		   mock_numa_mask;
 extern struct net_device
 		   mock_net_device;
+extern bool        mock_pin_tracked_pages;
+extern int         mock_pinned_pages;
+extern int         mock_queue_err_skb_errors;
 extern int         mock_route_errors;
 extern int         mock_spin_lock_held;
 extern struct task_struct
 		   mock_task;
 extern int         mock_trylock_errors;
+extern struct netdev_queue
+		   mock_tx_queues[];
 extern int         mock_vmalloc_errors;
+extern int         mock_vmap_errors;
 extern int         mock_xmit_log_verbose;
 extern int         mock_xmit_log_homa_info;
 
+extern struct page *
+		   mock_alloc_page(gfp_t gfp_mask);
 extern int         mock_check_error(int *errorMask);
 extern void        mock_clear_xmit_prios(void);
+extern int         mock_cpu_to_node(int cpu);
 extern void        mock_data_ready(struct sock *sk);
 extern cycles_t    mock_get_cycles(void);
+extern void        mock_get_page(struct page *page);
 extern unsigned int
 		   mock_get_mtu(const struct dst_entry *dst);
+extern void       *mock_page_address(const struct page *page);
+extern struct page *
+		   mock_page_new(char *data, char *buf);
+extern int         mock_page_refs(struct page *page);
+extern int         mock_page_to_nid(const struct page *page);
+extern void        mock_put_page(struct page *page);
 extern void        mock_rcu_read_lock(void);
 extern void        mock_rcu_read_unlock(void);
 extern void        mock_spin_lock(spinlock_t *lock);
@@ -70,6 +70,7 @@ FIXTURE_SETUP(homa_grant)
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
 	self->homa.pacer_fifo_fraction = 0;
 	self->homa.grant_fifo_fraction = 0;
+	self->homa.fifo_grant_increment = 0;
 	self->homa.window_param = 10000;
 	self->homa.grant_window = 10000;
 	self->homa.max_incoming = 50000;
@@ -108,6 +109,24 @@ static struct homa_rpc *test_rpc(FIXTURE_DATA(homa_grant) *self,
 	return rpc;
 }
 
+/* Create an RPC and place it on the staging list for a given core,
+ * without adding it to the grantable lists.
+ */
+static struct homa_rpc *staged_rpc(FIXTURE_DATA(homa_grant) *self,
+		__u64 id, struct in6_addr *server_ip, int size, int core)
+{
+	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, server_ip, self->server_port,
+			id, 1000, size);
+	homa_message_in_init(rpc, size, 0);
+	rpc->msgin.staged_remaining = homa_grant_remaining(rpc);
+	rpc->msgin.staged = 1;
+	llist_add(&rpc->msgin.staged_links,
+			&homa_cores[core]->grantable_staged);
+	atomic_inc(&self->homa.num_staged_rpcs);
+	return rpc;
+}
+
 TEST_F(homa_grant, homa_grant_outranks)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,UNIT_OUTGOING,
@@ -139,6 +158,59 @@ TEST_F(homa_grant, homa_grant_outranks)
 	EXPECT_EQ(0, homa_grant_outranks(crpc2, crpc4));
 	EXPECT_EQ(0, homa_grant_outranks(crpc4, crpc2));
 }
+TEST_F(homa_grant, homa_grant_outranks__grant_weights)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			100, 1000, 20000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			102, 1000, 30000);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			104, 1000, 40000);
+
+	homa_message_in_init(crpc1, 20000, 0);
+	crpc1->msgin.birth = 1000;
+	self->hsk.grant_weight = 2;
+	homa_message_in_init(crpc2, 30000, 0);
+	crpc2->msgin.birth = 2000;
+	homa_message_in_init(crpc3, 40000, 0);
+	crpc3->msgin.birth = 3000;
+
+	EXPECT_EQ(2, crpc2->msgin.grant_weight);
+	EXPECT_EQ(0, homa_grant_outranks(crpc1, crpc2));
+	EXPECT_EQ(1, homa_grant_outranks(crpc2, crpc1));
+	EXPECT_EQ(1, homa_grant_outranks(crpc1, crpc3));
+	EXPECT_EQ(0, homa_grant_outranks(crpc3, crpc1));
+}
+TEST_F(homa_grant, homa_grant_outranks__weighted_difference_less_than_1)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			100, 1000, 20000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			102, 1000, 30000);
+
+	/* 30001/3 and 10000/1 are equal after integer division, but
+	 * crpc2 really has fewer weighted bytes remaining; the ranking
+	 * values must agree with homa_grant_outranks.
+	 */
+	homa_message_in_init(crpc1, 30001, 0);
+	crpc1->msgin.grant_weight = 3;
+	crpc1->msgin.birth = 1000;
+	homa_message_in_init(crpc2, 10000, 0);
+	crpc2->msgin.birth = 2000;
+	EXPECT_EQ(1, homa_grant_outranks(crpc2, crpc1));
+	EXPECT_EQ(0, homa_grant_outranks(crpc1, crpc2));
+	EXPECT_GT(homa_grant_remaining(crpc1), homa_grant_remaining(crpc2));
+
+	/* Exactly equal weighted values compare equal. */
+	crpc1->msgin.bytes_remaining = 30000;
+	EXPECT_EQ(homa_grant_remaining(crpc1), homa_grant_remaining(crpc2));
+	EXPECT_EQ(1, homa_grant_outranks(crpc1, crpc2));
+}
 
 TEST_F(homa_grant, homa_grant_update_incoming)
 {
@@ -185,6 +257,104 @@ TEST_F(homa_grant, homa_grant_update_incoming)
 	EXPECT_EQ(500, rpc->msgin.rec_incoming);
 }
 
+TEST_F(homa_grant, homa_grant_bucket)
+{
+	EXPECT_EQ(0, homa_grant_bucket(-100));
+	EXPECT_EQ(0, homa_grant_bucket(63));
+	EXPECT_EQ(1, homa_grant_bucket(64));
+	EXPECT_EQ(3, homa_grant_bucket(255));
+	EXPECT_EQ(4, homa_grant_bucket(256));
+	EXPECT_EQ(7, homa_grant_bucket(511));
+	EXPECT_EQ(8, homa_grant_bucket(512));
+	EXPECT_EQ(9, homa_grant_bucket(640));
+	EXPECT_EQ(28, homa_grant_bucket(20000));
+	EXPECT_EQ(31, homa_grant_bucket(30000));
+	EXPECT_EQ(51, homa_grant_bucket(HOMA_MAX_MESSAGE_LENGTH));
+	EXPECT_EQ(HOMA_GRANT_BUCKETS-1, homa_grant_bucket(0x7fffffff));
+}
+TEST_F(homa_grant, homa_grant_next_peer)
+{
+	struct homa_peer *peer;
+
+	EXPECT_EQ(NULL, homa_grant_next_peer(&self->homa, NULL));
+	test_rpc(self, 200, self->server_ip, 1000000);
+	test_rpc(self, 300, self->server_ip+1, 100);
+	test_rpc(self, 400, self->server_ip+2, 30000);
+	test_rpc(self, 500, self->server_ip+3, 30100);
+
+	peer = homa_grant_next_peer(&self->homa, NULL);
+	EXPECT_EQ(1, peer->grant_bucket);
+	peer = homa_grant_next_peer(&self->homa, peer);
+	EXPECT_EQ(31, peer->grant_bucket);
+	EXPECT_EQ(400, list_first_entry(&peer->grantable_rpcs,
+			struct homa_rpc, grantable_links)->id);
+	peer = homa_grant_next_peer(&self->homa, peer);
+	EXPECT_EQ(31, peer->grant_bucket);
+	EXPECT_EQ(500, list_first_entry(&peer->grantable_rpcs,
+			struct homa_rpc, grantable_links)->id);
+	peer = homa_grant_next_peer(&self->homa, peer);
+	EXPECT_EQ(51, peer->grant_bucket);
+	EXPECT_EQ(NULL, homa_grant_next_peer(&self->homa, peer));
+}
+
+TEST_F(homa_grant, homa_grant_insert_peer__empty_bucket)
+{
+	struct homa_rpc *rpc = test_rpc(self, 200, self->server_ip, 20000);
+
+	EXPECT_EQ(28, rpc->peer->grant_bucket);
+	EXPECT_EQ(1UL << 28, self->homa.grantable_nonempty);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grantable_peer_inserts);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.grantable_peer_checks);
+}
+TEST_F(homa_grant, homa_grant_insert_peer__grant_weight)
+{
+	struct homa_rpc *rpc;
+
+	self->hsk.grant_weight = 4;
+	rpc = test_rpc(self, 200, self->server_ip, 20000);
+	EXPECT_EQ(20, rpc->peer->grant_bucket);
+	EXPECT_EQ(1UL << 20, self->homa.grantable_nonempty);
+}
+TEST_F(homa_grant, homa_grant_insert_peer__position_within_bucket)
+{
+	test_rpc(self, 200, self->server_ip, 30000);
+	test_rpc(self, 300, self->server_ip+1, 30200);
+	test_rpc(self, 400, self->server_ip+2, 30100);
+	test_rpc(self, 500, self->server_ip+3, 29800);
+
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("response from 4.2.3.4, id 500, remaining 29800; "
+			"response from 1.2.3.4, id 200, remaining 30000; "
+			"response from 3.2.3.4, id 400, remaining 30100; "
+			"response from 2.2.3.4, id 300, remaining 30200",
+			unit_log_get());
+	EXPECT_EQ(1UL << 31, self->homa.grantable_nonempty);
+	EXPECT_EQ(4, homa_cores[cpu_number]->metrics.grantable_peer_inserts);
+	EXPECT_EQ(6, homa_cores[cpu_number]->metrics.grantable_peer_checks);
+}
+
+TEST_F(homa_grant, homa_grant_unlink_peer)
+{
+	struct homa_rpc *rpc1 = test_rpc(self, 200, self->server_ip, 30000);
+	struct homa_rpc *rpc2 = test_rpc(self, 300, self->server_ip+1, 30100);
+	struct homa_rpc *rpc3 = test_rpc(self, 400, self->server_ip+2, 100);
+
+	EXPECT_EQ((1UL << 31) | (1UL << 1), self->homa.grantable_nonempty);
+	homa_grant_unlink_peer(&self->homa, rpc1->peer);
+	EXPECT_TRUE(list_empty(&rpc1->peer->grantable_links));
+	EXPECT_EQ((1UL << 31) | (1UL << 1), self->homa.grantable_nonempty);
+	homa_grant_unlink_peer(&self->homa, rpc2->peer);
+	EXPECT_EQ(1UL << 1, self->homa.grantable_nonempty);
+	homa_grant_unlink_peer(&self->homa, rpc3->peer);
+	EXPECT_EQ(0, self->homa.grantable_nonempty);
+
+	/* Restore the peers so the RPCs can be cleaned up normally. */
+	homa_grant_insert_peer(&self->homa, rpc1->peer);
+	homa_grant_insert_peer(&self->homa, rpc2->peer);
+	homa_grant_insert_peer(&self->homa, rpc3->peer);
+}
+
 TEST_F(homa_grant, homa_grant_add_rpc__update_metrics)
 {
 	self->homa.last_grantable_change = 100;
@@ -300,6 +470,68 @@ TEST_F(homa_grant, homa_grant_add_rpc__move_peer_in_homa_list)
 	EXPECT_EQ(4, self->homa.num_grantable_rpcs);
 }
 
+TEST_F(homa_grant, homa_grant_add_staged__basics)
+{
+	struct homa_rpc *rpc1, *rpc2, *rpc3;
+
+	test_rpc(self, 100, self->server_ip, 40000);
+	mock_cycles = 500;
+	rpc1 = staged_rpc(self, 102, self->server_ip, 20000, 1);
+	rpc2 = staged_rpc(self, 104, self->server_ip+1, 30000, 2);
+	rpc3 = staged_rpc(self, 106, self->server_ip, 50000, 1);
+	rpc1->msgin.birth = 100;
+
+	homa_grant_add_staged(&self->homa);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("response from 1.2.3.4, id 102, remaining 20000; "
+			"response from 1.2.3.4, id 100, remaining 40000; "
+			"response from 1.2.3.4, id 106, remaining 50000; "
+			"response from 2.2.3.4, id 104, remaining 30000",
+			unit_log_get());
+	EXPECT_EQ(4, self->homa.num_grantable_rpcs);
+	EXPECT_EQ(0, atomic_read(&self->homa.num_staged_rpcs));
+	EXPECT_EQ(0, rpc1->msgin.staged);
+	EXPECT_EQ(0, rpc2->msgin.staged);
+	EXPECT_EQ(0, rpc3->msgin.staged);
+	EXPECT_EQ(100, rpc1->msgin.birth);
+	EXPECT_TRUE(llist_empty(&homa_cores[1]->grantable_staged));
+	EXPECT_TRUE(llist_empty(&homa_cores[2]->grantable_staged));
+}
+TEST_F(homa_grant, homa_grant_add_staged__use_key_recorded_when_staged)
+{
+	struct homa_rpc *rpc;
+
+	test_rpc(self, 100, self->server_ip, 40000);
+	rpc = staged_rpc(self, 102, self->server_ip, 50000, 1);
+
+	/* Simulate data arriving after the RPC was staged; the RPC's lock
+	 * isn't held here, so its live byte count mustn't be used.
+	 */
+	rpc->msgin.bytes_remaining = 10000;
+	homa_grant_add_staged(&self->homa);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("response from 1.2.3.4, id 100, remaining 40000; "
+			"response from 1.2.3.4, id 102, remaining 10000",
+			unit_log_get());
+}
+TEST_F(homa_grant, homa_grant_add_staged__nothing_staged)
+{
+	struct homa_rpc *rpc;
+
+	rpc = staged_rpc(self, 100, self->server_ip, 20000, 1);
+	atomic_set(&self->homa.num_staged_rpcs, 0);
+
+	homa_grant_add_staged(&self->homa);
+	EXPECT_EQ(0, self->homa.num_grantable_rpcs);
+	EXPECT_EQ(1, rpc->msgin.staged);
+
+	/* Clean up so the RPC can be freed normally. */
+	atomic_set(&self->homa.num_staged_rpcs, 1);
+	homa_grant_add_staged(&self->homa);
+}
+
 TEST_F(homa_grant, homa_grant_remove_rpc__skip_if_not_linked)
 {
 	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
@@ -465,6 +697,30 @@ TEST_F(homa_grant, homa_grant_send__nothing_available)
 	EXPECT_EQ(0, rpc->msgin.granted);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_grant, homa_grant_send__limited_by_buffer_space)
+{
+	struct homa_rpc *rpc;
+
+	/* Only 1 bpage available, so only part of the message has space. */
+	atomic_set(&self->hsk.buffer_pool.free_bpages, 1);
+	rpc = test_rpc(self, 100, self->server_ip, 200000);
+	EXPECT_EQ(1, rpc->msgin.num_bpages);
+	self->homa.grant_window = 100000;
+	self->homa.max_incoming = 1000000;
+
+	unit_log_clear();
+	int granted = homa_grant_send(rpc, &self->homa);
+	EXPECT_EQ(1, granted);
+	EXPECT_EQ(HOMA_BPAGE_SIZE - self->homa.max_gso_size,
+			rpc->msgin.granted);
+	EXPECT_FALSE(list_empty(&rpc->buf_links));
+
+	/* No space for any more grants. */
+	unit_log_clear();
+	granted = homa_grant_send(rpc, &self->homa);
+	EXPECT_EQ(0, granted);
+	EXPECT_STREQ("", unit_log_get());
+}
 TEST_F(homa_grant, homa_grant_send__resend_all)
 {
 	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
@@ -478,6 +734,139 @@ TEST_F(homa_grant, homa_grant_send__resend_all)
 	EXPECT_STREQ("xmit GRANT 10000@0 resend_all", unit_log_get());
 }
 
+TEST_F(homa_grant, homa_grant_xmit__not_deferred)
+{
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+	struct grant_header grant = {.offset = htonl(5000), .priority = 2};
+
+	unit_log_clear();
+	homa_grant_xmit(rpc, &grant);
+	EXPECT_STREQ("xmit GRANT 5000@2", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_deferred_grants);
+}
+TEST_F(homa_grant, homa_grant_xmit__defer)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct homa_rpc *rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	struct homa_rpc *rpc2 = test_rpc(self, 102, self->server_ip+1, 20000);
+	struct grant_header grant = {.offset = htonl(5000), .priority = 2};
+
+	core->defer_grants = 1;
+	unit_log_clear();
+	homa_grant_xmit(rpc1, &grant);
+	grant.offset = htonl(6000);
+	homa_grant_xmit(rpc2, &grant);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(2, core->num_deferred_grants);
+	EXPECT_EQ(rpc2->peer, core->deferred_grants[1].peer);
+	EXPECT_EQ(6000, ntohl(core->deferred_grants[1].grant.offset));
+
+	homa_grant_flush(core);
+	EXPECT_STREQ("xmit GRANT 5000@2; xmit GRANT 6000@2", unit_log_get());
+	core->defer_grants = 0;
+}
+TEST_F(homa_grant, homa_grant_xmit__replace_existing_grant)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+	struct grant_header grant = {.offset = htonl(5000), .priority = 2,
+			.resend_all = 1};
+
+	core->defer_grants = 1;
+	homa_grant_xmit(rpc, &grant);
+	grant.offset = htonl(7000);
+	grant.priority = 3;
+	grant.resend_all = 0;
+	homa_grant_xmit(rpc, &grant);
+	EXPECT_EQ(1, core->num_deferred_grants);
+	EXPECT_EQ(7000, ntohl(core->deferred_grants[0].grant.offset));
+	EXPECT_EQ(3, core->deferred_grants[0].grant.priority);
+	EXPECT_EQ(1, core->deferred_grants[0].grant.resend_all);
+	core->num_deferred_grants = 0;
+	core->defer_grants = 0;
+}
+TEST_F(homa_grant, homa_grant_xmit__deferred_grants_full)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+	struct grant_header grant = {.offset = htonl(5000), .priority = 2};
+	int i;
+
+	core->defer_grants = 1;
+	for (i = 0; i < HOMA_MAX_DEFERRED_GRANTS; i++) {
+		core->deferred_grants[i].hsk = &self->hsk;
+		core->deferred_grants[i].peer = rpc->peer;
+		core->deferred_grants[i].dport = rpc->dport;
+		core->deferred_grants[i].grant = (struct homa_grant_entry) {
+				.sender_id = cpu_to_be64(1000 + 2*i),
+				.offset = htonl(5000)};
+	}
+	core->num_deferred_grants = HOMA_MAX_DEFERRED_GRANTS;
+	homa_grant_xmit(rpc, &grant);
+	EXPECT_EQ(4, core->metrics.packets_sent[MULTI_GRANT - DATA]);
+	EXPECT_EQ(16, core->metrics.grants_coalesced);
+	EXPECT_EQ(1, core->num_deferred_grants);
+	core->num_deferred_grants = 0;
+	core->defer_grants = 0;
+}
+
+TEST_F(homa_grant, homa_grant_flush__combine_grants)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct homa_rpc *rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	struct homa_rpc *rpc2 = test_rpc(self, 102, self->server_ip+1, 20000);
+	struct homa_rpc *rpc3 = test_rpc(self, 104, self->server_ip, 20000);
+	struct homa_rpc *rpc4 = test_rpc(self, 106, self->server_ip, 20000);
+	struct grant_header grant = {.offset = htonl(5000), .priority = 2};
+
+	core->defer_grants = 1;
+	homa_grant_xmit(rpc1, &grant);
+	homa_grant_xmit(rpc2, &grant);
+	homa_grant_xmit(rpc3, &grant);
+	homa_grant_xmit(rpc4, &grant);
+	unit_log_clear();
+	homa_grant_flush(core);
+	EXPECT_STREQ("xmit MULTI_GRANT 100:5000@2 104:5000@2 106:5000@2; "
+			"xmit GRANT 5000@2", unit_log_get());
+	EXPECT_EQ(3, core->metrics.grants_coalesced);
+	EXPECT_EQ(0, core->num_deferred_grants);
+	core->defer_grants = 0;
+}
+TEST_F(homa_grant, homa_grant_flush__max_grants_per_packet)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct grant_header grant = {.offset = htonl(5000), .priority = 2};
+	int i;
+
+	core->defer_grants = 1;
+	for (i = 0; i < 6; i++)
+		homa_grant_xmit(test_rpc(self, 100 + 2*i, self->server_ip,
+				20000), &grant);
+	unit_log_clear();
+	homa_grant_flush(core);
+	EXPECT_STREQ("xmit MULTI_GRANT 100:5000@2 102:5000@2 104:5000@2 "
+			"106:5000@2; "
+			"xmit MULTI_GRANT 108:5000@2 110:5000@2",
+			unit_log_get());
+	core->defer_grants = 0;
+}
+TEST_F(homa_grant, homa_grant_flush__socket_shutdown)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+	struct grant_header grant = {.offset = htonl(5000), .priority = 2};
+
+	core->defer_grants = 1;
+	homa_grant_xmit(rpc, &grant);
+	self->hsk.shutdown = true;
+	unit_log_clear();
+	homa_grant_flush(core);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, core->num_deferred_grants);
+	self->hsk.shutdown = false;
+	core->defer_grants = 0;
+}
+
 TEST_F(homa_grant, homa_grant_check_rpc__msgin_not_initialized)
 {
 	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
@@ -552,7 +941,7 @@ TEST_F(homa_grant, homa_grant_check_rpc__new_message_bumps_existing)
 	struct homa_rpc *rpc1, *rpc2, *rpc3;
 	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
 	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
@@ -568,12 +957,39 @@ TEST_F(homa_grant, homa_grant_check_rpc__new_message_bumps_existing)
 	EXPECT_EQ(-1, atomic_read(&rpc2->msgin.rank));
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 }
+TEST_F(homa_grant, homa_grant_check_rpc__new_message_with_grant_weight)
+{
+	struct homa_rpc *rpc1, *rpc2, *rpc3;
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
+	self->homa.overcommit_current = 2;
+	homa_grant_recalc(&self->homa, 0);
+	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
+	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
+
+	/* Unweighted, rpc3 would be staged behind both active messages;
+	 * with weight 4 it preempts both of them.
+	 */
+	self->hsk.grant_weight = 4;
+	rpc3 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 104, 1000, 60000);
+	homa_message_in_init(rpc3, 60000, 0);
+	homa_rpc_lock(rpc3, "test");
+	homa_grant_check_rpc(rpc3);
+	EXPECT_EQ(0, rpc3->msgin.staged);
+	EXPECT_EQ(10000, rpc3->msgin.granted);
+	EXPECT_EQ(0, atomic_read(&rpc3->msgin.rank));
+	EXPECT_EQ(1, atomic_read(&rpc1->msgin.rank));
+	EXPECT_EQ(-1, atomic_read(&rpc2->msgin.rank));
+	EXPECT_EQ(15000*HOMA_GRANT_WEIGHT_SCALE,
+			atomic64_read(&self->homa.active_remaining[0]));
+}
 TEST_F(homa_grant, homa_grant_check_rpc__new_message_cant_be_granted)
 {
 	struct homa_rpc *rpc1, *rpc2, *rpc3;
 	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
 	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
@@ -589,6 +1005,45 @@ TEST_F(homa_grant, homa_grant_check_rpc__new_message_cant_be_granted)
 	EXPECT_EQ(-1, atomic_read(&rpc3->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
+
+	/* The RPC should have been staged rather than added. */
+	EXPECT_EQ(1, rpc3->msgin.staged);
+	EXPECT_TRUE(list_empty(&rpc3->grantable_links));
+	EXPECT_EQ(1, atomic_read(&self->homa.num_staged_rpcs));
+	EXPECT_EQ(30000*HOMA_GRANT_WEIGHT_SCALE, rpc3->msgin.staged_remaining);
+	EXPECT_FALSE(llist_empty(&homa_cores[cpu_number]->grantable_staged));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grantable_staged_rpcs);
+	EXPECT_EQ(2, self->homa.num_grantable_rpcs);
+
+	/* A second packet for the RPC mustn't stage it again. */
+	homa_rpc_lock(rpc3, "test");
+	homa_grant_check_rpc(rpc3);
+	EXPECT_EQ(1, atomic_read(&self->homa.num_staged_rpcs));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grantable_staged_rpcs);
+}
+TEST_F(homa_grant, homa_grant_check_rpc__overcommit_increased)
+{
+	struct homa_rpc *rpc1, *rpc2, *rpc3;
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
+	self->homa.overcommit_current = 2;
+	homa_grant_recalc(&self->homa, 0);
+	EXPECT_EQ(2, self->homa.num_active_rpcs);
+
+	/* active_remaining[2] hasn't been filled in yet, so it mustn't
+	 * cause the new message to be staged.
+	 */
+	self->homa.overcommit_current = 3;
+	atomic64_set(&self->homa.active_remaining[2], 0);
+	rpc3 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 104, 1000, 40000);
+	homa_message_in_init(rpc3, 40000, 0);
+	homa_rpc_lock(rpc3, "test");
+	homa_grant_check_rpc(rpc3);
+	EXPECT_EQ(0, rpc3->msgin.staged);
+	EXPECT_EQ(2, atomic_read(&rpc3->msgin.rank));
+	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
+	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 }
 TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_from_negative_rank)
 {
@@ -596,7 +1051,7 @@ TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_from_negative_rank)
 	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
 	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
 	rpc3 = test_rpc(self, 104, self->server_ip, 40000);
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
@@ -611,6 +1066,34 @@ TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_from_negative_rank)
 	EXPECT_EQ(0, atomic_read(&rpc3->msgin.rank));
 	EXPECT_EQ(-1, atomic_read(&rpc2->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc1->msgin.rank));
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("response from 1.2.3.4, id 104, remaining 15000; "
+			"response from 1.2.3.4, id 100, remaining 20000; "
+			"response from 1.2.3.4, id 102, remaining 30000",
+			unit_log_get());
+}
+TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_of_staged_rpc)
+{
+	struct homa_rpc *rpc1, *rpc2, *rpc3;
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
+	self->homa.overcommit_current = 2;
+	homa_grant_recalc(&self->homa, 0);
+	rpc3 = staged_rpc(self, 104, self->server_ip, 40000, cpu_number);
+	EXPECT_EQ(-1, atomic_read(&rpc3->msgin.rank));
+
+	/* The key recorded at staging time must be refreshed, or the
+	 * recalculation would leave the message inactive.
+	 */
+	rpc3->msgin.bytes_remaining = 15000;
+	homa_rpc_lock(rpc3, "test");
+	homa_grant_check_rpc(rpc3);
+	EXPECT_EQ(0, rpc3->msgin.staged);
+	EXPECT_EQ(0, atomic_read(&rpc3->msgin.rank));
+	EXPECT_EQ(1, atomic_read(&rpc1->msgin.rank));
+	EXPECT_EQ(-1, atomic_read(&rpc2->msgin.rank));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_priority_bumps);
 }
 TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_from_positive_rank)
 {
@@ -618,7 +1101,7 @@ TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_from_positive_rank)
 	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
 	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
 	rpc3 = test_rpc(self, 104, self->server_ip, 40000);
-	self->homa.max_overcommit = 4;
+	self->homa.overcommit_current = 4;
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
@@ -627,6 +1110,7 @@ TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_from_positive_rank)
 
 	rpc3->msgin.bytes_remaining = 25000;
 	unit_log_clear();
+	homa_cores[cpu_number]->metrics.grant_recalc_calls = 0;
 	homa_rpc_lock(rpc3, "test");
 	homa_grant_check_rpc(rpc3);
 	EXPECT_EQ(25000, rpc3->msgin.granted);
@@ -635,6 +1119,9 @@ TEST_F(homa_grant, homa_grant_check_rpc__upgrade_priority_from_positive_rank)
 	EXPECT_EQ(2, atomic_read(&rpc2->msgin.rank));
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_STREQ("xmit GRANT 25000@1", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.grant_recalc_calls);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_incremental_bumps);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_recalcs_avoided);
 }
 TEST_F(homa_grant, homa_grant_check_rpc__send_new_grant)
 {
@@ -653,6 +1140,7 @@ TEST_F(homa_grant, homa_grant_check_rpc__send_new_grant)
 	EXPECT_EQ(10000, rpc->msgin.rec_incoming);
 	EXPECT_EQ(10000, atomic_read(&self->homa.total_incoming));
 	EXPECT_STREQ("xmit GRANT 15000@0", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_recalcs_avoided);
 }
 TEST_F(homa_grant, homa_grant_check_rpc__remove_from_grantable)
 {
@@ -702,6 +1190,67 @@ TEST_F(homa_grant, homa_grant_check_rpc__recalc_because_of_headroom)
 	EXPECT_EQ(14000, atomic_read(&self->homa.total_incoming));
 }
 
+TEST_F(homa_grant, homa_grant_promote__move_several_ranks)
+{
+	struct homa_rpc *rpc1, *rpc2, *rpc3, *rpc4;
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
+	rpc3 = test_rpc(self, 104, self->server_ip, 40000);
+	rpc4 = test_rpc(self, 106, self->server_ip, 50000);
+	self->homa.overcommit_current = 4;
+	homa_grant_recalc(&self->homa, 0);
+	EXPECT_EQ(3, atomic_read(&rpc4->msgin.rank));
+	EXPECT_EQ(0, rpc4->msgin.priority);
+
+	rpc4->msgin.bytes_remaining = 25000;
+	homa_grant_promote(rpc4, &self->homa);
+	EXPECT_STREQ("100 106 102 104", rpc_ids(self->homa.active_rpcs, 4));
+	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
+	EXPECT_EQ(1, atomic_read(&rpc4->msgin.rank));
+	EXPECT_EQ(2, atomic_read(&rpc2->msgin.rank));
+	EXPECT_EQ(3, atomic_read(&rpc3->msgin.rank));
+	EXPECT_EQ(25000*HOMA_GRANT_WEIGHT_SCALE,
+			atomic64_read(&self->homa.active_remaining[1]));
+	EXPECT_EQ(30000*HOMA_GRANT_WEIGHT_SCALE,
+			atomic64_read(&self->homa.active_remaining[2]));
+	EXPECT_EQ(40000*HOMA_GRANT_WEIGHT_SCALE,
+			atomic64_read(&self->homa.active_remaining[3]));
+	EXPECT_EQ(2, rpc4->msgin.priority);
+	EXPECT_EQ(1, rpc2->msgin.priority);
+	EXPECT_EQ(0, rpc3->msgin.priority);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grant_incremental_bumps);
+}
+TEST_F(homa_grant, homa_grant_promote__order_unchanged)
+{
+	struct homa_rpc *rpc1, *rpc2;
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
+	homa_grant_recalc(&self->homa, 0);
+
+	rpc2->msgin.bytes_remaining = 20000;
+	homa_grant_promote(rpc2, &self->homa);
+	EXPECT_STREQ("100 102", rpc_ids(self->homa.active_rpcs, 2));
+	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
+	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
+	EXPECT_EQ(20000*HOMA_GRANT_WEIGHT_SCALE,
+			atomic64_read(&self->homa.active_remaining[1]));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.grant_incremental_bumps);
+}
+TEST_F(homa_grant, homa_grant_promote__rpc_no_longer_active)
+{
+	struct homa_rpc *rpc1, *rpc2;
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
+	homa_grant_recalc(&self->homa, 0);
+	atomic_set(&rpc2->msgin.rank, -1);
+
+	rpc2->msgin.bytes_remaining = 10000;
+	homa_grant_promote(rpc2, &self->homa);
+	EXPECT_STREQ("100 102", rpc_ids(self->homa.active_rpcs, 2));
+	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
+	EXPECT_EQ(-1, atomic_read(&rpc2->msgin.rank));
+}
+
 TEST_F(homa_grant, homa_grant_recalc__basics)
 {
 	struct homa_rpc *rpc1, *rpc2, *rpc3, *rpc4;
@@ -710,7 +1259,7 @@ TEST_F(homa_grant, homa_grant_recalc__basics)
 	rpc3 = test_rpc(self, 104, self->server_ip+1, 25000);
 	rpc4 = test_rpc(self, 106, self->server_ip+1, 35000);
 	self->homa.max_incoming = 100000;
-	self->homa.max_overcommit = 3;
+	self->homa.overcommit_current = 3;
 
 	unit_log_clear();
 	homa_grant_recalc(&self->homa, 0);
@@ -720,18 +1269,36 @@ TEST_F(homa_grant, homa_grant_recalc__basics)
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(2, rpc1->msgin.priority);
 	EXPECT_EQ(10000, rpc1->msgin.granted);
-	EXPECT_EQ(20000, atomic_read(&self->homa.active_remaining[0]));
+	EXPECT_EQ(20000*HOMA_GRANT_WEIGHT_SCALE,
+			atomic64_read(&self->homa.active_remaining[0]));
 	EXPECT_EQ(1, atomic_read(&self->homa.grant_recalc_count));
 	EXPECT_EQ(0, atomic_read(&rpc1->grants_in_progress));
 
 	EXPECT_EQ(1, atomic_read(&rpc3->msgin.rank));
 	EXPECT_EQ(1, rpc3->msgin.priority);
 	EXPECT_EQ(10000, rpc3->msgin.granted);
-	EXPECT_EQ(30000, atomic_read(&self->homa.active_remaining[2]));
+	EXPECT_EQ(30000*HOMA_GRANT_WEIGHT_SCALE,
+			atomic64_read(&self->homa.active_remaining[2]));
 
 	EXPECT_EQ(2, atomic_read(&rpc2->msgin.rank));
 	EXPECT_EQ(-1, atomic_read(&rpc4->msgin.rank));
 }
+TEST_F(homa_grant, homa_grant_recalc__add_staged_rpcs)
+{
+	struct homa_rpc *rpc1, *rpc2;
+
+	rpc1 = test_rpc(self, 100, self->server_ip, 40000);
+	rpc2 = staged_rpc(self, 102, self->server_ip, 20000, 3);
+	self->homa.overcommit_current = 1;
+
+	unit_log_clear();
+	homa_grant_recalc(&self->homa, 0);
+	EXPECT_STREQ("xmit GRANT 10000@0", unit_log_get());
+	EXPECT_EQ(0, rpc2->msgin.staged);
+	EXPECT_EQ(0, atomic_read(&rpc2->msgin.rank));
+	EXPECT_EQ(10000, rpc2->msgin.granted);
+	EXPECT_EQ(-1, atomic_read(&rpc1->msgin.rank));
+}
 TEST_F(homa_grant, homa_grant_recalc__already_locked)
 {
 	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
@@ -768,7 +1335,7 @@ TEST_F(homa_grant, homa_grant_recalc__clear_existing_active_rpcs)
 	self->homa.num_active_rpcs = 1;
 	self->homa.max_incoming = 100000;
 	self->homa.max_rpcs_per_peer = 10;
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(-1, atomic_read(&rpc1->msgin.rank));
@@ -842,7 +1409,7 @@ TEST_F(homa_grant, homa_grant_recalc__rpc_fully_granted)
 	rpc3 = test_rpc(self, 104, self->server_ip, 10000);
 	rpc4 = test_rpc(self, 106, self->server_ip, 10000);
 	self->homa.max_incoming = 32000;
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(10000, rpc1->msgin.granted);
@@ -858,7 +1425,7 @@ TEST_F(homa_grant, homa_grant_recalc__rpc_fully_granted_but_skip_recalc)
 	rpc3 = test_rpc(self, 104, self->server_ip, 10000);
 	rpc4 = test_rpc(self, 106, self->server_ip, 10000);
 	self->homa.max_incoming = 32000;
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 	unit_hook_register(grantable_spinlock_hook);
 	hook_homa = &self->homa;
 	mock_trylock_errors = 0xfe0;
@@ -991,6 +1558,7 @@ TEST_F(homa_grant, homa_grant_find_oldest__fifo_grant_unused)
 			self->server_ip, self->client_port, 55, 200000, 100);
 	ASSERT_NE(NULL, srpc1);
 	ASSERT_NE(NULL, srpc2);
+	self->homa.fifo_grant_increment = 10000;
 	srpc1->msgin.granted += + 2*self->homa.fifo_grant_increment;
 
 	unit_log_clear();
@@ -1004,6 +1572,239 @@ TEST_F(homa_grant, homa_grant_find_oldest__no_good_candidates)
 	EXPECT_EQ(NULL, self->homa.oldest_rpc);
 }
 
+TEST_F(homa_grant, homa_grant_fifo__basics)
+{
+	struct homa_rpc *rpc1, *rpc2;
+
+	self->homa.fifo_grant_increment = 5000;
+	self->homa.fifo_grant_interval = 50000;
+	self->homa.max_sched_prio = 2;
+	mock_cycles = 200;
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	mock_cycles = 100;
+	rpc2 = test_rpc(self, 102, self->server_ip+1, 40000);
+
+	unit_log_clear();
+	homa_grant_fifo(&self->homa);
+	EXPECT_STREQ("xmit GRANT 5000@2", unit_log_get());
+	EXPECT_EQ(0, rpc1->msgin.granted);
+	EXPECT_EQ(5000, rpc2->msgin.granted);
+	EXPECT_EQ(50000, atomic_read(&self->homa.grant_nonfifo_left));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.fifo_grants);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.fifo_grants_no_incoming);
+}
+TEST_F(homa_grant, homa_grant_fifo__fifo_grants_disabled)
+{
+	test_rpc(self, 100, self->server_ip, 20000);
+
+	unit_log_clear();
+	homa_grant_fifo(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_grant, homa_grant_fifo__not_time_yet)
+{
+	self->homa.fifo_grant_increment = 5000;
+	atomic_set(&self->homa.grant_nonfifo_left, 1);
+	test_rpc(self, 100, self->server_ip, 20000);
+
+	unit_log_clear();
+	homa_grant_fifo(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, atomic_read(&self->homa.grant_nonfifo_left));
+}
+TEST_F(homa_grant, homa_grant_fifo__no_grantable_rpcs)
+{
+	self->homa.fifo_grant_increment = 5000;
+	self->homa.fifo_grant_interval = 50000;
+
+	homa_grant_fifo(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(50000, atomic_read(&self->homa.grant_nonfifo_left));
+}
+TEST_F(homa_grant, homa_grant_fifo__message_fully_granted)
+{
+	struct homa_rpc *rpc;
+
+	self->homa.fifo_grant_increment = 5000;
+	self->homa.fifo_grant_interval = 50000;
+	self->homa.max_sched_prio = 2;
+	rpc = test_rpc(self, 100, self->server_ip, 3000);
+
+	unit_log_clear();
+	homa_grant_fifo(&self->homa);
+	EXPECT_STREQ("xmit GRANT 3000@2", unit_log_get());
+	EXPECT_EQ(3000, rpc->msgin.granted);
+	EXPECT_TRUE(list_empty(&rpc->grantable_links));
+	EXPECT_EQ(0, self->homa.num_grantable_rpcs);
+}
+TEST_F(homa_grant, homa_grant_fifo__bounded_slowdown)
+{
+	struct homa_rpc *large, *small;
+	int i, before, srpt_bytes = 0;
+
+	/* A stream of short messages continually outranks a large one;
+	 * under pure SRPT the large message would starve. FIFO grants
+	 * should give it grant_fifo_fraction of all granted bytes.
+	 */
+	self->homa.fifo_grant_interval = 40000;
+	self->homa.grant_fifo_fraction = 200;
+	self->homa.max_incoming = 1000000;
+	homa_incoming_sysctl_changed(&self->homa);
+	EXPECT_EQ(10000, self->homa.fifo_grant_increment);
+	mock_cycles = 100;
+	large = test_rpc(self, 100, self->server_ip, 1000000);
+	for (i = 0; i < 20; i++) {
+		mock_cycles = 200 + i;
+		small = test_rpc(self, 200 + 2*i, self->server_ip+1, 20000);
+		while (small->msgin.granted < small->msgin.length) {
+			/* Granted data arrives immediately. */
+			small->msgin.bytes_remaining = small->msgin.length
+					- small->msgin.granted;
+			large->msgin.bytes_remaining = large->msgin.length
+					- large->msgin.granted;
+			before = small->msgin.granted;
+			homa_grant_send(small, &self->homa);
+			srpt_bytes += small->msgin.granted - before;
+			homa_grant_fifo(&self->homa);
+		}
+		homa_grant_remove_rpc(small);
+	}
+	EXPECT_EQ(400000, srpt_bytes);
+	EXPECT_EQ(100000, large->msgin.granted);
+	EXPECT_EQ(10, homa_cores[cpu_number]->metrics.fifo_grants);
+}
+
+TEST_F(homa_grant, homa_grant_tune_overcommit__disabled)
+{
+	self->homa.link_mbps = 10000;
+	self->homa.overcommit_tick_count = 3;
+	self->homa.overcommit_current = 2;
+	homa_grant_tune_overcommit(&self->homa, 5000);
+	EXPECT_EQ(5000, self->homa.overcommit_prev_bytes);
+	EXPECT_EQ(0, self->homa.overcommit_tick_count);
+	EXPECT_EQ(2, self->homa.overcommit_current);
+}
+TEST_F(homa_grant, homa_grant_tune_overcommit__wait_for_more_ticks)
+{
+	self->homa.dynamic_overcommit = 1;
+	self->homa.link_mbps = 10000;
+	self->homa.overcommit_ticks = 2;
+	self->homa.overcommit_current = 2;
+	test_rpc(self, 100, self->server_ip, 20000);
+	test_rpc(self, 102, self->server_ip, 30000);
+	test_rpc(self, 104, self->server_ip, 40000);
+
+	homa_grant_tune_overcommit(&self->homa, 1000);
+	EXPECT_EQ(1, self->homa.overcommit_tick_count);
+	EXPECT_EQ(0, self->homa.overcommit_prev_bytes);
+	EXPECT_EQ(2, self->homa.overcommit_current);
+}
+TEST_F(homa_grant, homa_grant_tune_overcommit__increase)
+{
+	self->homa.dynamic_overcommit = 1;
+	self->homa.link_mbps = 10000;
+	self->homa.overcommit_ticks = 2;
+	self->homa.overcommit_current = 2;
+	self->homa.overcommit_prev_bytes = 1000000;
+	test_rpc(self, 100, self->server_ip, 20000);
+	test_rpc(self, 102, self->server_ip, 30000);
+	test_rpc(self, 104, self->server_ip, 40000);
+
+	homa_grant_tune_overcommit(&self->homa, 1500000);
+	homa_grant_tune_overcommit(&self->homa, 2000000);
+	EXPECT_EQ(3, self->homa.overcommit_current);
+	EXPECT_EQ(8, self->homa.max_overcommit);
+	EXPECT_EQ(400, self->homa.overcommit_prev_util);
+	EXPECT_EQ(1, self->homa.overcommit_last_change);
+	EXPECT_EQ(2000000, self->homa.overcommit_prev_bytes);
+	EXPECT_EQ(0, self->homa.overcommit_tick_count);
+	EXPECT_EQ(3, self->homa.num_active_rpcs);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.overcommit_increases);
+}
+TEST_F(homa_grant, homa_grant_tune_overcommit__all_messages_already_active)
+{
+	self->homa.dynamic_overcommit = 1;
+	self->homa.link_mbps = 10000;
+	self->homa.overcommit_ticks = 1;
+	self->homa.overcommit_current = 3;
+	test_rpc(self, 100, self->server_ip, 20000);
+	test_rpc(self, 102, self->server_ip, 30000);
+	test_rpc(self, 104, self->server_ip, 40000);
+
+	homa_grant_tune_overcommit(&self->homa, 100000);
+	EXPECT_EQ(3, self->homa.overcommit_current);
+	EXPECT_EQ(80, self->homa.overcommit_prev_util);
+	EXPECT_EQ(0, self->homa.overcommit_last_change);
+}
+TEST_F(homa_grant, homa_grant_tune_overcommit__revert_after_collapse)
+{
+	self->homa.dynamic_overcommit = 1;
+	self->homa.link_mbps = 10000;
+	self->homa.overcommit_ticks = 1;
+	self->homa.overcommit_current = 2;
+	test_rpc(self, 100, self->server_ip, 20000);
+	test_rpc(self, 102, self->server_ip, 30000);
+	test_rpc(self, 104, self->server_ip, 40000);
+	test_rpc(self, 106, self->server_ip, 50000);
+
+	homa_grant_tune_overcommit(&self->homa, 1000000);
+	EXPECT_EQ(3, self->homa.overcommit_current);
+	EXPECT_EQ(800, self->homa.overcommit_prev_util);
+
+	/* Utilization dropped after the increase. */
+	homa_grant_tune_overcommit(&self->homa, 1500000);
+	EXPECT_EQ(2, self->homa.overcommit_current);
+	EXPECT_EQ(400, self->homa.overcommit_prev_util);
+	EXPECT_EQ(-1, self->homa.overcommit_last_change);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.overcommit_decreases);
+
+	/* Utilization still low, but the last change was a decrease. */
+	homa_grant_tune_overcommit(&self->homa, 1800000);
+	EXPECT_EQ(3, self->homa.overcommit_current);
+}
+TEST_F(homa_grant, homa_grant_tune_overcommit__decrease_when_saturated)
+{
+	self->homa.dynamic_overcommit = 1;
+	self->homa.link_mbps = 10000;
+	self->homa.overcommit_ticks = 1;
+	self->homa.overcommit_current = 3;
+	test_rpc(self, 100, self->server_ip, 20000);
+	test_rpc(self, 102, self->server_ip, 30000);
+	test_rpc(self, 104, self->server_ip, 40000);
+	test_rpc(self, 106, self->server_ip, 50000);
+
+	homa_grant_tune_overcommit(&self->homa, 1240000);
+	EXPECT_EQ(2, self->homa.overcommit_current);
+	EXPECT_EQ(992, self->homa.overcommit_prev_util);
+	EXPECT_EQ(2, self->homa.num_active_rpcs);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.overcommit_decreases);
+}
+TEST_F(homa_grant, homa_grant_tune_overcommit__respect_bounds)
+{
+	self->homa.dynamic_overcommit = 1;
+	self->homa.link_mbps = 10000;
+	self->homa.overcommit_ticks = 1;
+	self->homa.overcommit_min = 2;
+	self->homa.overcommit_max = 3;
+	self->homa.overcommit_current = 3;
+	test_rpc(self, 100, self->server_ip, 20000);
+	test_rpc(self, 102, self->server_ip, 30000);
+	test_rpc(self, 104, self->server_ip, 40000);
+	test_rpc(self, 106, self->server_ip, 50000);
+
+	/* Can't increase above overcommit_max. */
+	homa_grant_tune_overcommit(&self->homa, 100000);
+	EXPECT_EQ(3, self->homa.overcommit_current);
+	EXPECT_EQ(0, self->homa.overcommit_last_change);
+
+	/* Can't decrease below overcommit_min. */
+	self->homa.overcommit_current = 2;
+	homa_grant_tune_overcommit(&self->homa, 1350000);
+	EXPECT_EQ(2, self->homa.overcommit_current);
+	EXPECT_EQ(0, self->homa.overcommit_last_change);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.overcommit_decreases);
+}
+
 TEST_F(homa_grant, homa_grant_rpc_free__rpc_not_grantable)
 {
 	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
@@ -1020,7 +1821,7 @@ TEST_F(homa_grant, homa_grant_free_rpc__in_active_list)
 	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
 	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
 	rpc3 = test_rpc(self, 104, self->server_ip, 40000);
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
@@ -1041,7 +1842,7 @@ TEST_F(homa_grant, homa_grant_free_rpc__not_in_active_list)
 	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
 	rpc2 = test_rpc(self, 102, self->server_ip, 30000);
 	rpc3 = test_rpc(self, 104, self->server_ip, 40000);
-	self->homa.max_overcommit = 2;
+	self->homa.overcommit_current = 2;
 	homa_grant_recalc(&self->homa, 0);
 	EXPECT_EQ(0, atomic_read(&rpc1->msgin.rank));
 	EXPECT_EQ(1, atomic_read(&rpc2->msgin.rank));
@@ -1055,6 +1856,20 @@ TEST_F(homa_grant, homa_grant_free_rpc__not_in_active_list)
 	EXPECT_TRUE(list_empty(&rpc3->grantable_links));
 	EXPECT_EQ(15000, atomic_read(&self->homa.total_incoming));
 }
+TEST_F(homa_grant, homa_grant_free_rpc__staged)
+{
+	struct homa_rpc *rpc1, *rpc2;
+
+	rpc1 = test_rpc(self, 100, self->server_ip, 20000);
+	rpc2 = staged_rpc(self, 102, self->server_ip, 30000, 2);
+
+	homa_grant_free_rpc(rpc2);
+	EXPECT_EQ(0, rpc2->msgin.staged);
+	EXPECT_TRUE(list_empty(&rpc2->grantable_links));
+	EXPECT_EQ(0, atomic_read(&self->homa.num_staged_rpcs));
+	EXPECT_EQ(1, self->homa.num_grantable_rpcs);
+	EXPECT_FALSE(list_empty(&rpc1->grantable_links));
+}
 
 TEST_F(homa_grant, homa_grantable_lock_slow__basics)
 {
@@ -1066,6 +1881,7 @@ TEST_F(homa_grant, homa_grantable_lock_slow__basics)
 
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grantable_lock_misses);
 	EXPECT_EQ(500, homa_cores[cpu_number]->metrics.grantable_lock_miss_cycles);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.grantable_lock_acquires);
 }
 TEST_F(homa_grant, homa_grantable_lock_slow__recalc_count)
 {
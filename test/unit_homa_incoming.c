@@ -142,6 +142,7 @@ FIXTURE_SETUP(homa_incoming)
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
 	self->homa.pacer_fifo_fraction = 0;
 	self->homa.grant_fifo_fraction = 0;
+	self->homa.fifo_grant_increment = 0;
 	mock_sock_init(&self->hsk, &self->homa, 0);
 	mock_sock_init(&self->hsk2, &self->homa, self->server_port);
 	self->server_addr.in6.sin6_family = self->hsk.inet.sk.sk_family;
@@ -552,8 +553,7 @@ TEST_F(homa_incoming, homa_copy_to_user__basics)
 {
 	struct homa_rpc *crpc;
 
-	mock_bpage_size = 2048;
-	mock_bpage_shift = 11;
+	self->hsk.buffer_pool.bpage_shift = 11;
 	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
 			self->server_ip, self->server_port, self->client_id,
 			1000, 4000);
@@ -646,8 +646,7 @@ TEST_F(homa_incoming, homa_copy_to_user__many_chunks_for_one_skb)
 {
 	struct homa_rpc *crpc;
 
-	mock_bpage_size = 512;
-	mock_bpage_shift = 9;
+	self->hsk.buffer_pool.bpage_shift = 9;
 	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
 			self->server_ip, self->server_port, self->client_id,
 			1000, 4000);
@@ -674,6 +673,25 @@ TEST_F(homa_incoming, homa_copy_to_user__many_chunks_for_one_skb)
 			"103560-103999",
 			unit_log_get());
 }
+TEST_F(homa_incoming, homa_copy_to_user__pinned_region)
+{
+	static char page[PAGE_SIZE];
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+	ASSERT_EQ(0, homa_pool_pin(&self->hsk.buffer_pool,
+			self->hsk.buffer_pool.region, 100*HOMA_BPAGE_SIZE));
+	self->hsk.buffer_pool.pinned_pages[0] = (struct page *) page;
+
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_STREQ("skb_copy_bits: 1400 bytes: 0-1399", unit_log_get());
+	EXPECT_EQ(1396, *((__u32 *) (page + 1396)));
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+}
 TEST_F(homa_incoming, homa_copy_to_user__error_in_import_single_range)
 {
 	struct homa_rpc *crpc;
@@ -945,7 +963,8 @@ TEST_F(homa_incoming, homa_dispatch_pkts__cutoffs_for_unknown_client_rpc)
 		        .unsched_cutoffs = {htonl(10), htonl(9), htonl(8),
 			htonl(7), htonl(6), htonl(5), htonl(4),
 			htonl(3)},
-			.cutoff_version = 400};
+			.cutoff_version = 400,
+			.unsched_bytes = htonl(2000)};
 	homa_dispatch_pkts(mock_skb_new(self->server_ip, &h.common, 0, 0),
 			&self->homa);
 	peer = homa_peer_find(&self->homa.peers, self->server_ip,
@@ -954,6 +973,7 @@ TEST_F(homa_incoming, homa_dispatch_pkts__cutoffs_for_unknown_client_rpc)
 	EXPECT_EQ(400, peer->cutoff_version);
 	EXPECT_EQ(9, peer->unsched_cutoffs[1]);
 	EXPECT_EQ(3, peer->unsched_cutoffs[7]);
+	EXPECT_EQ(2000, peer->unsched_bytes);
 }
 TEST_F(homa_incoming, homa_dispatch_pkts__resend_for_unknown_server_rpc)
 {
@@ -1058,6 +1078,20 @@ TEST_F(homa_incoming, homa_dispatch_pkts__invoke_homa_grant_check_rpc)
 	unit_log_grantables(&self->homa);
 	EXPECT_SUBSTR("id 1235", unit_log_get());
 }
+TEST_F(homa_incoming, homa_dispatch_pkts__check_waiting_rpcs)
+{
+	self->hsk.buffer_pool.check_waiting_needed = 1;
+	self->hsk.buffer_pool.check_waiting_invoked = 0;
+	homa_dispatch_pkts(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), &self->homa);
+	EXPECT_EQ(1, self->hsk.buffer_pool.check_waiting_invoked);
+	EXPECT_EQ(0, self->hsk.buffer_pool.check_waiting_needed);
+
+	/* No need to check this time. */
+	homa_dispatch_pkts(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), &self->homa);
+	EXPECT_EQ(1, self->hsk.buffer_pool.check_waiting_invoked);
+}
 TEST_F(homa_incoming, homa_dispatch_pkts__forced_reap)
 {
 	struct homa_rpc *dead = unit_client_rpc(&self->hsk,
@@ -1173,6 +1207,31 @@ TEST_F(homa_incoming, homa_data_pkt__no_buffers)
 	EXPECT_EQ(1400, homa_cores[cpu_number]->metrics.dropped_data_no_bufs);
 	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
 }
+TEST_F(homa_incoming, homa_data_pkt__beyond_buffer_space)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 200000);
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	/* Only 1 bpage is available, so only part of the message can
+	 * have buffer space.
+	 */
+	atomic_set(&self->hsk.buffer_pool.free_bpages, 1);
+	self->data.message_length = htonl(200000);
+	self->data.incoming = htonl(10000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc);
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
+
+	self->data.seg.offset = htonl(HOMA_BPAGE_SIZE - 1000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, HOMA_BPAGE_SIZE - 1000), crpc);
+	EXPECT_EQ(1400, homa_cores[cpu_number]->metrics.dropped_data_no_bufs);
+	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
+}
 TEST_F(homa_incoming, homa_data_pkt__update_delta)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1256,6 +1315,16 @@ TEST_F(homa_incoming, homa_data_pkt__send_cutoffs)
 			1400, 0), &self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_incoming, homa_data_pkt__send_incast_unsched_limit)
+{
+	self->homa.cutoff_version = 2;
+	self->homa.incast_unsched_limit = 3000;
+	self->data.message_length = htonl(5000);
+	mock_xmit_log_verbose = 1;
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0), &self->homa);
+	EXPECT_SUBSTR("version 2, unsched_bytes 3000", unit_log_get());
+}
 TEST_F(homa_incoming, homa_data_pkt__cutoffs_up_to_date)
 {
 	self->homa.cutoff_version = 123;
@@ -1356,6 +1425,85 @@ TEST_F(homa_incoming, homa_grant_pkt__grant_past_end_of_message)
 	EXPECT_EQ(20000, crpc->msgout.granted);
 }
 
+TEST_F(homa_incoming, homa_multi_grant_pkt__basics)
+{
+	struct homa_rpc *srpc1 = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 20000);
+	struct homa_rpc *srpc2 = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id+2, 100, 20000);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	homa_xmit_data(srpc1, false);
+	homa_xmit_data(srpc2, false);
+	unit_log_clear();
+
+	struct multi_grant_header h = {{.sport = htons(srpc1->dport),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = MULTI_GRANT},
+			.num_grants = htons(2),
+			.grants = {{.sender_id = cpu_to_be64(self->client_id),
+				.offset = htonl(11000), .priority = 3},
+				{.sender_id = cpu_to_be64(self->client_id+2),
+				.offset = htonl(11000), .priority = 2}}};
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_EQ(11000, srpc1->msgout.granted);
+	EXPECT_EQ(3, srpc1->msgout.sched_priority);
+	EXPECT_EQ(11000, srpc2->msgout.granted);
+	EXPECT_EQ(2, srpc2->msgout.sched_priority);
+	EXPECT_STREQ("xmit DATA 1400@10000; xmit DATA 1400@10000",
+			unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.packets_received[
+			MULTI_GRANT - DATA]);
+}
+TEST_F(homa_incoming, homa_multi_grant_pkt__unknown_rpc)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 20000);
+	ASSERT_NE(NULL, srpc);
+	homa_xmit_data(srpc, false);
+	unit_log_clear();
+
+	struct multi_grant_header h = {{.sport = htons(srpc->dport),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->client_id+2),
+			.type = MULTI_GRANT},
+			.num_grants = htons(2),
+			.grants = {{.sender_id = cpu_to_be64(self->client_id+2),
+				.offset = htonl(11000), .priority = 3},
+				{.sender_id = cpu_to_be64(self->client_id),
+				.offset = htonl(11000), .priority = 3}}};
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_EQ(11000, srpc->msgout.granted);
+	EXPECT_STREQ("xmit DATA 1400@10000", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.unknown_rpcs);
+}
+TEST_F(homa_incoming, homa_multi_grant_pkt__too_many_grants)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 20000);
+	ASSERT_NE(NULL, srpc);
+	homa_xmit_data(srpc, false);
+	unit_log_clear();
+
+	struct multi_grant_header h = {{.sport = htons(srpc->dport),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = MULTI_GRANT},
+			.num_grants = htons(1000),
+			.grants = {{.sender_id = cpu_to_be64(self->client_id),
+				.offset = htonl(11000), .priority = 3}}};
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->homa);
+	EXPECT_EQ(11000, srpc->msgout.granted);
+}
+
 TEST_F(homa_incoming, homa_resend_pkt__unknown_rpc)
 {
 	struct resend_header h = {{.sport = htons(self->client_port),
@@ -1563,6 +1711,28 @@ TEST_F(homa_incoming, homa_cutoffs_pkt_basics)
 	EXPECT_EQ(9, crpc->peer->unsched_cutoffs[1]);
 	EXPECT_EQ(3, crpc->peer->unsched_cutoffs[7]);
 }
+TEST_F(homa_incoming, homa_cutoffs_pkt__unsched_bytes_missing)
+{
+	struct cutoffs_header h = {{.sport = htons(self->server_port),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(self->server_id),
+			.type = CUTOFFS},
+		        .unsched_cutoffs = {htonl(10), htonl(9), htonl(8),
+			htonl(7), htonl(6), htonl(5), htonl(4), htonl(3)},
+			.cutoff_version = 400,
+			.unsched_bytes = htonl(5000)};
+	struct sk_buff *skb = mock_skb_new(self->server_ip, &h.common, 0, 0);
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->homa.peers, self->server_ip,
+			&self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	peer->unsched_bytes = 2000;
+	skb->len -= sizeof(h.unsched_bytes);
+	homa_cutoffs_pkt(skb, &self->hsk);
+	EXPECT_EQ(400, peer->cutoff_version);
+	EXPECT_EQ(0, peer->unsched_bytes);
+}
 TEST_F(homa_incoming, homa_cutoffs__cant_find_peer)
 {
 	struct homa_peer *peer;
@@ -2596,29 +2766,63 @@ TEST_F(homa_incoming, homa_rpc_handoff__update_last_app_active)
 	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
 }
 
-TEST_F(homa_incoming, homa_incoming_sysctl_changed__grant_nonfifo)
+TEST_F(homa_incoming, homa_incoming_sysctl_changed__poll_cycles)
 {
 	cpu_khz = 2000000;
 	self->homa.poll_usecs = 40;
 	homa_incoming_sysctl_changed(&self->homa);
 	EXPECT_EQ(80000, self->homa.poll_cycles);
 }
-TEST_F(homa_incoming, homa_incoming_sysctl_changed__poll_cycles)
+TEST_F(homa_incoming, homa_incoming_sysctl_changed__fifo_grant_increment)
 {
-	self->homa.fifo_grant_increment = 10000;
+	self->homa.fifo_grant_interval = 90000;
 	self->homa.grant_fifo_fraction = 0;
 	homa_incoming_sysctl_changed(&self->homa);
-	EXPECT_EQ(0, self->homa.grant_nonfifo);
+	EXPECT_EQ(0, self->homa.fifo_grant_increment);
+	EXPECT_EQ(90000, atomic_read(&self->homa.grant_nonfifo_left));
 
 	self->homa.grant_fifo_fraction = 100;
 	homa_incoming_sysctl_changed(&self->homa);
-	EXPECT_EQ(90000, self->homa.grant_nonfifo);
+	EXPECT_EQ(10000, self->homa.fifo_grant_increment);
 
 	self->homa.grant_fifo_fraction = 500;
 	homa_incoming_sysctl_changed(&self->homa);
-	EXPECT_EQ(10000, self->homa.grant_nonfifo);
+	EXPECT_EQ(90000, self->homa.fifo_grant_increment);
 
 	self->homa.grant_fifo_fraction = 2000;
 	homa_incoming_sysctl_changed(&self->homa);
-	EXPECT_EQ(10000, self->homa.grant_nonfifo);
+	EXPECT_EQ(500, self->homa.grant_fifo_fraction);
+	EXPECT_EQ(90000, self->homa.fifo_grant_increment);
+}
+TEST_F(homa_incoming, homa_incoming_sysctl_changed__overcommit_bounds)
+{
+	self->homa.overcommit_min = 0;
+	self->homa.overcommit_max = 100;
+	self->homa.max_overcommit = 1;
+	homa_incoming_sysctl_changed(&self->homa);
+	EXPECT_EQ(1, self->homa.overcommit_min);
+	EXPECT_EQ(HOMA_MAX_GRANTS, self->homa.overcommit_max);
+	EXPECT_EQ(1, self->homa.overcommit_current);
+
+	self->homa.dynamic_overcommit = 1;
+	self->homa.overcommit_min = 4;
+	self->homa.overcommit_max = 3;
+	homa_incoming_sysctl_changed(&self->homa);
+	EXPECT_EQ(3, self->homa.overcommit_min);
+	EXPECT_EQ(3, self->homa.overcommit_current);
+	EXPECT_EQ(1, self->homa.max_overcommit);
+}
+TEST_F(homa_incoming, homa_incoming_sysctl_changed__keep_tuned_overcommit)
+{
+	self->homa.max_overcommit = 4;
+	self->homa.dynamic_overcommit = 1;
+	self->homa.overcommit_current = 6;
+	homa_incoming_sysctl_changed(&self->homa);
+	EXPECT_EQ(6, self->homa.overcommit_current);
+	EXPECT_EQ(4, self->homa.max_overcommit);
+
+	/* Disabling dynamic overcommit restores the administrator's value. */
+	self->homa.dynamic_overcommit = 0;
+	homa_incoming_sysctl_changed(&self->homa);
+	EXPECT_EQ(4, self->homa.overcommit_current);
 }
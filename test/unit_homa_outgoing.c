@@ -50,6 +50,7 @@ FIXTURE_SETUP(homa_outgoing)
 	atomic64_set(&self->homa.link_idle_time, 10000);
 	self->homa.cycles_per_kbyte = 1000;
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
+	self->homa.skb_cache_size = 32;
 	mock_sock_init(&self->hsk, &self->homa, self->client_port);
 	self->server_addr.in6.sin6_family = AF_INET;
 	self->server_addr.in6.sin6_addr = self->server_ip[0];
@@ -112,6 +113,29 @@ TEST_F(homa_outgoing, homa_message_out_init__basics)
 	EXPECT_EQ(3, crpc->msgout.num_skbs);
 	EXPECT_EQ(3000, crpc->msgout.copied_from_user);
 }
+TEST_F(homa_outgoing, homa_message_out_init__limit_unsched_bytes_for_incast)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	crpc1 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(crpc1 == NULL);
+	crpc1->peer->unsched_bytes = 2000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc1,
+			unit_iov_iter((void *) 1000, 5000), 0));
+	homa_rpc_unlock(crpc1);
+	EXPECT_EQ(2000, crpc1->msgout.unscheduled);
+	EXPECT_EQ(2000, crpc1->msgout.granted);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.unsched_limited_msgs);
+
+	/* Short messages aren't affected by the limit. */
+	crpc2 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(crpc2 == NULL);
+	ASSERT_EQ(0, -homa_message_out_init(crpc2,
+			unit_iov_iter((void *) 1000, 1500), 0));
+	homa_rpc_unlock(crpc2);
+	EXPECT_EQ(1500, crpc2->msgout.unscheduled);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.unsched_limited_msgs);
+}
 TEST_F(homa_outgoing, homa_message_out_init__gso_force_software)
 {
 	struct homa_rpc *crpc1 = homa_rpc_new_client(&self->hsk,
@@ -389,6 +413,604 @@ TEST_F(homa_outgoing, homa_message_out_init__too_short_for_pipelining)
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_message_out_init__xmit_in_chunks)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.xmit_chunk_bytes = 2000;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 5000), HOMA_OUT_XMIT));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("_copy_from_iter 1400 bytes at 1000; "
+			"_copy_from_iter 1400 bytes at 2400; "
+			"xmit DATA 1400@0; xmit DATA 1400@1400; "
+			"_copy_from_iter 1400 bytes at 3800; "
+			"_copy_from_iter 800 bytes at 5200; "
+			"xmit DATA 1400@2800; xmit DATA 800@4200",
+			unit_log_get());
+	EXPECT_EQ(5000, crpc->msgout.next_xmit_offset);
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_message_out_init__zerocopy_cant_alloc_zcopy)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 3000), HOMA_OUT_ZEROCOPY));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(0, crpc->msgout.num_skbs);
+}
+TEST_F(homa_outgoing, homa_message_out_init__zerocopy_limit_segs_per_skb)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	mock_net_device.gso_max_size = 20000;
+	self->homa.max_gso_size = 20000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 10000), HOMA_OUT_ZEROCOPY));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(8400, crpc->msgout.gso_pkt_data);
+	EXPECT_EQ(2, crpc->msgout.num_skbs);
+	EXPECT_EQ(6, skb_shinfo(crpc->msgout.packets)->gso_segs);
+}
+TEST_F(homa_outgoing, homa_message_out_init__zerocopy_copy_multiple_iovecs)
+{
+	struct iovec vecs[2] = {{(void *) 1000, 1000}, {(void *) 5000, 500}};
+	struct iov_iter iter;
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	iov_iter_init(&iter, WRITE, vecs, 2, 1500);
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc, &iter, HOMA_OUT_ZEROCOPY));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("_copy_from_iter 1000 bytes at 1000; "
+			"_copy_from_iter 400 bytes at 5000; "
+			"_copy_from_iter 100 bytes at 5400; "
+			"sock_queue_err_skb: origin 5, info 2, data 0, code 1",
+			unit_log_get());
+	EXPECT_EQ(NULL, skb_zcopy(crpc->msgout.packets));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.zerocopy_bytes);
+}
+TEST_F(homa_outgoing, homa_message_out_init__zerocopy_segments_in_frags)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct data_segment *seg;
+	struct sk_buff *skb;
+	skb_frag_t *frag;
+	int i;
+
+	ASSERT_FALSE(crpc == NULL);
+	mock_net_device.gso_max_size = 5000;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 5000), HOMA_OUT_ZEROCOPY));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("iov_iter_get_pages2 1400 bytes at 1000; "
+			"iov_iter_get_pages2 1400 bytes at 2400; "
+			"iov_iter_get_pages2 1400 bytes at 3800; "
+			"iov_iter_get_pages2 800 bytes at 5200",
+			unit_log_get());
+	EXPECT_EQ(2, crpc->msgout.num_skbs);
+
+	skb = crpc->msgout.packets;
+	EXPECT_NE(NULL, skb_zcopy(skb));
+	EXPECT_EQ(3, skb_shinfo(skb)->gso_segs);
+	EXPECT_EQ(sizeof(struct data_header), skb_headlen(skb));
+	EXPECT_EQ(sizeof(struct data_header) + 2*sizeof(struct data_segment)
+			+ 4200, skb->len);
+	unit_log_clear();
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		unit_log_printf(" ", "%d@%d", skb_frag_size(frag),
+				skb_frag_off(frag));
+	}
+	EXPECT_STREQ("1400@1000 24@0 1400@2400 24@24 296@3800 1104@0",
+			unit_log_get());
+	frag = &skb_shinfo(skb)->frags[3];
+	seg = (struct data_segment *) (page_address(skb_frag_page(frag))
+			+ skb_frag_off(frag));
+	EXPECT_EQ(2800, ntohl(seg->offset));
+	EXPECT_EQ(1400, ntohl(seg->segment_length));
+
+	/* Header page: one reference for each frag that uses it. */
+	EXPECT_EQ(2, mock_page_refs(skb_frag_page(frag)));
+
+	skb = homa_get_skb_info(skb)->next_skb;
+	EXPECT_EQ(1, skb_shinfo(skb)->nr_frags);
+	EXPECT_EQ(800, skb_frag_size(&skb_shinfo(skb)->frags[0]));
+	EXPECT_EQ(5000, homa_cores[cpu_number]->metrics.zerocopy_bytes);
+}
+TEST_F(homa_outgoing, homa_message_out_init__zerocopy_cant_alloc_hdr_page)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	mock_net_device.gso_max_size = 5000;
+	mock_alloc_page_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 5000), HOMA_OUT_ZEROCOPY));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(0, crpc->msgout.num_skbs);
+}
+TEST_F(homa_outgoing, homa_message_out_init__zerocopy_cant_get_pages)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	mock_gup_errors = 2;
+	EXPECT_EQ(EFAULT, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 3000), HOMA_OUT_ZEROCOPY));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(1, crpc->msgout.num_skbs);
+}
+
+TEST_F(homa_outgoing, homa_message_out_init__region_not_registered)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	EXPECT_EQ(EINVAL, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 0x3000000, 3000),
+			HOMA_OUT_REGION));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(0, crpc->msgout.num_skbs);
+}
+TEST_F(homa_outgoing, homa_message_out_init__region_message_outside_region)
+{
+	struct iovec vecs[2] = {{(void *) 0x3000000, 1000},
+			{(void *) 0x3001000, 500}};
+	struct iov_iter iter;
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 0));
+	EXPECT_EQ(EINVAL, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 0x2fff000, 3000),
+			HOMA_OUT_REGION));
+	EXPECT_EQ(EINVAL, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) (0x3000000 + 3*PAGE_SIZE),
+			PAGE_SIZE + 1), HOMA_OUT_REGION));
+	iov_iter_init(&iter, WRITE, vecs, 2, 1500);
+	EXPECT_EQ(EINVAL, -homa_message_out_init(crpc, &iter,
+			HOMA_OUT_REGION));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(0, crpc->msgout.num_skbs);
+}
+TEST_F(homa_outgoing, homa_message_out_init__region_pages_in_frags)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct sk_buff *skb;
+	int i;
+
+	ASSERT_FALSE(crpc == NULL);
+	mock_pin_tracked_pages = true;
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 0));
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) (0x3000000 + 1000), 3500),
+			HOMA_OUT_REGION));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(NULL, strstr(unit_log_get(), "_copy_from_iter"));
+	EXPECT_EQ(NULL, strstr(unit_log_get(), "iov_iter_get_pages2"));
+	EXPECT_EQ(3, crpc->msgout.num_skbs);
+	unit_log_clear();
+	for (skb = crpc->msgout.packets; skb != NULL;
+			skb = homa_get_skb_info(skb)->next_skb) {
+		EXPECT_NE(NULL, skb_zcopy(skb));
+		for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+			skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+			unit_log_printf(" ", "%d@%d", skb_frag_size(frag),
+					skb_frag_off(frag));
+		}
+	}
+	EXPECT_STREQ("1400@1000 1400@2400 296@3800 404@0", unit_log_get());
+	EXPECT_EQ(4, mock_page_refs(region->pages[0]));
+	EXPECT_EQ(2, mock_page_refs(region->pages[1]));
+	EXPECT_EQ(3500, homa_cores[cpu_number]->metrics.zerocopy_bytes);
+}
+TEST_F(homa_outgoing, homa_message_out_init__copy_helpers)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.copy_helper_bytes = 2000;
+	self->homa.busy_cycles = 1000;
+	homa_cores[2]->last_active = 9500;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 7000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("queue_work_on core 3; "
+			"_copy_from_iter 1400 bytes at 3800; "
+			"_copy_from_iter 1400 bytes at 5200; "
+			"queue_work_on core 4; "
+			"_copy_from_iter 1400 bytes at 6600; "
+			"_copy_from_iter 1400 bytes at 1000; "
+			"_copy_from_iter 1400 bytes at 2400",
+			unit_log_get());
+	unit_log_clear();
+	unit_log_filled_skbs(crpc->msgout.packets, 0);
+	EXPECT_STREQ("DATA 1400@0; DATA 1400@1400; DATA 1400@2800; "
+			"DATA 1400@4200; DATA 1400@5600",
+			unit_log_get());
+	EXPECT_EQ(5, crpc->msgout.num_skbs);
+	EXPECT_EQ(7000, crpc->msgout.copied_from_user);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.copy_helpers);
+	EXPECT_EQ(4200, homa_cores[cpu_number]->metrics.helper_copy_bytes);
+}
+TEST_F(homa_outgoing, homa_message_out_init__copy_helper_fails)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.copy_helper_bytes = 2000;
+	mock_copy_data_errors = 2;
+	unit_log_clear();
+	EXPECT_EQ(EFAULT, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 7000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(2, crpc->msgout.num_skbs);
+	EXPECT_EQ(2800, crpc->msgout.copied_from_user);
+	EXPECT_EQ(0, atomic_read(&crpc->flags) & RPC_COPYING_FROM_USER);
+}
+
+TEST_F(homa_outgoing, homa_copy_helpers_start__message_too_short)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.copy_helper_bytes = 2000;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 3999), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(NULL, strstr(unit_log_get(), "queue_work_on"));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.copy_helpers);
+}
+TEST_F(homa_outgoing, homa_copy_helpers_start__no_idle_cores)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	int i;
+
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.copy_helper_bytes = 2000;
+	self->homa.busy_cycles = 1000;
+	for (i = 0; i < nr_cpu_ids; i++)
+		homa_cores[i]->last_app_active = 9500;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 7000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(NULL, strstr(unit_log_get(), "queue_work_on"));
+	EXPECT_EQ(5, crpc->msgout.num_skbs);
+}
+TEST_F(homa_outgoing, homa_copy_helpers_start__wrap_around_cores)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	int i;
+
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.copy_helper_bytes = 2000;
+	self->homa.busy_cycles = 1000;
+	for (i = 2; i < 7; i++)
+		homa_cores[i]->last_active = 9500;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 7000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("queue_work_on core 7; ", unit_log_get());
+	EXPECT_SUBSTR("queue_work_on core 0; ", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_copy_helpers_start__fewer_ranges_than_cores)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.copy_helper_bytes = 1000;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 4000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("queue_work_on core 2; "
+			"_copy_from_iter 1400 bytes at 2400; "
+			"queue_work_on core 3; "
+			"_copy_from_iter 1200 bytes at 3800; "
+			"_copy_from_iter 1400 bytes at 1000",
+			unit_log_get());
+	EXPECT_EQ(NULL, strstr(unit_log_get(), "queue_work_on core 4"));
+	EXPECT_EQ(3, crpc->msgout.num_skbs);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.copy_helpers);
+}
+
+TEST_F(homa_outgoing, homa_skb_new__use_cached_skb)
+{
+	struct sk_buff *skb = alloc_skb(2000, GFP_KERNEL);
+
+	skb_put(skb, 100);
+	homa_skb_recycle(&self->homa, skb);
+	EXPECT_EQ(1, homa_cores[cpu_number]->num_cached_skbs);
+	skb->alloc_cpu = 5;
+	EXPECT_EQ(skb, homa_skb_new(1500));
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_cached_skbs);
+	EXPECT_EQ(0, skb->len);
+	EXPECT_EQ(cpu_number, skb->alloc_cpu);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.recycled_skbs);
+	kfree_skb(skb);
+}
+TEST_F(homa_outgoing, homa_skb_new__cached_skb_too_small)
+{
+	struct sk_buff *skb = alloc_skb(1000, GFP_KERNEL);
+	struct sk_buff *skb2;
+
+	homa_skb_recycle(&self->homa, skb);
+	skb2 = homa_skb_new(5000);
+	ASSERT_NE(NULL, skb2);
+	EXPECT_EQ(NULL, homa_cores[cpu_number]->skb_cache);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.recycled_skbs);
+	kfree_skb(skb2);
+}
+TEST_F(homa_outgoing, homa_skb_new__cache_empty)
+{
+	struct sk_buff *skb;
+
+	mock_alloc_skb_errors = 1;
+	EXPECT_EQ(NULL, homa_skb_new(1000));
+	skb = homa_skb_new(1000);
+	ASSERT_NE(NULL, skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.recycled_skbs);
+	kfree_skb(skb);
+}
+TEST_F(homa_outgoing, homa_skb_new__used_by_homa_message_out_init)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	homa_skb_recycle(&self->homa, alloc_skb(5000, GFP_KERNEL));
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 3000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.recycled_skbs);
+	unit_log_clear();
+	unit_log_message_out_packets(&crpc->msgout, 1);
+	EXPECT_STREQ("DATA from 0.0.0.0:40000, dport 99, id 2, "
+			"message_length 3000, offset 0, data_length 1400, "
+			"incoming 3000; "
+		     "DATA from 0.0.0.0:40000, dport 99, id 2, "
+			"message_length 3000, offset 1400, data_length 1400, "
+			"incoming 3000; "
+		     "DATA from 0.0.0.0:40000, dport 99, id 2, "
+			"message_length 3000, offset 2800, data_length 200, "
+			"incoming 3000",
+		     unit_log_get());
+}
+
+TEST_F(homa_outgoing, homa_skb_recycle__cache_disabled)
+{
+	self->homa.skb_cache_size = 0;
+	homa_skb_recycle(&self->homa, alloc_skb(1000, GFP_KERNEL));
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_cached_skbs);
+}
+TEST_F(homa_outgoing, homa_skb_recycle__skb_still_referenced)
+{
+	struct sk_buff *skb = alloc_skb(1000, GFP_KERNEL);
+
+	skb_get(skb);
+	homa_skb_recycle(&self->homa, skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_cached_skbs);
+	EXPECT_EQ(1, refcount_read(&skb->users));
+	kfree_skb(skb);
+}
+TEST_F(homa_outgoing, homa_skb_recycle__nonlinear)
+{
+	struct sk_buff *skb = alloc_skb(1000, GFP_KERNEL);
+
+	skb->len = 100;
+	skb->data_len = 100;
+	homa_skb_recycle(&self->homa, skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_cached_skbs);
+}
+TEST_F(homa_outgoing, homa_skb_recycle__pfmemalloc)
+{
+	struct sk_buff *skb = alloc_skb(1000, GFP_KERNEL);
+
+	skb->pfmemalloc = 1;
+	homa_skb_recycle(&self->homa, skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_cached_skbs);
+}
+TEST_F(homa_outgoing, homa_skb_recycle__reset_skb)
+{
+	struct sk_buff *skb = alloc_skb(1000, GFP_KERNEL);
+
+	skb_reserve(skb, 50);
+	skb_put(skb, 200);
+	skb->priority = 3;
+	skb_shinfo(skb)->gso_size = 1400;
+	skb_shinfo(skb)->gso_segs = 4;
+	homa_skb_recycle(&self->homa, skb);
+	EXPECT_EQ(skb, homa_cores[cpu_number]->skb_cache);
+	EXPECT_EQ(1, homa_cores[cpu_number]->num_cached_skbs);
+	EXPECT_EQ(0, skb->len);
+	EXPECT_EQ(0, skb->priority);
+	EXPECT_EQ(skb->head, skb->data);
+	EXPECT_EQ(skb->data, skb_tail_pointer(skb));
+	EXPECT_EQ(0, skb_shinfo(skb)->gso_size);
+	EXPECT_EQ(0, skb_shinfo(skb)->gso_segs);
+	EXPECT_EQ(1, refcount_read(&skb->users));
+}
+TEST_F(homa_outgoing, homa_skb_recycle__cache_full)
+{
+	self->homa.skb_cache_size = 1;
+	homa_skb_recycle(&self->homa, alloc_skb(1000, GFP_KERNEL));
+	homa_skb_recycle(&self->homa, alloc_skb(1000, GFP_KERNEL));
+	EXPECT_EQ(1, homa_cores[cpu_number]->num_cached_skbs);
+}
+
+TEST_F(homa_outgoing, homa_skb_cache_flush__basics)
+{
+	homa_skb_recycle(&self->homa, alloc_skb(1000, GFP_KERNEL));
+	homa_skb_recycle(&self->homa, alloc_skb(1000, GFP_KERNEL));
+	EXPECT_EQ(2, homa_cores[cpu_number]->num_cached_skbs);
+	homa_skb_cache_flush(homa_cores[cpu_number]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_cached_skbs);
+	EXPECT_EQ(NULL, homa_cores[cpu_number]->skb_cache);
+}
+
+TEST_F(homa_outgoing, homa_zcopy_new__cant_alloc_notify_skb)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	mock_alloc_skb_errors = 1;
+	EXPECT_EQ(NULL, homa_zcopy_new(crpc));
+}
+
+TEST_F(homa_outgoing, homa_zcopy_append__data_spans_pages)
+{
+	struct sk_buff *skb = alloc_skb(100, GFP_KERNEL);
+	int i;
+
+	EXPECT_EQ(0, -homa_zcopy_append(skb, unit_iov_iter((void *) 4000,
+			5000), 5000));
+	EXPECT_EQ(5000, skb->len);
+	EXPECT_EQ(5000, skb->data_len);
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		unit_log_printf(" ", "%d@%d", skb_frag_size(frag),
+				skb_frag_off(frag));
+	}
+	EXPECT_STREQ("iov_iter_get_pages2 5000 bytes at 4000 96@4000 "
+			"4096@0 808@0", unit_log_get());
+	kfree_skb(skb);
+}
+TEST_F(homa_outgoing, homa_zcopy_append__out_of_frags)
+{
+	struct sk_buff *skb = alloc_skb(100, GFP_KERNEL);
+
+	skb_shinfo(skb)->nr_frags = MAX_SKB_FRAGS - 1;
+	EXPECT_EQ(EMSGSIZE, -homa_zcopy_append(skb,
+			unit_iov_iter((void *) 4000, 5000), 5000));
+	EXPECT_EQ(MAX_SKB_FRAGS, skb_shinfo(skb)->nr_frags);
+	EXPECT_EQ(96, skb->len);
+	kfree_skb(skb);
+}
+TEST_F(homa_outgoing, homa_zcopy_append__cant_get_pages)
+{
+	struct sk_buff *skb = alloc_skb(100, GFP_KERNEL);
+
+	mock_gup_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_zcopy_append(skb,
+			unit_iov_iter((void *) 4000, 5000), 5000));
+	EXPECT_EQ(0, skb_shinfo(skb)->nr_frags);
+	kfree_skb(skb);
+}
+
+TEST_F(homa_outgoing, homa_zcopy_complete__notify_after_skbs_freed)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 3000), HOMA_OUT_ZEROCOPY));
+	EXPECT_EQ(3, refcount_read(&skb_zcopy(crpc->msgout.packets)->refcnt));
+	unit_log_clear();
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+	EXPECT_STREQ("homa_rpc_free invoked", unit_log_get());
+	unit_log_clear();
+	homa_rpc_reap(&self->hsk, 1000);
+	EXPECT_STREQ("sock_queue_err_skb: origin 5, info 2, data 0, code 0; "
+			"reaped 2", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_zcopy_complete__large_id)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct homa_zcopy *zcopy;
+
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	zcopy = homa_zcopy_new(crpc);
+	ASSERT_NE(NULL, zcopy);
+	zcopy->id = 0x300000004;
+	unit_log_clear();
+	homa_zcopy_complete(NULL, &zcopy->ubuf, false);
+	EXPECT_STREQ("sock_queue_err_skb: origin 5, info 4, data 3, code 1",
+			unit_log_get());
+}
+TEST_F(homa_outgoing, homa_zcopy_complete__error_queue_full)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct homa_zcopy *zcopy;
+
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	zcopy = homa_zcopy_new(crpc);
+	ASSERT_NE(NULL, zcopy);
+	mock_queue_err_skb_errors = 1;
+	unit_log_clear();
+	homa_zcopy_complete(NULL, &zcopy->ubuf, true);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.zerocopy_notify_drops);
+}
+
+TEST_F(homa_outgoing, homa_zcopy_complete__region_ring)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct homa_zcopy *zcopy;
+
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 4));
+	zcopy = homa_zcopy_new(crpc);
+	ASSERT_NE(NULL, zcopy);
+	zcopy->in_region = true;
+	zcopy->region_offset = 5000;
+	unit_log_clear();
+	homa_zcopy_complete(NULL, &zcopy->ubuf, true);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, self->hsk.send_region.ring->head);
+	EXPECT_EQ(5000, self->hsk.send_region.ring->offsets[0]);
+}
+TEST_F(homa_outgoing, homa_zcopy_complete__region_ring_full)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct homa_zcopy *zcopy;
+
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 4));
+	self->hsk.send_region.ring_head = 4;
+	zcopy = homa_zcopy_new(crpc);
+	ASSERT_NE(NULL, zcopy);
+	zcopy->in_region = true;
+	zcopy->region_offset = 5000;
+	unit_log_clear();
+	homa_zcopy_complete(NULL, &zcopy->ubuf, true);
+	EXPECT_STREQ("sock_queue_err_skb: origin 5, info 2, data 0, code 0",
+			unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.send_ring_overflows);
+}
 
 TEST_F(homa_outgoing, homa_xmit_control__server_request)
 {
@@ -635,6 +1257,26 @@ TEST_F(homa_outgoing, homa_xmit_data__throttle)
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("request id 1234, next_offset 2800", unit_log_get());
 }
+#ifdef CONFIG_BQL
+TEST_F(homa_outgoing, homa_xmit_data__bql_feedback)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 6000, 1000);
+	unit_log_clear();
+	self->homa.max_nic_queue_cycles = 3000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	self->homa.bql_feedback = 1;
+	mock_tx_queues[0].dql.num_queued = 5000;
+	mock_tx_queues[0].dql.num_completed = 1000;
+
+	homa_xmit_data(crpc, false);
+	EXPECT_STREQ("wake_up_process pid -1", unit_log_get());
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 1234, next_offset 0", unit_log_get());
+}
+#endif
 TEST_F(homa_outgoing, homa_xmit_data__update_next_xmit_offset)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -827,6 +1469,165 @@ TEST_F(homa_outgoing, homa_resend_data__advance_next_xmit)
 	homa_print_packet(*crpc->msgout.next_xmit, buffer, sizeof(buffer));
 	EXPECT_STREQ("skb is NULL!", buffer);
 }
+TEST_F(homa_outgoing, homa_resend_data__use_index)
+{
+	mock_net_device.gso_max_size = 5000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 16000, 1000);
+	struct sk_buff *skb3;
+
+	ASSERT_NE(NULL, crpc);
+	skb3 = homa_get_skb_info(homa_get_skb_info(homa_get_skb_info(
+			crpc->msgout.packets)->next_skb)->next_skb)->next_skb;
+	unit_log_clear();
+	homa_resend_data(crpc, 12900, 13000, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@12800", unit_log_get());
+	ASSERT_NE(NULL, crpc->msgout.skb_index);
+	EXPECT_EQ(skb3, crpc->msgout.skb_index[3]);
+}
+TEST_F(homa_outgoing, homa_resend_data__cant_build_index)
+{
+	mock_net_device.gso_max_size = 5000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 16000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	unit_log_clear();
+	mock_kmalloc_errors = 1;
+	homa_resend_data(crpc, 12900, 13000, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@12800", unit_log_get());
+	EXPECT_EQ(NULL, crpc->msgout.skb_index);
+}
+TEST_F(homa_outgoing, homa_resend_data__share_zerocopy_frags)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct page *page;
+	int refs;
+
+	ASSERT_FALSE(crpc == NULL);
+	mock_net_device.gso_max_size = 5000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 5000), HOMA_OUT_ZEROCOPY));
+	homa_rpc_unlock(crpc);
+	page = skb_frag_page(&skb_shinfo(crpc->msgout.packets)->frags[4]);
+	refs = mock_page_refs(page);
+	unit_log_clear();
+	homa_resend_data(crpc, 2800, 4200, 2);
+	EXPECT_STREQ("xmit DATA retrans 1400@2800", unit_log_get());
+	EXPECT_EQ(1400, homa_cores[cpu_number]->metrics.resent_shared_bytes);
+
+	/* The retransmitted packet has already been freed. */
+	EXPECT_EQ(refs, mock_page_refs(page));
+}
+
+TEST_F(homa_outgoing, homa_skb_index_build__basics)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct sk_buff *skbs[5];
+	int i;
+
+	ASSERT_FALSE(crpc == NULL);
+	self->homa.unsched_bytes = 2000;
+	ASSERT_EQ(0, -homa_message_out_init(crpc,
+			unit_iov_iter((void *) 1000, 5000), 0));
+	unit_log_clear();
+	unit_log_filled_skbs(crpc->msgout.packets, 0);
+	EXPECT_STREQ("DATA 1400@0; DATA 600@1400; DATA 1400@2000; "
+			"DATA 1400@3400; DATA 200@4800",
+			unit_log_get());
+	skbs[0] = crpc->msgout.packets;
+	for (i = 1; i < 5; i++)
+		skbs[i] = homa_get_skb_info(skbs[i-1])->next_skb;
+
+	EXPECT_EQ(0, -homa_skb_index_build(crpc));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(skbs[0], crpc->msgout.skb_index[0]);
+	EXPECT_EQ(skbs[1], crpc->msgout.skb_index[1]);
+	EXPECT_EQ(skbs[2], crpc->msgout.skb_index[2]);
+	EXPECT_EQ(skbs[3], crpc->msgout.skb_index[3]);
+}
+TEST_F(homa_outgoing, homa_skb_index_build__still_copying)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	atomic_or(RPC_COPYING_FROM_USER, &crpc->flags);
+	EXPECT_EQ(EAGAIN, -homa_skb_index_build(crpc));
+	EXPECT_EQ(NULL, crpc->msgout.skb_index);
+	atomic_andnot(RPC_COPYING_FROM_USER, &crpc->flags);
+}
+TEST_F(homa_outgoing, homa_skb_index_build__kmalloc_fails)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_skb_index_build(crpc));
+	EXPECT_EQ(NULL, crpc->msgout.skb_index);
+}
+
+TEST_F(homa_outgoing, homa_skb_share_data__basics)
+{
+	struct sk_buff *from = alloc_skb(100, GFP_KERNEL);
+	struct sk_buff *to = alloc_skb(100, GFP_KERNEL);
+	struct page *page1 = mock_page_new((char *) 0x10000, NULL);
+	struct page *page2 = mock_page_new((char *) 0x20000, NULL);
+	int i;
+
+	skb_put(from, 20);
+	skb_fill_page_desc(from, 0, page1, 100, 1000);
+	skb_fill_page_desc(from, 1, page2, 0, 500);
+	from->len += 1500;
+	from->data_len += 1500;
+	EXPECT_EQ(0, -homa_skb_share_data(to, from, 920, 400));
+	EXPECT_EQ(400, to->len);
+	EXPECT_EQ(400, to->data_len);
+	unit_log_clear();
+	for (i = 0; i < skb_shinfo(to)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(to)->frags[i];
+		unit_log_printf(" ", "%d@%d", skb_frag_size(frag),
+				skb_frag_off(frag));
+	}
+	EXPECT_STREQ("100@1000 300@0", unit_log_get());
+	EXPECT_EQ(2, mock_page_refs(page1));
+	EXPECT_EQ(2, mock_page_refs(page2));
+	kfree_skb(to);
+	kfree_skb(from);
+}
+TEST_F(homa_outgoing, homa_skb_share_data__data_in_linear_part)
+{
+	struct sk_buff *from = alloc_skb(100, GFP_KERNEL);
+	struct sk_buff *to = alloc_skb(100, GFP_KERNEL);
+
+	skb_put(from, 20);
+	EXPECT_EQ(EINVAL, -homa_skb_share_data(to, from, 10, 5));
+	EXPECT_EQ(0, skb_shinfo(to)->nr_frags);
+	kfree_skb(to);
+	kfree_skb(from);
+}
+TEST_F(homa_outgoing, homa_skb_share_data__not_enough_data)
+{
+	struct sk_buff *from = alloc_skb(100, GFP_KERNEL);
+	struct sk_buff *to = alloc_skb(100, GFP_KERNEL);
+
+	skb_put(from, 20);
+	skb_fill_page_desc(from, 0, mock_page_new((char *) 0x10000, NULL),
+			0, 1000);
+	from->len += 1000;
+	from->data_len += 1000;
+	EXPECT_EQ(EINVAL, -homa_skb_share_data(to, from, 520, 1000));
+	EXPECT_EQ(500, to->len);
+	kfree_skb(to);
+	kfree_skb(from);
+}
 
 TEST_F(homa_outgoing, homa_outgoing_sysctl_changed)
 {
@@ -846,8 +1647,72 @@ TEST_F(homa_outgoing, homa_outgoing_sysctl_changed)
 	cpu_khz = 2000000;
 	homa_outgoing_sysctl_changed(&self->homa);
 	EXPECT_EQ(400, self->homa.max_nic_queue_cycles);
+
+	self->homa.num_pacers = 0;
+	homa_outgoing_sysctl_changed(&self->homa);
+	EXPECT_EQ(1, self->homa.num_pacers);
+	self->homa.num_pacers = HOMA_MAX_PACERS + 1;
+	homa_outgoing_sysctl_changed(&self->homa);
+	EXPECT_EQ(HOMA_MAX_PACERS, self->homa.num_pacers);
 }
 
+#ifdef CONFIG_BQL
+TEST_F(homa_outgoing, homa_nic_queue_sync__disabled)
+{
+	mock_tx_queues[0].dql.num_queued = 5000;
+	homa_nic_queue_sync(&self->homa, &mock_net_device);
+	EXPECT_EQ(10000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bql_samples);
+}
+TEST_F(homa_outgoing, homa_nic_queue_sync__too_soon)
+{
+	self->homa.bql_feedback = 1;
+	self->homa.bql_next_sample = 10001;
+	mock_tx_queues[0].dql.num_queued = 5000;
+	homa_nic_queue_sync(&self->homa, &mock_net_device);
+	EXPECT_EQ(10000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bql_samples);
+}
+TEST_F(homa_outgoing, homa_nic_queue_sync__no_device)
+{
+	self->homa.bql_feedback = 1;
+	homa_nic_queue_sync(&self->homa, NULL);
+	EXPECT_EQ(10000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bql_unavailable);
+}
+TEST_F(homa_outgoing, homa_nic_queue_sync__driver_doesnt_support_bql)
+{
+	self->homa.bql_feedback = 1;
+	atomic64_set(&self->homa.link_idle_time, 12000);
+	homa_nic_queue_sync(&self->homa, &mock_net_device);
+	EXPECT_EQ(12000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bql_unavailable);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bql_samples);
+}
+TEST_F(homa_outgoing, homa_nic_queue_sync__queue_longer_than_model)
+{
+	self->homa.bql_feedback = 1;
+	self->homa.max_nic_queue_cycles = 2000;
+	mock_tx_queues[0].dql.num_queued = 5000;
+	mock_tx_queues[0].dql.num_completed = 1000;
+	mock_tx_queues[1].dql.num_queued = 3000;
+	mock_tx_queues[1].dql.num_completed = 2500;
+	homa_nic_queue_sync(&self->homa, &mock_net_device);
+	EXPECT_EQ(14500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(10500, self->homa.bql_next_sample);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bql_samples);
+}
+TEST_F(homa_outgoing, homa_nic_queue_sync__queue_shorter_than_model)
+{
+	self->homa.bql_feedback = 1;
+	atomic64_set(&self->homa.link_idle_time, 20000);
+	mock_tx_queues[1].dql.num_queued = 3000;
+	mock_tx_queues[1].dql.num_completed = 2000;
+	homa_nic_queue_sync(&self->homa, &mock_net_device);
+	EXPECT_EQ(11000, atomic64_read(&self->homa.link_idle_time));
+}
+#endif
+
 TEST_F(homa_outgoing, homa_check_nic_queue__basics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -902,7 +1767,7 @@ TEST_F(homa_outgoing, homa_check_nic_queue__pacer_metrics)
 	homa_add_to_throttled(crpc);
 	unit_log_clear();
 	atomic64_set(&self->homa.link_idle_time, 9000);
-	self->homa.pacer_wake_time = 9800;
+	self->homa.pacers[0].wake_time = 9800;
 	mock_cycles = 10000;
 	self->homa.max_nic_queue_cycles = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
@@ -930,6 +1795,65 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_empty)
 
 /* Don't know how to unit test homa_pacer_main... */
 
+TEST_F(homa_outgoing, homa_pacer_arm_timer__queue_short_enough)
+{
+	self->homa.max_nic_queue_cycles = 2000;
+	atomic64_set(&self->homa.link_idle_time, 12000);
+	EXPECT_FALSE(homa_pacer_arm_timer(&self->homa.pacers[0]));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.pacer_timer_sleeps);
+}
+TEST_F(homa_outgoing, homa_pacer_arm_timer__queue_too_long)
+{
+	self->homa.max_nic_queue_cycles = 2000;
+	atomic64_set(&self->homa.link_idle_time, 15000);
+	EXPECT_TRUE(homa_pacer_arm_timer(&self->homa.pacers[0]));
+	EXPECT_STREQ("hrtimer_start 3000 ns", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.pacer_timer_sleeps);
+}
+TEST_F(homa_outgoing, homa_pacer_arm_timer__convert_cycles_to_ns)
+{
+	self->homa.max_nic_queue_cycles = 2000;
+	atomic64_set(&self->homa.link_idle_time, 15000);
+	cpu_khz = 2000000;
+	EXPECT_TRUE(homa_pacer_arm_timer(&self->homa.pacers[0]));
+	EXPECT_STREQ("hrtimer_start 1500 ns", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_pacer_arm_timer__outranked)
+{
+	self->homa.max_nic_queue_cycles = 2000;
+	atomic64_set(&self->homa.link_idle_time, 11500);
+	self->homa.pacers[0].head_bytes = 5000;
+	self->homa.pacers[2].head_bytes = 4000;
+	self->homa.pacers_throttled = 0x5;
+	EXPECT_TRUE(homa_pacer_arm_timer(&self->homa.pacers[0]));
+	EXPECT_STREQ("hrtimer_start 500 ns", unit_log_get());
+}
+
+TEST_F(homa_outgoing, homa_pacer_timer)
+{
+	EXPECT_EQ(HRTIMER_NORESTART,
+			homa_pacer_timer(&self->homa.pacers[1].timer));
+	EXPECT_STREQ("wake_up_process pid -1", unit_log_get());
+}
+
+TEST_F(homa_outgoing, homa_pacer_outranked)
+{
+	self->homa.pacers[0].head_bytes = 5000;
+	EXPECT_EQ(0, homa_pacer_outranked(&self->homa.pacers[0]));
+
+	/* Shard 2 has a shorter message, but isn't marked as throttled. */
+	self->homa.pacers[2].head_bytes = 4000;
+	EXPECT_EQ(0, homa_pacer_outranked(&self->homa.pacers[0]));
+
+	self->homa.pacers_throttled = 0x5;
+	EXPECT_EQ(1, homa_pacer_outranked(&self->homa.pacers[0]));
+	EXPECT_EQ(0, homa_pacer_outranked(&self->homa.pacers[2]));
+
+	self->homa.pacers[2].head_bytes = 5000;
+	EXPECT_EQ(0, homa_pacer_outranked(&self->homa.pacers[0]));
+}
+
 TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -950,7 +1874,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 	unit_log_clear();
@@ -977,16 +1901,16 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	homa_add_to_throttled(crpc2);
 	homa_add_to_throttled(crpc3);
 
-	/* First attempt: pacer_fifo_count doesn't reach zero. */
+	/* First attempt: fifo_count doesn't reach zero. */
 	self->homa.max_nic_queue_cycles = 1300;
-	self->homa.pacer_fifo_count = 200;
+	self->homa.pacers[0].fifo_count = 200;
 	self->homa.pacer_fifo_fraction = 150;
 	mock_cycles = 13000;
 	atomic64_set(&self->homa.link_idle_time, 10000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_SUBSTR("id 4, message_length 10000, offset 0, data_length 1400",
 			unit_log_get());
 	unit_log_clear();
@@ -994,12 +1918,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	EXPECT_STREQ("request id 4, next_offset 1400; "
 			"request id 2, next_offset 0; "
 			"request id 6, next_offset 0", unit_log_get());
-	EXPECT_EQ(50, self->homa.pacer_fifo_count);
+	EXPECT_EQ(50, self->homa.pacers[0].fifo_count);
 
-	/* Second attempt: pacer_fifo_count reaches zero. */
+	/* Second attempt: fifo_count reaches zero. */
 	atomic64_set(&self->homa.link_idle_time, 10000);
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_SUBSTR("id 2, message_length 20000, offset 0, data_length 1400",
 			unit_log_get());
 	unit_log_clear();
@@ -1007,7 +1931,36 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	EXPECT_STREQ("request id 4, next_offset 1400; "
 			"request id 2, next_offset 1400; "
 			"request id 6, next_offset 0", unit_log_get());
-	EXPECT_EQ(900, self->homa.pacer_fifo_count);
+	EXPECT_EQ(900, self->homa.pacers[0].fifo_count);
+}
+TEST_F(homa_outgoing, homa_pacer_xmit__fifo_xmit_moves_rpc_up_in_srpt)
+{
+	mock_cycles = 10000;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 2, 3000, 1000);
+	mock_cycles = 11000;
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 4, 2000, 1000);
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc2);
+	EXPECT_EQ(2000, self->homa.pacers[0].head_bytes);
+
+	self->homa.max_nic_queue_cycles = 1300;
+	self->homa.pacers[0].fifo_count = 100;
+	self->homa.pacer_fifo_fraction = 150;
+	mock_cycles = 13000;
+	atomic64_set(&self->homa.link_idle_time, 10000);
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
+	EXPECT_EQ(1600, self->homa.pacers[0].head_bytes);
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 2, next_offset 1400; "
+			"request id 4, next_offset 0", unit_log_get());
 }
 TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 {
@@ -1020,7 +1973,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	mock_trylock_errors = 1;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -1031,7 +1984,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__queue_empty)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -1047,12 +2000,29 @@ TEST_F(homa_outgoing, homa_pacer_xmit__nic_queue_fills)
 	atomic64_set(&self->homa.link_idle_time, 12000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("request id 1234, next_offset 1400", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_pacer_xmit__nic_queue_already_full)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id,
+			10000, 1000);
+	homa_add_to_throttled(crpc);
+	self->homa.max_nic_queue_cycles = 2000;
+	atomic64_set(&self->homa.link_idle_time, 13000);
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("", unit_log_get());
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 1234, next_offset 0", unit_log_get());
+}
 TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1064,12 +2034,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_trylock_errors = ~1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.pacer_skipped_rpcs);
 	unit_log_clear();
 	mock_trylock_errors = 0;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 }
@@ -1088,7 +2058,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__remove_from_queue)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa.pacers[0]);
 	EXPECT_STREQ("xmit DATA 1000@0; xmit DATA 1400@0",
 			unit_log_get());
 	unit_log_clear();
@@ -1097,6 +2067,64 @@ TEST_F(homa_outgoing, homa_pacer_xmit__remove_from_queue)
 	EXPECT_TRUE(list_empty(&crpc1->throttled_links));
 }
 
+TEST_F(homa_outgoing, homa_pacer_xmit__outranked_by_other_shard)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id,
+			10000, 1000);
+	homa_add_to_throttled(crpc);
+	self->homa.max_nic_queue_cycles = 2000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	self->homa.pacers[1].head_bytes = 100;
+	set_bit(1, &self->homa.pacers_throttled);
+	atomic64_set(&self->homa.link_idle_time, 11500);
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("", unit_log_get());
+
+	/* Now the other shard is empty, so the full queue is available. */
+	clear_bit(1, &self->homa.pacers_throttled);
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
+	EXPECT_EQ(8600, self->homa.pacers[0].head_bytes);
+}
+TEST_F(homa_outgoing, homa_pacer_xmit__update_head_bytes_on_removal)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 2,
+			1000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 4,
+			10000, 1000);
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc2);
+	EXPECT_EQ(1000, self->homa.pacers[0].head_bytes);
+	self->homa.max_nic_queue_cycles = 1000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa.pacers[0]);
+	EXPECT_STREQ("xmit DATA 1000@0", unit_log_get());
+	EXPECT_EQ(10000, self->homa.pacers[0].head_bytes);
+	EXPECT_EQ(1, self->homa.pacers_throttled);
+}
+
+TEST_F(homa_outgoing, homa_pacer_start__only_create_missing_threads)
+{
+	/* The mock kthread_create returns NULL, so each new thread
+	 * appears in the log as "pid -1".
+	 */
+	self->homa.pacers[0].kthread = &mock_task;
+	unit_log_clear();
+	EXPECT_EQ(0, homa_pacer_start(&self->homa, 3));
+	EXPECT_STREQ("wake_up_process pid -1; wake_up_process pid -1",
+			unit_log_get());
+	self->homa.pacers[0].kthread = NULL;
+}
+
 /* Don't know how to unit test homa_pacer_stop... */
 
 TEST_F(homa_outgoing, homa_add_to_throttled__basics)
@@ -1146,6 +2174,23 @@ TEST_F(homa_outgoing, homa_add_to_throttled__basics)
 		"request id 8, next_offset 0; "
 		"request id 6, next_offset 0", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_add_to_throttled__choose_shard)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+	int shard;
+
+	self->homa.num_pacers = HOMA_MAX_PACERS;
+	shard = hash_32(crpc->peer->addr.in6_u.u6_addr32[3], 16)
+			% HOMA_MAX_PACERS;
+	homa_add_to_throttled(crpc);
+	EXPECT_EQ(&self->homa.pacers[shard], crpc->pacer);
+	EXPECT_EQ(1UL << shard, self->homa.pacers_throttled);
+	EXPECT_EQ(5000, self->homa.pacers[shard].head_bytes);
+	EXPECT_EQ(1, unit_list_length(
+			&self->homa.pacers[shard].throttled_rpcs));
+}
 TEST_F(homa_outgoing, homa_add_to_throttled__inc_metrics)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -1160,15 +2205,12 @@ TEST_F(homa_outgoing, homa_add_to_throttled__inc_metrics)
 
 	homa_add_to_throttled(crpc1);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.throttle_list_adds);
-	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.throttle_list_checks);
 
 	homa_add_to_throttled(crpc2);
 	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.throttle_list_adds);
-	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.throttle_list_checks);
 
 	homa_add_to_throttled(crpc3);
 	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.throttle_list_adds);
-	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.throttle_list_checks);
 }
 
 TEST_F(homa_outgoing, homa_remove_from_throttled)
@@ -1178,17 +2220,19 @@ TEST_F(homa_outgoing, homa_remove_from_throttled)
 			self->server_port, self->client_id, 5000, 1000);
 
 	homa_add_to_throttled(crpc);
-	EXPECT_FALSE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_FALSE(list_empty(&self->homa.pacers[0].throttled_rpcs));
 
 	// First attempt will remove.
 	unit_log_clear();
 	homa_remove_from_throttled(crpc);
-	EXPECT_TRUE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_TRUE(list_empty(&self->homa.pacers[0].throttled_rpcs));
+	EXPECT_EQ(0, self->homa.pacers_throttled);
+	EXPECT_EQ(INT_MAX, self->homa.pacers[0].head_bytes);
 	EXPECT_STREQ("removing id 1234 from throttled list", unit_log_get());
 
 	// Second attempt: nothing to do.
 	unit_log_clear();
 	homa_remove_from_throttled(crpc);
-	EXPECT_TRUE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_TRUE(list_empty(&self->homa.pacers[0].throttled_rpcs));
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -263,6 +263,9 @@ TEST_F(homa_plumbing, homa_set_sock_opt__success)
 	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
 			& ~(PAGE_SIZE - 1));
 	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 0;
+	args.flags = 0;
 	self->optval.user = &args;
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
@@ -270,8 +273,400 @@ TEST_F(homa_plumbing, homa_set_sock_opt__success)
 			sizeof(struct homa_set_buf_args)));
 	EXPECT_EQ(args.start, self->hsk.buffer_pool.region);
 	EXPECT_EQ(64, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(HOMA_BPAGE_SHIFT, self->hsk.buffer_pool.bpage_shift);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.so_set_buf_calls);
 }
+TEST_F(homa_plumbing, homa_set_sock_opt__legacy_args)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 99;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			offsetof(struct homa_set_buf_args, bpage_shift)));
+	EXPECT_EQ(64, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(HOMA_BPAGE_SHIFT, self->hsk.buffer_pool.bpage_shift);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__custom_bpage_shift)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = HOMA_BPAGE_SHIFT + 2;
+	args.ring_entries = 0;
+	args.flags = 0;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(16, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(HOMA_BPAGE_SHIFT + 2, self->hsk.buffer_pool.bpage_shift);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__bad_bpage_shift)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 64*HOMA_BPAGE_SIZE,
+			HOMA_MAX_BPAGE_SHIFT + 1};
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__return_ring)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 1024;
+	args.flags = 0;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(63, self->hsk.buffer_pool.num_bpages);
+	ASSERT_NE(NULL, self->hsk.buffer_pool.ring);
+	EXPECT_EQ(1024, self->hsk.buffer_pool.ring_entries);
+	EXPECT_EQ(1024, self->hsk.buffer_pool.ring->size);
+	EXPECT_EQ(2, mock_pinned_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__bad_ring_entries)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 64*HOMA_BPAGE_SIZE,
+			0, 1000};
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	args.ring_entries = 2*HOMA_MAX_RING_ENTRIES;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	args.ring_entries = 1024;
+	args.length = 100;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__cant_attach_ring)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 1024;
+	args.flags = 0;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	mock_gup_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.region);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__args_without_flags)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 0;
+	args.flags = 99;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			offsetof(struct homa_set_buf_args, flags)));
+	EXPECT_EQ(64, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.pinned_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__bad_flags)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 64*HOMA_BPAGE_SIZE,
+			0, 0, 2};
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__pin_region)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 0;
+	args.flags = HOMA_BUF_PIN;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	ASSERT_NE(NULL, self->hsk.buffer_pool.pinned_pages);
+	EXPECT_EQ(64*HOMA_BPAGE_SIZE/PAGE_SIZE, mock_pinned_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__cant_pin_region)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 0;
+	args.flags = HOMA_BUF_PIN;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	mock_gup_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.region);
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__cant_pin_region_after_ring)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 1024;
+	args.flags = HOMA_BUF_PIN;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	mock_gup_errors = 2;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+
+	/* The pool was never initialized, and the ring was released. */
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.region);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.ring);
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__pool_already_exists)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+	char *region;
+	int pinned;
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = 0;
+	args.ring_entries = 1024;
+	args.flags = HOMA_BUF_PIN;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	region = self->hsk.buffer_pool.region;
+	pinned = mock_pinned_pages;
+	EXPECT_NE(0, pinned);
+
+	/* The second call must fail without disturbing the existing pool
+	 * and must release everything it pinned.
+	 */
+	EXPECT_EQ(EBUSY, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(region, self->hsk.buffer_pool.region);
+	ASSERT_NE(NULL, self->hsk.buffer_pool.ring);
+	ASSERT_NE(NULL, self->hsk.buffer_pool.pinned_pages);
+	EXPECT_EQ(pinned, mock_pinned_pages);
+	EXPECT_EQ(pinned, mock_locked_vm);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__init_fails_after_pinning)
+{
+	struct homa_set_buf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	args.bpage_shift = HOMA_MAX_BPAGE_SHIFT + 1;
+	args.ring_entries = 1024;
+	args.flags = HOMA_BUF_PIN;
+	self->optval.user = &args;
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.region);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.ring);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.pinned_pages);
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__grant_weight_bad_optlen)
+{
+	int weight = 5;
+
+	self->optval.user = &weight;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(weight) + 1));
+	EXPECT_EQ(1, self->hsk.grant_weight);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__grant_weight_copy_fails)
+{
+	int weight = 5;
+
+	self->optval.user = &weight;
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(weight)));
+	EXPECT_EQ(1, self->hsk.grant_weight);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__grant_weight_out_of_range)
+{
+	int weight = 0;
+
+	self->optval.user = &weight;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(weight)));
+	weight = HOMA_MAX_GRANT_WEIGHT + 1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(weight)));
+	EXPECT_EQ(1, self->hsk.grant_weight);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__grant_weight_success)
+{
+	int weight = HOMA_MAX_GRANT_WEIGHT;
+
+	self->optval.user = &weight;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(weight)));
+	EXPECT_EQ(HOMA_MAX_GRANT_WEIGHT, self->hsk.grant_weight);
+}
+
+TEST_F(homa_plumbing, homa_set_sock_opt__send_buf_bad_optlen)
+{
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_SEND_BUF, self->optval,
+			sizeof(struct homa_set_send_buf_args) - 1));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__send_buf_cant_read_args)
+{
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_SEND_BUF, self->optval,
+			sizeof(struct homa_set_send_buf_args)));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__send_buf_nonzero_pad)
+{
+	struct homa_set_send_buf_args args = {(void *) 0x3000000,
+			10*PAGE_SIZE, 0, 1};
+
+	self->optval.user = &args;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_SEND_BUF, self->optval, sizeof(args)));
+	EXPECT_EQ(NULL, self->hsk.send_region.start);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__send_buf_success)
+{
+	struct homa_set_send_buf_args args = {(void *) 0x3000000,
+			10*PAGE_SIZE, 64, 0};
+
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_SEND_BUF, self->optval, sizeof(args)));
+	EXPECT_EQ(0x3000000, (unsigned long) self->hsk.send_region.start);
+	EXPECT_NE(NULL, self->hsk.send_region.ring);
+	EXPECT_EQ(11, mock_pinned_pages);
+}
+
+TEST_F(homa_plumbing, homa_getsockopt__bad_option)
+{
+	struct homa_buf_stats stats;
+	int len = sizeof(stats);
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, 0,
+			SO_HOMA_BUF_STATS, (char __user *) &stats, &len));
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, (char __user *) &stats, &len));
+}
+TEST_F(homa_plumbing, homa_getsockopt__cant_read_optlen)
+{
+	struct homa_buf_stats stats;
+	int len = sizeof(stats);
+
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_STATS, (char __user *) &stats, &len));
+}
+TEST_F(homa_plumbing, homa_getsockopt__optlen_too_small)
+{
+	struct homa_buf_stats stats;
+	int len = sizeof(stats) - 1;
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_STATS, (char __user *) &stats, &len));
+}
+TEST_F(homa_plumbing, homa_getsockopt__cant_copy_stats)
+{
+	struct homa_buf_stats stats;
+	int len = sizeof(stats);
+
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_STATS, (char __user *) &stats, &len));
+}
+TEST_F(homa_plumbing, homa_getsockopt__success)
+{
+	struct homa_buf_stats stats;
+	int len = sizeof(stats) + 10;
+
+	memset(&stats, 0, sizeof(stats));
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BUF_STATS, (char __user *) &stats, &len));
+	EXPECT_EQ(sizeof(stats), len);
+	EXPECT_EQ(100, stats.num_bpages);
+	EXPECT_EQ(100, stats.free_bpages);
+}
+TEST_F(homa_plumbing, homa_getsockopt__grant_weight)
+{
+	int weight = 0;
+	int len = sizeof(weight) - 1;
+
+	self->hsk.grant_weight = 7;
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, (char __user *) &weight, &len));
+	len = 20;
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, (char __user *) &weight, &len));
+	EXPECT_EQ(sizeof(weight), len);
+	EXPECT_EQ(7, weight);
+}
 
 TEST_F(homa_plumbing, homa_sendmsg__args_not_in_user_space)
 {
@@ -348,6 +743,48 @@ TEST_F(homa_plumbing, homa_sendmsg__request_sent_successfully)
 	EXPECT_EQ(88888, crpc->completion_cookie);
 	homa_rpc_unlock(crpc);
 }
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy_request)
+{
+	atomic64_set(&self->homa.next_outgoing_id, 1234);
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+
+	/* The message has two iovecs, so it gets copied. */
+	EXPECT_SUBSTR("sock_queue_err_skb: origin 5, info 1234, data 0, "
+			"code 1; xmit DATA 200@0", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy_message_in_send_region)
+{
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 0));
+	self->send_vec[0].iov_base = (void *) (0x3000000 + 1000);
+	self->send_vec[0].iov_len = 3500;
+	iov_iter_init(&self->sendmsg_hdr.msg_iter, WRITE, self->send_vec,
+			1, 3500);
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(NULL, strstr(unit_log_get(), "iov_iter_get_pages2"));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy_message_outside_send_region)
+{
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 0));
+	self->send_vec[0].iov_base = (void *) (0x3000000 + 3*PAGE_SIZE);
+	self->send_vec[0].iov_len = 3500;
+	iov_iter_init(&self->sendmsg_hdr.msg_iter, WRITE, self->send_vec,
+			1, 3500);
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_SUBSTR("iov_iter_get_pages2", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
 TEST_F(homa_plumbing, homa_sendmsg__response_nonzero_completion_cookie)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE,
@@ -432,6 +869,12 @@ TEST_F(homa_plumbing, homa_sendmsg__response_succeeds)
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
 
+TEST_F(homa_plumbing, homa_recvmsg__error_queue)
+{
+	EXPECT_EQ(0, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, MSG_ERRQUEUE, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_STREQ("inet_recv_error invoked", unit_log_get());
+}
 TEST_F(homa_plumbing, homa_recvmsg__wrong_args_length)
 {
 	self->recvmsg_hdr.msg_controllen -= 1;
@@ -682,6 +1125,31 @@ TEST_F(homa_plumbing, homa_softirq__packet_too_short)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
 }
+TEST_F(homa_plumbing, homa_softirq__cutoffs_packet_from_old_peer)
+{
+	struct cutoffs_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = CUTOFFS},
+		        .unsched_cutoffs = {htonl(10), htonl(9), htonl(8),
+			htonl(7), htonl(6), htonl(5), htonl(4), htonl(3)},
+			.cutoff_version = 400,
+			.unsched_bytes = htonl(5000)};
+	struct homa_peer *peer;
+	struct sk_buff *skb;
+
+	/* Older peers send CUTOFFS packets without unsched_bytes. */
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len -= sizeof(h.unsched_bytes);
+	homa_softirq(skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.short_packets);
+	peer = homa_peer_find(&self->homa.peers, self->client_ip,
+			&self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	EXPECT_EQ(400, peer->cutoff_version);
+	EXPECT_EQ(3, peer->unsched_cutoffs[7]);
+	EXPECT_EQ(0, peer->unsched_bytes);
+}
 TEST_F(homa_plumbing, homa_softirq__bogus_packet_type)
 {
 	struct sk_buff *skb;
@@ -795,6 +1263,41 @@ TEST_F(homa_plumbing, homa_softirq__per_rpc_batching)
 			"sk->sk_data_ready invoked",
 			unit_log_get());
 }
+TEST_F(homa_plumbing, homa_softirq__batch_grants)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct sk_buff *skb;
+
+	self->homa.batch_grants = 1;
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.message_length = htonl(100000);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(2002);
+	skb_shinfo(skb)->frag_list = mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 0);
+	homa_softirq(skb);
+	EXPECT_EQ(0, core->metrics.packets_sent[GRANT - DATA]);
+	EXPECT_EQ(1, core->metrics.packets_sent[MULTI_GRANT - DATA]);
+	EXPECT_EQ(2, core->metrics.grants_coalesced);
+	EXPECT_EQ(0, core->defer_grants);
+	EXPECT_EQ(0, core->num_deferred_grants);
+}
+TEST_F(homa_plumbing, homa_softirq__batch_grants_disabled)
+{
+	struct homa_core *core = homa_cores[cpu_number];
+	struct sk_buff *skb;
+
+	self->homa.batch_grants = 0;
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.message_length = htonl(100000);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(2002);
+	skb_shinfo(skb)->frag_list = mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 0);
+	homa_softirq(skb);
+	EXPECT_EQ(2, core->metrics.packets_sent[GRANT - DATA]);
+	EXPECT_EQ(0, core->metrics.packets_sent[MULTI_GRANT - DATA]);
+}
 
 TEST_F(homa_plumbing, homa_metrics_open)
 {
@@ -12,6 +12,9 @@
 
 static struct homa_pool *cur_pool;
 
+/* Stands in for the kernel mappings of pinned pages. */
+static char pinned_buffer[3*PAGE_SIZE];
+
 FIXTURE(homa_pool) {
 	struct homa homa;
 	struct homa_sock hsk;
@@ -33,27 +36,20 @@ FIXTURE_TEARDOWN(homa_pool)
 	unit_teardown();
 }
 
-static void steal_bpages_hook(char *id)
+static int lock_hook_calls;
+static void steal_race_hook(char *id)
 {
 	if (strcmp(id, "spin_lock") != 0)
 		return;
 	if (!cur_pool)
 		return;
-	switch (cur_pool->cores[1].next_candidate) {
-	case 1:
-		atomic_set(&cur_pool->descriptors[0].refs, 2);
-		break;
-	case 2:
-		atomic_set(&cur_pool->descriptors[1].refs, 1);
-		cur_pool->descriptors[1].owner = 3;
-		cur_pool->descriptors[1].expiration = mock_cycles + 1;
-	case 3:
-		atomic_set(&cur_pool->descriptors[2].refs, 1);
-		cur_pool->descriptors[2].owner = 3;
-		cur_pool->descriptors[2].expiration = mock_cycles - 1;
-	case 4:
-		atomic_set(&cur_pool->descriptors[3].refs, 1);
-	}
+
+	/* The first call is for the core's cache lock; the second is
+	 * for the first candidate page to steal.
+	 */
+	lock_hook_calls++;
+	if (lock_hook_calls == 2)
+		atomic_set(&cur_pool->descriptors[2].refs, 2);
 }
 static void change_owner_hook(char *id)
 {
@@ -61,12 +57,43 @@ static void change_owner_hook(char *id)
 		return;
 	if (!cur_pool)
 		return;
-	cur_pool->descriptors[cur_pool->cores[cpu_number].page_hint].owner = -1;
+	/* Tests using this hook allocate 2000-byte messages: size class 3. */
+	cur_pool->descriptors[cur_pool->cores[cpu_number].classes[3].page_hint]
+			.owner = -1;
+}
+
+/* Recreates a pool on a 2-node NUMA machine: bpages 32-63 and 96-99
+ * are on node 1, the others on node 0, and the current core is on node 1.
+ */
+static void numa_setup(struct homa_sock *hsk)
+{
+	homa_pool_destroy(&hsk->buffer_pool);
+	mock_nr_node_ids = 2;
+	mock_numa_mask = 32*HOMA_BPAGE_SIZE;
+	homa_pool_init(hsk, (void *) 0x1000000, 100*HOMA_BPAGE_SIZE, 0);
+}
+
+/* Attaches a return ring with the given number of entries to a pool. */
+static struct homa_return_ring *attach_ring(struct homa_pool *pool,
+		int entries)
+{
+	if (homa_pool_attach_ring(pool, (void __user *) 0x2000000, entries)
+			!= 0)
+		return NULL;
+	return pool->ring;
 }
 
 TEST_F(homa_pool, homa_pool_set_bpages_needed)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	/* The first RPC holds partial space, so the others need space for
+	 * their entire messages.
+	 */
+	atomic_set(&pool->free_bpages, 1);
+	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, pool->partial_rpc);
 	atomic_set(&pool->free_bpages, 0);
 	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE+1);
@@ -83,32 +110,100 @@ TEST_F(homa_pool, homa_pool_init__basics)
 	EXPECT_EQ(100, pool->num_bpages);
 	EXPECT_EQ(-1, pool->descriptors[98].owner);
 }
+TEST_F(homa_pool, homa_pool_init__bpage_shift)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	homa_pool_destroy(pool);
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, 18));
+	EXPECT_EQ(18, pool->bpage_shift);
+	EXPECT_EQ(25, pool->num_bpages);
+}
+TEST_F(homa_pool, homa_pool_init__bpage_shift_too_small)
+{
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, HOMA_BPAGE_SHIFT-1));
+}
+TEST_F(homa_pool, homa_pool_init__bpage_shift_too_large)
+{
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
+			100*HOMA_BPAGE_SIZE, HOMA_MAX_BPAGE_SHIFT+1));
+}
 TEST_F(homa_pool, homa_pool_init__region_not_page_aligned)
 {
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk,
 			((char *) 0x1000000) + 10,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0));
 }
 TEST_F(homa_pool, homa_pool_init__region_too_small)
 {
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk, (void *) 0x1000000,
-			HOMA_BPAGE_SIZE));
+			HOMA_BPAGE_SIZE, 0));
 }
 TEST_F(homa_pool, homa_pool_init__cant_allocate_descriptors)
 {
 	mock_kmalloc_errors = 1;
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0));
 }
 TEST_F(homa_pool, homa_pool_init__cant_allocate_core_info)
 {
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	mock_kmalloc_errors = 2;
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
-			100*HOMA_BPAGE_SIZE));
+			100*HOMA_BPAGE_SIZE, 0));
+}
+
+TEST_F(homa_pool, homa_pool_init__cant_allocate_free_map)
+{
+	homa_pool_destroy(&self->hsk.buffer_pool);
+	mock_kmalloc_errors = 4;
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
+			100*HOMA_BPAGE_SIZE, 0));
+}
+TEST_F(homa_pool, homa_pool_init__free_map)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	EXPECT_EQ(2, pool->num_map_words);
+	EXPECT_EQ(~0UL, pool->free_map[0]);
+	EXPECT_EQ((1UL << 36) - 1, pool->free_map[1]);
+}
+TEST_F(homa_pool, homa_pool_init__numa_maps)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	numa_setup(&self->hsk);
+	EXPECT_EQ(2, pool->num_nodes);
+	EXPECT_EQ(3, pool->num_maps);
+	EXPECT_EQ(-1, pool->copy_node);
+	EXPECT_EQ(1, pool->cores[1].node);
+	EXPECT_EQ(0, pool->cores[2].node);
+	EXPECT_EQ(0, pool->descriptors[10].node);
+	EXPECT_EQ(1, pool->descriptors[40].node);
+	EXPECT_EQ(0xffffffffUL, pool->free_map[0]);
+	EXPECT_EQ(0xffffffffUL, pool->free_map[1]);
+	EXPECT_EQ(0xffffffffUL << 32, pool->free_map[2]);
+	EXPECT_EQ(0xfUL << 32, pool->free_map[3]);
+	EXPECT_EQ(0, pool->free_map[4]);
+	EXPECT_EQ(0, pool->free_map[5]);
+}
+TEST_F(homa_pool, homa_pool_init__numa_node_unknown)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_gup_errors = 3;
+	numa_setup(&self->hsk);
+	EXPECT_EQ(-1, pool->descriptors[0].node);
+	EXPECT_EQ(-1, pool->descriptors[1].node);
+	EXPECT_EQ(0, pool->descriptors[2].node);
+	EXPECT_EQ(0xfffffffcUL, pool->free_map[0]);
+	EXPECT_EQ(3, pool->free_map[4]);
 }
 
 TEST_F(homa_pool, homa_pool_destroy__idempotent)
@@ -116,98 +211,531 @@ TEST_F(homa_pool, homa_pool_destroy__idempotent)
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	homa_pool_destroy(&self->hsk.buffer_pool);
 }
+TEST_F(homa_pool, homa_pool_destroy__release_ring)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
 
-TEST_F(homa_pool, homa_pool_get_pages__basics)
+	ASSERT_NE(NULL, attach_ring(pool, 64));
+	EXPECT_EQ(1, mock_pinned_pages);
+	homa_pool_destroy(pool);
+	EXPECT_EQ(NULL, pool->ring);
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+
+TEST_F(homa_pool, homa_pool_attach_ring__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, homa_pool_attach_ring(pool,
+			(void __user *) (0x2000000 + PAGE_SIZE - 128), 64));
+	ASSERT_NE(NULL, pool->ring);
+	EXPECT_EQ(PAGE_SIZE - 128, ((unsigned long) pool->ring) & ~PAGE_MASK);
+	EXPECT_EQ(2, pool->ring_num_pages);
+	EXPECT_EQ(2, mock_pinned_pages);
+	EXPECT_EQ(2, mock_locked_vm);
+	EXPECT_EQ(&mock_mm, pool->ring_mm);
+	EXPECT_EQ(64, pool->ring_entries);
+	EXPECT_EQ(64, pool->ring->size);
+	EXPECT_EQ(0, pool->ring->head);
+	EXPECT_EQ(0, pool->ring->tail);
+}
+TEST_F(homa_pool, homa_pool_attach_ring__cant_pin_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_gup_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_pool_attach_ring(pool,
+			(void __user *) 0x2000000, 64));
+	EXPECT_EQ(NULL, pool->ring);
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+TEST_F(homa_pool, homa_pool_attach_ring__exceeds_locked_memory_limit)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_locked_vm_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_attach_ring(pool,
+			(void __user *) 0x2000000, 64));
+	EXPECT_EQ(NULL, pool->ring);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+}
+TEST_F(homa_pool, homa_pool_attach_ring__cant_map_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_vmap_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_attach_ring(pool,
+			(void __user *) 0x2000000, 64));
+	EXPECT_EQ(NULL, pool->ring);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+}
+
+TEST_F(homa_pool, homa_pool_pin__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, homa_pool_pin(pool, pool->region,
+			100*HOMA_BPAGE_SIZE));
+	ASSERT_NE(NULL, pool->pinned_pages);
+	EXPECT_EQ(1600, pool->num_pinned);
+	EXPECT_EQ(1600, mock_pinned_pages);
+	EXPECT_EQ(1600, mock_locked_vm);
+	EXPECT_EQ(&mock_mm, pool->pinned_mm);
+	EXPECT_EQ(1, atomic_read(&mock_mm.mm_count));
+	EXPECT_EQ(0x1000000 + 2*PAGE_SIZE,
+			(unsigned long) pool->pinned_pages[2]);
+	homa_pool_destroy(pool);
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+	EXPECT_EQ(0, atomic_read(&mock_mm.mm_count));
+}
+TEST_F(homa_pool, homa_pool_pin__exceeds_locked_memory_limit)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_locked_vm_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_pin(pool, pool->region,
+			100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+}
+TEST_F(homa_pool, homa_pool_pin__cant_allocate_page_array)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_pin(pool, pool->region,
+			100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+}
+TEST_F(homa_pool, homa_pool_pin__cant_pin_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_gup_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_pool_pin(pool, pool->region,
+			100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(NULL, pool->pinned_pages);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+}
+
+TEST_F(homa_pool, homa_pool_copy_pinned__merge_contiguous_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct data_header h = {.common = {.type = DATA}};
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(&self->client_ip, &h.common, 3000, 1000);
+	ASSERT_EQ(0, homa_pool_pin(pool, pool->region,
+			100*HOMA_BPAGE_SIZE));
+	pool->pinned_pages[1] = (struct page *) pinned_buffer;
+	pool->pinned_pages[2] = (struct page *) (pinned_buffer + PAGE_SIZE);
+	unit_log_clear();
+	EXPECT_EQ(0, homa_pool_copy_pinned(pool, skb, sizeof(h),
+			(void __user *) (0x1000000 + PAGE_SIZE - 100), 3000));
+	EXPECT_STREQ("skb_copy_bits: 3000 bytes: 1000-3999",
+			unit_log_get());
+	EXPECT_EQ(1000, *((__u32 *) (pinned_buffer + PAGE_SIZE - 100)));
+	kfree_skb(skb);
+}
+TEST_F(homa_pool, homa_pool_copy_pinned__discontiguous_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct data_header h = {.common = {.type = DATA}};
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(&self->client_ip, &h.common, 3000, 1000);
+	ASSERT_EQ(0, homa_pool_pin(pool, pool->region,
+			100*HOMA_BPAGE_SIZE));
+	pool->pinned_pages[1] = (struct page *) (pinned_buffer + 2*PAGE_SIZE);
+	pool->pinned_pages[2] = (struct page *) pinned_buffer;
+	unit_log_clear();
+	EXPECT_EQ(0, homa_pool_copy_pinned(pool, skb, sizeof(h) + 100,
+			(void __user *) (0x1000000 + PAGE_SIZE - 100), 2000));
+	EXPECT_STREQ("skb_copy_bits: 100 bytes: 1100-1199; "
+			"skb_copy_bits: 1900 bytes: 1200-3099",
+			unit_log_get());
+	EXPECT_EQ(1100, *((__u32 *) (pinned_buffer + 3*PAGE_SIZE - 100)));
+	EXPECT_EQ(1200, *((__u32 *) pinned_buffer));
+	kfree_skb(skb);
+}
+TEST_F(homa_pool, homa_pool_copy_pinned__copy_error)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct data_header h = {.common = {.type = DATA}};
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(&self->client_ip, &h.common, 1000, 1000);
+	ASSERT_EQ(0, homa_pool_pin(pool, pool->region,
+			100*HOMA_BPAGE_SIZE));
+	pool->pinned_pages[0] = (struct page *) pinned_buffer;
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_pool_copy_pinned(pool, skb, sizeof(h),
+			(void __user *) 0x1000000, 1000));
+	kfree_skb(skb);
+}
+
+TEST_F(homa_pool, homa_pool_drain_ring__basics)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_return_ring *ring = attach_ring(pool, 4);
 	__u32 pages[10];
+
+	ASSERT_NE(NULL, ring);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 3, pages, 0));
+	EXPECT_EQ(97, atomic_read(&pool->free_bpages));
+	ring->offsets[0] = 0;
+	ring->offsets[1] = HOMA_BPAGE_SIZE;
+	ring->offsets[2] = 2*HOMA_BPAGE_SIZE;
+	ring->head = 3;
+	EXPECT_EQ(3, homa_pool_drain_ring(pool));
+	EXPECT_EQ(100, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(3, ring->tail);
+	EXPECT_EQ(3, pool->ring_tail);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.bpage_ring_returns);
+	EXPECT_EQ(0, homa_pool_drain_ring(pool));
+}
+TEST_F(homa_pool, homa_pool_drain_ring__wrap_around_and_multiple_batches)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_return_ring *ring = attach_ring(pool, 32);
+	__u32 pages[20];
+	int i;
+
+	ASSERT_NE(NULL, ring);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 20, pages, 0));
+	EXPECT_EQ(19, pages[19]);
+	EXPECT_EQ(80, atomic_read(&pool->free_bpages));
+	pool->ring_tail = 30;
+	ring->tail = 30;
+	for (i = 30; i < 50; i++)
+		ring->offsets[i & 31] = (i - 30) << HOMA_BPAGE_SHIFT;
+	ring->head = 50;
+	EXPECT_EQ(20, homa_pool_drain_ring(pool));
+	EXPECT_EQ(100, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(50, ring->tail);
+}
+TEST_F(homa_pool, homa_pool_drain_ring__corrupted_ring)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_return_ring *ring = attach_ring(pool, 4);
+
+	ASSERT_NE(NULL, ring);
+	ring->head = 100;
+	EXPECT_EQ(0, homa_pool_drain_ring(pool));
+	EXPECT_EQ(100, ring->tail);
+	EXPECT_EQ(100, pool->ring_tail);
+	EXPECT_EQ(100, atomic_read(&pool->free_bpages));
+}
+TEST_F(homa_pool, homa_pool_drain_ring__no_ring)
+{
+	EXPECT_EQ(0, homa_pool_drain_ring(&self->hsk.buffer_pool));
+}
+TEST_F(homa_pool, homa_pool_drain_ring__lock_unavailable)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_return_ring *ring = attach_ring(pool, 4);
+	__u32 pages[10];
+
+	ASSERT_NE(NULL, ring);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	ring->offsets[0] = 0;
+	ring->head = 1;
+	mock_trylock_errors = 1;
+	EXPECT_EQ(0, homa_pool_drain_ring(pool));
+	EXPECT_EQ(0, ring->tail);
+	EXPECT_EQ(1, homa_pool_drain_ring(pool));
+}
+
+TEST_F(homa_pool, homa_pool_claim_map__next_candidate)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	atomic_set(&pool->free_bpages, 20);
+	pool->cores[cpu_number].next_candidate = 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(64, pages[0]);
+	EXPECT_EQ(65, pages[1]);
+	EXPECT_EQ(1, pool->cores[cpu_number].next_candidate);
+}
+TEST_F(homa_pool, homa_pool_claim_map__next_candidate_beyond_limit)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	atomic_set(&pool->free_bpages, 92);
+	pool->cores[cpu_number].next_candidate = 1;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(0, pages[0]);
 	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
-	EXPECT_EQ(-1, pool->descriptors[1].owner);
-	EXPECT_EQ(2, pool->cores[cpu_number].next_candidate);
-	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(0, pool->cores[cpu_number].next_candidate);
 }
-TEST_F(homa_pool, homa_pool_get_pages__not_enough_space)
+TEST_F(homa_pool, homa_pool_claim_map__use_words_beyond_limit)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
-	atomic_set(&pool->free_bpages, 1);
-	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
-	atomic_set(&pool->free_bpages, 2);
+	atomic_set(&pool->free_bpages, 92);
+	pool->free_map[0] = 0;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(64, pages[0]);
+	EXPECT_EQ(65, pages[1]);
+	EXPECT_EQ(1, pool->cores[cpu_number].next_candidate);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_map_words);
 }
-TEST_F(homa_pool, homa_pool_get_pages__set_limit)
+TEST_F(homa_pool, homa_pool_claim_map__partially_used_word)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
-	atomic_set(&pool->free_bpages, 62);
-	pool->cores[cpu_number].next_candidate = 49;
+	atomic_set(&pool->free_bpages, 20);
+	pool->free_map[0] = 0x14;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(49, pages[0]);
-	EXPECT_EQ(0, pages[1]);
+	EXPECT_EQ(2, pages[0]);
+	EXPECT_EQ(4, pages[1]);
+	EXPECT_EQ(0, pool->free_map[0]);
 }
-TEST_F(homa_pool, homa_pool_get_pages__set_limit_with_MIN_EXTRA)
+TEST_F(homa_pool, homa_pool_claim_map__prefer_local_node)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
-	atomic_set(&pool->free_bpages, 92);
-	pool->cores[cpu_number].next_candidate = 13;
+
+	numa_setup(&self->hsk);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(32, pages[0]);
+	EXPECT_EQ(33, pages[1]);
+	EXPECT_EQ(0xffffffffUL, pool->free_map[0]);
+	EXPECT_EQ(0xffffff00UL << 32, pool->free_map[2]);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_local_allocs);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
+TEST_F(homa_pool, homa_pool_claim_map__fall_back_to_other_nodes)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+
+	mock_gup_errors = 1;
+	numa_setup(&self->hsk);
+	pool->free_map[2] = 0;
+	pool->free_map[3] = 0;
+	atomic_set(&pool->free_bpages, 3);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 3, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(1, pages[1]);
+	EXPECT_EQ(2, pages[2]);
+	EXPECT_EQ(5, homa_cores[cpu_number]->metrics.bpage_map_words);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_local_allocs);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
+TEST_F(homa_pool, homa_pool_claim_map__single_node)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+
+	EXPECT_EQ(1, pool->num_maps);
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(13, pages[0]);
-	EXPECT_EQ(0, pages[1]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_local_allocs);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
 }
-TEST_F(homa_pool, homa_pool_get_pages__skip_unusable_bpages)
+
+TEST_F(homa_pool, homa_pool_drain_caches)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	pool->free_map[0] = 0;
+	pool->free_map[1] = 0;
+	atomic_set(&pool->free_bpages, 3);
+	pool->cores[2].num_cached = 2;
+	pool->cores[2].cache[0] = 10;
+	pool->cores[2].cache[1] = 11;
+	pool->cores[3].num_cached = 1;
+	pool->cores[3].cache[0] = 12;
+	pool->cores[4].num_cached = 2;
+	pool->cores[4].cache[0] = 13;
+	pool->cores[4].cache[1] = 14;
+	mock_trylock_errors = 2;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 3, pages, 0));
+	EXPECT_EQ(11, pages[0]);
+	EXPECT_EQ(10, pages[1]);
+	EXPECT_EQ(14, pages[2]);
+	EXPECT_EQ(0, pool->cores[2].num_cached);
+	EXPECT_EQ(1, pool->cores[3].num_cached);
+	EXPECT_EQ(1, pool->cores[4].num_cached);
+}
+
+TEST_F(homa_pool, homa_pool_steal_page__skip_unusable_bpages)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
 	mock_cycles = 1000;
+	pool->free_map[0] = 0;
+	pool->free_map[1] = 0;
+	atomic_set(&pool->free_bpages, 1);
 	atomic_set(&pool->descriptors[0].refs, 2);
+	pool->descriptors[0].owner = 3;
 	atomic_set(&pool->descriptors[1].refs, 1);
 	pool->descriptors[1].owner = 3;
 	pool->descriptors[1].expiration = mock_cycles + 1;
 	atomic_set(&pool->descriptors[2].refs, 1);
-	pool->descriptors[2].owner = 3;
-	pool->descriptors[2].expiration = mock_cycles - 1;
 	atomic_set(&pool->descriptors[3].refs, 1);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	pool->descriptors[3].owner = 3;
+	pool->descriptors[3].expiration = mock_cycles - 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(3, pages[0]);
+	EXPECT_EQ(-1, pool->descriptors[3].owner);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[3].refs));
+	EXPECT_EQ(1, atomic_read(&pool->free_bpages));
 }
-TEST_F(homa_pool, homa_pool_get_pages__cant_lock_pages)
+TEST_F(homa_pool, homa_pool_steal_page__cant_lock_page)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
 	mock_cycles = 1000;
-	mock_trylock_errors = 3;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(3, pages[1]);
+	pool->free_map[0] = 0;
+	pool->free_map[1] = 0;
+	atomic_set(&pool->free_bpages, 1);
+	atomic_set(&pool->descriptors[2].refs, 1);
+	pool->descriptors[2].owner = 3;
+	atomic_set(&pool->descriptors[4].refs, 1);
+	pool->descriptors[4].owner = 3;
+	mock_trylock_errors = 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(4, pages[0]);
+	EXPECT_EQ(3, pool->descriptors[2].owner);
 }
-TEST_F(homa_pool, homa_pool_get_pages__state_changes_while_locking)
+TEST_F(homa_pool, homa_pool_steal_page__state_changes_while_locking)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
 	mock_cycles = 1000;
-	unit_hook_register(steal_bpages_hook);
+	pool->free_map[0] = 0;
+	pool->free_map[1] = 0;
+	atomic_set(&pool->free_bpages, 1);
+	atomic_set(&pool->descriptors[2].refs, 1);
+	pool->descriptors[2].owner = 3;
+	atomic_set(&pool->descriptors[4].refs, 1);
+	pool->descriptors[4].owner = 3;
+	lock_hook_calls = 0;
+	unit_hook_register(steal_race_hook);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(4, pages[0]);
+	EXPECT_EQ(2, atomic_read(&pool->descriptors[2].refs));
+	EXPECT_EQ(3, pool->descriptors[2].owner);
+}
+
+TEST_F(homa_pool, homa_pool_get_pages__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(1, pages[1]);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
+	EXPECT_EQ(-1, pool->descriptors[1].owner);
+	EXPECT_EQ(0, pool->cores[cpu_number].next_candidate);
+	EXPECT_EQ(6, pool->cores[cpu_number].num_cached);
+	EXPECT_EQ(2, pool->cores[cpu_number].cache[5]);
+	EXPECT_EQ(~0UL << 8, pool->free_map[0]);
+	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
 }
-TEST_F(homa_pool, homa_pool_get_pages__steal_expired_page)
+TEST_F(homa_pool, homa_pool_get_pages__prefer_copy_node)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
-	pool->descriptors[0].owner = 5;
-	mock_cycles = 5000;
-	pool->descriptors[0].expiration = mock_cycles - 1;
-	atomic_set(&pool->free_bpages, 20);
+
+	numa_setup(&self->hsk);
+	pool->copy_node = 0;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(0, pages[0]);
 	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(-1, pool->descriptors[0].owner);
-	EXPECT_EQ(19, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_local_allocs);
+}
+TEST_F(homa_pool, homa_pool_get_pages__not_enough_space)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	atomic_set(&pool->free_bpages, 1);
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
+	atomic_set(&pool->free_bpages, 2);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+}
+TEST_F(homa_pool, homa_pool_get_pages__scan_length_histogram)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+
+	/* First call refills the cache from the map; second call is
+	 * satisfied from the cache.
+	 */
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(1, pool->cores[cpu_number].stats.scan_lengths[0]);
+	EXPECT_EQ(1, pool->cores[cpu_number].stats.scan_lengths[1]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_scan_lengths[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_scan_lengths[1]);
+
+	/* This call must examine 2 words. */
+	pool->cores[cpu_number].num_cached = 0;
+	pool->free_map[0] = 0;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(1, pool->cores[cpu_number].stats.scan_lengths[2]);
+}
+TEST_F(homa_pool, homa_pool_get_pages__drain_return_ring)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_return_ring *ring = attach_ring(pool, 4);
+	__u32 pages[10];
+
+	ASSERT_NE(NULL, ring);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	atomic_set(&pool->free_bpages, 0);
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(0, pool->check_waiting_needed);
+
+	ring->offsets[0] = 0;
+	ring->offsets[1] = HOMA_BPAGE_SIZE;
+	ring->head = 2;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(0, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(2, ring->tail);
+	EXPECT_EQ(1, pool->check_waiting_needed);
+}
+TEST_F(homa_pool, homa_pool_get_pages__use_cached_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 3, pages, 0));
+	EXPECT_EQ(1, pages[0]);
+	EXPECT_EQ(2, pages[1]);
+	EXPECT_EQ(3, pages[2]);
+	EXPECT_EQ(4, pool->cores[cpu_number].num_cached);
+	EXPECT_EQ(4, homa_cores[cpu_number]->metrics.bpage_cache_hits);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_map_words);
+}
+TEST_F(homa_pool, homa_pool_get_pages__request_larger_than_cache)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[20];
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 10, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(9, pages[9]);
+	EXPECT_EQ(0, pool->cores[cpu_number].num_cached);
+	EXPECT_EQ(~0UL << 10, pool->free_map[0]);
+}
+TEST_F(homa_pool, homa_pool_get_pages__dont_cache_when_pool_nearly_full)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	atomic_set(&pool->free_bpages, 10);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(0, pool->cores[cpu_number].num_cached);
+	EXPECT_EQ(~0UL << 1, pool->free_map[0]);
 }
 TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 {
@@ -221,6 +749,56 @@ TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 			pool->descriptors[pages[1]].expiration);
 	EXPECT_EQ(2, atomic_read(&pool->descriptors[1].refs));
 }
+TEST_F(homa_pool, homa_pool_get_pages__cost_vs_occupancy)
+{
+	/* Measures the cost of allocating bpages (free map words examined)
+	 * as the pool fills up. Free pages are always at the high end of
+	 * the pool, which was the worst case for the old linear scan of
+	 * descriptors (its cost grew with the number of allocated bpages,
+	 * for every allocation).
+	 */
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	int num_bpages = 4096;
+	int occupancy[] = {0, 50, 90, 99};
+	__u32 pages[HOMA_MAX_BPAGES];
+	__u64 words, hits;
+	int i, j, used, count;
+
+	for (i = 0; i < sizeof(occupancy)/sizeof(occupancy[0]); i++) {
+		homa_pool_destroy(pool);
+		ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+				((__u64) num_bpages)*HOMA_BPAGE_SIZE, 0));
+		used = num_bpages*occupancy[i]/100;
+		for (j = 0; j < used; j += count) {
+			count = used - j;
+			if (count > 64)
+				count = 64;
+			ASSERT_EQ(0, homa_pool_get_pages(pool, count, pages, 0));
+		}
+		pool->cores[cpu_number].next_candidate = 0;
+		words = homa_cores[cpu_number]->metrics.bpage_map_words;
+		hits = homa_cores[cpu_number]->metrics.bpage_cache_hits;
+		for (j = 0; j < 1000; j++) {
+			__u32 offset;
+
+			ASSERT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+			offset = pages[0] << HOMA_BPAGE_SHIFT;
+			homa_pool_release_buffers(pool, 1, &offset);
+		}
+		words = homa_cores[cpu_number]->metrics.bpage_map_words
+				- words;
+		hits = homa_cores[cpu_number]->metrics.bpage_cache_hits
+				- hits;
+
+		/* Only the first refill of the core's cache has to search
+		 * through the allocated part of the map; after that, each
+		 * refill examines a single word and serves several
+		 * allocations.
+		 */
+		EXPECT_EQ(1000, hits);
+		EXPECT_GE(used/BITS_PER_LONG + 1 + 1000/4, words);
+	}
+}
 
 TEST_F(homa_pool, homa_pool_allocate__basics)
 {
@@ -234,9 +812,9 @@ TEST_F(homa_pool, homa_pool_allocate__basics)
 	EXPECT_EQ(0, crpc->msgin.bpage_offsets[0]);
 	EXPECT_EQ(-1, pool->descriptors[0].owner);
 	EXPECT_EQ(2*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[2]);
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(150000 - 2*HOMA_BPAGE_SIZE,
-			pool->cores[cpu_number].allocated);
+	EXPECT_EQ(2, pool->cores[cpu_number].classes[5].page_hint);
+	EXPECT_EQ(18944, pool->cores[cpu_number].classes[5].allocated);
+	EXPECT_EQ(5, pool->descriptors[2].size_class);
 }
 TEST_F(homa_pool, homa_pool_no_buffer_pool)
 {
@@ -251,7 +829,7 @@ TEST_F(homa_pool, homa_pool_no_buffer_pool)
 TEST_F(homa_pool, homa_pool_allocate__cant_allocate_full_bpages)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	atomic_set(&pool->free_bpages, 1);
+	atomic_set(&pool->free_bpages, 0);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000,	150000);
@@ -259,6 +837,95 @@ TEST_F(homa_pool, homa_pool_allocate__cant_allocate_full_bpages)
 
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 	EXPECT_FALSE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(0, atomic_read(&pool->free_bpages));
+}
+TEST_F(homa_pool, homa_pool_allocate__allocate_granted_bytes_only)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(HOMA_BPAGE_SIZE, homa_pool_covered(crpc));
+	EXPECT_TRUE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(0, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.buffer_partial_allocs);
+}
+TEST_F(homa_pool, homa_pool_allocate__only_one_partial_message)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(1, crpc1->msgin.num_bpages);
+	EXPECT_EQ(crpc1, pool->partial_rpc);
+
+	/* The second message can't get partial space, even though it
+	 * has fewer bytes remaining.
+	 */
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 140000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_FALSE(list_empty(&crpc2->buf_links));
+	EXPECT_EQ(crpc1, pool->partial_rpc);
+	EXPECT_EQ(1, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(3, pool->bpages_needed);
+}
+TEST_F(homa_pool, homa_pool_allocate__higher_priority_rpc_waiting)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	atomic_set(&pool->free_bpages, 0);
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	100000);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(NULL, pool->partial_rpc);
+
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 150000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(NULL, pool->partial_rpc);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.waiting_for_bufs));
+}
+TEST_F(homa_pool, homa_pool_allocate__leave_reserve_for_partial_rpc)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc1, 150000));
+	EXPECT_FALSE(list_empty(&crpc1->buf_links));
+	EXPECT_EQ(1, pool->reserved);
+
+	/* Allocating this message would consume the reserved bpage. */
+	atomic_set(&pool->free_bpages, 2);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(2, atomic_read(&pool->free_bpages));
+
+	/* This one leaves enough for crpc1. */
+	atomic_set(&pool->free_bpages, 3);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 102, 1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc3);
+	EXPECT_EQ(2, crpc3->msgin.num_bpages);
 	EXPECT_EQ(1, atomic_read(&pool->free_bpages));
 }
 TEST_F(homa_pool, homa_pool_allocate__no_partial_page)
@@ -278,7 +945,7 @@ TEST_F(homa_pool, homa_pool_allocate__no_partial_page)
 TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	pool->free_map[0] &= ~3UL;
 	atomic_set(&pool->free_bpages, 40);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -286,7 +953,7 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 	ASSERT_NE(NULL, crpc);
 
 	// First allocation just sets up a partially-allocated bpage.
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
+	EXPECT_EQ(2, pool->cores[cpu_number].classes[3].page_hint);
 
 	// Try a second allocation; the lock hook steals the partial bpage,
 	// so a new one has to be allocated.
@@ -296,8 +963,8 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 	EXPECT_EQ(0, homa_pool_allocate(crpc));
 	EXPECT_EQ(1, crpc->msgin.num_bpages);
 	EXPECT_EQ(3*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
-	EXPECT_EQ(3, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(2000, pool->cores[cpu_number].allocated);
+	EXPECT_EQ(3, pool->cores[cpu_number].classes[3].page_hint);
+	EXPECT_EQ(2048, pool->cores[cpu_number].classes[3].allocated);
 	EXPECT_EQ(1, -pool->descriptors[2].owner);
 	EXPECT_EQ(1, pool->descriptors[3].owner);
 	EXPECT_EQ(38, atomic_read(&pool->free_bpages));
@@ -305,49 +972,54 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 TEST_F(homa_pool, homa_pool_allocate__page_wrap_around)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].page_hint = 2;
-	pool->cores[cpu_number].allocated = HOMA_BPAGE_SIZE-1900;
+	pool->cores[cpu_number].classes[3].page_hint = 2;
+	pool->cores[cpu_number].classes[3].allocated = HOMA_BPAGE_SIZE-1900;
 	atomic_set(&pool->descriptors[2].refs, 1);
 	pool->descriptors[2].owner = cpu_number;
+	pool->descriptors[2].size_class = 3;
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000, 2000);
 	ASSERT_NE(NULL, crpc);
 
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
+	EXPECT_EQ(2, pool->cores[cpu_number].classes[3].page_hint);
 	EXPECT_EQ(1, crpc->msgin.num_bpages);
 	EXPECT_EQ(2*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
-	EXPECT_EQ(2000, pool->cores[cpu_number].allocated);
+	EXPECT_EQ(2048, pool->cores[cpu_number].classes[3].allocated);
 	EXPECT_EQ(cpu_number, pool->descriptors[2].owner);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_reuses);
 }
 TEST_F(homa_pool, homa_pool_allocate__owned_page_overflow)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	pool->free_map[0] &= ~3UL;
 	atomic_set(&pool->free_bpages, 50);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000, 2000);
 	ASSERT_NE(NULL, crpc);
 
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
+	EXPECT_EQ(2, pool->cores[cpu_number].classes[3].page_hint);
 	crpc->msgin.num_bpages = 0;
-	pool->cores[cpu_number].allocated = HOMA_BPAGE_SIZE-1900;
+	pool->cores[cpu_number].classes[3].allocated = HOMA_BPAGE_SIZE-1900;
 	EXPECT_EQ(0, homa_pool_allocate(crpc));
 	EXPECT_EQ(1, crpc->msgin.num_bpages);
 	EXPECT_EQ(3*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
-	EXPECT_EQ(3, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(2000, pool->cores[cpu_number].allocated);
+	EXPECT_EQ(3, pool->cores[cpu_number].classes[3].page_hint);
+	EXPECT_EQ(2048, pool->cores[cpu_number].classes[3].allocated);
 	EXPECT_EQ(-1, pool->descriptors[2].owner);
 	EXPECT_EQ(1, atomic_read(&pool->descriptors[2].refs));
 	EXPECT_EQ(1, pool->descriptors[3].owner);
 	EXPECT_EQ(48, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(1, pool->cores[cpu_number].stats.partial_bpages);
+	EXPECT_EQ(1996, pool->cores[cpu_number].stats.partial_waste);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_partial_fills);
+	EXPECT_EQ(1996, homa_cores[cpu_number]->metrics.bpage_partial_waste);
 }
 TEST_F(homa_pool, homa_pool_allocate__reuse_owned_page)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	pool->cores[cpu_number].next_candidate = 2;
+	pool->free_map[0] &= ~3UL;
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000, 2000);
@@ -360,10 +1032,70 @@ TEST_F(homa_pool, homa_pool_allocate__reuse_owned_page)
 	EXPECT_EQ(1, crpc1->msgin.num_bpages);
 	EXPECT_EQ(2*HOMA_BPAGE_SIZE, crpc1->msgin.bpage_offsets[0]);
 	EXPECT_EQ(1, crpc2->msgin.num_bpages);
-	EXPECT_EQ(2*HOMA_BPAGE_SIZE + 2000, crpc2->msgin.bpage_offsets[0]);
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE + 2048, crpc2->msgin.bpage_offsets[0]);
 	EXPECT_EQ(3, atomic_read(&pool->descriptors[2].refs));
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(5000, pool->cores[cpu_number].allocated);
+	EXPECT_EQ(2, pool->cores[cpu_number].classes[3].page_hint);
+	EXPECT_EQ(5056, pool->cores[cpu_number].classes[3].allocated);
+}
+TEST_F(homa_pool, homa_pool_allocate__size_classes)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 64);
+	ASSERT_NE(NULL, crpc1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 65);
+	ASSERT_NE(NULL, crpc2);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 102, 1000, 16385);
+	ASSERT_NE(NULL, crpc3);
+
+	EXPECT_EQ(0, crpc1->msgin.bpage_offsets[0]);
+	EXPECT_EQ(HOMA_BPAGE_SIZE, crpc2->msgin.bpage_offsets[0]);
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE, crpc3->msgin.bpage_offsets[0]);
+	EXPECT_EQ(0, pool->descriptors[0].size_class);
+	EXPECT_EQ(1, pool->descriptors[1].size_class);
+	EXPECT_EQ(5, pool->descriptors[2].size_class);
+	EXPECT_EQ(1, pool->cores[cpu_number].classes[1].page_hint);
+	EXPECT_EQ(16448, pool->cores[cpu_number].classes[5].allocated);
+}
+TEST_F(homa_pool, homa_pool_allocate__round_up_to_cache_line)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 100);
+	ASSERT_NE(NULL, crpc1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 200);
+	ASSERT_NE(NULL, crpc2);
+
+	EXPECT_EQ(0, crpc1->msgin.bpage_offsets[0]);
+	EXPECT_EQ(128, crpc2->msgin.bpage_offsets[0]);
+	EXPECT_EQ(3, atomic_read(&pool->descriptors[0].refs));
+	EXPECT_EQ(384, pool->cores[cpu_number].classes[1].allocated);
+}
+TEST_F(homa_pool, homa_pool_allocate__page_owned_for_different_class)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	pool->free_map[0] &= ~4UL;
+	pool->cores[cpu_number].classes[0].page_hint = 2;
+	atomic_set(&pool->descriptors[2].refs, 1);
+	pool->descriptors[2].owner = cpu_number;
+	pool->descriptors[2].size_class = 3;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 50);
+	ASSERT_NE(NULL, crpc);
+
+	EXPECT_EQ(0, crpc->msgin.bpage_offsets[0]);
+	EXPECT_EQ(0, pool->cores[cpu_number].classes[0].page_hint);
+	EXPECT_EQ(cpu_number, pool->descriptors[2].owner);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[2].refs));
 }
 TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage)
 {
@@ -374,11 +1106,15 @@ TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage)
 			4000, 98, 1000, 5*HOMA_BPAGE_SIZE + 100);
 	ASSERT_NE(NULL, crpc);
 
-	EXPECT_EQ(0, crpc->msgin.num_bpages);
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
+	/* The full bpages get released, then space is allocated for
+	 * just the granted bytes.
+	 */
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[0].refs));
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[4].refs));
-	EXPECT_EQ(5, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(4, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(1, pool->check_waiting_needed);
 }
 TEST_F(homa_pool, homa_pool_allocate__out_of_space)
 {
@@ -408,6 +1144,84 @@ TEST_F(homa_pool, homa_pool_allocate__out_of_space)
 	EXPECT_EQ(1, pool->bpages_needed);
 }
 
+TEST_F(homa_pool, homa_pool_extend__already_covered)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc, 30000));
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+}
+TEST_F(homa_pool, homa_pool_extend__entire_message_covered)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(3, crpc->msgin.num_bpages);
+	EXPECT_EQ(150000, homa_pool_extend(crpc, 150000));
+}
+TEST_F(homa_pool, homa_pool_extend__allocate_more)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+	atomic_set(&pool->free_bpages, 10);
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc, 100000));
+	EXPECT_EQ(2, crpc->msgin.num_bpages);
+	EXPECT_EQ(9, atomic_read(&pool->free_bpages));
+
+	/* Reaching the end of the message requires the partial bpage. */
+	EXPECT_EQ(150000, homa_pool_extend(crpc, 150000));
+	EXPECT_EQ(3, crpc->msgin.num_bpages);
+}
+TEST_F(homa_pool, homa_pool_extend__make_partial_progress)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+
+	/* Not enough space to cover the entire message, but there's
+	 * enough for one more bpage.
+	 */
+	atomic_set(&pool->free_bpages, 1);
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc, 150000));
+	EXPECT_EQ(2, crpc->msgin.num_bpages);
+	EXPECT_EQ(0, atomic_read(&pool->free_bpages));
+	EXPECT_TRUE(list_empty(&crpc->buf_links));
+}
+TEST_F(homa_pool, homa_pool_extend__out_of_space)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc, 100000));
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_FALSE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(1, pool->bpages_needed);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.buffer_extend_failures);
+
+	/* Second failure doesn't queue the RPC twice. */
+	EXPECT_EQ(HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc, 100000));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.waiting_for_bufs));
+}
+
 TEST_F(homa_pool, homa_pool_get_buffer)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
@@ -425,6 +1239,20 @@ TEST_F(homa_pool, homa_pool_get_buffer)
 	EXPECT_EQ((150000 & (HOMA_BPAGE_SIZE-1)) - 100, available);
 	EXPECT_EQ((void *) (pool->region + 2*HOMA_BPAGE_SIZE + 100), buffer);
 }
+TEST_F(homa_pool, homa_pool_get_buffer__partial_allocation)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	int available;
+
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	homa_pool_get_buffer(crpc, 1000, &available);
+	EXPECT_EQ(HOMA_BPAGE_SIZE - 1000, available);
+}
 
 TEST_F(homa_pool, homa_pool_release_buffers__basics)
 {
@@ -437,7 +1265,7 @@ TEST_F(homa_pool, homa_pool_release_buffers__basics)
 	ASSERT_NE(NULL, crpc1);
 	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
-			4000, 98, 1000,	2000);
+			4000, 98, 1000,	20000);
 	ASSERT_NE(NULL, crpc2);
 
 	EXPECT_EQ(1, atomic_read(&pool->descriptors[0].refs));
@@ -451,6 +1279,7 @@ TEST_F(homa_pool, homa_pool_release_buffers__basics)
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
 	EXPECT_EQ(2, atomic_read(&pool->descriptors[2].refs));
 	EXPECT_EQ(99, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(3, pool->free_map[0] & 7);
 
 	/* Ignore requests if pool not initialized. */
 	saved_region = pool->region;
@@ -460,6 +1289,79 @@ TEST_F(homa_pool, homa_pool_release_buffers__basics)
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
 	pool->region = saved_region;
 }
+TEST_F(homa_pool, homa_pool_release_buffers__numa)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 offsets[2];
+
+	mock_gup_errors = 1;
+	numa_setup(&self->hsk);
+	offsets[0] = 0;
+	offsets[1] = 40*HOMA_BPAGE_SIZE;
+	atomic_set(&pool->descriptors[0].refs, 1);
+	atomic_set(&pool->descriptors[40].refs, 1);
+	pool->free_map[4] = 0;
+	__clear_bit(40, &pool->free_map[2]);
+	homa_pool_release_buffers(pool, 2, offsets);
+	EXPECT_EQ(1, pool->free_map[4]);
+	EXPECT_EQ(0xffffffffUL << 32, pool->free_map[2]);
+
+	/* Node learned while the bpage was in use. */
+	atomic_set(&pool->descriptors[0].refs, 1);
+	pool->free_map[4] = 0;
+	pool->descriptors[0].node = 0;
+	__clear_bit(0, &pool->free_map[0]);
+	homa_pool_release_buffers(pool, 1, offsets);
+	EXPECT_EQ(0, pool->free_map[4]);
+	EXPECT_EQ(0xffffffffUL, pool->free_map[0]);
+}
+
+TEST_F(homa_pool, homa_pool_learn_nodes__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 offsets[3];
+
+	mock_gup_errors = 3;
+	numa_setup(&self->hsk);
+	offsets[0] = 0;
+	offsets[1] = HOMA_BPAGE_SIZE + 100;
+	offsets[2] = 40*HOMA_BPAGE_SIZE;
+
+	/* First call: node still not available for bpage 1. */
+	mock_gup_errors = 2;
+	homa_pool_learn_nodes(pool, 3, offsets);
+	EXPECT_EQ(0, pool->descriptors[0].node);
+	EXPECT_EQ(-1, pool->descriptors[1].node);
+	EXPECT_EQ(1, pool->descriptors[40].node);
+
+	homa_pool_learn_nodes(pool, 3, offsets);
+	EXPECT_EQ(0, pool->descriptors[1].node);
+}
+TEST_F(homa_pool, homa_pool_learn_nodes__single_node)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 offsets[1] = {0};
+
+	homa_pool_learn_nodes(pool, 1, offsets);
+	EXPECT_EQ(-1, pool->descriptors[0].node);
+}
+
+TEST_F(homa_pool, homa_pool_set_copy_node)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	/* Single node: nothing to record. */
+	homa_pool_set_copy_node(pool);
+	EXPECT_EQ(-1, pool->copy_node);
+
+	numa_setup(&self->hsk);
+	cpu_number = 2;
+	homa_pool_set_copy_node(pool);
+	EXPECT_EQ(0, pool->copy_node);
+	cpu_number = 3;
+	homa_pool_set_copy_node(pool);
+	EXPECT_EQ(1, pool->copy_node);
+}
 
 TEST_F(homa_pool, homa_pool_check_waiting__basics)
 {
@@ -472,34 +1374,57 @@ TEST_F(homa_pool, homa_pool_check_waiting__basics)
 			4000, 98, 1000,	3*HOMA_BPAGE_SIZE);
 	ASSERT_NE(NULL, crpc2);
 	EXPECT_EQ(0, crpc2->msgin.num_bpages);
-	EXPECT_EQ(3, pool->bpages_needed);
+	EXPECT_EQ(1, pool->bpages_needed);
 
 	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000,	2*HOMA_BPAGE_SIZE);
 	ASSERT_NE(NULL, crpc3);
 	EXPECT_EQ(0, crpc3->msgin.num_bpages);
-	EXPECT_EQ(2, pool->bpages_needed);
+	EXPECT_EQ(1, pool->bpages_needed);
 
-	/* Now free up the allocated pages and make sure that space can be
-	 * allocated for the queued RPCs.
+	/* Now free up bpages and make sure that space can be allocated
+	 * for the queued RPCs. With only 1 free bpage, the first RPC gets
+	 * space for its granted bytes only.
 	 */
 	unit_log_clear();
 	atomic_set(&pool->free_bpages, 1);
 	homa_pool_check_waiting(pool);
 	EXPECT_EQ(0, crpc2->msgin.num_bpages);
-	EXPECT_EQ(0, crpc3->msgin.num_bpages);
+	EXPECT_EQ(1, crpc3->msgin.num_bpages);
 	atomic_set(&pool->free_bpages, 5);
 	homa_pool_check_waiting(pool);
 	EXPECT_EQ(3, crpc2->msgin.num_bpages);
-	EXPECT_EQ(2, crpc3->msgin.num_bpages);
+	EXPECT_EQ(1, crpc3->msgin.num_bpages);
 	EXPECT_EQ(INT_MAX, pool->bpages_needed);
 }
+TEST_F(homa_pool, homa_pool_check_waiting__record_wait_time)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	atomic_set(&pool->free_bpages, 0);
+	mock_cycles = 1000;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(0, crpc->msgin.num_bpages);
+
+	mock_cycles = 5000;
+	atomic_set(&pool->free_bpages, 5);
+	homa_pool_check_waiting(pool);
+	EXPECT_EQ(2, crpc->msgin.num_bpages);
+	EXPECT_EQ(1, pool->cores[cpu_number].stats.waits);
+	EXPECT_EQ(4000, pool->cores[cpu_number].stats.wait_cycles);
+	EXPECT_EQ(4000, homa_cores[cpu_number]->metrics.buffer_wait_cycles);
+}
 TEST_F(homa_pool, homa_pool_check_waiting__bpages_needed_but_no_queued_rpcs)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	pool->bpages_needed = 1;
+	pool->check_waiting_needed = 1;
 	homa_pool_check_waiting(pool);
+	EXPECT_EQ(0, pool->check_waiting_needed);
 	EXPECT_EQ(100, atomic_read(&pool->free_bpages));
 	EXPECT_EQ(INT_MAX, pool->bpages_needed);
 }
@@ -528,6 +1453,8 @@ TEST_F(homa_pool, homa_pool_check_waiting__reset_bpages_needed)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 
+	/* Large GSO size means the 2nd RPC needs all of its space at once. */
+	self->homa.max_gso_size = 2*HOMA_BPAGE_SIZE;
 	atomic_set(&pool->free_bpages, 0);
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
@@ -553,14 +1480,14 @@ TEST_F(homa_pool, homa_pool_check_waiting__wake_up_waiting_rpc)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 
-        /* Queue up an RPC that needs 2 bpages. */
+        /* Queue up an RPC that needs 2 bpages (but can start with 1). */
 	atomic_set(&pool->free_bpages, 0);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000,	2*HOMA_BPAGE_SIZE);
 	ASSERT_NE(NULL, crpc);
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
-	EXPECT_EQ(2, pool->bpages_needed);
+	EXPECT_EQ(1, pool->bpages_needed);
 
 	/* Free the required pages. */
 	unit_log_clear();
@@ -580,12 +1507,364 @@ TEST_F(homa_pool, homa_pool_check_waiting__reallocation_fails)
 			4000, 98, 1000,	4*HOMA_BPAGE_SIZE);
 	ASSERT_NE(NULL, crpc);
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
-	pool->bpages_needed = 2;
+	pool->bpages_needed = 0;
 
 	unit_log_clear();
-	atomic_set(&pool->free_bpages, 2);
 	homa_pool_check_waiting(pool);
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 	EXPECT_STREQ("", unit_log_get());
-	EXPECT_EQ(4, pool->bpages_needed);
-}
\ No newline at end of file
+	EXPECT_EQ(1, pool->bpages_needed);
+}
+TEST_F(homa_pool, homa_pool_check_waiting__extend_stalled_rpc)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	/* Create an RPC with space for only part of its message, which
+	 * is waiting to extend its space.
+	 */
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc);
+	homa_pool_extend(crpc, 100000);
+	EXPECT_FALSE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(1, pool->bpages_needed);
+
+	unit_log_clear();
+	self->homa.grant_window = 100000;
+	atomic_set(&pool->free_bpages, 1);
+	homa_pool_check_waiting(pool);
+	EXPECT_EQ(2, crpc->msgin.num_bpages);
+	EXPECT_TRUE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(INT_MAX, pool->bpages_needed);
+	EXPECT_SUBSTR("xmit GRANT 101400@", unit_log_get());
+	EXPECT_EQ(101400, crpc->msgin.granted);
+}
+
+TEST_F(homa_pool, homa_pool_check_waiting__partial_rpc_completes)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	/* Two large messages arrive when the pool is nearly full; only
+	 * the first gets partial space.
+	 */
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 3*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(1, crpc1->msgin.num_bpages);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+
+	/* crpc1 uses up the pool and has to wait for more space, but it
+	 * stays ahead of crpc2.
+	 */
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc1,
+			3*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE - 10000, homa_pool_extend(crpc1,
+			3*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(crpc1, list_first_entry(&self->hsk.waiting_for_bufs,
+			struct homa_rpc, buf_links));
+	EXPECT_EQ(1, pool->bpages_needed);
+
+	/* When a bpage is freed, crpc1 gets it and can complete. */
+	self->homa.grant_window = 4*HOMA_BPAGE_SIZE;
+	self->homa.max_incoming = 1000000;
+	atomic_set(&pool->free_bpages, 1);
+	homa_pool_check_waiting(pool);
+	EXPECT_EQ(3, crpc1->msgin.num_bpages);
+	EXPECT_EQ(3*HOMA_BPAGE_SIZE, crpc1->msgin.granted);
+	EXPECT_EQ(NULL, pool->partial_rpc);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.waiting_for_bufs));
+}
+
+TEST_F(homa_pool, homa_pool_forget_rpc__partial_rpc)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	atomic_set(&pool->free_bpages, 1);
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	150000);
+	ASSERT_NE(NULL, crpc1);
+	homa_pool_extend(crpc1, 150000);
+	atomic_set(&pool->free_bpages, 0);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.waiting_for_bufs));
+	EXPECT_EQ(1, pool->reserved);
+
+	homa_rpc_free(crpc1);
+	EXPECT_EQ(NULL, pool->partial_rpc);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.waiting_for_bufs));
+	EXPECT_EQ(0, pool->reserved);
+
+	/* crpc2 can now start with space for its granted bytes. */
+	EXPECT_EQ(1, pool->bpages_needed);
+}
+TEST_F(homa_pool, homa_pool_forget_rpc__not_waiting)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	2000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_TRUE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(INT_MAX, pool->bpages_needed);
+}
+
+TEST_F(homa_pool, homa_pool_get_stats__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_buf_stats stats;
+
+	pool->cores[2].stats.partial_bpages = 3;
+	pool->cores[2].stats.partial_waste = 300;
+	pool->cores[2].stats.scan_lengths[4] = 7;
+	pool->cores[3].stats.waits = 2;
+	pool->cores[3].stats.wait_cycles = 5000000;
+	pool->cores[5].stats.scan_lengths[4] = 1;
+	pool->cores[5].stats.partial_waste = 20;
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 2000));
+	atomic_set(&pool->free_bpages, 0);
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 2*HOMA_BPAGE_SIZE));
+
+	homa_pool_get_stats(pool, &stats);
+	EXPECT_EQ(100, stats.num_bpages);
+	EXPECT_EQ(0, stats.free_bpages);
+	EXPECT_EQ(1, stats.owned_bpages);
+	EXPECT_EQ(1, stats.waiting_rpcs);
+	EXPECT_EQ(3, stats.partial_bpages);
+	EXPECT_EQ(368, stats.partial_waste);
+	EXPECT_EQ(2, stats.waits);
+	EXPECT_EQ(5000, stats.wait_usecs);
+	EXPECT_EQ(8, stats.scan_lengths[4]);
+}
+TEST_F(homa_pool, homa_pool_get_stats__no_region)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_buf_stats stats;
+
+	homa_pool_destroy(pool);
+	memset(&stats, 0xff, sizeof(stats));
+	homa_pool_get_stats(pool, &stats);
+	EXPECT_EQ(0, stats.num_bpages);
+	EXPECT_EQ(0, stats.scan_lengths[0]);
+}
+
+TEST_F(homa_pool, homa_send_region_init__basics)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+	struct homa_send_ring *ring;
+
+	EXPECT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 64));
+	ring = homa_send_ring_addr((void *) 0x3000000, 10*PAGE_SIZE, 64);
+	EXPECT_EQ(0x3000000, (unsigned long) region->start);
+	EXPECT_EQ(((char *) ring) - ((char *) 0x3000000), region->length);
+	EXPECT_EQ(10, region->num_pages);
+	EXPECT_EQ(0x3000000 + 2*PAGE_SIZE, (unsigned long) region->pages[2]);
+	ASSERT_NE(NULL, region->ring);
+	EXPECT_EQ(64, region->ring_entries);
+	EXPECT_EQ(64, region->ring->size);
+	EXPECT_EQ(0, region->ring->head);
+	EXPECT_EQ(11, mock_pinned_pages);
+	EXPECT_EQ(11, mock_locked_vm);
+	EXPECT_EQ(2, atomic_read(&mock_mm.mm_count));
+	homa_send_region_destroy(region);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+	EXPECT_EQ(0, atomic_read(&mock_mm.mm_count));
+}
+TEST_F(homa_pool, homa_send_region_init__pin_pages_for_writing)
+{
+	EXPECT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 0));
+	EXPECT_EQ(FOLL_WRITE | FOLL_LONGTERM, mock_gup_flags);
+}
+TEST_F(homa_pool, homa_send_region_init__start_not_page_aligned)
+{
+	EXPECT_EQ(EINVAL, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000100, 10*PAGE_SIZE, 0));
+	EXPECT_EQ(NULL, self->hsk.send_region.start);
+}
+TEST_F(homa_pool, homa_send_region_init__bad_ring_entries)
+{
+	EXPECT_EQ(EINVAL, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 48));
+	EXPECT_EQ(EINVAL, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE,
+			2*HOMA_MAX_RING_ENTRIES));
+	EXPECT_EQ(EINVAL, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 100, 64));
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+TEST_F(homa_pool, homa_send_region_init__no_space_for_messages)
+{
+	EXPECT_EQ(EINVAL, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000,
+			sizeof(struct homa_send_ring) + 64*sizeof(__u32), 64));
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+TEST_F(homa_pool, homa_send_region_init__cant_pin_pages)
+{
+	mock_gup_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 0));
+	EXPECT_EQ(NULL, self->hsk.send_region.start);
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+TEST_F(homa_pool, homa_send_region_init__exceeds_locked_memory_limit)
+{
+	mock_locked_vm_errors = 2;
+	EXPECT_EQ(ENOMEM, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 64));
+	EXPECT_EQ(NULL, self->hsk.send_region.start);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+}
+TEST_F(homa_pool, homa_send_region_init__cant_map_ring)
+{
+	mock_vmap_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 64));
+	EXPECT_EQ(NULL, self->hsk.send_region.start);
+	EXPECT_EQ(0, mock_pinned_pages);
+	EXPECT_EQ(0, mock_locked_vm);
+}
+TEST_F(homa_pool, homa_send_region_init__region_already_registered)
+{
+	EXPECT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 64));
+	EXPECT_EQ(EBUSY, -homa_send_region_init(&self->hsk,
+			(void __user *) 0x4000000, 10*PAGE_SIZE, 64));
+	EXPECT_EQ(0x3000000, (unsigned long) self->hsk.send_region.start);
+	EXPECT_EQ(11, mock_pinned_pages);
+}
+
+TEST_F(homa_pool, homa_send_region_destroy__idempotent)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+
+	EXPECT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 10*PAGE_SIZE, 0));
+	homa_send_region_destroy(region);
+	EXPECT_EQ(NULL, region->start);
+	EXPECT_EQ(NULL, region->pages);
+	homa_send_region_destroy(region);
+	EXPECT_EQ(0, mock_pinned_pages);
+}
+
+TEST_F(homa_pool, homa_send_region_append__data_spans_pages)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+	struct sk_buff *skb = alloc_skb(100, GFP_KERNEL);
+	int i;
+
+	mock_pin_tracked_pages = true;
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 0));
+	EXPECT_EQ(0, -homa_send_region_append(region, skb, PAGE_SIZE - 100,
+			5000));
+	EXPECT_EQ(5000, skb->len);
+	EXPECT_EQ(5000, skb->data_len);
+	unit_log_clear();
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		unit_log_printf(" ", "%d@%d", skb_frag_size(frag),
+				skb_frag_off(frag));
+	}
+	EXPECT_STREQ("100@3996 4096@0 804@0", unit_log_get());
+	EXPECT_EQ(region->pages[1], skb_frag_page(&skb_shinfo(skb)->frags[1]));
+	EXPECT_EQ(2, mock_page_refs(region->pages[1]));
+	EXPECT_EQ(1, mock_page_refs(region->pages[3]));
+	kfree_skb(skb);
+	EXPECT_EQ(1, mock_page_refs(region->pages[1]));
+}
+TEST_F(homa_pool, homa_send_region_append__out_of_frags)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+	struct sk_buff *skb = alloc_skb(100, GFP_KERNEL);
+
+	mock_pin_tracked_pages = true;
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 0));
+	skb_shinfo(skb)->nr_frags = MAX_SKB_FRAGS - 1;
+	EXPECT_EQ(EMSGSIZE, -homa_send_region_append(region, skb,
+			PAGE_SIZE - 100, 5000));
+	EXPECT_EQ(MAX_SKB_FRAGS, skb_shinfo(skb)->nr_frags);
+	EXPECT_EQ(100, skb->len);
+	kfree_skb(skb);
+}
+
+TEST_F(homa_pool, homa_send_region_post__no_ring)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 0));
+	EXPECT_FALSE(homa_send_region_post(region, 100));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.send_ring_overflows);
+}
+TEST_F(homa_pool, homa_send_region_post__basics)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+	struct homa_send_ring *ring;
+
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 4));
+	ring = region->ring;
+	EXPECT_TRUE(homa_send_region_post(region, 100));
+	EXPECT_TRUE(homa_send_region_post(region, 200));
+	EXPECT_EQ(2, ring->head);
+	EXPECT_EQ(100, ring->offsets[0]);
+	EXPECT_EQ(200, ring->offsets[1]);
+}
+TEST_F(homa_pool, homa_send_region_post__wrap_around)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+	struct homa_send_ring *ring;
+
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 4));
+	ring = region->ring;
+	region->ring_head = 7;
+	ring->tail = 6;
+	EXPECT_TRUE(homa_send_region_post(region, 300));
+	EXPECT_EQ(8, ring->head);
+	EXPECT_EQ(300, ring->offsets[3]);
+}
+TEST_F(homa_pool, homa_send_region_post__ring_full)
+{
+	struct homa_send_region *region = &self->hsk.send_region;
+	struct homa_send_ring *ring;
+
+	ASSERT_EQ(0, homa_send_region_init(&self->hsk,
+			(void __user *) 0x3000000, 4*PAGE_SIZE, 4));
+	ring = region->ring;
+	region->ring_head = 5;
+	ring->tail = 1;
+	EXPECT_FALSE(homa_send_region_post(region, 300));
+	EXPECT_EQ(0, ring->head);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.send_ring_overflows);
+
+	/* Corrupted tail: treated as full. */
+	ring->tail = 10;
+	EXPECT_FALSE(homa_send_region_post(region, 300));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.send_ring_overflows);
+}
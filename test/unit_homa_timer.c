@@ -178,6 +178,71 @@ TEST_F(homa_timer, homa_check_rpc__check_for_resend)
 	EXPECT_STREQ("xmit RESEND 0-99@7", unit_log_get());
 }
 
+TEST_F(homa_timer, homa_incast_check__many_new_requests)
+{
+	self->homa.incast_rpcs = 5;
+	self->homa.incast_unsched_bytes = 3000;
+	self->homa.cutoff_version = 4;
+	homa_incast_check(&self->homa, 100);
+	EXPECT_EQ(3000, self->homa.incast_unsched_limit);
+	EXPECT_EQ(5, self->homa.cutoff_version);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.incasts);
+
+	/* Incast continues: no new version. */
+	homa_incast_check(&self->homa, 110);
+	EXPECT_EQ(5, self->homa.cutoff_version);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.incasts);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.incast_ticks);
+}
+TEST_F(homa_timer, homa_incast_check__total_incoming_too_high)
+{
+	self->homa.incast_rpcs = 5;
+	self->homa.max_incoming = 10000;
+	atomic_set(&self->homa.total_incoming,
+			10001 + self->homa.fifo_grant_increment);
+	homa_incast_check(&self->homa, 0);
+	EXPECT_EQ(self->homa.incast_unsched_bytes,
+			self->homa.incast_unsched_limit);
+}
+TEST_F(homa_timer, homa_incast_check__detection_disabled)
+{
+	self->homa.incast_rpcs = 0;
+	homa_incast_check(&self->homa, 100);
+	EXPECT_EQ(0, self->homa.incast_unsched_limit);
+	EXPECT_EQ(0, self->homa.cutoff_version);
+}
+TEST_F(homa_timer, homa_incast_check__incast_ends)
+{
+	self->homa.incast_rpcs = 5;
+	self->homa.incast_ticks = 3;
+	self->homa.cutoff_version = 4;
+	homa_incast_check(&self->homa, 100);
+	EXPECT_NE(0, self->homa.incast_unsched_limit);
+
+	homa_incast_check(&self->homa, 101);
+	homa_incast_check(&self->homa, 102);
+	EXPECT_NE(0, self->homa.incast_unsched_limit);
+	EXPECT_EQ(5, self->homa.cutoff_version);
+
+	/* Another burst resets the quiet count. */
+	homa_incast_check(&self->homa, 110);
+	homa_incast_check(&self->homa, 111);
+	homa_incast_check(&self->homa, 112);
+	EXPECT_NE(0, self->homa.incast_unsched_limit);
+
+	homa_incast_check(&self->homa, 113);
+	EXPECT_EQ(0, self->homa.incast_unsched_limit);
+	EXPECT_EQ(6, self->homa.cutoff_version);
+	EXPECT_EQ(6, homa_cores[cpu_number]->metrics.incast_ticks);
+}
+TEST_F(homa_timer, homa_incast_check__cutoff_version_wraps)
+{
+	self->homa.incast_rpcs = 5;
+	self->homa.cutoff_version = 0xffff;
+	homa_incast_check(&self->homa, 100);
+	EXPECT_EQ(1, self->homa.cutoff_version);
+}
+
 TEST_F(homa_timer, homa_timer__basics)
 {
 	self->homa.timeout_ticks = 5;
@@ -231,6 +296,17 @@ TEST_F(homa_timer, homa_timer__reap_dead_rpcs)
 	homa_timer(&self->homa);
 	EXPECT_EQ(11, self->hsk.dead_skbs);
 }
+TEST_F(homa_timer, homa_timer__check_waiting_rpcs)
+{
+	self->hsk.buffer_pool.check_waiting_invoked = 0;
+	homa_timer(&self->homa);
+	EXPECT_EQ(0, self->hsk.buffer_pool.check_waiting_invoked);
+
+	self->hsk.buffer_pool.check_waiting_needed = 1;
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, self->hsk.buffer_pool.check_waiting_invoked);
+	EXPECT_EQ(0, self->hsk.buffer_pool.check_waiting_needed);
+}
 TEST_F(homa_timer, homa_timer__rpc_in_service)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE,
@@ -86,6 +86,24 @@ static void set_cutoffs(struct homa *homa, int c0, int c1, int c2,
 	homa->unsched_cutoffs[7] = c7;
 }
 
+/**
+ * drain_heap() - Removes all of the nodes from a heap, smallest first,
+ * logging the index of each node within @nodes.
+ * @heap:   Heap to drain.
+ * @nodes:  Array containing all of the nodes in @heap.
+ *
+ * Return: the contents of the unit test log.
+ */
+static const char *drain_heap(struct homa_heap *heap,
+		struct homa_heap_node *nodes)
+{
+	while (heap->root) {
+		UNIT_LOG(" ", "%d", (int) (heap->root - nodes));
+		homa_heap_remove(heap, heap->root);
+	}
+	return unit_log_get();
+}
+
 /**
  * dead_rpcs() - Logs the ids for all of the RPCS in hsk->dead_rpcs.
  * @hsk:  Homa socket to check for dead RPCs.
@@ -462,10 +480,10 @@ TEST_F(homa_utils, homa_rpc_free__remove_from_throttled_list)
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 10000, 1000);
 	homa_add_to_throttled(crpc);
-	EXPECT_EQ(1, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_EQ(1, unit_list_length(&self->homa.pacers[0].throttled_rpcs));
 	unit_log_clear();
 	homa_rpc_free(crpc);
-	EXPECT_EQ(0, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, unit_list_length(&self->homa.pacers[0].throttled_rpcs));
 }
 
 TEST_F(homa_utils, homa_rpc_free_rcu)
@@ -504,6 +522,22 @@ TEST_F(homa_utils, homa_rpc_reap__basics)
 	EXPECT_STREQ("1236 1238", dead_rpcs(&self->hsk));
 	EXPECT_EQ(4, self->hsk.dead_skbs);
 }
+TEST_F(homa_utils, homa_rpc_reap__recycle_outgoing_skbs)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 2000);
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(5, self->hsk.dead_skbs);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(0, self->hsk.dead_skbs);
+
+	/* Only the request's sk_buffs are recycled; the incoming response
+	 * packet is freed.
+	 */
+	EXPECT_EQ(4, homa_cores[cpu_number]->num_cached_skbs);
+}
 TEST_F(homa_utils, homa_rpc_reap__protected)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -796,3 +830,58 @@ TEST_F(homa_utils, homa_prios_changed__share_lowest_priority)
 	EXPECT_EQ(0x7fffffff, self->homa.unsched_cutoffs[0]);
 	EXPECT_EQ(0, self->homa.max_sched_prio);
 }
+
+TEST_F(homa_utils, homa_heap_insert__ordering)
+{
+	struct homa_heap heap = {NULL, 0};
+	struct homa_heap_node nodes[6];
+
+	homa_heap_insert(&heap, &nodes[0], 500);
+	homa_heap_insert(&heap, &nodes[1], 200);
+	homa_heap_insert(&heap, &nodes[2], 800);
+	homa_heap_insert(&heap, &nodes[3], 200);
+	homa_heap_insert(&heap, &nodes[4], 100);
+	homa_heap_insert(&heap, &nodes[5], 500);
+	EXPECT_EQ(&nodes[4], heap.root);
+	EXPECT_STREQ("4 1 3 0 5 2", drain_heap(&heap, nodes));
+	EXPECT_EQ(NULL, heap.root);
+}
+TEST_F(homa_utils, homa_heap_remove__not_root)
+{
+	struct homa_heap heap = {NULL, 0};
+	struct homa_heap_node nodes[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		homa_heap_insert(&heap, &nodes[i], (i*5) % 8);
+	/* Force some depth into the heap before removing interior nodes. */
+	homa_heap_remove(&heap, heap.root);
+	homa_heap_remove(&heap, &nodes[3]);
+	homa_heap_remove(&heap, &nodes[6]);
+	EXPECT_STREQ("5 2 7 4 1", drain_heap(&heap, nodes));
+}
+TEST_F(homa_utils, homa_heap_decrease_key__root)
+{
+	struct homa_heap heap = {NULL, 0};
+	struct homa_heap_node nodes[2];
+
+	homa_heap_insert(&heap, &nodes[0], 100);
+	homa_heap_insert(&heap, &nodes[1], 200);
+	homa_heap_decrease_key(&heap, &nodes[0], 50);
+	EXPECT_EQ(50, nodes[0].key);
+	EXPECT_STREQ("0 1", drain_heap(&heap, nodes));
+}
+TEST_F(homa_utils, homa_heap_decrease_key__becomes_smallest)
+{
+	struct homa_heap heap = {NULL, 0};
+	struct homa_heap_node nodes[4];
+
+	homa_heap_insert(&heap, &nodes[0], 100);
+	homa_heap_insert(&heap, &nodes[1], 200);
+	homa_heap_insert(&heap, &nodes[2], 300);
+	homa_heap_insert(&heap, &nodes[3], 400);
+	homa_heap_decrease_key(&heap, &nodes[2], 50);
+	EXPECT_EQ(&nodes[2], heap.root);
+	homa_heap_decrease_key(&heap, &nodes[3], 150);
+	EXPECT_STREQ("2 0 3 1", drain_heap(&heap, nodes));
+}
@@ -206,7 +206,8 @@ void unit_log_grantables(struct homa *homa)
 {
 	struct homa_peer *peer;
 	struct homa_rpc *rpc;
-	list_for_each_entry(peer, &homa->grantable_peers, grantable_links) {
+	for (peer = homa_grant_next_peer(homa, NULL); peer != NULL;
+			peer = homa_grant_next_peer(homa, peer)) {
 		list_for_each_entry(rpc, &peer->grantable_rpcs,
 				grantable_links) {
 			unit_log_printf("; ", "%s from %s, id %lu, "
@@ -295,18 +296,48 @@ void unit_log_skb_list(struct sk_buff_head *packets, int verbose)
 
 /**
  * unit_log_throttled() - Append to the test log information about all of
- * the messages in homa->throttle_rpcs.
+ * the messages in the throttled lists of all pacer shards. The messages
+ * for each shard are logged in the order of its srpt_heap.
  * @homa:     Homa's overall state.
  */
 void unit_log_throttled(struct homa *homa)
 {
+#define MAX_THROTTLED 100
+	struct homa_rpc *rpcs[MAX_THROTTLED];
 	struct homa_rpc *rpc;
-	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
-		unit_log_printf("; ", "%s id %lu, next_offset %d",
-				homa_is_client(rpc->id) ? "request"
-				: "response",
-				(long unsigned int) rpc->id,
-				rpc->msgout.next_xmit_offset);
+	int i, j, count;
+
+	for (i = 0; i < HOMA_MAX_PACERS; i++) {
+		count = 0;
+		list_for_each_entry_rcu(rpc, &homa->pacers[i].throttled_rpcs,
+				throttled_links) {
+			if (count >= MAX_THROTTLED)
+				break;
+
+			/* Insertion sort by (key, seq). */
+			for (j = count; j > 0; j--) {
+				struct homa_heap_node *prev =
+						&rpcs[j-1]->srpt_node;
+
+				if ((prev->key < rpc->srpt_node.key)
+						|| ((prev->key
+						== rpc->srpt_node.key)
+						&& (prev->seq
+						< rpc->srpt_node.seq)))
+					break;
+				rpcs[j] = rpcs[j-1];
+			}
+			rpcs[j] = rpc;
+			count++;
+		}
+		for (j = 0; j < count; j++) {
+			rpc = rpcs[j];
+			unit_log_printf("; ", "%s id %lu, next_offset %d",
+					homa_is_client(rpc->id) ? "request"
+					: "response",
+					(long unsigned int) rpc->id,
+					rpc->msgout.next_xmit_offset);
+		}
 	}
 }
 
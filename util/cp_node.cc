@@ -74,6 +74,7 @@ bool server_iovec = false;
 int inet_family = AF_INET;
 int server_core = -1;
 int buf_bpages = 1000;
+bool pin_buf = false;
 
 /* Node ids for clients to send requests to. */
 std::vector<int> server_ids;
@@ -289,6 +290,8 @@ void print_help(const char *name)
 	printf("    --no-trunc        For TCP, allow messages longer than Homa's limit\n");
 	printf("    --one-way         Make all response messages 100 B, instead of the same\n"\
 		"                      size as request messages\n");
+	printf("    --pin-buf         Back the buffer pool with transparent hugepages and\n"
+		"                      have Homa pin it in memory (HOMA_BUF_PIN)\n");
 	printf("    --ports           Number of ports on which to send requests (one\n"
 		"                      sending thread per port (default: %d)\n",
 		client_ports);
@@ -332,6 +335,8 @@ void print_help(const char *name)
 	printf("    --ipv6            Use IPv6 instead of IPv4\n");
 	printf("    --pin             All server threads will be restricted to run only\n"
 	        "                      on the givevn core\n");
+	printf("    --pin-buf         Back the buffer pool with transparent hugepages and\n"
+		"                      have Homa pin it in memory (HOMA_BUF_PIN)\n");
 	printf("    --protocol        Transport protocol to use: homa or tcp (default: %s)\n",
 			protocol);
 	printf("    --port-threads    Number of server threads to service each port\n"
@@ -1054,6 +1059,13 @@ homa_server::homa_server(int port, int id, int inet_family,
 	}
 	arg.start = buf_region;
 	arg.length = buf_size;
+	arg.bpage_shift = 0;
+	arg.ring_entries = 0;
+	arg.flags = 0;
+	if (pin_buf) {
+		madvise(buf_region, buf_size, MADV_HUGEPAGE);
+		arg.flags = HOMA_BUF_PIN;
+	}
 	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
 			sizeof(arg));
 	if (status < 0) {
@@ -1905,6 +1917,13 @@ homa_client::homa_client(int id)
 	}
 	arg.start = buf_region;
 	arg.length = buf_size;
+	arg.bpage_shift = 0;
+	arg.ring_entries = 0;
+	arg.flags = 0;
+	if (pin_buf) {
+		madvise(buf_region, buf_size, MADV_HUGEPAGE);
+		arg.flags = HOMA_BUF_PIN;
+	}
 	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
 			sizeof(arg));
 	if (status < 0) {
@@ -2742,6 +2761,7 @@ int client_cmd(std::vector<string> &words)
 	std::string servers;
 
 	buf_bpages = 1000;
+	pin_buf = false;
 	client_iovec = false;
 	client_max = 1;
 	client_ports = 1;
@@ -2761,6 +2781,8 @@ int client_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &buf_bpages, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--pin-buf") == 0) {
+			pin_buf = true;
 		} else if (strcmp(option, "--client-max") == 0) {
 			if (!parse(words, i+1, (int *) &client_max,
 					option, "integer"))
@@ -3075,6 +3097,7 @@ int log_cmd(std::vector<string> &words)
 int server_cmd(std::vector<string> &words)
 {
 	buf_bpages = 1000;
+	pin_buf = false;
 	first_port = 4000;
 	inet_family = AF_INET;
         protocol = "homa";
@@ -3090,6 +3113,8 @@ int server_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &buf_bpages, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--pin-buf") == 0) {
+			pin_buf = true;
 		} else if (strcmp(option, "--first-port") == 0) {
 			if (!parse(words, i+1, &first_port, option, "integer"))
 				return 0;
@@ -429,6 +429,9 @@ void test_set_buf(int fd)
 
 	arg.start = region;
 	arg.length = 64*HOMA_BPAGE_SIZE;
+	arg.bpage_shift = 0;
+	arg.ring_entries = 0;
+	arg.flags = 0;
 	status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
 			sizeof(arg));
 	if (status < 0)
@@ -913,6 +916,9 @@ int main(int argc, char** argv)
 	struct homa_set_buf_args arg;
 	arg.start = buf_region;
 	arg.length = 1000*HOMA_BPAGE_SIZE;
+	arg.bpage_shift = 0;
+	arg.ring_entries = 0;
+	arg.flags = 0;
 	status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
 			sizeof(arg));
 	if (status < 0) {
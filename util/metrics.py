@@ -446,10 +446,19 @@ if elapsed_secs != 0:
         percent = percent.ljust(12)
         print("%-28s %15d %s %s" % (symbol, delta, percent, docs[symbol]))
 
-    if deltas["throttle_list_adds"] > 0:
-        print("%-28s %15.1f              List traversals per throttle "
-                "list insert" % ("checks_per_throttle_insert",
-                deltas["throttle_list_checks"]/deltas["throttle_list_adds"]))
+    if ("grantable_peer_inserts" in deltas) \
+            and (deltas["grantable_peer_inserts"] > 0):
+        print("%-28s %15.1f              Peers checked per grantable_peers "
+                "insert" % ("checks_per_grant_peer_insert",
+                deltas["grantable_peer_checks"]
+                / deltas["grantable_peer_inserts"]))
+
+    if ("grantable_lock_acquires" in deltas) \
+            and (deltas["grantable_lock_acquires"] > 0):
+        ns = (deltas["grantable_lock_cycles"]
+                / deltas["grantable_lock_acquires"]) / (cpu_khz * 1e-06)
+        print("%-28s %15.1f              Avg. grantable_lock hold time (ns)"
+                % ("grantable_lock_hold", ns))
 
     if deltas["responses_received"] > 0:
         print("%-28s %15.1f              ACK packets sent per 1000 client RPCs"
@@ -91,6 +91,9 @@ void homa_server(int port)
 	}
 	arg.start = buf_region;
 	arg.length = 1000*HOMA_BPAGE_SIZE;
+	arg.bpage_shift = 0;
+	arg.ring_entries = 0;
+	arg.flags = 0;
 	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
 			sizeof(arg));
 	if (status < 0) {